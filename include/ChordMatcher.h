@@ -0,0 +1,446 @@
+/*
+ * Chord Matcher
+ *
+ * Chord patterns from mapping files ({60,64,67}=F): a set of notes played together fires
+ * one key instead of the keys of its notes. Shared by the firmware's schedule stage and the
+ * Linux daemon. No Arduino dependencies.
+ *
+ * The notes of a profile's chords that are down are kept as a 128-bit bitset. A gather
+ * starts with the first chord note and lasts CHORD_WINDOW ms; after every chord note-on in
+ * it the bitset is looked up in a hash table of all patterns (profile and bitset hashed
+ * together, linear probing), so the cost does not grow with the number of patterns. A
+ * pattern the gathered notes match exactly fires at once, unless it is part of a bigger
+ * pattern (flagged when the patterns are added): then it waits until the window closes, a
+ * note-off lets go of it, or a note arrives that no bigger pattern contains - only then
+ * does the smaller chord fire, if the bigger one did not complete first. Whether a bigger
+ * pattern still contains the gathered notes is one more hash lookup: for every pattern
+ * inside a bigger one, the note sets between the two are indexed when they are added.
+ *
+ * CHORD_MODE=SUPPRESS holds the chord notes back while gathering and only plays their keys
+ * if the window closes without a match (they are late by up to the window); CANCEL plays
+ * them at once and releases their keys when a chord matches. Either way the chord key is
+ * released with the first of its notes, the other notes' note-offs are swallowed.
+ *
+ * Notes outside every chord of the profile are not touched and cost one bit test.
+ */
+
+#ifndef CHORD_MATCHER_H
+#define CHORD_MATCHER_H
+
+#include <stdint.h>
+#include <string.h>
+#include "MappingParser.h"
+
+#define CHORD_WORDS (MAX_MIDI_NOTES / 32)
+
+static_assert((CHORD_HASH_SLOTS & (CHORD_HASH_SLOTS - 1)) == 0, "CHORD_HASH_SLOTS must be a power of two");
+static_assert(CHORD_HASH_SLOTS > CHORD_MAX, "CHORD_HASH_SLOTS must leave free slots to end a probe");
+static_assert((CHORD_GROW_SLOTS & (CHORD_GROW_SLOTS - 1)) == 0, "CHORD_GROW_SLOTS must be a power of two");
+static_assert(CHORD_GROW_SLOTS > CHORD_GROW_MAX, "CHORD_GROW_SLOTS must leave free slots to end a probe");
+
+struct ChordEntry {
+  uint32_t notes[CHORD_WORDS];
+  KeyMapping mapping;
+  uint8_t profile;
+  bool hasSuperset;  // A bigger pattern of the profile contains these notes
+};
+
+// Patterns of every profile, with an open-addressing index over (profile, notes)
+// growSlots indexes the note sets a deferred chord can grow through: each set from a
+// pattern up to (not including) a bigger pattern of the profile, under the bigger one
+struct ChordTable {
+  ChordEntry entries[CHORD_MAX];
+  uint16_t slots[CHORD_HASH_SLOTS];      // Entry index + 1, 0 = empty
+  uint16_t count;
+  uint16_t growSlots[CHORD_GROW_SLOTS];  // Index + 1 of a bigger pattern, 0 = empty
+  uint16_t growCount;
+};
+
+// A matched chord whose notes are not all up yet
+struct ActiveChord {
+  uint32_t notes[CHORD_WORDS];  // Its notes still down
+  KeyMapping mapping;
+  bool sounding;                // Chord key still pressed (released with the first note-off)
+};
+
+// Engine calls the matcher makes (press or release a key the way the profile releases keys)
+struct ChordOutput {
+  void (*press)(KeyMapping mapping);
+  void (*release)(KeyMapping mapping);
+};
+
+struct ChordState {
+  uint8_t mode;                         // ChordMode
+  uint16_t windowMs;
+  bool gathering;
+  uint32_t gatherStartMs;
+  uint32_t gathered[CHORD_WORDS];       // Chord notes pressed in this gather and still down
+  uint8_t pending[CHORD_NOTES_MAX];     // SUPPRESS: notes held back, in arrival order
+  uint8_t pendingCount;
+  bool deferred;                        // Gathered notes matched a chord that waits for a bigger one
+  uint32_t deferredNotes[CHORD_WORDS];
+  KeyMapping deferredMapping;
+  ActiveChord active[CHORD_ACTIVE_MAX];
+  uint8_t activeCount;
+  uint32_t recognized;                  // Chords matched since reset
+};
+
+inline bool chordBit(const uint32_t* notes, uint8_t note) {
+  return notes[note >> 5] & (1UL << (note & 31));
+}
+
+inline bool isMapped(KeyMapping mapping) {
+  return mapping.keyCode > 0 || mapping.modifierMask > 0;
+}
+
+inline uint32_t chordHash(uint8_t profile, const uint32_t* notes) {
+  uint32_t hash = 2166136261UL ^ profile;
+  for (int i = 0; i < CHORD_WORDS; i++) {
+    hash = (hash ^ notes[i]) * 0x9E3779B1UL;
+    hash ^= hash >> 15;
+  }
+  return hash;
+}
+
+// Are all of a's notes in b?
+inline bool chordSubset(const uint32_t* a, const uint32_t* b) {
+  for (int i = 0; i < CHORD_WORDS; i++) {
+    if (a[i] & ~b[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline void clearChords(ChordTable& table) {
+  memset(table.slots, 0, sizeof(table.slots));
+  table.count = 0;
+  memset(table.growSlots, 0, sizeof(table.growSlots));
+  table.growCount = 0;
+}
+
+// Note sets from pattern small up to (not including) pattern big: 2^(extra notes) - 1
+inline int chordGrowSetCount(const uint32_t* small, const uint32_t* big) {
+  int extra = 0;
+  for (int i = 0; i < CHORD_WORDS; i++) {
+    extra += __builtin_popcount(big[i] & ~small[i]);
+  }
+  return (1 << extra) - 1;
+}
+
+// Index every note set from pattern small up to the bigger pattern at bigIndex (load only)
+// A set already indexed under another pattern containing it is not added again
+inline void addChordGrowSets(ChordTable& table, const uint32_t* small, uint16_t bigIndex) {
+  const ChordEntry& big = table.entries[bigIndex];
+  uint8_t extra[CHORD_NOTES_MAX];
+  int extraCount = 0;
+  for (int n = 0; n < MAX_MIDI_NOTES; n++) {
+    if (chordBit(big.notes, n) && !chordBit(small, n)) {
+      extra[extraCount++] = n;
+    }
+  }
+  for (uint32_t mask = 0; mask + 1 < (1UL << extraCount); mask++) {
+    uint32_t notes[CHORD_WORDS];
+    memcpy(notes, small, sizeof(notes));
+    for (int i = 0; i < extraCount; i++) {
+      if (mask & (1UL << i)) {
+        notes[extra[i] >> 5] |= 1UL << (extra[i] & 31);
+      }
+    }
+    uint32_t slot = chordHash(big.profile, notes) & (CHORD_GROW_SLOTS - 1);
+    bool indexed = false;
+    while (table.growSlots[slot] != 0 && !indexed) {
+      const ChordEntry& entry = table.entries[table.growSlots[slot] - 1];
+      indexed = entry.profile == big.profile && chordSubset(notes, entry.notes)
+                && memcmp(entry.notes, notes, sizeof(notes)) != 0;
+      slot = (slot + 1) & (CHORD_GROW_SLOTS - 1);
+    }
+    if (!indexed) {
+      table.growSlots[slot] = bigIndex + 1;
+      table.growCount++;
+    }
+  }
+}
+
+// Add a profile's pattern and mark its notes in profile.chordNotes
+// Returns false if the table (or the index of sets between patterns) is full; a second
+// pattern for the same notes replaces the key
+// Patterns inside a bigger one of the same profile are flagged and the sets between the
+// two indexed (a scan of the table, at load only)
+inline bool addChord(ChordTable& table, uint8_t profileIndex, Profile& profile, const ChordPattern& pattern) {
+  uint32_t slot = chordHash(profileIndex, pattern.notes) & (CHORD_HASH_SLOTS - 1);
+  while (table.slots[slot] != 0) {
+    ChordEntry& entry = table.entries[table.slots[slot] - 1];
+    if (entry.profile == profileIndex && memcmp(entry.notes, pattern.notes, sizeof(entry.notes)) == 0) {
+      entry.mapping = pattern.mapping;
+      return true;
+    }
+    slot = (slot + 1) & (CHORD_HASH_SLOTS - 1);
+  }
+  if (table.count == CHORD_MAX) {
+    return false;
+  }
+  // Room for every set it adds between patterns (sets already indexed are counted too)
+  int growSets = 0;
+  for (int i = 0; i < table.count; i++) {
+    const ChordEntry& other = table.entries[i];
+    if (other.profile != profileIndex) {
+      continue;
+    }
+    if (chordSubset(pattern.notes, other.notes)) {
+      growSets += chordGrowSetCount(pattern.notes, other.notes);
+    } else if (chordSubset(other.notes, pattern.notes)) {
+      growSets += chordGrowSetCount(other.notes, pattern.notes);
+    }
+  }
+  if (table.growCount + growSets > CHORD_GROW_MAX) {
+    return false;
+  }
+  uint16_t index = table.count;
+  ChordEntry& entry = table.entries[index];
+  memcpy(entry.notes, pattern.notes, sizeof(entry.notes));
+  entry.mapping = pattern.mapping;
+  entry.profile = profileIndex;
+  entry.hasSuperset = false;
+  for (int i = 0; i < index; i++) {
+    ChordEntry& other = table.entries[i];
+    if (other.profile != profileIndex) {
+      continue;
+    }
+    if (chordSubset(entry.notes, other.notes)) {
+      entry.hasSuperset = true;
+      addChordGrowSets(table, entry.notes, i);
+    } else if (chordSubset(other.notes, entry.notes)) {
+      other.hasSuperset = true;
+      addChordGrowSets(table, other.notes, index);
+    }
+  }
+  table.slots[slot] = ++table.count;
+  for (int i = 0; i < CHORD_WORDS; i++) {
+    profile.chordNotes[i] |= pattern.notes[i];
+  }
+  return true;
+}
+
+inline const ChordEntry* findChord(const ChordTable& table, uint8_t profileIndex, const uint32_t* notes) {
+  uint32_t slot = chordHash(profileIndex, notes) & (CHORD_HASH_SLOTS - 1);
+  while (table.slots[slot] != 0) {
+    const ChordEntry& entry = table.entries[table.slots[slot] - 1];
+    if (entry.profile == profileIndex && memcmp(entry.notes, notes, sizeof(entry.notes)) == 0) {
+      return &entry;
+    }
+    slot = (slot + 1) & (CHORD_HASH_SLOTS - 1);
+  }
+  return nullptr;
+}
+
+// Can the gathered notes still become a pattern of the profile bigger than them?
+// Only asked while a chord is deferred, so the gathered notes contain a pattern and the sets
+// between it and every bigger pattern are in growSlots
+inline bool chordCanGrow(const ChordTable& table, uint8_t profileIndex, const uint32_t* gathered) {
+  uint32_t slot = chordHash(profileIndex, gathered) & (CHORD_GROW_SLOTS - 1);
+  while (table.growSlots[slot] != 0) {
+    const ChordEntry& entry = table.entries[table.growSlots[slot] - 1];
+    if (entry.profile == profileIndex && chordSubset(gathered, entry.notes)
+        && memcmp(entry.notes, gathered, sizeof(entry.notes)) != 0) {
+      return true;
+    }
+    slot = (slot + 1) & (CHORD_GROW_SLOTS - 1);
+  }
+  return false;
+}
+
+// Notes the matcher stands in for: held back (SUPPRESS) or part of a matched chord. Their
+// own keys are not down, so a profile switch forgets them along with the chord state
+// rather than letting their note-offs release keys they never pressed
+inline void chordOwnedNotes(const ChordState& state, uint32_t* notes) {
+  memset(notes, 0, CHORD_WORDS * sizeof(uint32_t));
+  for (int i = 0; i < state.pendingCount; i++) {
+    notes[state.pending[i] >> 5] |= 1UL << (state.pending[i] & 31);
+  }
+  for (int i = 0; i < state.activeCount; i++) {
+    for (int w = 0; w < CHORD_WORDS; w++) {
+      notes[w] |= state.active[i].notes[w];
+    }
+  }
+}
+
+// Forget every gather and chord without touching keys (after a profile switch released them)
+inline void resetChords(ChordState& state, const Config& config) {
+  state.mode = config.chordMode;
+  state.windowMs = config.chordWindowMs;
+  state.gathering = false;
+  state.pendingCount = 0;
+  state.deferred = false;
+  state.activeCount = 0;
+  memset(state.gathered, 0, sizeof(state.gathered));
+}
+
+// SUPPRESS: play the held-back notes' own keys (the window closed without a match)
+inline void flushChordGather(ChordState& state, const Profile& profile, const ChordOutput& out) {
+  for (int i = 0; i < state.pendingCount; i++) {
+    KeyMapping mapping = profile.noteToKey[state.pending[i]];
+    if (isMapped(mapping)) {
+      out.press(mapping);
+    }
+  }
+  state.pendingCount = 0;
+  state.gathering = false;
+  state.deferred = false;
+  memset(state.gathered, 0, sizeof(state.gathered));
+}
+
+// Press a chord's key for its notes and end the gather. CANCEL releases the keys its notes
+// pressed (all but skipNote, the note-on that completed it); SUPPRESS plays the held-back
+// notes that are not in it (gathered while a deferred chord waited for a bigger one)
+inline void fireChord(ChordState& state, const Profile& profile, KeyMapping mapping, const uint32_t* notes,
+                      int skipNote, const ChordOutput& out) {
+  uint32_t chordNotes[CHORD_WORDS];
+  memcpy(chordNotes, notes, sizeof(chordNotes));
+  if (state.mode == CHORD_CANCEL) {
+    for (int n = 0; n < MAX_MIDI_NOTES; n++) {
+      if (n != skipNote && chordBit(chordNotes, n) && isMapped(profile.noteToKey[n])) {
+        out.release(profile.noteToKey[n]);
+      }
+    }
+  }
+  ActiveChord& active = state.active[state.activeCount++];
+  memcpy(active.notes, chordNotes, sizeof(active.notes));
+  active.mapping = mapping;
+  active.sounding = true;
+  out.press(mapping);
+  state.recognized++;
+
+  int kept = 0;
+  for (int i = 0; i < state.pendingCount; i++) {
+    if (!chordBit(chordNotes, state.pending[i])) {
+      state.pending[kept++] = state.pending[i];
+    }
+  }
+  state.pendingCount = kept;
+  flushChordGather(state, profile, out);
+}
+
+// The deferred chord was the one meant: fire it
+inline void fireDeferredChord(ChordState& state, const Profile& profile, const ChordOutput& out) {
+  fireChord(state, profile, state.deferredMapping, state.deferredNotes, -1, out);
+}
+
+// Close the gather once its window has passed - returns true if held-back notes were played
+// or a deferred chord fired
+inline bool expireChordGather(ChordState& state, const Profile& profile, uint32_t nowMs, const ChordOutput& out) {
+  if (!state.gathering || nowMs - state.gatherStartMs < state.windowMs) {
+    return false;
+  }
+  if (state.deferred) {
+    fireDeferredChord(state, profile, out);
+    return true;
+  }
+  bool played = state.pendingCount > 0;
+  flushChordGather(state, profile, out);
+  return played;
+}
+
+// A note-on on the profile - returns true if the matcher took it (the caller must not press
+// its key), false to play it as usual
+inline bool chordNoteOn(ChordState& state, const ChordTable& table, uint8_t profileIndex, const Profile& profile,
+                        uint8_t note, uint32_t nowMs, const ChordOutput& out) {
+  if (!chordBit(profile.chordNotes, note)) {
+    return false;
+  }
+  expireChordGather(state, profile, nowMs, out);
+  if (!state.gathering) {
+    state.gathering = true;
+    state.gatherStartMs = nowMs;
+  }
+  state.gathered[note >> 5] |= 1UL << (note & 31);
+
+  const ChordEntry* chord = findChord(table, profileIndex, state.gathered);
+  if (chord != nullptr && state.activeCount < CHORD_ACTIVE_MAX) {
+    if (!chord->hasSuperset) {
+      fireChord(state, profile, chord->mapping, state.gathered, note, out);
+      return true;
+    }
+    // A bigger chord starts with these notes: wait for it
+    state.deferred = true;
+    memcpy(state.deferredNotes, state.gathered, sizeof(state.deferredNotes));
+    state.deferredMapping = chord->mapping;
+  } else if (state.deferred && !chordCanGrow(table, profileIndex, state.gathered)) {
+    // This note rules out every bigger chord, so the waiting one was meant; the note starts
+    // a gather of its own
+    state.gathered[note >> 5] &= ~(1UL << (note & 31));
+    fireDeferredChord(state, profile, out);
+    return chordNoteOn(state, table, profileIndex, profile, note, nowMs, out);
+  }
+
+  // Not (yet) a chord: CANCEL plays the note, SUPPRESS holds it back
+  if (state.mode == CHORD_CANCEL) {
+    return false;
+  }
+  if (state.pendingCount == CHORD_NOTES_MAX) {
+    flushChordGather(state, profile, out);
+    return false;
+  }
+  state.pending[state.pendingCount++] = note;
+  return true;
+}
+
+// A note-off on the profile - returns true if the matcher took it (the caller must not
+// release its key), false to release it as usual
+inline bool chordNoteOff(ChordState& state, const Profile& profile, uint8_t note, const ChordOutput& out) {
+  if (!chordBit(profile.chordNotes, note)) {
+    return false;
+  }
+  uint32_t bit = 1UL << (note & 31);
+  for (int i = 0; i < state.activeCount; i++) {
+    ActiveChord& active = state.active[i];
+    if (!(active.notes[note >> 5] & bit)) {
+      continue;
+    }
+    active.notes[note >> 5] &= ~bit;
+    if (active.sounding) {
+      out.release(active.mapping);
+      active.sounding = false;
+    }
+    bool empty = true;
+    for (int w = 0; w < CHORD_WORDS; w++) {
+      empty &= active.notes[w] == 0;
+    }
+    if (empty) {
+      state.active[i] = state.active[--state.activeCount];
+    }
+    return true;
+  }
+
+  if (state.gathering && (state.gathered[note >> 5] & bit)) {
+    if (state.deferred) {
+      // Let go while the chord waited for a bigger one: it was the smaller chord (a short
+      // one), and this note-off releases it if the note is in it
+      fireDeferredChord(state, profile, out);
+      return chordNoteOff(state, profile, note, out);
+    }
+    if (state.mode == CHORD_SUPPRESS) {
+      // Let go before the window closed: it was not a chord, play what was held back
+      flushChordGather(state, profile, out);
+    } else {
+      state.gathered[note >> 5] &= ~bit;
+    }
+  }
+  return false;
+}
+
+// Release every sounding chord key and drop the gather (an input's notes were released)
+inline void releaseChords(ChordState& state, const ChordOutput& out) {
+  for (int i = 0; i < state.activeCount; i++) {
+    if (state.active[i].sounding) {
+      out.release(state.active[i].mapping);
+    }
+  }
+  state.activeCount = 0;
+  state.gathering = false;
+  state.pendingCount = 0;
+  state.deferred = false;
+  memset(state.gathered, 0, sizeof(state.gathered));
+}
+
+#endif // CHORD_MATCHER_H
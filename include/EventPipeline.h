@@ -0,0 +1,296 @@
+/*
+ * Event Pipeline
+ *
+ * The note path as explicit stages passing fixed-size typed events through bounded queues:
+ *
+ *   ingest -> [MidiEvent] -> normalize -> [NoteEvent] -> route -> [NoteEvent] -> map
+ *          -> [KeyEvent]  -> schedule (key engine) -> [HidReport] -> emit
+ *
+ * This header holds the event types, the queue and the stages that are pure transforms
+ * (normalize, route, map). They have no Arduino dependencies, so each can be timed on its
+ * own on a PC (env:pipeline_bench). Ingest, schedule and emit live in the firmware.
+ *
+ * Control messages (release a source's notes, select a profile, change the key) and
+ * transpose changes travel through the same queues as the notes, so they take effect
+ * exactly between the notes around them.
+ */
+
+#ifndef EVENT_PIPELINE_H
+#define EVENT_PIPELINE_H
+
+#include <stdint.h>
+#include "MappingParser.h"
+#include "Transpose.h"
+
+// Ingest-side status values below 0x80 (never MIDI status bytes) carry pipeline control
+#define PIPELINE_CONTROL_RELEASE_SOURCE 0x01  // Release every note the source is holding
+#define PIPELINE_CONTROL_SELECT_PROFILE 0x02  // data1 = profile index
+
+// MIDI channel message types (status without channel)
+#define PIPELINE_MIDI_NOTE_OFF 0x80
+#define PIPELINE_MIDI_NOTE_ON  0x90
+#define PIPELINE_MIDI_CONTROL_CHANGE 0xB0
+
+// Raw message from an input (ingest output)
+struct MidiEvent {
+  uint32_t timestamp;  // Cycle count at ingest - every later stage measures latency from here
+  uint8_t source;      // Input the message came from (USB port index, DIN, ...)
+  uint8_t type;        // Status without channel, or PIPELINE_CONTROL_*
+  uint8_t data1;
+  uint8_t data2;
+};
+
+enum NoteEventKind : uint8_t {
+  NOTE_EVENT_ON,
+  NOTE_EVENT_OFF,
+  NOTE_EVENT_SELECT_PROFILE,  // note = profile index
+  NOTE_EVENT_RELEASE_SOURCE,
+  NOTE_EVENT_CONTROL,         // note = controller, velocity = value (consumed by route)
+  NOTE_EVENT_KEY_CHANGE       // note = 1 one fifth up (a sharp more), 0 one fifth down (set by route)
+};
+
+// Note on/off with MIDI quirks removed (normalize output, route output)
+struct NoteEvent {
+  uint32_t timestamp;
+  uint8_t source;
+  uint8_t kind;        // NoteEventKind
+  uint8_t note;
+  uint8_t velocity;
+  uint8_t profile;     // Profile the note is played on (set by route)
+};
+
+enum KeyEventKind : uint8_t {
+  KEY_EVENT_PRESS,
+  KEY_EVENT_RELEASE,
+  KEY_EVENT_SELECT_PROFILE,  // note = profile index
+  KEY_EVENT_RELEASE_SOURCE,
+  KEY_EVENT_KEY_CHANGE       // note = 1 up, 0 down - the current profile's key signature
+};
+
+// Mapped key action for the key engine (map output)
+struct KeyEvent {
+  uint32_t timestamp;
+  uint8_t source;
+  uint8_t kind;        // KeyEventKind
+  uint8_t note;        // Note that caused it (held-note tracking)
+  KeyMapping mapping;
+};
+
+// Bounded single-producer single-consumer ring (N must be a power of two)
+// push() refuses when full - producers stop and leave the rest upstream (backpressure)
+template <typename T, uint16_t N>
+class EventQueue {
+  static_assert((N & (N - 1)) == 0, "EventQueue size must be a power of two");
+
+public:
+  EventQueue() : head_(0), count_(0), maxDepth_(0), refused_(0) {}
+
+  bool push(const T& event) {
+    if (count_ == N) {
+      refused_++;
+      return false;
+    }
+    events_[(head_ + count_) & (N - 1)] = event;
+    count_++;
+    if (count_ > maxDepth_) {
+      maxDepth_ = count_;
+    }
+    return true;
+  }
+
+  bool pop(T& event) {
+    if (count_ == 0) {
+      return false;
+    }
+    event = events_[head_];
+    head_ = (head_ + 1) & (N - 1);
+    count_--;
+    return true;
+  }
+
+  void clear() {
+    head_ = 0;
+    count_ = 0;
+  }
+
+  bool full() const { return count_ == N; }
+  bool empty() const { return count_ == 0; }
+  uint16_t depth() const { return count_; }
+  uint16_t maxDepth() const { return maxDepth_; }
+  uint16_t capacity() const { return N; }
+  uint32_t refused() const { return refused_; }  // Pushes refused because the queue was full
+
+private:
+  T events_[N];
+  uint16_t head_;
+  uint16_t count_;
+  uint16_t maxDepth_;
+  uint32_t refused_;
+};
+
+// Per-stage counters; latency is the age of an event (ingest to this stage) in cycles
+struct StageStats {
+  uint32_t processed;         // Events taken from the input queue
+  uint32_t forwarded;         // Events handed to the next stage
+  uint32_t filtered;          // Events this stage consumed on purpose (not a note, unmapped, ...)
+  uint64_t latencyCycles;     // Sum of event ages when processed
+  uint32_t maxLatencyCycles;  // Oldest event processed
+  uint64_t busyCycles;        // Time spent inside the stage
+};
+
+inline void recordStageEvent(StageStats& stats, uint32_t age) {
+  stats.processed++;
+  stats.latencyCycles += age;
+  if (age > stats.maxLatencyCycles) {
+    stats.maxLatencyCycles = age;
+  }
+}
+
+// Normalize: note-on with velocity 0 becomes note-off, everything that is not a note, a
+// control change or a pipeline control message is dropped (returns false)
+// Running status is already resolved by the time a message is ingested (USB MIDI packets
+// carry full status bytes, DIN bytes go through MidiStreamParser)
+inline bool normalizeEvent(const MidiEvent& in, NoteEvent& out) {
+  out.timestamp = in.timestamp;
+  out.source = in.source;
+  out.note = in.data1 & 0x7F;
+  out.velocity = in.data2 & 0x7F;
+  out.profile = 0;
+  switch (in.type) {
+    case PIPELINE_MIDI_NOTE_ON:
+      out.kind = (out.velocity > 0) ? NOTE_EVENT_ON : NOTE_EVENT_OFF;
+      return true;
+    case PIPELINE_MIDI_NOTE_OFF:
+      out.kind = NOTE_EVENT_OFF;
+      return true;
+    case PIPELINE_MIDI_CONTROL_CHANGE:
+      out.kind = NOTE_EVENT_CONTROL;
+      return true;
+    case PIPELINE_CONTROL_SELECT_PROFILE:
+      out.kind = NOTE_EVENT_SELECT_PROFILE;
+      out.note = in.data1;
+      return true;
+    case PIPELINE_CONTROL_RELEASE_SOURCE:
+      out.kind = NOTE_EVENT_RELEASE_SOURCE;
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Which profile and transpose the stream is on at the route stage, and what changes them
+struct RouteState {
+  uint8_t profileIndex;       // Profile for notes routed from now on
+  uint8_t profileCount;
+  uint8_t profileSwitchNote;  // 255 = switching disabled
+  uint8_t keyUpNote;          // Key change control notes (255 = none)
+  uint8_t keyDownNote;
+  TransposeState transpose;
+  const Profile* profiles;    // Auto-transpose looks at the mapped keys of the current profile
+};
+
+inline void initRouteState(RouteState& state, const Profile* profiles, uint8_t profileIndex, uint8_t profileCount,
+                           const Config& config) {
+  state.profiles = profiles;
+  state.profileIndex = profileIndex;
+  state.profileCount = profileCount;
+  state.profileSwitchNote = config.profileSwitchNote;
+  state.keyUpNote = config.keyUpNote;
+  state.keyDownNote = config.keyDownNote;
+  resetTranspose(state.transpose, config);
+}
+
+// Route: the profile switch note becomes a select-profile event for the next profile, key
+// change notes become key-change events, transpose control notes and controllers change the
+// transpose, and every note is stamped with the profile it is played on and moved by the
+// transpose it was played with
+// Returns false if the event goes no further (switch note with a single profile, bad index,
+// key change or transpose control note-off, transpose control, control change, note
+// transposed out of the MIDI range)
+// nowMs (any millisecond clock) times the phrase gaps auto-transpose waits for
+inline bool routeEvent(RouteState& state, NoteEvent& event, uint32_t nowMs) {
+  if (event.kind == NOTE_EVENT_CONTROL) {
+    transposeController(state.transpose, event.note, event.velocity);
+    return false;
+  }
+  if (event.kind == NOTE_EVENT_RELEASE_SOURCE) {
+    // The schedule stage lets go of the input's notes; a phrase gap starts
+    releaseAutoTransposeNotes(state.transpose, nowMs);
+  }
+  if (event.kind == NOTE_EVENT_ON && state.profileSwitchNote < 255 && event.note == state.profileSwitchNote) {
+    if (state.profileCount < 2) {
+      return false;
+    }
+    event.kind = NOTE_EVENT_SELECT_PROFILE;
+    event.note = (state.profileIndex + 1) % state.profileCount;
+  }
+  if (event.kind == NOTE_EVENT_SELECT_PROFILE) {
+    if (event.note >= state.profileCount) {
+      return false;
+    }
+    state.profileIndex = event.note;
+    state.transpose.autoReady = false;
+  }
+  if ((event.kind == NOTE_EVENT_ON || event.kind == NOTE_EVENT_OFF)
+      && (event.note == state.keyUpNote || event.note == state.keyDownNote)) {
+    if (event.kind == NOTE_EVENT_OFF) {
+      return false;
+    }
+    event.kind = NOTE_EVENT_KEY_CHANGE;
+    event.note = event.note == state.keyUpNote;
+    state.transpose.autoReady = false;
+  }
+  if (event.kind == NOTE_EVENT_ON || event.kind == NOTE_EVENT_OFF) {
+    bool on = event.kind == NOTE_EVENT_ON;
+    if (transposeControlNote(state.transpose, event.note, on)) {
+      return false;
+    }
+    int note = transposeNote(state.transpose, event.note, on, nowMs);
+    if (note < 0) {
+      return false;
+    }
+    event.note = note;
+  }
+  event.profile = state.profileIndex;
+  return true;
+}
+
+// Housekeeping beside the route stage: auto-transpose's search between phrases, over the
+// profile notes are routed to - returns true if it searched
+inline bool serviceRouteTranspose(RouteState& state, uint32_t nowMs) {
+  return serviceAutoTranspose(state.transpose, nowMs, state.profiles[state.profileIndex]);
+}
+
+// Map: notes become key presses/releases through the profile they were routed to - a single
+// table load, transpose, accidental snapping and out-of-range folding are already done
+// (route, buildNoteTable)
+// Returns false for unmapped notes (no key code and no modifier) that are not part of a
+// chord - chord notes go on to the chord matcher in the schedule stage even without a key
+inline bool mapEvent(const Profile* profiles, const NoteEvent& in, KeyEvent& out) {
+  out.timestamp = in.timestamp;
+  out.source = in.source;
+  out.note = in.note;
+  out.mapping.keyCode = 0;
+  out.mapping.modifierMask = 0;
+  switch (in.kind) {
+    case NOTE_EVENT_ON:
+    case NOTE_EVENT_OFF: {
+      const Profile& profile = profiles[in.profile];
+      out.mapping = profile.noteToKey[in.note];
+      out.kind = (in.kind == NOTE_EVENT_ON) ? KEY_EVENT_PRESS : KEY_EVENT_RELEASE;
+      return out.mapping.keyCode > 0 || out.mapping.modifierMask > 0
+             || (profile.chordNotes[in.note >> 5] & (1UL << (in.note & 31)));
+    }
+    case NOTE_EVENT_SELECT_PROFILE:
+      out.kind = KEY_EVENT_SELECT_PROFILE;
+      return true;
+    case NOTE_EVENT_KEY_CHANGE:
+      out.kind = KEY_EVENT_KEY_CHANGE;
+      return true;
+    default:
+      out.kind = KEY_EVENT_RELEASE_SOURCE;
+      return true;
+  }
+}
+
+#endif // EVENT_PIPELINE_H
@@ -0,0 +1,499 @@
+/*
+ * Key Engine
+ *
+ * The keys notes hold down, shared by the firmware's engine variants and the Linux daemon.
+ * No Arduino dependencies: times are milliseconds the caller passes in (millis() or
+ * CLOCK_MONOTONIC), and the keyboard state goes out through an emit function the caller
+ * provides (the firmware's HID transmit queue, the daemon's uinput keyboard).
+ *
+ * Pressed keys are listed in press order, max 6 like the USB report. A key several notes
+ * hold (a key set sharing a key with another note) is listed once and counted, so it is
+ * only released with the last of them. Modifier-only keys (LSHIFT as a note's whole
+ * mapping) are a separate mask held until NoteOff in every mode, so they never replay
+ * other keys.
+ *
+ * Timed (fast-press) and hybrid keys have a release timer, one per key code: pressing the
+ * key again with another modifier takes it over. An unarmed timer only remembers the press
+ * time (hybrid release without a maximum hold). A hybrid key released before its minimum
+ * hold keeps its note's reference until the timer runs out; pressing it again in the
+ * meantime takes that reference over instead of adding one, so the new note-off still
+ * releases it. A hybrid key cut short by its maximum hold is remembered with the notes
+ * still holding it: their late note-offs only count down, so they cannot release the key
+ * when another note presses it again in the meantime.
+ *
+ * The release strategy is a parameter rather than engine state, so the firmware's variants
+ * (one per strategy) pass it as a constant and keep no mode checks on the note path.
+ */
+
+#ifndef KEY_ENGINE_H
+#define KEY_ENGINE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "MappingParser.h"
+
+struct PressedKey {
+  uint8_t keyCode;
+  uint8_t modifierMask;
+  uint8_t refs;  // Notes holding the key
+};
+
+struct ReleaseTimer {
+  uint8_t keyCode;
+  uint8_t modifierMask;
+  bool armed;          // false = only tracks the press time (hybrid release without a maximum hold)
+  bool deferred;       // Note-off came before the minimum hold, the timer releases the key
+  bool maxHold;        // Hybrid maximum hold: the key's notes are still down when it runs out
+  uint32_t pressMs;    // When the key was pressed (hybrid minimum hold)
+  uint32_t releaseMs;  // When the key is released
+};
+
+struct KeyEngine {
+  PressedKey pressedKeys[MAX_SIMULTANEOUS_KEYS];
+  uint8_t pressedKeyCount;
+  uint8_t activeModifierKeys;                // Combined modifier mask from modifier-only keys
+  ReleaseTimer timers[MAX_SIMULTANEOUS_KEYS];
+  uint8_t timerCount;
+  PressedKey expiredKeys[MAX_SIMULTANEOUS_KEYS];  // Keys a maximum hold released, refs = their notes still down
+  uint8_t expiredKeyCount;
+  uint8_t timerSlot[256];                    // Timer of each key code (index + 1, 0 = none)
+  unsigned int pressDurationMs;              // Current profile's press duration (timed and hybrid)
+  unsigned int minHoldMs;                    // Current profile's minimum hold (hybrid)
+};
+
+// Which pressed keys a profile switch keeps (see keepNoteKeys)
+struct KeyKeep {
+  uint8_t refs[MAX_SIMULTANEOUS_KEYS];  // Kept notes holding each pressed key
+  uint8_t expiredRefs[MAX_SIMULTANEOUS_KEYS];  // Kept notes of each expired key
+  uint8_t modifiers;                    // Modifier-only keys of kept notes
+};
+
+// Held notes of an input (a bitset over MAX_MIDI_NOTES): a note holds its key once however
+// many note-ons it gets, so the engine only sees a note-on when the note's bit goes up and
+// a note-off when it goes down. Both return true on that transition
+inline bool holdNote(uint8_t* heldNotes, uint8_t note) {
+  uint8_t bit = 1 << (note & 7);
+  if (heldNotes[note >> 3] & bit) {
+    return false;
+  }
+  heldNotes[note >> 3] |= bit;
+  return true;
+}
+
+inline bool releaseNote(uint8_t* heldNotes, uint8_t note) {
+  uint8_t bit = 1 << (note & 7);
+  if (!(heldNotes[note >> 3] & bit)) {
+    return false;
+  }
+  heldNotes[note >> 3] &= ~bit;
+  return true;
+}
+
+// Timing of the profile whose keys are pressed from now on
+inline void setKeyEngineProfile(KeyEngine& engine, const Profile& profile) {
+  engine.pressDurationMs = profile.pressDurationMs;
+  engine.minHoldMs = profile.minHoldMs;
+}
+
+// Index of a key+modifier combo in the pressed keys list, -1 if it is not pressed
+inline int findPressedKey(const KeyEngine& engine, uint8_t keyCode, uint8_t modifierMask) {
+  for (int i = 0; i < engine.pressedKeyCount; i++) {
+    if (engine.pressedKeys[i].keyCode == keyCode && engine.pressedKeys[i].modifierMask == modifierMask) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Index of a key+modifier combo a maximum hold released, -1 if none of its notes is down
+inline int findExpiredKey(const KeyEngine& engine, uint8_t keyCode, uint8_t modifierMask) {
+  for (int i = 0; i < engine.expiredKeyCount; i++) {
+    if (engine.expiredKeys[i].keyCode == keyCode && engine.expiredKeys[i].modifierMask == modifierMask) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Remember the notes still holding a key a maximum hold released - when the list is full
+// the oldest entry is forgotten (its note-offs then act on the key again)
+inline void addExpiredKey(KeyEngine& engine, const PressedKey& key) {
+  int index = findExpiredKey(engine, key.keyCode, key.modifierMask);
+  if (index >= 0) {
+    engine.expiredKeys[index].refs += key.refs;
+    return;
+  }
+  if (engine.expiredKeyCount == MAX_SIMULTANEOUS_KEYS) {
+    memmove(engine.expiredKeys, engine.expiredKeys + 1, (MAX_SIMULTANEOUS_KEYS - 1) * sizeof(PressedKey));
+    engine.expiredKeyCount--;
+  }
+  engine.expiredKeys[engine.expiredKeyCount++] = key;
+}
+
+// A note-off of a key a maximum hold released: count it down - returns false if the key
+// has no such notes
+inline bool releaseExpiredKey(KeyEngine& engine, KeyMapping key) {
+  int index = findExpiredKey(engine, key.keyCode, key.modifierMask);
+  if (index < 0) {
+    return false;
+  }
+  if (--engine.expiredKeys[index].refs == 0) {
+    engine.expiredKeys[index] = engine.expiredKeys[--engine.expiredKeyCount];
+  }
+  return true;
+}
+
+// Add a key to the pressed keys list - a key that is already pressed gains a reference
+// instead of a second entry, a key beyond the sixth is not pressed
+inline void addPressedKey(KeyEngine& engine, uint8_t keyCode, uint8_t modifierMask) {
+  int index = findPressedKey(engine, keyCode, modifierMask);
+  if (index >= 0) {
+    engine.pressedKeys[index].refs++;
+    return;
+  }
+  if (engine.pressedKeyCount < MAX_SIMULTANEOUS_KEYS) {
+    PressedKey& key = engine.pressedKeys[engine.pressedKeyCount++];
+    key.keyCode = keyCode;
+    key.modifierMask = modifierMask;
+    key.refs = 1;
+  }
+}
+
+// Shift the keys after index down over it
+inline void removePressedKeyAt(KeyEngine& engine, int index) {
+  for (int j = index; j < engine.pressedKeyCount - 1; j++) {
+    engine.pressedKeys[j] = engine.pressedKeys[j + 1];
+  }
+  engine.pressedKeyCount--;
+}
+
+// Drop one reference to a key - returns true if that was the last one and the key is released
+inline bool removePressedKey(KeyEngine& engine, uint8_t keyCode, uint8_t modifierMask) {
+  int index = findPressedKey(engine, keyCode, modifierMask);
+  if (index < 0 || --engine.pressedKeys[index].refs > 0) {
+    return false;
+  }
+  removePressedKeyAt(engine, index);
+  return true;
+}
+
+// Release a key however many notes hold it (its timer ran out, or a new press replaced its modifier)
+inline void dropPressedKey(KeyEngine& engine, uint8_t keyCode, uint8_t modifierMask) {
+  int index = findPressedKey(engine, keyCode, modifierMask);
+  if (index >= 0) {
+    removePressedKeyAt(engine, index);
+  }
+}
+
+// Start (or restart) the release timer of a pressed key
+// A key code has one timer: pressing it again with another modifier takes the key over
+// maxHold: the key's notes release it themselves, the timer only cuts their hold short
+inline void scheduleRelease(KeyEngine& engine, KeyMapping mapping, uint32_t nowMs, uint32_t releaseMs, bool armed,
+                            bool maxHold) {
+  uint8_t slot = engine.timerSlot[mapping.keyCode];
+  if (slot == 0) {
+    if (engine.timerCount >= MAX_SIMULTANEOUS_KEYS) {
+      return;
+    }
+    slot = ++engine.timerCount;
+    engine.timerSlot[mapping.keyCode] = slot;
+  } else if (engine.timers[slot - 1].modifierMask != mapping.modifierMask) {
+    dropPressedKey(engine, mapping.keyCode, engine.timers[slot - 1].modifierMask);
+  }
+  ReleaseTimer& timer = engine.timers[slot - 1];
+  timer.keyCode = mapping.keyCode;
+  timer.modifierMask = mapping.modifierMask;
+  timer.armed = armed;
+  timer.deferred = false;
+  timer.maxHold = maxHold;
+  timer.pressMs = nowMs;
+  timer.releaseMs = releaseMs;
+}
+
+// Drop a key's release timer, if it has one - the last timer moves into the freed slot
+inline void cancelReleaseTimer(KeyEngine& engine, KeyMapping mapping) {
+  uint8_t slot = engine.timerSlot[mapping.keyCode];
+  if (slot == 0 || engine.timers[slot - 1].modifierMask != mapping.modifierMask) {
+    return;
+  }
+  engine.timerSlot[mapping.keyCode] = 0;
+  engine.timerCount--;
+  if (slot - 1 < engine.timerCount) {
+    engine.timers[slot - 1] = engine.timers[engine.timerCount];
+    engine.timerSlot[engine.timers[slot - 1].keyCode] = slot;
+  }
+}
+
+// Is a key only waiting out its minimum hold? Its reference belongs to a note that is up
+inline bool releaseDeferred(const KeyEngine& engine, KeyMapping key) {
+  uint8_t slot = engine.timerSlot[key.keyCode];
+  return slot != 0 && engine.timers[slot - 1].modifierMask == key.modifierMask && engine.timers[slot - 1].deferred;
+}
+
+// Forget every release timer without releasing its key
+inline void clearReleaseTimers(KeyEngine& engine) {
+  for (int i = 0; i < engine.timerCount; i++) {
+    engine.timerSlot[engine.timers[i].keyCode] = 0;
+  }
+  engine.timerCount = 0;
+}
+
+// Forget every key without releasing it (engine reset, benchmarks)
+inline void clearKeyEngine(KeyEngine& engine) {
+  engine.pressedKeyCount = 0;
+  engine.activeModifierKeys = 0;
+  engine.expiredKeyCount = 0;
+  clearReleaseTimers(engine);
+}
+
+// Release the keys whose armed timer is due - returns true if any was released
+inline bool expireReleaseTimers(KeyEngine& engine, uint32_t nowMs) {
+  bool released = false;
+  for (int i = engine.timerCount - 1; i >= 0; i--) {
+    const ReleaseTimer& timer = engine.timers[i];
+    if (timer.armed && (int32_t)(nowMs - timer.releaseMs) >= 0) {
+      KeyMapping key = {timer.keyCode, timer.modifierMask};
+      int index = findPressedKey(engine, key.keyCode, key.modifierMask);
+      if (index >= 0 && timer.maxHold && !timer.deferred) {
+        addExpiredKey(engine, engine.pressedKeys[index]);
+      }
+      dropPressedKey(engine, key.keyCode, key.modifierMask);
+      cancelReleaseTimer(engine, key);
+      released = true;
+    }
+  }
+  return released;
+}
+
+// Time until the earliest armed release (0 if it is due) - returns false if none is armed
+inline bool nextReleaseDelay(const KeyEngine& engine, uint32_t nowMs, uint32_t& delayMs) {
+  bool pending = false;
+  for (int i = 0; i < engine.timerCount; i++) {
+    const ReleaseTimer& timer = engine.timers[i];
+    if (!timer.armed) {
+      continue;
+    }
+    int32_t remaining = (int32_t)(timer.releaseMs - nowMs);
+    uint32_t delay = (remaining > 0) ? (uint32_t)remaining : 0;
+    if (!pending || delay < delayMs) {
+      delayMs = delay;
+      pending = true;
+    }
+  }
+  return pending;
+}
+
+// One note lets go of a key - returns true if the key was released (no other note holds
+// it and a hybrid minimum hold is over; a shorter hybrid hold has its timer moved to the
+// end of the minimum hold instead)
+// Notes whose key a maximum hold already released count down first, without touching the key
+inline bool releaseKey(KeyEngine& engine, KeyMapping key, ReleaseStrategy release, uint32_t nowMs) {
+  if (engine.expiredKeyCount > 0 && releaseExpiredKey(engine, key)) {
+    return false;
+  }
+  int index = findPressedKey(engine, key.keyCode, key.modifierMask);
+  if (index >= 0 && engine.pressedKeys[index].refs > 1) {
+    // Another note still holds the key, its note-off decides
+    engine.pressedKeys[index].refs--;
+    return false;
+  }
+  if (release == RELEASE_HYBRID && index >= 0) {
+    uint8_t slot = engine.timerSlot[key.keyCode];
+    if (slot != 0 && engine.timers[slot - 1].modifierMask == key.modifierMask) {
+      ReleaseTimer& timer = engine.timers[slot - 1];
+      if (nowMs - timer.pressMs < engine.minHoldMs) {
+        timer.releaseMs = timer.pressMs + engine.minHoldMs;
+        timer.armed = true;
+        timer.deferred = true;
+        return false;
+      }
+    }
+  }
+  // A held key kept across a switch from a hybrid profile may still have a timer
+  cancelReleaseTimer(engine, key);
+  return removePressedKey(engine, key.keyCode, key.modifierMask);
+}
+
+// Press a mapped key (mapping has a keyCode or a modifier) and emit the new state
+// A key set's keys are all pressed before the state goes out, so they arrive together
+template <typename Emit>
+inline void keyNoteOn(KeyEngine& engine, const KeySetPool& keySets, KeyMapping mapping, ReleaseStrategy release,
+                      uint32_t nowMs, Emit emit) {
+  if (mapping.keyCode == 0) {
+    engine.activeModifierKeys |= mapping.modifierMask;
+    emit();
+    return;
+  }
+
+  KeyMapping keys[KEY_SET_KEYS_MAX];
+  int keyCount = expandKeys(keySets, mapping, keys);
+  for (int i = 0; i < keyCount; i++) {
+    if (releaseDeferred(engine, keys[i])) {
+      // Pressed again before a deferred release: take over the released note's reference,
+      // the strategy below decides about the timer anew
+      cancelReleaseTimer(engine, keys[i]);
+    } else {
+      addPressedKey(engine, keys[i].keyCode, keys[i].modifierMask);
+    }
+    if (release == RELEASE_TIMED) {
+      scheduleRelease(engine, keys[i], nowMs, nowMs + engine.pressDurationMs, true, false);
+    } else if (release == RELEASE_HYBRID && (engine.pressDurationMs > 0 || engine.minHoldMs > 0)) {
+      // NoteOff releases the key; the timer remembers the press for the minimum hold and,
+      // with a press duration, cuts a longer hold short (never below the minimum hold)
+      unsigned int maxHoldMs = (engine.pressDurationMs > engine.minHoldMs) ? engine.pressDurationMs : engine.minHoldMs;
+      scheduleRelease(engine, keys[i], nowMs, nowMs + maxHoldMs, engine.pressDurationMs > 0, true);
+    }
+  }
+  emit();
+
+  if (release == RELEASE_IMMEDIATE) {
+    for (int i = 0; i < keyCount; i++) {
+      removePressedKey(engine, keys[i].keyCode, keys[i].modifierMask);
+    }
+    emit();
+  }
+}
+
+// Release a mapped key and emit the new state if a key went up (fast-press strategies
+// ignore NoteOff for regular keys, timers release them)
+template <typename Emit>
+inline void keyNoteOff(KeyEngine& engine, const KeySetPool& keySets, KeyMapping mapping, ReleaseStrategy release,
+                       uint32_t nowMs, Emit emit) {
+  if (mapping.keyCode == 0) {
+    engine.activeModifierKeys &= ~mapping.modifierMask;
+    emit();
+    return;
+  }
+  if (!releasesOnNoteOff(release)) {
+    return;
+  }
+
+  KeyMapping keys[KEY_SET_KEYS_MAX];
+  int keyCount = expandKeys(keySets, mapping, keys);
+  bool released = false;
+  for (int i = 0; i < keyCount; i++) {
+    released |= releaseKey(engine, keys[i], release, nowMs);
+  }
+  if (released) {
+    emit();
+  }
+}
+
+// Turn the pressed keys into keyboard reports, handed to send(modifiers, keys) in order
+// MERGED: every key in one report, modifiers combined. SPLIT / PREROLL: one report per run
+// of consecutive keys with the same modifier (a chord whose keys share a modifier is one
+// report); the modifier-first report of PREROLL is up to the sender, which knows what the
+// host last saw. Modifier-only keys go into every report
+template <typename Send>
+inline void buildKeyReports(const KeyEngine& engine, uint8_t modifierMode, Send send) {
+  uint8_t keys[MAX_SIMULTANEOUS_KEYS];
+  memset(keys, 0, sizeof(keys));
+
+  if (engine.pressedKeyCount == 0) {
+    send(engine.activeModifierKeys, keys);
+    return;
+  }
+
+  if (modifierMode == MODIFIERS_MERGED) {
+    uint8_t modifiers = engine.activeModifierKeys;
+    int keyIdx = 0;
+    for (int i = 0; i < engine.pressedKeyCount; i++) {
+      modifiers |= engine.pressedKeys[i].modifierMask;
+      if (engine.pressedKeys[i].keyCode > 0 && keyIdx < MAX_SIMULTANEOUS_KEYS) {
+        keys[keyIdx++] = engine.pressedKeys[i].keyCode;
+      }
+    }
+    send(modifiers, keys);
+    return;
+  }
+
+  int startIdx = 0;
+  uint8_t currentModifier = engine.pressedKeys[0].modifierMask;
+  for (int i = 1; i <= engine.pressedKeyCount; i++) {
+    if (i < engine.pressedKeyCount && engine.pressedKeys[i].modifierMask == currentModifier) {
+      continue;
+    }
+
+    memset(keys, 0, sizeof(keys));
+    int keyIdx = 0;
+    for (int j = startIdx; j < i && keyIdx < MAX_SIMULTANEOUS_KEYS; j++) {
+      if (engine.pressedKeys[j].keyCode > 0) {
+        keys[keyIdx++] = engine.pressedKeys[j].keyCode;
+      }
+    }
+    send((uint8_t)(currentModifier | engine.activeModifierKeys), keys);
+
+    if (i < engine.pressedKeyCount) {
+      startIdx = i;
+      currentModifier = engine.pressedKeys[i].modifierMask;
+    }
+  }
+}
+
+// Profile switch, first step: does a held note keep its key? It does if the new profile
+// maps it to the same key, released the same way (a key held until NoteOff must stay that
+// way, a fast-press variant ignores NoteOff); modifier-only keys are always held
+inline bool noteKeepsKey(KeyMapping before, KeyMapping after, bool releaseUnchanged) {
+  return before.keyCode == after.keyCode && before.modifierMask == after.modifierMask
+         && (before.keyCode == 0 || releaseUnchanged);
+}
+
+// Second step, for every held note that keeps its key: count it on its keys
+inline void keepNoteKeys(const KeyEngine& engine, const KeySetPool& keySets, KeyMapping mapping, KeyKeep& keep) {
+  if (mapping.keyCode == 0) {
+    keep.modifiers |= mapping.modifierMask;
+    return;
+  }
+  KeyMapping keys[KEY_SET_KEYS_MAX];
+  int keyCount = expandKeys(keySets, mapping, keys);
+  for (int k = 0; k < keyCount; k++) {
+    int index = findPressedKey(engine, keys[k].keyCode, keys[k].modifierMask);
+    if (index >= 0) {
+      keep.refs[index]++;
+    } else if ((index = findExpiredKey(engine, keys[k].keyCode, keys[k].modifierMask)) >= 0) {
+      keep.expiredRefs[index]++;
+    }
+  }
+}
+
+// Last step: keys waiting for a timed release stay down until their timer (unarmed hybrid
+// timers belong to held notes, which decided already), moved by shiftMs when the press
+// duration is rescaled; kept keys are then held by the kept notes only and every other key
+// is released. Only kept notes still count against expired keys. The caller emits the new state
+inline void applyKeptKeys(KeyEngine& engine, KeyKeep& keep, int32_t shiftMs) {
+  for (int t = 0; t < engine.timerCount; t++) {
+    ReleaseTimer& timer = engine.timers[t];
+    if (!timer.armed) {
+      continue;
+    }
+    timer.releaseMs += (uint32_t)shiftMs;
+    int index = findPressedKey(engine, timer.keyCode, timer.modifierMask);
+    if (index >= 0 && keep.refs[index] == 0) {
+      // Held by the timer alone now, no note is left for an expiry to remember
+      keep.refs[index] = 1;
+      timer.maxHold = false;
+    }
+  }
+
+  int expiredCount = 0;
+  for (int i = 0; i < engine.expiredKeyCount; i++) {
+    if (keep.expiredRefs[i] > 0) {
+      engine.expiredKeys[expiredCount] = engine.expiredKeys[i];
+      engine.expiredKeys[expiredCount++].refs = keep.expiredRefs[i];
+    }
+  }
+  engine.expiredKeyCount = expiredCount;
+
+  for (int i = engine.pressedKeyCount - 1; i >= 0; i--) {
+    if (keep.refs[i] > 0) {
+      engine.pressedKeys[i].refs = keep.refs[i];
+      continue;
+    }
+    KeyMapping key = {engine.pressedKeys[i].keyCode, engine.pressedKeys[i].modifierMask};
+    removePressedKeyAt(engine, i);
+    cancelReleaseTimer(engine, key);
+  }
+  engine.activeModifierKeys = keep.modifiers;
+}
+
+#endif
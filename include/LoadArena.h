@@ -0,0 +1,75 @@
+/*
+ * Load Arena
+ *
+ * Fixed-capacity bump allocator for load-time scratch (line buffers, upper-case copies,
+ * file names) so loading config and mapping files never touches the heap.
+ *
+ * Usage: open a LoadArenaScope at the top of a loader; everything allocated inside it
+ * is released when the scope ends, so the arena is empty again after every load.
+ */
+
+#ifndef LOAD_ARENA_H
+#define LOAD_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class LoadArena {
+public:
+  LoadArena(uint8_t* buffer, size_t capacity)
+    : buffer_(buffer), capacity_(capacity), used_(0), highWater_(0), failures_(0) {}
+
+  // Allocate size bytes (4-byte aligned), or nullptr if the arena is exhausted
+  void* allocate(size_t size) {
+    size_t aligned = (used_ + 3) & ~(size_t)3;
+    if (aligned + size > capacity_) {
+      failures_++;
+      return nullptr;
+    }
+    used_ = aligned + size;
+    if (used_ > highWater_) {
+      highWater_ = used_;
+    }
+    return buffer_ + aligned;
+  }
+
+  // Allocate a zero-terminated, empty char buffer able to hold length characters
+  char* allocateString(size_t length) {
+    char* str = static_cast<char*>(allocate(length + 1));
+    if (str) {
+      str[0] = '\0';
+    }
+    return str;
+  }
+
+  size_t mark() const { return used_; }
+  void release(size_t mark) { used_ = mark; }
+
+  size_t used() const { return used_; }
+  size_t capacity() const { return capacity_; }
+  size_t highWater() const { return highWater_; }
+  unsigned long failures() const { return failures_; }
+
+private:
+  uint8_t* buffer_;
+  size_t capacity_;
+  size_t used_;
+  size_t highWater_;       // Most bytes ever in use at once
+  unsigned long failures_; // Allocations refused because the arena was full
+};
+
+// Releases everything allocated from the arena since the scope was opened
+class LoadArenaScope {
+public:
+  explicit LoadArenaScope(LoadArena& arena) : arena_(arena), mark_(arena.mark()) {}
+  ~LoadArenaScope() { arena_.release(mark_); }
+
+  LoadArenaScope(const LoadArenaScope&) = delete;
+  LoadArenaScope& operator=(const LoadArenaScope&) = delete;
+
+private:
+  LoadArena& arena_;
+  size_t mark_;
+};
+
+#endif // LOAD_ARENA_H
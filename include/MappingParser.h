@@ -0,0 +1,258 @@
+/*
+ * Mapping Parser
+ *
+ * Profile and config types plus the CONFIG.TXT / mapping file line parsers, shared by the
+ * Teensy firmware (src/main.cpp) and the Linux daemon (src/linux/) so both read the same
+ * files the same way. No Arduino dependencies.
+ *
+ * The parsers work line by line on a mutable buffer: callers read a line, hand it over and
+ * the parser trims, uppercases and splits it in place.
+ */
+
+#ifndef MAPPING_PARSER_H
+#define MAPPING_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "MidiConfig.h"
+
+// Structure to store key mapping with modifier
+struct KeyMapping {
+  uint8_t keyCode;      // HID key code (0 = unmapped)
+  uint8_t modifierMask; // Modifier mask (SHIFT, CTRL, etc.)
+};
+
+// Key code of a mapping that presses a key set: its modifierMask is the set's index in the
+// KeySetPool (no HID usage the parser produces is this high)
+#define KEY_SET_CODE 0xFF
+
+static_assert(KEY_SET_MAX <= 256, "key set indexes must fit in KeyMapping.modifierMask");
+
+// Keys one note presses together (60=A+S), all with the set's modifiers
+struct KeySet {
+  uint8_t keys[KEY_SET_KEYS_MAX];  // HID key codes, unused entries 0
+  uint8_t modifierMask;
+};
+
+// Key sets of every profile, each distinct set stored once
+struct KeySetPool {
+  KeySet sets[KEY_SET_MAX];
+  uint8_t count;
+};
+
+// How a chord whose keys use different modifiers is turned into reports
+enum ModifierMode {
+  MODIFIERS_SPLIT,    // One report per run of keys sharing a modifier (preserves each key's modifier)
+  MODIFIERS_MERGED,   // All keys in one report with every modifier combined (fastest)
+  MODIFIERS_PREROLL,  // Like SPLIT, but a changed modifier is reported alone before its keys
+  MODIFIER_MODE_COUNT
+};
+
+// How notes outside a profile's mapped window are played - precomputed into noteToKey
+// when the mapping file is loaded, so a folded note costs the same single lookup
+enum FoldMode {
+  FOLD_OFF,    // Unmapped notes play nothing
+  FOLD_WRAP,   // Moved by whole octaves into the mapped window (same pitch class)
+  FOLD_CLAMP,  // Played as the lowest or highest mapped note
+  FOLD_MODE_COUNT
+};
+
+// Which notes outside the profile's key are snapped to a neighbouring note of the key -
+// precomputed into noteToKey like folding, and rebuilt when the key changes at runtime
+enum AccidentalMode {
+  ACCIDENTALS_KEEP,      // Every note plays its own mapping
+  ACCIDENTALS_UNMAPPED,  // Unmapped out-of-key notes take a neighbour's mapping
+  ACCIDENTALS_MODIFIED,  // Also out-of-key notes that need a modifier (neighbour must need none)
+  ACCIDENTAL_MODE_COUNT
+};
+
+// What happens to the keys of a chord's notes while the chord is being gathered
+enum ChordMode {
+  CHORD_SUPPRESS,  // Chord notes wait up to the gather window; their keys only play if no chord matched
+  CHORD_CANCEL,    // Chord notes play at once; their keys are released when a chord matches
+  CHORD_MODE_COUNT
+};
+
+// When a pressed key is released - derived from fast-press mode, hybrid release and press duration
+enum ReleaseStrategy {
+  RELEASE_IMMEDIATE,  // Fast-press with PRESS_DURATION=0: press and release in the same pass
+  RELEASE_TIMED,      // Fast-press with PRESS_DURATION>0: release after the press duration
+  RELEASE_HELD,       // Normal mode: release on NoteOff
+  RELEASE_HYBRID,     // Release on NoteOff, held at least MIN_HOLD and at most PRESS_DURATION (0 = no limit)
+  RELEASE_STRATEGY_COUNT
+};
+
+// Structure to store a profile (set of mappings)
+// Profile names are kept separately by the caller (the firmware keeps them out of DTCM)
+struct Profile {
+  KeyMapping noteToKey[MAX_MIDI_NOTES];     // 128 MIDI notes (0-127)
+  bool isValid;                              // True if profile has been loaded
+  bool fastPressMode;                        // Fast-press mode for this profile (overrides global config)
+  unsigned int pressDurationMs;              // Press duration for this profile (overrides global config)
+  uint8_t modifierMode;                      // ModifierMode for this profile (overrides global config)
+  bool hybridRelease;                        // Hybrid release for this profile (overrides global config)
+  unsigned int minHoldMs;                    // Shortest hold in hybrid release (overrides global config)
+  uint8_t foldMode;                          // FoldMode applied to this profile's table (overrides global config)
+  uint8_t accidentalMode;                    // AccidentalMode applied to this profile's table (overrides global config)
+  int8_t keySignature;                       // Sharps (> 0) or flats (< 0) of the profile's key (overrides global config)
+  uint32_t chordNotes[MAX_MIDI_NOTES / 32];  // Notes that are part of one of the profile's chords (bitset)
+};
+
+// A {60,64,67}=F line: the notes (bitset) that together fire one key
+struct ChordPattern {
+  uint32_t notes[MAX_MIDI_NOTES / 32];
+  KeyMapping mapping;
+};
+
+// USB identity a mapping file is meant for (DEVICE_VID=, DEVICE_PID=, DEVICE_NAME=)
+struct DeviceMatch {
+  uint16_t vendorId;                          // 0 = any vendor
+  uint16_t productId;                         // 0 = any product
+  char productName[DEVICE_NAME_MAX_LEN + 1];  // Uppercase substring of the product string, "" = any
+};
+
+// Configuration settings (CONFIG.TXT)
+struct Config {
+  bool fastPressMode;     // If true, send quick press/release regardless of MIDI duration
+  unsigned int pressDurationMs;  // Duration for fast press mode (milliseconds)
+  uint8_t profileSwitchNote; // MIDI note to trigger profile switching (default: 12 = C0)
+  uint8_t modifierMode;      // ModifierMode used for chords with mixed modifiers
+  bool hybridRelease;        // If true, release on NoteOff clamped to MIN_HOLD..PRESS_DURATION
+  unsigned int minHoldMs;    // Shortest hold in hybrid release (milliseconds)
+  int8_t transpose;          // Transpose at startup in semitones
+  uint8_t transposeUpNote;   // Transpose control notes (255 = none)
+  uint8_t transposeDownNote;
+  uint8_t octaveUpNote;
+  uint8_t octaveDownNote;
+  uint8_t transposeController;  // Controller that sets the transpose, value 64 = none (255 = none)
+  uint8_t foldMode;          // FoldMode for notes outside a profile's mapped window
+  bool autoTranspose;        // If true, pick the transpose from recently played notes between phrases
+  uint16_t autoTransposeGapMs;  // Silence that separates phrases for auto-transpose
+  uint8_t accidentalMode;    // AccidentalMode for notes outside the key
+  int8_t keySignature;       // Key the accidentals are judged against: sharps (> 0) or flats (< 0)
+  uint8_t keyUpNote;         // Key change control notes: one fifth up / down (255 = none)
+  uint8_t keyDownNote;
+  uint8_t chordMode;         // ChordMode for chord patterns in mapping files
+  uint16_t chordWindowMs;    // Time a chord's notes have to arrive in
+};
+
+extern const Config defaultConfig;
+
+// What a mapping file line turned out to be
+enum MappingLineType {
+  MAPPING_LINE_NONE,     // Empty, comment, section header or not understood
+  MAPPING_LINE_SETTING,  // Per-profile setting (FAST_PRESS_MODE=, DEVICE_NAME=, ...)
+  MAPPING_LINE_NOTE,     // MIDI note mapping (a key or a key set), stored in profile.noteToKey
+  MAPPING_LINE_CHORD     // Chord pattern ({60,64,67}=F), stored in *chord for the caller
+};
+
+// String helpers (in place, ASCII)
+char* trimString(char* str);
+void upperString(char* str);
+bool strEquals(const char* a, const char* b);
+bool strEndsWith(const char* str, const char* suffix);
+bool containsIgnoreCase(const char* str, const char* upperNeedle);
+
+// Value parsers (values already uppercase)
+bool parseBoolValue(const char* value);
+void parseModifierMode(const char* value, uint8_t& mode);
+void parseFoldMode(const char* value, uint8_t& mode);
+void parseChordMode(const char* value, uint8_t& mode);
+void parseAccidentalMode(const char* value, uint8_t& mode);
+bool parseKeySignature(const char* value, int8_t& signature);
+bool parseKeyMapping(char* keyName, uint8_t& keyCode, uint8_t& modifierMask);
+bool parseKeySet(const char* keyNames, KeySet& set);
+
+// Empty the pool
+void clearKeySets(KeySetPool& pool);
+
+// Point mapping at set, adding it to the pool unless an equal set is there already
+// Returns false if the pool is full
+bool addKeySet(KeySetPool& pool, const KeySet& set, KeyMapping& mapping);
+
+// Mapping files contain "MAPPINGS" in their name and end with ".TXT" (name already uppercase)
+bool isMappingFileName(const char* upperName);
+
+// Profile name for a mapping file: the file name without extension, trimmed ("mapping" if empty)
+void profileNameFromFileName(const char* fileName, char* name, size_t maxLength);
+
+// Empty profile (no mappings, no chord notes, not yet valid) with the settings a mapping file
+// starts from - the CONFIG.TXT defaults its own setting lines may override
+void initProfileFromConfig(Profile& profile, const Config& config);
+
+// Apply one CONFIG.TXT line to config - returns true if it was a known setting
+bool parseConfigLine(char* line, Config& config);
+
+// Apply one mapping file line to a profile and its device match
+// Chord lines are returned in *chord (callers without chord support pass nullptr and get
+// MAPPING_LINE_NONE for them); key sets (A+S) go into *keySets (without a pool, or when it
+// is full, the line is not understood)
+MappingLineType parseMappingLine(char* line, Profile& profile, DeviceMatch& match, ChordPattern* chord = nullptr,
+                                 KeySetPool* keySets = nullptr);
+
+// Fill the unmapped notes outside the mapped window according to profile.foldMode
+// Call once after the whole mapping file has been parsed
+void foldProfile(Profile& profile);
+
+// Snap the out-of-key notes of source into profile.noteToKey according to
+// profile.accidentalMode and profile.keySignature (reads only in-key notes, so source may be
+// profile.noteToKey itself); keySets holds the sets source's key set mappings point into
+void snapAccidentals(Profile& profile, const KeyMapping* source, const KeySetPool& keySets);
+
+// Note table for the profile's current settings from the table the mapping file declared:
+// source copied in, accidentals snapped, then folded. Pass profile.noteToKey as source right
+// after parsing; to rebuild after a key change, pass a copy kept from before the first build
+void buildNoteTable(Profile& profile, const KeyMapping* source, const KeySetPool& keySets);
+
+// Whether a note belongs to the major (or relative minor) scale with this key signature
+// The seven pitch classes of a key are the seven fifths F..B moved by its sharps or flats
+inline bool noteInKey(int8_t keySignature, uint8_t note) {
+  int pitchClass = note % 12;
+  int fifth = (pitchClass * 7) % 12;  // Fifths above C, 0..11
+  return (fifth - keySignature + 1 + 24) % 12 <= 6;
+}
+
+inline bool isKeySet(KeyMapping mapping) {
+  return mapping.keyCode == KEY_SET_CODE;
+}
+
+// The keys a mapping presses into keys (KEY_SET_KEYS_MAX entries) - a key set's keys each
+// with the set's modifiers, or the mapping itself - returns how many
+inline int expandKeys(const KeySetPool& pool, KeyMapping mapping, KeyMapping* keys) {
+  if (!isKeySet(mapping)) {
+    keys[0] = mapping;
+    return 1;
+  }
+  const KeySet& set = pool.sets[mapping.modifierMask];
+  int count = 0;
+  while (count < KEY_SET_KEYS_MAX && set.keys[count] != 0) {
+    keys[count].keyCode = set.keys[count];
+    keys[count].modifierMask = set.modifierMask;
+    count++;
+  }
+  return count;
+}
+
+// Modifiers a mapping presses - a key set's modifierMask is its pool index, not modifiers
+inline uint8_t mappingModifiers(const KeySetPool& pool, KeyMapping mapping) {
+  return isKeySet(mapping) ? pool.sets[mapping.modifierMask].modifierMask : mapping.modifierMask;
+}
+
+// Release strategy a profile's fast-press settings call for
+// Hybrid release takes precedence over fast-press mode
+inline ReleaseStrategy releaseStrategyFor(const Profile& profile) {
+  if (profile.hybridRelease) {
+    return RELEASE_HYBRID;
+  }
+  if (!profile.fastPressMode) {
+    return RELEASE_HELD;
+  }
+  return (profile.pressDurationMs == 0) ? RELEASE_IMMEDIATE : RELEASE_TIMED;
+}
+
+// Whether NoteOff releases a regular key (fast-press keys are released by their timer)
+inline bool releasesOnNoteOff(ReleaseStrategy release) {
+  return release == RELEASE_HELD || release == RELEASE_HYBRID;
+}
+
+#endif // MAPPING_PARSER_H
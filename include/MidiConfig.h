@@ -14,16 +14,240 @@
 // Limited by USB HID keyboard report size (6 keys + modifiers)
 #define MAX_SIMULTANEOUS_KEYS 6
 
+// USB host device table: MIDI devices and hubs that can be attached at the same time
+// Every slot is a driver object listening for a device, so only reserve what a rig needs
+#ifndef MIDI_DEVICE_COUNT
+#define MIDI_DEVICE_COUNT 8
+#endif
+#ifndef USB_HUB_COUNT
+#define USB_HUB_COUNT 4
+#endif
+
+#if MIDI_DEVICE_COUNT < 1 || MIDI_DEVICE_COUNT > 8
+#error "MIDI_DEVICE_COUNT must be between 1 and 8"
+#endif
+#if USB_HUB_COUNT < 0 || USB_HUB_COUNT > 4
+#error "USB_HUB_COUNT must be between 0 and 4"
+#endif
+
+// MIDI messages read from one device per loop pass before moving on to the next
+#define MIDI_READ_BURST 4
+
+// Ports using USBHost_t36's big-buffer MIDI driver (bit 0 = device 1 ... bit 7 = device 8)
+// Big-buffer ports accept 512-byte high-speed packets and queue 400 messages instead of 80,
+// for controllers that burst faster than loop() drains them. Each costs about 2.5 KB of RAM.
+#ifndef MIDI_BIG_BUFFER_PORTS
+#define MIDI_BIG_BUFFER_PORTS 0x00
+#endif
+
+// DIN MIDI input on Serial1 (ENABLE_DIN_MIDI builds, see env:teensy41_din)
+// RX is pin 0; bytes are timestamped in the UART interrupt and queued for loop()
+#define DIN_MIDI_BAUD 31250
+#define DIN_MIDI_RX_QUEUE_SIZE 256  // Bytes, power of two (80ms of input at full line rate)
+
+// Bytes fed through the stream parser by its throughput benchmark
+#define PARSER_BENCHMARK_BYTES 30000
+
+// USB MIDI passthrough (ENABLE_MIDI_PASSTHROUGH builds, see env:teensy41_passthrough)
+// Host-port MIDI packets waiting to be forwarded to the PC, and how many go out per loop pass
+// (a burst has to fit the core's free transmit buffers: 32 packets are 128 bytes)
+#define MIDI_PASSTHROUGH_QUEUE_SIZE 256
+#define MIDI_PASSTHROUGH_BURST 32
+
+// HID transmit queue: reports waiting for the USB keyboard endpoint
+// A fast-press note produces 2 reports, so 32 covers a 10+ note burst between host polls
+#define HID_REPORT_QUEUE_SIZE 32
+
+// Size of a USB HID boot keyboard report: modifiers, reserved, 6 key codes
+#define HID_REPORT_SIZE 8
+
+// What happens when the queue is full because the host is not keeping up:
+//   HID_QUEUE_COLLAPSE          - the newest queued report is replaced by the latest state
+//   HID_QUEUE_DROP_INTERMEDIATE - all queued reports are discarded, only the latest state is kept
+#define HID_QUEUE_COLLAPSE 0
+#define HID_QUEUE_DROP_INTERMEDIATE 1
+#ifndef HID_QUEUE_POLICY
+#define HID_QUEUE_POLICY HID_QUEUE_COLLAPSE
+#endif
+
+// Keyboard endpoint: the transmit stage submits reports through its own transfers
+// HID_TX_SLOTS: transfers kept on the keyboard endpoint - a slot is reused once the host has
+//   polled its report, so reports go out at the rate the host really polls
+// HID_POLL_INTERVAL_US: the interval the keyboard descriptor asks for, which the report rate
+//   benchmark compares against - bInterval (KEYBOARD_INTERVAL in the core's usb_desc.h) at
+//   high speed means 2^(bInterval-1) microframes of 125us; 1000 without the core (full speed)
+//   Derived only: the descriptor sets the rate, so change KEYBOARD_INTERVAL to change it
+#ifdef HID_POLL_INTERVAL_US
+#error "HID_POLL_INTERVAL_US follows KEYBOARD_INTERVAL (usb_desc.h) and cannot be overridden"
+#endif
+#ifdef KEYBOARD_INTERVAL
+#define HID_POLL_INTERVAL_US (125 << (KEYBOARD_INTERVAL - 1))
+#else
+#define HID_POLL_INTERVAL_US 1000
+#endif
+#define HID_TX_SLOTS 4
+
+// Cooperative scheduler for loop() (see TaskScheduler.h)
+// Latency-critical tasks run every pass; housekeeping gets one slice per pass while they are
+// idle, and at least every HOUSEKEEPING_MAX_DEFER_US under sustained MIDI load
+#define SCHEDULER_MAX_TASKS 12
+#define HOUSEKEEPING_MAX_DEFER_US 2000
+
+// Idle: after a pass where no task had work, the core sleeps (WFI) until the next interrupt -
+// a USB host transfer (MIDI packet), a DIN byte, the USB device or the 1ms SysTick
+// IDLE_SLEEP=0 spins instead, pausing IDLE_PASS_DELAY_US after each idle pass
+#ifndef IDLE_SLEEP
+#define IDLE_SLEEP 1
+#endif
+#define IDLE_PASS_DELAY_US 100
+
+// Optionally lower the CPU clock to IDLE_CPU_FREQ after IDLE_CLOCK_DROP_MS without work
+// (0 = never). The first note afterwards waits for the clock to be raised again - the idle
+// wake benchmark (teensy41_bench) shows how long that takes
+#ifndef IDLE_CLOCK_DROP_MS
+#define IDLE_CLOCK_DROP_MS 0
+#endif
+#define IDLE_CPU_FREQ 150000000
+#if IDLE_CLOCK_DROP_MS > 0 && !IDLE_SLEEP
+#error "IDLE_CLOCK_DROP_MS needs IDLE_SLEEP"
+#endif
+
+// Slice budgets per task in microseconds - a longer slice is counted as an overrun ("stats")
+#define TASK_BUDGET_USB_HOST_US       50
+#define TASK_BUDGET_MIDI_INGEST_US    50
+#define TASK_BUDGET_RELEASE_TIMERS_US 10
+#define TASK_BUDGET_HID_TX_US         20
+#define TASK_BUDGET_PASSTHROUGH_US    50
+#define TASK_BUDGET_SERIAL_CONSOLE_US 200
+#define TASK_BUDGET_PIPELINE_US       50
+#define TASK_BUDGET_LOAD_GENERATOR_US 50
+#define TASK_BUDGET_KEY_CHANGE_US     20
+#define TASK_BUDGET_CHORD_WINDOW_US   10
+#define TASK_BUDGET_AUTO_TRANSPOSE_US 50
+
+// Event pipeline between MIDI ingest and the key engine (see EventPipeline.h)
+// Events per stage queue (power of two); inputs stop reading while the ingest queue is
+// within PIPELINE_CONTROL_RESERVE of full, leaving room for connect/disconnect control events
+// (a control event that still does not fit is retried on the next poll, ahead of that port's notes)
+#define PIPELINE_QUEUE_SIZE 64
+#define PIPELINE_CONTROL_RESERVE 4
+
+// Synthetic MIDI load generator ("load" serial command, ENABLE_LOAD_GENERATOR builds)
+// Set LOAD_GENERATOR_AT_BOOT=1 to run every pattern once at startup (env:teensy41_load)
+#ifndef LOAD_GENERATOR_AT_BOOT
+#define LOAD_GENERATOR_AT_BOOT 0
+#endif
+#define LOAD_GENERATOR_DEFAULT_RATE 2000    // MIDI events per second
+#define LOAD_GENERATOR_DEFAULT_SECONDS 5
+#define LOAD_GENERATOR_MIN_RATE 100
+#define LOAD_GENERATOR_MAX_RATE 100000
+#define LOAD_GENERATOR_MAX_SECONDS 60
+#define LOAD_GENERATOR_BACKLOG 80           // Events a late run may owe before it drops (a USB MIDI receive queue)
+#define LOAD_GENERATOR_SLICE_EVENTS 32      // Events injected per scheduler slice at most
+#define LOAD_GENERATOR_CHORD_SIZE 10        // Notes per chord in the "chords" pattern
+#define LOAD_GENERATOR_MODIFIER_CHORD_SIZE 6
+#define LOAD_GENERATOR_PROBES 32            // Presses being timed at once (others are not sampled)
+#define LOAD_GENERATOR_DRAIN_TIMEOUT_MS 500
+#define LOAD_LATENCY_BUCKET_US 5            // Latency histogram resolution
+#define LOAD_LATENCY_BUCKETS 2000           // 10ms range, longer latencies share an overflow bucket
+
+// Maximum length of a serial console command (debug builds)
+#define SERIAL_COMMAND_MAX_LEN 32
+
+// Iterations per on-device benchmark (ENABLE_BENCHMARKS builds)
+#define BENCHMARK_ITERATIONS 10000
+
+// Timer interrupts per idle mode in the idle wake benchmark
+#define IDLE_BENCHMARK_SAMPLES 200
+
+// Reports sent by the HID report rate benchmark (0.5s at 8 kHz, 4s at 1 kHz)
+#define HID_BENCHMARK_REPORTS 4000
+
 // Maximum number of profiles per mapping file
 #define MAX_PROFILES 8
 
+// Maximum stored length of a profile name (longer names are truncated)
+#define PROFILE_NAME_MAX_LEN 63
+
+// Maximum length of a DEVICE_NAME= product name filter in a mapping file
+#define DEVICE_NAME_MAX_LEN 31
+
+// Maximum length of a mapping file name on the SD card (longer files are skipped)
+#define MAPPING_FILE_NAME_MAX_LEN 255
+
+// Longest line read from CONFIG.TXT or a mapping file (the rest of a longer line is ignored)
+#define LOAD_LINE_MAX_LEN 255
+
+// Scratch arena for loading files (line buffer, file name and key name copies)
+#define LOAD_ARENA_SIZE 1024
+
+// Memory budgets in bytes, enforced with static_assert (see printMemoryReport)
+// RAM1 = DTCM hot data used on every note, RAM2 = DMAMEM cold data
+#define RAM1_BUDGET_PROFILES    4096
+#define RAM1_BUDGET_KEY_STATE   512
+#define RAM1_BUDGET_HID_TX      512
+#define RAM1_BUDGET_MIDI_PORTS  512
+#define RAM1_BUDGET_PASSTHROUGH 1280
+#define RAM1_BUDGET_DIN_MIDI    2304
+#define RAM1_BUDGET_SCHEDULER   768
+#define RAM1_BUDGET_PIPELINE    3584
+#define RAM1_BUDGET_LOAD_GENERATOR 1024
+#define RAM1_BUDGET_CHORDS      8448
+#define RAM1_BUDGET_KEY_SETS    384
+#define RAM2_BUDGET_NAMES       4096
+#define RAM2_BUDGET_HID_TX_BUFFERS 256
+#define RAM2_BUDGET_LOAD_ARENA  1024
+#define RAM2_BUDGET_SOURCE_TABLES 2048
+#define RAM2_BUDGET_LOAD_LATENCY 8192
+
+// Teensy 4.1 memory map
+#define DTCM_START_ADDRESS  0x20000000UL
+#define RAM1_SIZE           0x80000UL
+#define RAM2_START_ADDRESS  0x20200000UL
+
 // MIDI note for profile switching (default: C1 = note 24, configurable via CONFIG.TXT)
 #define PROFILE_SWITCH_NOTE 24
 
+// Largest runtime transpose either way in semitones (TRANSPOSE=, transpose control notes and CC)
+#define TRANSPOSE_MAX 48
+
+// Chord recognition ({60,64,67}=F lines in mapping files, see ChordMatcher.h)
+// Patterns over all profiles, hash slots (power of two, about twice CHORD_MAX), note sets
+// between a pattern and a bigger one containing it and their hash slots, notes a pattern
+// may have, chords sounding at once, and the default gather window (CHORD_WINDOW=)
+#define CHORD_MAX 256
+#define CHORD_HASH_SLOTS 512
+#define CHORD_GROW_MAX 512
+#define CHORD_GROW_SLOTS 1024
+#define CHORD_NOTES_MAX 8
+#define CHORD_ACTIVE_MAX 4
+#define CHORD_WINDOW_MS 30
+
+// Key sets (60=A+S lines: one note presses several keys in the same report)
+// Distinct sets over all profiles, and keys a set may have
+#define KEY_SET_MAX 64
+#define KEY_SET_KEYS_MAX 4
+
+// Most sharps or flats in a key signature (KEY_SIGNATURE= and the key change control notes)
+#define KEY_SIGNATURE_MAX 7
+
+// Auto-transpose: recent note-ons it picks the transpose for, and the default silence (ms)
+// that starts a new phrase (AUTO_TRANSPOSE_GAP= in CONFIG.TXT)
+#define AUTO_TRANSPOSE_WINDOW 32
+#define AUTO_TRANSPOSE_GAP_MS 400
+
 // Configuration file names on SD card
 #define CONFIG_FILE_NAME "CONFIG.TXT"
 #define MAPPINGS_FILE_NAME "MAPPINGS.TXT"
 
+// Profile store: parsed config and profiles kept in a LittleFS partition on program flash
+// The SD card is only read at boot to import new or changed files into it
+#define PROFILE_STORE_FLASH_SIZE  (256 * 1024)  // Bytes of program flash reserved for LittleFS
+#define PROFILE_STORE_FILE_NAME   "/profiles.bin"
+#define PROFILE_STORE_TEMP_NAME   "/profiles.tmp"
+#define PROFILE_STORE_MAGIC       0x5346484DUL  // "MHFS"
+#define PROFILE_STORE_VERSION     8             // Bump when Config or Profile layout changes
+
 // HID Keyboard Usage Codes (USB HID Standard)
 // Common keys for gaming:
 #define KEY_A           0x04
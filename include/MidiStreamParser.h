@@ -0,0 +1,125 @@
+/*
+ * MIDI Stream Parser
+ *
+ * Byte-level MIDI 1.0 parser for serial (DIN / UART) input. Handles running status,
+ * real-time bytes (0xF8-0xFF) interleaved anywhere - even inside another message -
+ * system common messages and SysEx, which is skipped.
+ *
+ * No Arduino dependencies, so it builds on a PC and can be fed byte-stream fixtures.
+ *
+ * Usage: call parse() for every received byte; when it returns true, message holds a
+ * complete message. For channel messages status includes the channel (0x90 | channel).
+ */
+
+#ifndef MIDI_STREAM_PARSER_H
+#define MIDI_STREAM_PARSER_H
+
+#include <stdint.h>
+
+struct MidiStreamMessage {
+  uint8_t status;  // Status byte (channel messages include the channel)
+  uint8_t data1;   // First data byte (0 if the message has none)
+  uint8_t data2;   // Second data byte (0 if the message has fewer than two)
+};
+
+class MidiStreamParser {
+public:
+  MidiStreamParser() { reset(); }
+
+  // Forget any partial message and the running status (e.g. after a line error)
+  void reset() {
+    status_ = 0;
+    dataCount_ = 0;
+    dataNeeded_ = 0;
+    inSysEx_ = false;
+  }
+
+  // Feed one byte - returns true when message holds a complete message
+  bool parse(uint8_t byte, MidiStreamMessage& message) {
+    if (byte >= 0xF8) {
+      // Real-time: delivered immediately, does not touch the message in progress
+      message.status = byte;
+      message.data1 = 0;
+      message.data2 = 0;
+      return true;
+    }
+
+    if (byte & 0x80) {
+      return parseStatus(byte, message);
+    }
+
+    // Data byte
+    if (inSysEx_) {
+      return false;
+    }
+    if (status_ == 0) {
+      strayBytes_++;  // No status to apply it to (joined mid-message or running status lost)
+      return false;
+    }
+
+    data_[dataCount_++] = byte;
+    if (dataCount_ < dataNeeded_) {
+      return false;
+    }
+
+    message.status = status_;
+    message.data1 = data_[0];
+    message.data2 = (dataNeeded_ > 1) ? data_[1] : 0;
+    dataCount_ = 0;
+    if (status_ >= 0xF0) {
+      status_ = 0;  // System common messages do not set running status
+    }
+    return true;
+  }
+
+  // Data bytes dropped because no status byte preceded them
+  unsigned long strayBytes() const { return strayBytes_; }
+
+private:
+  bool parseStatus(uint8_t byte, MidiStreamMessage& message) {
+    dataCount_ = 0;
+
+    if (byte < 0xF0) {
+      // Channel message: program change and channel pressure have one data byte
+      uint8_t type = byte & 0xF0;
+      status_ = byte;
+      dataNeeded_ = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+      inSysEx_ = false;
+      return false;
+    }
+
+    // System exclusive and system common messages cancel running status
+    status_ = 0;
+    inSysEx_ = false;
+    switch (byte) {
+      case 0xF0:  // SysEx start - data bytes are skipped until the next status byte
+        inSysEx_ = true;
+        return false;
+      case 0xF1:  // MTC quarter frame
+      case 0xF3:  // Song select
+        status_ = byte;
+        dataNeeded_ = 1;
+        return false;
+      case 0xF2:  // Song position
+        status_ = byte;
+        dataNeeded_ = 2;
+        return false;
+      case 0xF6:  // Tune request - no data
+        message.status = byte;
+        message.data1 = 0;
+        message.data2 = 0;
+        return true;
+      default:    // 0xF7 (SysEx end) and undefined 0xF4/0xF5
+        return false;
+    }
+  }
+
+  uint8_t status_;       // Status the next data bytes belong to (0 = none)
+  uint8_t data_[2];
+  uint8_t dataCount_;    // Data bytes received for the current message
+  uint8_t dataNeeded_;   // Data bytes the current status takes
+  bool inSysEx_;
+  unsigned long strayBytes_ = 0;
+};
+
+#endif // MIDI_STREAM_PARSER_H
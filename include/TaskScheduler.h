@@ -0,0 +1,161 @@
+/*
+ * Task Scheduler
+ *
+ * Cooperative scheduler for loop(): tasks are plain functions that do a bounded slice of
+ * work and return. Every pass runs all latency-critical tasks (priority below
+ * TASK_PRIORITY_HOUSEKEEPING) in priority order, then at most one housekeeping slice - and
+ * only if the critical tasks found nothing to do, or housekeeping has waited longer than
+ * the deferral limit. A new background job therefore adds at most one slice between two
+ * runs of the note path, and its run time shows up in its own statistics.
+ *
+ * Times are measured with a free-running cycle counter passed in by the caller, so the
+ * scheduler has no Arduino dependencies. Periods and deferral limits must stay below one
+ * counter wrap (about 7s at 600 MHz).
+ *
+ * Usage: add() every task once at startup, then call runPass() from loop().
+ */
+
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <stdint.h>
+
+// Returns true if the task found work to do on this call
+typedef bool (*TaskFunction)();
+
+// Lower values run first; everything below TASK_PRIORITY_HOUSEKEEPING runs on every pass
+enum TaskPriority : uint8_t {
+  TASK_PRIORITY_INPUT,         // USB host, MIDI ingest
+  TASK_PRIORITY_TIMERS,        // Key release timers
+  TASK_PRIORITY_OUTPUT,        // Keyboard report emitter
+  TASK_PRIORITY_HOUSEKEEPING,  // One slice per pass when the note path is idle
+  TASK_PRIORITY_BACKGROUND     // Like housekeeping, visited after it in each round
+};
+
+struct TaskStats {
+  uint32_t runs;         // Slices run
+  uint32_t busyRuns;     // Slices that found work
+  uint64_t totalCycles;  // Time spent in the task
+  uint32_t maxCycles;    // Longest slice
+  uint32_t overruns;     // Slices longer than the budget
+};
+
+struct SchedulerTask {
+  const char* name;
+  TaskFunction run;
+  uint8_t priority;       // TaskPriority
+  uint32_t budgetCycles;  // Longest slice the task is expected to take
+  uint32_t periodCycles;  // Minimum time between housekeeping slices (0 = whenever possible)
+  uint32_t lastStart;     // Cycle count when the last slice started
+  TaskStats stats;
+};
+
+class TaskScheduler {
+public:
+  TaskScheduler(SchedulerTask* tasks, uint8_t capacity, uint32_t (*cycleCounter)(), uint32_t cyclesPerMicro,
+                uint32_t maxDeferMicros)
+    : tasks_(tasks), capacity_(capacity), count_(0), criticalCount_(0), cursor_(0),
+      cycleCounter_(cycleCounter), cyclesPerMicro_(cyclesPerMicro), maxDeferCycles_(maxDeferMicros * cyclesPerMicro),
+      lastHousekeeping_(0), passes_(0), deferrals_(0), maxPassCycles_(0) {}
+
+  // Register a task - returns false if the table is full
+  // Tasks are kept sorted by priority; equal priorities run in the order they were added
+  bool add(const char* name, TaskFunction run, TaskPriority priority, uint32_t budgetMicros, uint32_t periodMicros = 0) {
+    if (count_ == capacity_) {
+      return false;
+    }
+    uint8_t index = count_;
+    while (index > 0 && tasks_[index - 1].priority > priority) {
+      tasks_[index] = tasks_[index - 1];
+      index--;
+    }
+    SchedulerTask& task = tasks_[index];
+    task.name = name;
+    task.run = run;
+    task.priority = priority;
+    task.budgetCycles = budgetMicros * cyclesPerMicro_;
+    task.periodCycles = periodMicros * cyclesPerMicro_;
+    task.lastStart = cycleCounter_();
+    task.stats = TaskStats{0, 0, 0, 0, 0};
+    count_++;
+    if (priority < TASK_PRIORITY_HOUSEKEEPING) {
+      criticalCount_++;
+    }
+    return true;
+  }
+
+  // One pass: every critical task, then at most one housekeeping slice
+  // Returns true if any task found work (false = an idle pass)
+  bool runPass() {
+    uint32_t passStart = cycleCounter_();
+    bool busy = false;
+    for (uint8_t i = 0; i < criticalCount_; i++) {
+      busy |= runTask(tasks_[i]);
+    }
+
+    uint8_t housekeepingCount = count_ - criticalCount_;
+    if (housekeepingCount > 0) {
+      uint32_t now = cycleCounter_();
+      if (!busy || now - lastHousekeeping_ >= maxDeferCycles_) {
+        lastHousekeeping_ = now;
+        for (uint8_t n = 0; n < housekeepingCount; n++) {
+          SchedulerTask& task = tasks_[criticalCount_ + cursor_];
+          cursor_ = (cursor_ + 1) % housekeepingCount;
+          if (task.periodCycles == 0 || now - task.lastStart >= task.periodCycles) {
+            busy |= runTask(task);
+            break;
+          }
+        }
+      } else {
+        deferrals_++;
+      }
+    }
+
+    uint32_t passCycles = cycleCounter_() - passStart;
+    if (passCycles > maxPassCycles_) {
+      maxPassCycles_ = passCycles;
+    }
+    passes_++;
+    return busy;
+  }
+
+  uint8_t count() const { return count_; }
+  const SchedulerTask& task(uint8_t index) const { return tasks_[index]; }
+  uint32_t cyclesPerMicro() const { return cyclesPerMicro_; }
+  uint32_t passes() const { return passes_; }
+  uint32_t deferrals() const { return deferrals_; }
+  uint32_t maxPassCycles() const { return maxPassCycles_; }
+
+private:
+  bool runTask(SchedulerTask& task) {
+    uint32_t start = cycleCounter_();
+    bool busy = task.run();
+    uint32_t cycles = cycleCounter_() - start;
+    task.lastStart = start;
+    task.stats.runs++;
+    task.stats.busyRuns += busy;
+    task.stats.totalCycles += cycles;
+    if (cycles > task.stats.maxCycles) {
+      task.stats.maxCycles = cycles;
+    }
+    if (cycles > task.budgetCycles) {
+      task.stats.overruns++;
+    }
+    return busy;
+  }
+
+  SchedulerTask* tasks_;
+  uint8_t capacity_;
+  uint8_t count_;
+  uint8_t criticalCount_;      // Tasks [0, criticalCount_) run on every pass
+  uint8_t cursor_;             // Next housekeeping task to offer a slice
+  uint32_t (*cycleCounter_)();
+  uint32_t cyclesPerMicro_;
+  uint32_t maxDeferCycles_;    // Housekeeping runs at least this often, even under load
+  uint32_t lastHousekeeping_;
+  uint32_t passes_;
+  uint32_t deferrals_;         // Passes where housekeeping waited for the note path
+  uint32_t maxPassCycles_;     // Longest pass
+};
+
+#endif // TASK_SCHEDULER_H
@@ -0,0 +1,232 @@
+/*
+ * Transpose
+ *
+ * Runtime transpose and octave shift: an offset added to every note before the profile
+ * table lookup, so a song an octave outside a mapping file's window still plays. It is
+ * changed by control notes (TRANSPOSE_UP_NOTE=, OCTAVE_UP_NOTE=, ...) or set absolutely by a
+ * controller (TRANSPOSE_CC=, value 64 = no transpose). Shared by the firmware's route stage
+ * and the Linux daemon. No Arduino dependencies.
+ *
+ * Every note-on remembers the offset it was played with, so its note-off reaches the same
+ * key even if the transpose changed while the note was down.
+ *
+ * Auto-transpose (AUTO_TRANSPOSE=) keeps a histogram of the last AUTO_TRANSPOSE_WINDOW
+ * notes, updated in constant time per note-on. Once every note has been up for
+ * AUTO_TRANSPOSE_GAP ms, housekeeping (serviceAutoTranspose) searches for the offset that
+ * puts most of those notes on mapped keys; the next note-on - the start of a phrase - moves
+ * the transpose there, if that beats the current one. The search never runs on the note
+ * path, and mid-phrase the transpose never changes, so a chord is never split across two
+ * offsets.
+ */
+
+#ifndef TRANSPOSE_H
+#define TRANSPOSE_H
+
+#include <stdint.h>
+#include "MappingParser.h"
+
+struct TransposeState {
+  int8_t offset;                      // Semitones added to incoming notes
+  uint8_t upNote;                     // Control notes (255 = none)
+  uint8_t downNote;
+  uint8_t octaveUpNote;
+  uint8_t octaveDownNote;
+  uint8_t controller;                 // Absolute transpose controller (255 = none)
+  int8_t heldOffset[MAX_MIDI_NOTES];  // Offset each note was last played with
+  
+  // Auto-transpose
+  bool autoEnabled;
+  uint16_t autoGapMs;                     // Silence that separates phrases
+  uint8_t held[MAX_MIDI_NOTES / 8];       // Notes down (before transpose)
+  uint8_t heldCount;
+  uint32_t lastReleaseMs;                 // Time the last note went up
+  uint8_t window[AUTO_TRANSPOSE_WINDOW];  // Recent note-ons, oldest at windowPos once full
+  uint8_t windowPos;
+  uint8_t windowCount;
+  uint8_t histogram[MAX_MIDI_NOTES];      // How often each note is in the window
+  bool autoReady;                         // autoOffset was searched for the next phrase
+  int8_t autoOffset;
+};
+
+inline void setTranspose(TransposeState& state, int offset) {
+  if (offset > TRANSPOSE_MAX) {
+    offset = TRANSPOSE_MAX;
+  } else if (offset < -TRANSPOSE_MAX) {
+    offset = -TRANSPOSE_MAX;
+  }
+  state.offset = offset;
+}
+
+// Controls and starting offset from the config; no note is held afterwards
+inline void resetTranspose(TransposeState& state, const Config& config) {
+  state.upNote = config.transposeUpNote;
+  state.downNote = config.transposeDownNote;
+  state.octaveUpNote = config.octaveUpNote;
+  state.octaveDownNote = config.octaveDownNote;
+  state.controller = config.transposeController;
+  setTranspose(state, config.transpose);
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    state.heldOffset[note] = 0;
+    state.histogram[note] = 0;
+  }
+  state.autoEnabled = config.autoTranspose;
+  state.autoGapMs = config.autoTransposeGapMs;
+  for (int i = 0; i < MAX_MIDI_NOTES / 8; i++) {
+    state.held[i] = 0;
+  }
+  state.heldCount = 0;
+  state.lastReleaseMs = 0;
+  state.windowPos = 0;
+  state.windowCount = 0;
+  state.autoReady = false;
+}
+
+// Window notes that land on a mapped key (one with a key code) at this offset
+inline int autoTransposeScore(const TransposeState& state, const Profile& profile, const uint8_t* notes,
+                              int noteCount, int offset) {
+  int score = 0;
+  for (int i = 0; i < noteCount; i++) {
+    int note = notes[i] + offset;
+    if (note >= 0 && note < MAX_MIDI_NOTES && profile.noteToKey[note].keyCode > 0) {
+      score += state.histogram[notes[i]];
+    }
+  }
+  return score;
+}
+
+// Best offset for the window - the current one unless another beats it; among equally good
+// offsets whole octaves win (the song stays in its key), then the smallest shift
+inline int bestAutoTransposeOffset(const TransposeState& state, const Profile& profile) {
+  uint8_t notes[AUTO_TRANSPOSE_WINDOW];
+  int noteCount = 0;
+  for (int i = 0; i < state.windowCount; i++) {
+    uint8_t note = state.window[i];
+    bool seen = false;
+    for (int j = 0; j < noteCount && !seen; j++) {
+      seen = notes[j] == note;
+    }
+    if (!seen) {
+      notes[noteCount++] = note;
+    }
+  }
+  
+  int bestOffset = state.offset;
+  int bestScore = autoTransposeScore(state, profile, notes, noteCount, state.offset);
+  int bestRank = -1;  // The current offset is kept on a tie
+  for (int offset = -TRANSPOSE_MAX; offset <= TRANSPOSE_MAX; offset++) {
+    int score = autoTransposeScore(state, profile, notes, noteCount, offset);
+    int rank = ((offset % 12) != 0) * 1000 + (offset < 0 ? -offset : offset);
+    if (score > bestScore || (score == bestScore && bestRank >= 0 && rank < bestRank)) {
+      bestOffset = offset;
+      bestScore = score;
+      bestRank = rank;
+    }
+  }
+  return bestOffset;
+}
+
+// Housekeeping: once every note has been up for the gap, search the offset the next phrase
+// starts with - returns true if it searched. Anything that changes the offset or the note
+// tables in between clears autoReady, so the search runs again
+inline bool serviceAutoTranspose(TransposeState& state, uint32_t nowMs, const Profile& profile) {
+  if (!state.autoEnabled || state.autoReady || state.heldCount > 0 || state.windowCount == 0
+      || nowMs - state.lastReleaseMs < state.autoGapMs) {
+    return false;
+  }
+  state.autoOffset = bestAutoTransposeOffset(state, profile);
+  state.autoReady = true;
+  return true;
+}
+
+// Every note of the input went up at once (it was disconnected or its notes were released)
+inline void releaseAutoTransposeNotes(TransposeState& state, uint32_t nowMs) {
+  if (state.heldCount == 0) {
+    return;
+  }
+  for (int i = 0; i < MAX_MIDI_NOTES / 8; i++) {
+    state.held[i] = 0;
+  }
+  state.heldCount = 0;
+  state.lastReleaseMs = nowMs;
+}
+
+// Held-note and histogram bookkeeping for auto-transpose, constant time per note; the start
+// of a phrase takes the offset housekeeping searched (if it has run since the gap began)
+inline void autoTransposeNote(TransposeState& state, uint8_t note, bool on, uint32_t nowMs) {
+  uint8_t bit = 1 << (note & 7);
+  bool wasHeld = state.held[note >> 3] & bit;
+  if (!on) {
+    if (wasHeld) {
+      state.held[note >> 3] &= ~bit;
+      state.heldCount--;
+      state.lastReleaseMs = nowMs;
+    }
+    return;
+  }
+  
+  bool phraseStart = state.heldCount == 0 && nowMs - state.lastReleaseMs >= state.autoGapMs;
+  if (phraseStart && state.autoReady) {
+    setTranspose(state, state.autoOffset);
+  }
+  state.autoReady = false;
+  if (!wasHeld) {
+    state.held[note >> 3] |= bit;
+    state.heldCount++;
+  }
+  if (state.windowCount == AUTO_TRANSPOSE_WINDOW) {
+    state.histogram[state.window[state.windowPos]]--;
+  } else {
+    state.windowCount++;
+  }
+  state.window[state.windowPos] = note;
+  state.windowPos = (state.windowPos + 1) % AUTO_TRANSPOSE_WINDOW;
+  state.histogram[note]++;
+}
+
+// Returns true if note is a transpose control note (its note-on shifts, its note-off is
+// swallowed) - control notes are compared before transposing
+inline bool transposeControlNote(TransposeState& state, uint8_t note, bool on) {
+  int shift;
+  if (note == state.upNote) {
+    shift = 1;
+  } else if (note == state.downNote) {
+    shift = -1;
+  } else if (note == state.octaveUpNote) {
+    shift = 12;
+  } else if (note == state.octaveDownNote) {
+    shift = -12;
+  } else {
+    return false;
+  }
+  if (on) {
+    setTranspose(state, state.offset + shift);
+    state.autoReady = false;
+  }
+  return true;
+}
+
+// Returns true if the control change was the transpose controller
+inline bool transposeController(TransposeState& state, uint8_t controller, uint8_t value) {
+  if (controller != state.controller) {
+    return false;
+  }
+  setTranspose(state, (int)value - 64);
+  state.autoReady = false;
+  return true;
+}
+
+// Table index for a note (note-ons take the current offset, note-offs the one their
+// note-on had), or -1 if it is transposed out of the MIDI range
+// nowMs is only used by auto-transpose
+inline int transposeNote(TransposeState& state, uint8_t note, bool on, uint32_t nowMs) {
+  if (state.autoEnabled) {
+    autoTransposeNote(state, note, on, nowMs);
+  }
+  if (on) {
+    state.heldOffset[note] = state.offset;
+  }
+  int transposed = note + state.heldOffset[note];
+  return (transposed >= 0 && transposed < MAX_MIDI_NOTES) ? transposed : -1;
+}
+
+#endif // TRANSPOSE_H
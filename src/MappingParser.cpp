@@ -0,0 +1,830 @@
+/*
+ * Mapping Parser - see MappingParser.h
+ *
+ * Shared by the firmware and the Linux daemon; keep it free of Arduino APIs.
+ */
+
+#include "MappingParser.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#endif
+
+#ifndef FLASHMEM
+#define FLASHMEM  // Teensy 4: keeps load-time code in flash instead of RAM1
+#endif
+
+const Config defaultConfig = {
+  .fastPressMode = true,      // Default: fast press mode enabled
+  .pressDurationMs = 0,       // Default: 0ms = immediate press/release (like open source player)
+  .profileSwitchNote = PROFILE_SWITCH_NOTE,  // Default: C1 = note 24 (configurable via CONFIG.TXT)
+  .modifierMode = MODIFIERS_SPLIT,           // Default: preserve each key's modifier
+  .hybridRelease = false,     // Default: release follows fast-press mode
+  .minHoldMs = 0,             // Default: no minimum hold
+  .transpose = 0,
+  .transposeUpNote = 255,     // Default: no transpose controls
+  .transposeDownNote = 255,
+  .octaveUpNote = 255,
+  .octaveDownNote = 255,
+  .transposeController = 255,
+  .foldMode = FOLD_OFF,       // Default: notes outside a mapping file's window play nothing
+  .autoTranspose = false,
+  .autoTransposeGapMs = AUTO_TRANSPOSE_GAP_MS,
+  .accidentalMode = ACCIDENTALS_KEEP,  // Default: accidentals play their own mapping
+  .keySignature = 0,          // Default: C major / A minor
+  .keyUpNote = 255,           // Default: no key change controls
+  .keyDownNote = 255,
+  .chordMode = CHORD_SUPPRESS,       // Default: a chord's notes never play their own keys
+  .chordWindowMs = CHORD_WINDOW_MS
+};
+
+// Trim leading and trailing whitespace in place, returns the first non-space character
+FLASHMEM char* trimString(char* str) {
+  while (isspace((unsigned char)*str)) {
+    str++;
+  }
+  char* end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1])) {
+    end--;
+  }
+  *end = '\0';
+  return str;
+}
+
+FLASHMEM void upperString(char* str) {
+  for (; *str; str++) {
+    *str = toupper((unsigned char)*str);
+  }
+}
+
+FLASHMEM bool strEquals(const char* a, const char* b) {
+  return strcmp(a, b) == 0;
+}
+
+FLASHMEM bool strEndsWith(const char* str, const char* suffix) {
+  size_t strLength = strlen(str);
+  size_t suffixLength = strlen(suffix);
+  return strLength >= suffixLength && strcmp(str + strLength - suffixLength, suffix) == 0;
+}
+
+// Case-insensitive substring search (needle already uppercase)
+FLASHMEM bool containsIgnoreCase(const char* str, const char* upperNeedle) {
+  for (; *str; str++) {
+    const char* s = str;
+    const char* n = upperNeedle;
+    while (*s && *n && toupper((unsigned char)*s) == *n) {
+      s++;
+      n++;
+    }
+    if (*n == '\0') {
+      return true;
+    }
+  }
+  return false;
+}
+
+// true for 1, TRUE, ON, YES (value already uppercase)
+FLASHMEM bool parseBoolValue(const char* value) {
+  return strEquals(value, "1") || strEquals(value, "TRUE") || strEquals(value, "ON") || strEquals(value, "YES");
+}
+
+// Map a MODIFIER_MODE value (already uppercase) to a ModifierMode, leaving mode unchanged if unknown
+FLASHMEM void parseModifierMode(const char* value, uint8_t& mode) {
+  if (strEquals(value, "SPLIT")) {
+    mode = MODIFIERS_SPLIT;
+  } else if (strEquals(value, "MERGED") || strEquals(value, "MERGE")) {
+    mode = MODIFIERS_MERGED;
+  } else if (strEquals(value, "PREROLL") || strEquals(value, "PRE_ROLL")) {
+    mode = MODIFIERS_PREROLL;
+  }
+}
+
+// Map a FOLD_OUT_OF_RANGE value (already uppercase) to a FoldMode, leaving mode unchanged if unknown
+FLASHMEM void parseFoldMode(const char* value, uint8_t& mode) {
+  if (strEquals(value, "OFF") || strEquals(value, "NONE") || strEquals(value, "FALSE") || strEquals(value, "0")) {
+    mode = FOLD_OFF;
+  } else if (strEquals(value, "WRAP") || strEquals(value, "OCTAVE")) {
+    mode = FOLD_WRAP;
+  } else if (strEquals(value, "CLAMP")) {
+    mode = FOLD_CLAMP;
+  }
+}
+
+// Map a CHORD_MODE value (already uppercase) to a ChordMode, leaving mode unchanged if unknown
+FLASHMEM void parseChordMode(const char* value, uint8_t& mode) {
+  if (strEquals(value, "SUPPRESS")) {
+    mode = CHORD_SUPPRESS;
+  } else if (strEquals(value, "CANCEL")) {
+    mode = CHORD_CANCEL;
+  }
+}
+
+// {N,N,...} with 2 to CHORD_NOTES_MAX different notes 0-127 (already trimmed)
+static FLASHMEM bool parseChordNotes(const char* value, uint32_t* notes) {
+  size_t length = strlen(value);
+  if (length < 2 || value[0] != '{' || value[length - 1] != '}') {
+    return false;
+  }
+  memset(notes, 0, MAX_MIDI_NOTES / 8);
+  int noteCount = 0;
+  const char* pos = value + 1;
+  while (true) {
+    char* end;
+    long note = strtol(pos, &end, 10);
+    if (end == pos || note < 0 || note >= MAX_MIDI_NOTES) {
+      return false;
+    }
+    uint32_t bit = 1UL << (note & 31);
+    if (!(notes[note >> 5] & bit)) {
+      notes[note >> 5] |= bit;
+      noteCount++;
+    }
+    while (isspace((unsigned char)*end)) {
+      end++;
+    }
+    if (*end == '}') {
+      break;
+    }
+    if (*end != ',') {
+      return false;
+    }
+    pos = end + 1;
+  }
+  return noteCount >= 2 && noteCount <= CHORD_NOTES_MAX;
+}
+
+// Map a SNAP_ACCIDENTALS value (already uppercase) to an AccidentalMode, leaving mode unchanged if unknown
+FLASHMEM void parseAccidentalMode(const char* value, uint8_t& mode) {
+  if (strEquals(value, "OFF") || strEquals(value, "KEEP") || strEquals(value, "FALSE") || strEquals(value, "0")) {
+    mode = ACCIDENTALS_KEEP;
+  } else if (strEquals(value, "UNMAPPED") || strEquals(value, "ON") || strEquals(value, "TRUE") || strEquals(value, "1")) {
+    mode = ACCIDENTALS_UNMAPPED;
+  } else if (strEquals(value, "MODIFIED") || strEquals(value, "ALL")) {
+    mode = ACCIDENTALS_MODIFIED;
+  }
+}
+
+// KEY_SIGNATURE value (already uppercase): sharps or flats as a signed number (2, -3), or a
+// key name - C, G, F#, BB (B flat), ... for major, with M / MIN / MINOR appended for minor
+// (AM = A minor). Returns false and leaves signature unchanged if not understood
+FLASHMEM bool parseKeySignature(const char* value, int8_t& signature) {
+  int sharps;
+  if (isdigit((unsigned char)value[0]) || value[0] == '-' || value[0] == '+') {
+    char* end;
+    sharps = strtol(value, &end, 10);
+    if (*end != '\0') {
+      return false;
+    }
+  } else {
+    // Fifths above C of the natural tonics, A..G
+    static const int8_t tonicFifths[7] = {3, 5, 0, 2, 4, -1, 1};
+    if (value[0] < 'A' || value[0] > 'G') {
+      return false;
+    }
+    sharps = tonicFifths[value[0] - 'A'];
+    const char* mode = value + 1;
+    if (*mode == '#') {
+      sharps += 7;
+      mode++;
+    } else if (*mode == 'B') {
+      sharps -= 7;
+      mode++;
+    }
+    while (*mode == ' ') {
+      mode++;
+    }
+    if (strEquals(mode, "M") || strEquals(mode, "MIN") || strEquals(mode, "MINOR")) {
+      sharps -= 3;  // Relative minor: A minor shares C major's signature
+    } else if (!strEquals(mode, "") && !strEquals(mode, "MAJ") && !strEquals(mode, "MAJOR")) {
+      return false;
+    }
+  }
+  if (sharps < -KEY_SIGNATURE_MAX || sharps > KEY_SIGNATURE_MAX) {
+    return false;
+  }
+  signature = sharps;
+  return true;
+}
+
+// MIDI note 0-127, or 255 to disable; anything else leaves note unchanged
+static FLASHMEM void parseNoteValue(const char* value, uint8_t& note) {
+  int number = atoi(value);
+  if ((number >= 0 && number < MAX_MIDI_NOTES) || number == 255) {
+    note = number;
+  }
+}
+
+FLASHMEM bool isMappingFileName(const char* upperName) {
+  return strstr(upperName, "MAPPINGS") != nullptr && strEndsWith(upperName, ".TXT");
+}
+
+FLASHMEM void profileNameFromFileName(const char* fileName, char* name, size_t maxLength) {
+  strncpy(name, fileName, maxLength);
+  name[maxLength] = '\0';
+  char* dotPos = strrchr(name, '.');
+  if (dotPos != nullptr && dotPos != name) {
+    *dotPos = '\0';
+  }
+  char* trimmedName = trimString(name);
+  if (trimmedName[0] == '\0') {
+    strncpy(name, "mapping", maxLength);
+    name[maxLength] = '\0';
+  } else if (trimmedName != name) {
+    memmove(name, trimmedName, strlen(trimmedName) + 1);
+  }
+}
+
+FLASHMEM void initProfileFromConfig(Profile& profile, const Config& config) {
+  memset(&profile, 0, sizeof(profile));
+  profile.fastPressMode = config.fastPressMode;
+  profile.pressDurationMs = config.pressDurationMs;
+  profile.modifierMode = config.modifierMode;
+  profile.hybridRelease = config.hybridRelease;
+  profile.minHoldMs = config.minHoldMs;
+  profile.foldMode = config.foldMode;
+  profile.accidentalMode = config.accidentalMode;
+  profile.keySignature = config.keySignature;
+}
+
+// CONFIG.TXT: SETTING=VALUE lines, # comments
+FLASHMEM bool parseConfigLine(char* line, Config& config) {
+  line = trimString(line);
+  
+  // Skip comments and empty lines
+  if (line[0] == '\0' || line[0] == '#') {
+    return false;
+  }
+  
+  // Parse: SETTING=VALUE
+  char* equalsPos = strchr(line, '=');
+  if (equalsPos == nullptr || equalsPos == line) {
+    return false;
+  }
+  *equalsPos = '\0';
+  char* setting = trimString(line);
+  char* value = trimString(equalsPos + 1);
+  upperString(setting);
+  upperString(value);
+  
+  if (strEquals(setting, "FAST_PRESS_MODE") || strEquals(setting, "FASTPRESS")) {
+    config.fastPressMode = parseBoolValue(value);
+    return true;
+  }
+  if (strEquals(setting, "PRESS_DURATION") || strEquals(setting, "DURATION")) {
+    int duration = atoi(value);
+    // Valid range: 0ms (immediate) to 1000ms (1 second)
+    if (duration >= 0 && duration <= 1000) {
+      config.pressDurationMs = duration;
+    }
+    return true;
+  }
+  if (strEquals(setting, "MODIFIER_MODE")) {
+    parseModifierMode(value, config.modifierMode);
+    return true;
+  }
+  if (strEquals(setting, "HYBRID_RELEASE") || strEquals(setting, "HYBRID")) {
+    config.hybridRelease = parseBoolValue(value);
+    return true;
+  }
+  if (strEquals(setting, "MIN_HOLD")) {
+    int hold = atoi(value);
+    // Same range as PRESS_DURATION
+    if (hold >= 0 && hold <= 1000) {
+      config.minHoldMs = hold;
+    }
+    return true;
+  }
+  if (strEquals(setting, "PROFILE_SWITCH_NOTE") || strEquals(setting, "PROFILE_SWITCH") || strEquals(setting, "SWITCH_NOTE")) {
+    parseNoteValue(value, config.profileSwitchNote);
+    return true;
+  }
+  if (strEquals(setting, "TRANSPOSE")) {
+    int transpose = atoi(value);
+    if (transpose >= -TRANSPOSE_MAX && transpose <= TRANSPOSE_MAX) {
+      config.transpose = transpose;
+    }
+    return true;
+  }
+  if (strEquals(setting, "TRANSPOSE_UP_NOTE")) {
+    parseNoteValue(value, config.transposeUpNote);
+    return true;
+  }
+  if (strEquals(setting, "TRANSPOSE_DOWN_NOTE")) {
+    parseNoteValue(value, config.transposeDownNote);
+    return true;
+  }
+  if (strEquals(setting, "OCTAVE_UP_NOTE")) {
+    parseNoteValue(value, config.octaveUpNote);
+    return true;
+  }
+  if (strEquals(setting, "OCTAVE_DOWN_NOTE")) {
+    parseNoteValue(value, config.octaveDownNote);
+    return true;
+  }
+  if (strEquals(setting, "TRANSPOSE_CC")) {
+    // Controller numbers share the note range: 0-127, or 255 to disable
+    parseNoteValue(value, config.transposeController);
+    return true;
+  }
+  if (strEquals(setting, "FOLD_OUT_OF_RANGE") || strEquals(setting, "FOLD")) {
+    parseFoldMode(value, config.foldMode);
+    return true;
+  }
+  if (strEquals(setting, "CHORD_MODE")) {
+    parseChordMode(value, config.chordMode);
+    return true;
+  }
+  if (strEquals(setting, "CHORD_WINDOW")) {
+    int window = atoi(value);
+    // Valid range: 1ms to 500ms
+    if (window >= 1 && window <= 500) {
+      config.chordWindowMs = window;
+    }
+    return true;
+  }
+  if (strEquals(setting, "SNAP_ACCIDENTALS") || strEquals(setting, "ACCIDENTALS")) {
+    parseAccidentalMode(value, config.accidentalMode);
+    return true;
+  }
+  if (strEquals(setting, "KEY_SIGNATURE") || strEquals(setting, "KEY")) {
+    parseKeySignature(value, config.keySignature);
+    return true;
+  }
+  if (strEquals(setting, "KEY_UP_NOTE")) {
+    parseNoteValue(value, config.keyUpNote);
+    return true;
+  }
+  if (strEquals(setting, "KEY_DOWN_NOTE")) {
+    parseNoteValue(value, config.keyDownNote);
+    return true;
+  }
+  if (strEquals(setting, "AUTO_TRANSPOSE")) {
+    config.autoTranspose = parseBoolValue(value);
+    return true;
+  }
+  if (strEquals(setting, "AUTO_TRANSPOSE_GAP")) {
+    int gap = atoi(value);
+    // Valid range: 50ms to 10 seconds
+    if (gap >= 50 && gap <= 10000) {
+      config.autoTransposeGapMs = gap;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Right side of a note or chord line: a key, a key with modifiers, or - with a pool to put
+// it in - a set of keys pressed together
+static FLASHMEM bool parseKeyTarget(char* value, KeyMapping& mapping, KeySetPool* keySets) {
+  KeySet set;
+  if (keySets != nullptr && parseKeySet(value, set)) {
+    return addKeySet(*keySets, set, mapping);
+  }
+  return parseKeyMapping(value, mapping.keyCode, mapping.modifierMask);
+}
+
+// Mapping files: MIDI_NOTE=KEY_NAME lines plus per-profile settings
+// [profile_name] section headers are legacy and ignored - each file is one profile
+FLASHMEM MappingLineType parseMappingLine(char* line, Profile& profile, DeviceMatch& match, ChordPattern* chord,
+                                          KeySetPool* keySets) {
+  line = trimString(line);
+  size_t lineLength = strlen(line);
+  
+  // Skip empty lines, profile section headers and comments
+  if (lineLength == 0 || (line[0] == '[' && line[lineLength - 1] == ']') || line[0] == '#') {
+    return MAPPING_LINE_NONE;
+  }
+  
+  // Parse profile-specific settings: FAST_PRESS_MODE=value or PRESS_DURATION=value
+  // OR parse MIDI note mappings: MIDI_NOTE=KEY_NAME
+  char* equalsPos = strchr(line, '=');
+  if (equalsPos == nullptr || equalsPos == line) {
+    return MAPPING_LINE_NONE;
+  }
+  *equalsPos = '\0';
+  char* leftSide = trimString(line);
+  char* rightSide = trimString(equalsPos + 1);
+  
+  // Remove inline comments (everything after #)
+  char* commentPos = strchr(rightSide, '#');
+  if (commentPos != nullptr) {
+    *commentPos = '\0';
+    rightSide = trimString(rightSide);
+  }
+  
+  // Check if it's a setting (not a MIDI note mapping)
+  // Settings have text keywords on the left side, MIDI notes are numbers 0-127
+  // Both sides are compared case-insensitively from here on
+  upperString(leftSide);
+  upperString(rightSide);
+  
+  if (strEquals(leftSide, "FAST_PRESS_MODE") || strEquals(leftSide, "FASTPRESS")) {
+    profile.fastPressMode = parseBoolValue(rightSide);
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "PRESS_DURATION") || strEquals(leftSide, "DURATION")) {
+    int duration = atoi(rightSide);
+    if (duration >= 0 && duration <= 1000) {
+      profile.pressDurationMs = duration;
+    }
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "MODIFIER_MODE")) {
+    parseModifierMode(rightSide, profile.modifierMode);
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "FOLD_OUT_OF_RANGE") || strEquals(leftSide, "FOLD")) {
+    parseFoldMode(rightSide, profile.foldMode);
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "SNAP_ACCIDENTALS") || strEquals(leftSide, "ACCIDENTALS")) {
+    parseAccidentalMode(rightSide, profile.accidentalMode);
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "KEY_SIGNATURE") || strEquals(leftSide, "KEY")) {
+    parseKeySignature(rightSide, profile.keySignature);
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "HYBRID_RELEASE") || strEquals(leftSide, "HYBRID")) {
+    profile.hybridRelease = parseBoolValue(rightSide);
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "MIN_HOLD")) {
+    int hold = atoi(rightSide);
+    if (hold >= 0 && hold <= 1000) {
+      profile.minHoldMs = hold;
+    }
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "DEVICE_VID") || strEquals(leftSide, "DEVICE_PID")) {
+    // Hex with 0x prefix or decimal
+    unsigned long id = strtoul(rightSide, nullptr, 0);
+    if (id <= 0xFFFF) {
+      if (strEquals(leftSide, "DEVICE_VID")) {
+        match.vendorId = id;
+      } else {
+        match.productId = id;
+      }
+    }
+    return MAPPING_LINE_SETTING;
+  }
+  if (strEquals(leftSide, "DEVICE_NAME")) {
+    strncpy(match.productName, rightSide, DEVICE_NAME_MAX_LEN);
+    match.productName[DEVICE_NAME_MAX_LEN] = '\0';
+    return MAPPING_LINE_SETTING;
+  }
+  
+  // Chord pattern: {NOTE,NOTE,...}=KEY_NAME
+  if (leftSide[0] == '{') {
+    if (chord == nullptr || !parseChordNotes(leftSide, chord->notes) || !parseKeyTarget(rightSide, chord->mapping, keySets)) {
+      return MAPPING_LINE_NONE;
+    }
+    return MAPPING_LINE_CHORD;
+  }
+  
+  // Not a setting, so it must be a MIDI note mapping: MIDI_NOTE=KEY_NAME
+  int note = atoi(leftSide);
+  
+  // Validate MIDI note range (0-127)
+  if (note >= 0 && note < MAX_MIDI_NOTES) {
+    KeyMapping mapping = {0, 0};
+    if (parseKeyTarget(rightSide, mapping, keySets)) {
+      profile.noteToKey[note] = mapping;
+      return MAPPING_LINE_NOTE;
+    }
+  }
+  return MAPPING_LINE_NONE;
+}
+
+// Modifier named in a KEY+MODIFIER combination (SHIFT, CTRL, ...), 0 if it is none
+static FLASHMEM uint8_t modifierFromName(const char* modifierStr) {
+  if (strEquals(modifierStr, "SHIFT") || strEquals(modifierStr, "LEFTSHIFT")) {
+    return MODIFIERKEY_LEFTSHIFT;
+  } else if (strEquals(modifierStr, "RSHIFT") || strEquals(modifierStr, "RIGHTSHIFT")) {
+    return MODIFIERKEY_RIGHTSHIFT;
+  } else if (strEquals(modifierStr, "CTRL") || strEquals(modifierStr, "CONTROL") || strEquals(modifierStr, "LEFTCTRL")) {
+    return MODIFIERKEY_LEFTCTRL;
+  } else if (strEquals(modifierStr, "RCTRL") || strEquals(modifierStr, "RIGHTCTRL")) {
+    return MODIFIERKEY_RIGHTCTRL;
+  } else if (strEquals(modifierStr, "ALT") || strEquals(modifierStr, "LEFTALT")) {
+    return MODIFIERKEY_LEFTALT;
+  } else if (strEquals(modifierStr, "RALT") || strEquals(modifierStr, "RIGHTALT")) {
+    return MODIFIERKEY_RIGHTALT;
+  } else if (strEquals(modifierStr, "META") || strEquals(modifierStr, "WIN") || strEquals(modifierStr, "CMD") || strEquals(modifierStr, "LEFTMETA")) {
+    return MODIFIERKEY_LEFTMETA;
+  } else if (strEquals(modifierStr, "RMETA") || strEquals(modifierStr, "RIGHTMETA")) {
+    return MODIFIERKEY_RIGHTMETA;
+  }
+  return 0;
+}
+
+// Parse key name with optional modifiers (e.g., "SHIFT+F", "F+SHIFT", "CTRL+SPACE")
+// Returns true if parsing succeeded
+FLASHMEM bool parseKeyMapping(char* keyName, uint8_t& keyCode, uint8_t& modifierMask) {
+  modifierMask = 0;
+  
+  // Split and uppercase in place (the caller's line buffer)
+  upperString(keyName);
+  char* keyUpper = trimString(keyName);
+  
+  // Check for modifier combinations (SHIFT+F, CTRL+SPACE, etc.)
+  char* baseKey = keyUpper;
+  char* modifierStr = nullptr;
+  char* plusPos = strchr(keyUpper, '+');
+  
+  if (plusPos != nullptr && plusPos != keyUpper) {
+    // Try "MODIFIER+KEY" format
+    *plusPos = '\0';
+    modifierStr = trimString(keyUpper);
+    baseKey = plusPos + 1;
+  } else {
+    // Try "KEY+MODIFIER" format
+    plusPos = strrchr(keyUpper, '+');
+    if (plusPos != nullptr && plusPos != keyUpper) {
+      *plusPos = '\0';
+      baseKey = keyUpper;
+      modifierStr = trimString(plusPos + 1);
+    }
+  }
+  
+  // Parse modifiers
+  if (modifierStr != nullptr && modifierStr[0] != '\0') {
+    modifierMask |= modifierFromName(modifierStr);
+  }
+  
+  // Parse base key
+  baseKey = trimString(baseKey);
+  
+  // Single letter A-Z
+  if (baseKey[0] >= 'A' && baseKey[0] <= 'Z' && baseKey[1] == '\0') {
+    keyCode = KEY_A + (baseKey[0] - 'A');
+    return true;
+  }
+  
+  // Number keys 0-9
+  if (baseKey[0] >= '0' && baseKey[0] <= '9' && baseKey[1] == '\0') {
+    if (baseKey[0] == '0') {
+      keyCode = KEY_0;
+    } else {
+      keyCode = KEY_1 + (baseKey[0] - '1');
+    }
+    return true;
+  }
+  
+  // Named keys
+  if (strEquals(baseKey, "SPACE") || strEquals(baseKey, "SPC")) {
+    keyCode = KEY_SPACE;
+    return true;
+  }
+  if (strEquals(baseKey, "ENTER") || strEquals(baseKey, "RETURN")) {
+    keyCode = KEY_ENTER;
+    return true;
+  }
+  if (strEquals(baseKey, "TAB")) {
+    keyCode = KEY_TAB;
+    return true;
+  }
+  if (strEquals(baseKey, "ESC") || strEquals(baseKey, "ESCAPE")) {
+    keyCode = KEY_ESC;
+    return true;
+  }
+  if (strEquals(baseKey, "BACKSPACE") || strEquals(baseKey, "BS")) {
+    keyCode = KEY_BACKSPACE;
+    return true;
+  }
+  
+  // Modifier keys as standalone keys (must be sent as modifiers, not key codes)
+  // USB HID keyboard protocol: modifiers are sent via modifier byte, not as key codes
+  if (strEquals(baseKey, "LSHIFT") || strEquals(baseKey, "LEFTSHIFT")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_LEFTSHIFT;
+    return true;
+  }
+  if (strEquals(baseKey, "RSHIFT") || strEquals(baseKey, "RIGHTSHIFT")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_RIGHTSHIFT;
+    return true;
+  }
+  if (strEquals(baseKey, "LCTRL") || strEquals(baseKey, "LEFTCTRL")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_LEFTCTRL;
+    return true;
+  }
+  if (strEquals(baseKey, "RCTRL") || strEquals(baseKey, "RIGHTCTRL")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_RIGHTCTRL;
+    return true;
+  }
+  if (strEquals(baseKey, "LALT") || strEquals(baseKey, "LEFTALT")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_LEFTALT;
+    return true;
+  }
+  if (strEquals(baseKey, "RALT") || strEquals(baseKey, "RIGHTALT")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_RIGHTALT;
+    return true;
+  }
+  if (strEquals(baseKey, "LMETA") || strEquals(baseKey, "LEFTMETA") || strEquals(baseKey, "LWIN") || strEquals(baseKey, "LCMD")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_LEFTMETA;
+    return true;
+  }
+  if (strEquals(baseKey, "RMETA") || strEquals(baseKey, "RIGHTMETA") || strEquals(baseKey, "RWIN") || strEquals(baseKey, "RCMD")) {
+    keyCode = 0;  // No regular key, just the modifier
+    modifierMask = MODIFIERKEY_RIGHTMETA;
+    return true;
+  }
+  
+  // Punctuation and special characters
+  if (strEquals(baseKey, "COMMA") || strEquals(baseKey, ",")) {
+    keyCode = KEY_COMMA;
+    return true;
+  }
+  if (strEquals(baseKey, "DOT") || strEquals(baseKey, "PERIOD") || strEquals(baseKey, ".")) {
+    keyCode = KEY_DOT;
+    return true;
+  }
+  if (strEquals(baseKey, "SLASH") || strEquals(baseKey, "/") || strEquals(baseKey, "?")) {
+    // Note: "?" is typically SHIFT+/, but we'll map it to / for standalone use
+    // If you need actual ?, use SHIFT+SLASH or SHIFT+/
+    keyCode = KEY_SLASH;
+    return true;
+  }
+  if (strEquals(baseKey, "MINUS") || strEquals(baseKey, "-") || strEquals(baseKey, "DASH")) {
+    keyCode = KEY_MINUS;
+    return true;
+  }
+  if (strEquals(baseKey, "EQUAL") || strEquals(baseKey, "EQUALS") || strEquals(baseKey, "=")) {
+    keyCode = KEY_EQUAL;
+    return true;
+  }
+  if (strEquals(baseKey, "LEFTBRACE") || strEquals(baseKey, "LBRACE") || strEquals(baseKey, "[")) {
+    keyCode = KEY_LEFTBRACE;
+    return true;
+  }
+  if (strEquals(baseKey, "RIGHTBRACE") || strEquals(baseKey, "RBRACE") || strEquals(baseKey, "]")) {
+    keyCode = KEY_RIGHTBRACE;
+    return true;
+  }
+  if (strEquals(baseKey, "BACKSLASH") || strEquals(baseKey, "BSLASH") || strEquals(baseKey, "\\")) {
+    keyCode = KEY_BACKSLASH;
+    return true;
+  }
+  
+  return false; // Invalid
+}
+
+// Parse a set of keys pressed together ("A+S", "CTRL+A+S", "W+LSHIFT+D"): two to
+// KEY_SET_KEYS_MAX different keys plus any modifiers, which apply to every key
+// Leaves keyNames untouched; returns false for anything else (a single key is no set)
+FLASHMEM bool parseKeySet(const char* keyNames, KeySet& set) {
+  memset(&set, 0, sizeof(set));
+  int keyCount = 0;
+  const char* pos = keyNames;
+  while (true) {
+    const char* end = strchr(pos, '+');
+    size_t length = (end != nullptr) ? (size_t)(end - pos) : strlen(pos);
+    char token[16];
+    if (length >= sizeof(token)) {
+      return false;
+    }
+    memcpy(token, pos, length);
+    token[length] = '\0';
+    upperString(token);
+    char* name = trimString(token);
+    if (name[0] == '\0') {
+      return false;
+    }
+    
+    uint8_t keyCode = 0;
+    uint8_t modifierMask = modifierFromName(name);
+    if (modifierMask == 0 && !parseKeyMapping(name, keyCode, modifierMask)) {
+      return false;
+    }
+    set.modifierMask |= modifierMask;
+    if (keyCode > 0) {
+      bool duplicate = false;
+      for (int i = 0; i < keyCount; i++) {
+        duplicate |= set.keys[i] == keyCode;
+      }
+      if (!duplicate) {
+        if (keyCount == KEY_SET_KEYS_MAX) {
+          return false;
+        }
+        set.keys[keyCount++] = keyCode;
+      }
+    }
+    
+    if (end == nullptr) {
+      break;
+    }
+    pos = end + 1;
+  }
+  return keyCount >= 2;
+}
+
+FLASHMEM void clearKeySets(KeySetPool& pool) {
+  memset(&pool, 0, sizeof(pool));
+}
+
+FLASHMEM bool addKeySet(KeySetPool& pool, const KeySet& set, KeyMapping& mapping) {
+  int index = 0;
+  while (index < pool.count && memcmp(&pool.sets[index], &set, sizeof(KeySet)) != 0) {
+    index++;
+  }
+  if (index == pool.count) {
+    if (pool.count == KEY_SET_MAX) {
+      return false;
+    }
+    pool.sets[pool.count++] = set;
+  }
+  mapping.keyCode = KEY_SET_CODE;
+  mapping.modifierMask = index;
+  return true;
+}
+
+// Notes below the lowest and above the highest mapped note take the mapping of the note
+// they fold to; unmapped notes inside the window stay unmapped
+FLASHMEM void foldProfile(Profile& profile) {
+  if (profile.foldMode != FOLD_WRAP && profile.foldMode != FOLD_CLAMP) {
+    return;
+  }
+  int lowest = -1;
+  int highest = -1;
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    if (profile.noteToKey[note].keyCode > 0 || profile.noteToKey[note].modifierMask > 0) {
+      if (lowest < 0) {
+        lowest = note;
+      }
+      highest = note;
+    }
+  }
+  if (lowest < 0) {
+    return;
+  }
+  
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    if (note >= lowest && note <= highest) {
+      continue;
+    }
+    int target;
+    if (profile.foldMode == FOLD_CLAMP) {
+      target = (note < lowest) ? lowest : highest;
+    } else if (note < lowest) {
+      target = note + (lowest - note + 11) / 12 * 12;
+    } else {
+      target = note - (note - highest + 11) / 12 * 12;
+    }
+    // A window narrower than an octave has no note of some pitch classes
+    if (target >= lowest && target <= highest) {
+      profile.noteToKey[note] = profile.noteToKey[target];
+    }
+  }
+}
+
+// An out-of-key note sits between two in-key notes (a major scale has no two neighbouring
+// notes outside it). It takes the lower one's mapping in sharp keys (and C) and the upper
+// one's in flat keys - an F# in D major is a raised F, a Bb in F major a lowered B - or the
+// other one if that neighbour cannot be used
+FLASHMEM void snapAccidentals(Profile& profile, const KeyMapping* source, const KeySetPool& keySets) {
+  if (profile.accidentalMode != ACCIDENTALS_UNMAPPED && profile.accidentalMode != ACCIDENTALS_MODIFIED) {
+    return;
+  }
+  bool snapModified = profile.accidentalMode == ACCIDENTALS_MODIFIED;
+  int preferred = (profile.keySignature >= 0) ? -1 : 1;
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    if (noteInKey(profile.keySignature, note)) {
+      continue;
+    }
+    KeyMapping own = source[note];
+    bool unmapped = own.keyCode == 0 && own.modifierMask == 0;
+    if (!unmapped && !(snapModified && mappingModifiers(keySets, own) != 0)) {
+      continue;
+    }
+    for (int attempt = 0; attempt < 2; attempt++) {
+      int neighbour = note + (attempt == 0 ? preferred : -preferred);
+      if (neighbour < 0 || neighbour >= MAX_MIDI_NOTES) {
+        continue;
+      }
+      KeyMapping target = source[neighbour];
+      // A snapped note has to be worth it: a key, and in MODIFIED mode one without a modifier
+      if (target.keyCode > 0 && (!snapModified || mappingModifiers(keySets, target) == 0)) {
+        profile.noteToKey[note] = target;
+        break;
+      }
+    }
+  }
+}
+
+FLASHMEM void buildNoteTable(Profile& profile, const KeyMapping* source, const KeySetPool& keySets) {
+  if (source != profile.noteToKey) {
+    memcpy(profile.noteToKey, source, sizeof(profile.noteToKey));
+  }
+  snapAccidentals(profile, source, keySets);
+  foldProfile(profile);
+}
@@ -0,0 +1,132 @@
+/*
+ * Config directory loader - see ConfigDirectory.h
+ */
+
+#include "ConfigDirectory.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+bool readLine(FILE* file, char* buffer, size_t maxLength) {
+  size_t length = 0;
+  bool truncated = false;
+  int c;
+  while ((c = getc(file)) != EOF && c != '\n') {
+    if (length < maxLength) {
+      buffer[length++] = (char)c;
+    } else {
+      truncated = true;
+    }
+  }
+  buffer[length] = '\0';
+  return !truncated;
+}
+
+static bool isRegularFile(const char* directory, const char* fileName) {
+  char path[PATH_MAX];
+  struct stat info;
+  snprintf(path, sizeof(path), "%s/%s", directory, fileName);
+  return stat(path, &info) == 0 && S_ISREG(info.st_mode);
+}
+
+FILE* openInDirectory(const char* directory, const char* fileName) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", directory, fileName);
+  return fopen(path, "r");
+}
+
+static int compareFileNames(const void* a, const void* b) {
+  return strcmp(static_cast<const char*>(a), static_cast<const char*>(b));
+}
+
+bool scanConfigDirectory(const char* directory, ConfigDirectory& files) {
+  files.configFile[0] = '\0';
+  files.mappingCount = 0;
+
+  DIR* dir = opendir(directory);
+  if (!dir) {
+    fprintf(stderr, "Cannot open %s: %s\n", directory, strerror(errno));
+    return false;
+  }
+
+  char upperName[MAPPING_FILE_NAME_MAX_LEN + 1];
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    const char* fileName = entry->d_name;
+    if (strncmp(fileName, "._", 2) == 0 || strlen(fileName) > MAPPING_FILE_NAME_MAX_LEN) {
+      continue;
+    }
+    if (!isRegularFile(directory, fileName)) {
+      continue;
+    }
+    strcpy(upperName, fileName);
+    upperString(upperName);
+    if (strEquals(upperName, CONFIG_FILE_NAME)) {
+      strcpy(files.configFile, fileName);
+    } else if (isMappingFileName(upperName) && files.mappingCount < MAPPING_SCAN_MAX) {
+      strcpy(files.mappingFiles[files.mappingCount++], fileName);
+    }
+  }
+  closedir(dir);
+  qsort(files.mappingFiles, files.mappingCount, sizeof(files.mappingFiles[0]), compareFileNames);
+  return true;
+}
+
+void loadConfigFile(const char* directory, const ConfigDirectory& files, Config& config) {
+  config = defaultConfig;
+  if (files.configFile[0] == '\0') {
+    return;
+  }
+  FILE* file = openInDirectory(directory, files.configFile);
+  if (!file) {
+    return;
+  }
+  char lineBuffer[LOAD_LINE_MAX_LEN + 1];
+  while (!feof(file)) {
+    readLine(file, lineBuffer, LOAD_LINE_MAX_LEN);
+    parseConfigLine(lineBuffer, config);
+  }
+  fclose(file);
+}
+
+bool loadMappingFile(const char* directory, const char* fileName, const Config& config, Profile& profile,
+                     DeviceMatch& match, KeyMapping* sourceTable, KeySetPool& keySets, ChordTable* chords,
+                     uint8_t profileIndex, MappingFileCounts& counts) {
+  counts.mappings = 0;
+  counts.chords = 0;
+  FILE* file = openInDirectory(directory, fileName);
+  if (!file) {
+    return false;
+  }
+
+  initProfileFromConfig(profile, config);
+  memset(&match, 0, sizeof(match));
+  profile.isValid = true;
+
+  char lineBuffer[LOAD_LINE_MAX_LEN + 1];
+  ChordPattern chord;
+  while (!feof(file)) {
+    readLine(file, lineBuffer, LOAD_LINE_MAX_LEN);
+    MappingLineType lineType = parseMappingLine(lineBuffer, profile, match, chords ? &chord : nullptr, &keySets);
+    if (lineType == MAPPING_LINE_NOTE) {
+      counts.mappings++;
+    } else if (lineType == MAPPING_LINE_CHORD) {
+      if (addChord(*chords, profileIndex, profile, chord)) {
+        counts.chords++;
+      } else {
+        fprintf(stderr, "%s: chord table full (%d patterns), chord ignored\n", fileName, CHORD_MAX);
+      }
+    }
+  }
+  fclose(file);
+  if (keySets.count == KEY_SET_MAX) {
+    fprintf(stderr, "%s: key set pool full (%d sets), further key sets ignored\n", fileName, KEY_SET_MAX);
+  }
+  memcpy(sourceTable, profile.noteToKey, sizeof(profile.noteToKey));
+  buildNoteTable(profile, sourceTable, keySets);
+  return true;
+}
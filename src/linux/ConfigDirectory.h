@@ -0,0 +1,57 @@
+/*
+ * Config directory loader for the Linux tools
+ *
+ * Reads a copy of the SD card the way the firmware does: CONFIG.TXT and the mapping files
+ * are found case-insensitively like on the FAT card, mapping files are taken in name order
+ * (directory order means nothing here) and lines are read with the firmware's length limit.
+ * Shared by the midi2key daemon and the latency rig, so the rig plays exactly the profile
+ * the daemon loaded.
+ */
+
+#ifndef CONFIG_DIRECTORY_H
+#define CONFIG_DIRECTORY_H
+
+#include <stdio.h>
+
+#include "MidiConfig.h"
+#include "MappingParser.h"
+#include "ChordMatcher.h"
+
+// Mapping files considered per directory (sorted by name, the first MAX_PROFILES are loaded)
+#define MAPPING_SCAN_MAX 64
+
+// Files of a config directory
+struct ConfigDirectory {
+  char configFile[MAPPING_FILE_NAME_MAX_LEN + 1];                       // CONFIG.TXT as spelled on disk ("" if none)
+  char mappingFiles[MAPPING_SCAN_MAX][MAPPING_FILE_NAME_MAX_LEN + 1];  // Sorted by name
+  int mappingCount;
+};
+
+// What loadMappingFile() found in a file
+struct MappingFileCounts {
+  int mappings;  // Note lines
+  int chords;    // Chord patterns added to the chord table
+};
+
+// Read one line (without the line ending) into buffer, which holds maxLength characters + '\0'
+// Characters past maxLength are discarded, like the firmware's readLine()
+bool readLine(FILE* file, char* buffer, size_t maxLength);
+
+FILE* openInDirectory(const char* directory, const char* fileName);
+
+// List CONFIG.TXT and the mapping files of a directory
+// Returns false (after printing why) if the directory cannot be read
+bool scanConfigDirectory(const char* directory, ConfigDirectory& files);
+
+// Defaults, then every line of CONFIG.TXT if the directory has one
+void loadConfigFile(const char* directory, const ConfigDirectory& files, Config& config);
+
+// Load one mapping file into a profile set up from config
+// The profile's declared table (before key signature snapping) goes to sourceTable, its
+// chord patterns into chords as profileIndex (nullptr: chord lines are ignored)
+// Returns false if the file cannot be opened
+bool loadMappingFile(const char* directory, const char* fileName, const Config& config, Profile& profile,
+                     DeviceMatch& match, KeyMapping* sourceTable, KeySetPool& keySets, ChordTable* chords,
+                     uint8_t profileIndex, MappingFileCounts& counts);
+
+#endif // CONFIG_DIRECTORY_H
@@ -0,0 +1,140 @@
+/*
+ * uinput keyboard - see UinputKeyboard.h
+ */
+
+#include "UinputKeyboard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <linux/uinput.h>
+
+// HID keyboard usage (0x00-0x73) -> evdev key code, as in the kernel's hid-input table
+static const uint8_t hidToEvdev[] = {
+  0,   0,   0,   0,   30,  48,  46,  32,  18,  33,  34,  35,  23,  36,  37,  38,   // 0x00 - A..L
+  50,  49,  24,  25,  16,  19,  31,  20,  22,  47,  17,  45,  21,  44,  2,   3,    // 0x10 M..Z, 1, 2
+  4,   5,   6,   7,   8,   9,   10,  11,  28,  1,   14,  15,  57,  12,  13,  26,   // 0x20 3..0, Enter..[
+  27,  43,  43,  39,  40,  41,  51,  52,  53,  58,  59,  60,  61,  62,  63,  64,   // 0x30 ]..F6
+  65,  66,  67,  68,  87,  88,  99,  70,  119, 110, 102, 104, 111, 107, 109, 106,  // 0x40 F7..Right
+  105, 108, 103, 69,  98,  55,  74,  78,  96,  79,  80,  81,  75,  76,  77,  71,   // 0x50 Left..KP7
+  72,  73,  82,  83,  86,  127, 116, 117, 183, 184, 185, 186, 187, 188, 189, 190,  // 0x60 KP8..F19
+  191, 192, 193, 194                                                               // 0x70 F20..F24
+};
+
+// Modifier mask bits 0-7: LCtrl, LShift, LAlt, LMeta, RCtrl, RShift, RAlt, RMeta
+static const uint16_t modifierToEvdev[8] = {
+  KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_LEFTALT, KEY_LEFTMETA,
+  KEY_RIGHTCTRL, KEY_RIGHTSHIFT, KEY_RIGHTALT, KEY_RIGHTMETA
+};
+
+static uint16_t evdevCode(uint8_t usage) {
+  return (usage < sizeof(hidToEvdev)) ? hidToEvdev[usage] : 0;
+}
+
+static bool containsKey(const uint8_t keys[UINPUT_REPORT_KEYS], uint8_t key) {
+  for (int i = 0; i < UINPUT_REPORT_KEYS; i++) {
+    if (keys[i] == key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+UinputKeyboard::UinputKeyboard() : fd_(-1), lastModifiers_(0) {
+  memset(lastKeys_, 0, sizeof(lastKeys_));
+}
+
+UinputKeyboard::~UinputKeyboard() {
+  close();
+}
+
+bool UinputKeyboard::open(const char* deviceName) {
+  fd_ = ::open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  bool ok = ioctl(fd_, UI_SET_EVBIT, EV_KEY) == 0 && ioctl(fd_, UI_SET_EVBIT, EV_SYN) == 0;
+  for (size_t i = 0; ok && i < sizeof(hidToEvdev); i++) {
+    if (hidToEvdev[i] != 0) {
+      ok = ioctl(fd_, UI_SET_KEYBIT, hidToEvdev[i]) == 0;
+    }
+  }
+  for (int i = 0; ok && i < 8; i++) {
+    ok = ioctl(fd_, UI_SET_KEYBIT, modifierToEvdev[i]) == 0;
+  }
+
+  struct uinput_setup setup;
+  memset(&setup, 0, sizeof(setup));
+  setup.id.bustype = BUS_VIRTUAL;
+  setup.id.vendor = 0x16C0;   // PJRC, like the Teensy keyboard
+  setup.id.product = 0x0483;
+  setup.id.version = 1;
+  strncpy(setup.name, deviceName, UINPUT_MAX_NAME_SIZE - 1);
+
+  ok = ok && ioctl(fd_, UI_DEV_SETUP, &setup) == 0 && ioctl(fd_, UI_DEV_CREATE) == 0;
+  if (!ok) {
+    int error = errno;
+    ::close(fd_);
+    fd_ = -1;
+    errno = error;
+  }
+  return ok;
+}
+
+void UinputKeyboard::close() {
+  if (fd_ < 0) {
+    return;
+  }
+  releaseAll();
+  ioctl(fd_, UI_DEV_DESTROY);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+bool UinputKeyboard::emit(uint16_t type, uint16_t code, int32_t value) {
+  struct input_event event;
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.code = code;
+  event.value = value;
+  return write(fd_, &event, sizeof(event)) == (ssize_t)sizeof(event);
+}
+
+// Same order as the kernel's HID driver handles a boot keyboard report: modifier bits,
+// then keys that left the array, then keys that entered it, then one SYN_REPORT
+bool UinputKeyboard::sendReport(uint8_t modifiers, const uint8_t keys[UINPUT_REPORT_KEYS]) {
+  if (fd_ < 0) {
+    return false;
+  }
+
+  bool ok = true;
+  uint8_t changed = modifiers ^ lastModifiers_;
+  for (int bit = 0; bit < 8; bit++) {
+    if (changed & (1 << bit)) {
+      ok = emit(EV_KEY, modifierToEvdev[bit], (modifiers >> bit) & 1) && ok;
+    }
+  }
+  for (int i = 0; i < UINPUT_REPORT_KEYS; i++) {
+    if (lastKeys_[i] != 0 && !containsKey(keys, lastKeys_[i]) && evdevCode(lastKeys_[i]) != 0) {
+      ok = emit(EV_KEY, evdevCode(lastKeys_[i]), 0) && ok;
+    }
+  }
+  for (int i = 0; i < UINPUT_REPORT_KEYS; i++) {
+    if (keys[i] != 0 && !containsKey(lastKeys_, keys[i]) && evdevCode(keys[i]) != 0) {
+      ok = emit(EV_KEY, evdevCode(keys[i]), 1) && ok;
+    }
+  }
+  ok = emit(EV_SYN, SYN_REPORT, 0) && ok;
+
+  lastModifiers_ = modifiers;
+  memcpy(lastKeys_, keys, sizeof(lastKeys_));
+  return ok;
+}
+
+void UinputKeyboard::releaseAll() {
+  static const uint8_t noKeys[UINPUT_REPORT_KEYS] = {0};
+  sendReport(0, noKeys);
+}
@@ -0,0 +1,42 @@
+/*
+ * uinput keyboard for the Linux daemon
+ *
+ * Takes the same 8-byte boot keyboard reports the firmware sends over USB (modifier mask +
+ * 6 HID usage codes) and turns the difference to the previous report into evdev key events
+ * on a virtual /dev/uinput keyboard, in the order the kernel's HID driver would.
+ *
+ * Kept apart from MidiConfig.h: its KEY_* names are HID usages, <linux/input.h> uses the
+ * same names for evdev codes.
+ */
+
+#ifndef UINPUT_KEYBOARD_H
+#define UINPUT_KEYBOARD_H
+
+#include <stdint.h>
+
+#define UINPUT_REPORT_KEYS 6
+
+class UinputKeyboard {
+public:
+  UinputKeyboard();
+  ~UinputKeyboard();
+
+  // Create the virtual keyboard - returns false (errno set) if /dev/uinput is not usable
+  bool open(const char* deviceName);
+  void close();
+
+  // Send the key changes between the previous report and this one
+  bool sendReport(uint8_t modifiers, const uint8_t keys[UINPUT_REPORT_KEYS]);
+
+  // Release everything that is still held
+  void releaseAll();
+
+private:
+  bool emit(uint16_t type, uint16_t code, int32_t value);
+
+  int fd_;
+  uint8_t lastModifiers_;
+  uint8_t lastKeys_[UINPUT_REPORT_KEYS];
+};
+
+#endif // UINPUT_KEYBOARD_H
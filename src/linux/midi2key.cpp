@@ -0,0 +1,777 @@
+/*
+ * midi2key - Linux daemon version of the MIDI to HID keyboard translator
+ *
+ * Reads the same CONFIG.TXT and *MAPPINGS*.TXT files as the firmware (through the shared
+ * MappingParser) and turns MIDI into key presses on a virtual uinput keyboard, so a rig can
+ * run without the Teensy dongle or be compared against it.
+ *
+ * Input is an ALSA sequencer port ("midi2key:0", connect sources with aconnect or -c) or a
+ * raw MIDI device (-r hw:1,0,0, parsed with MidiStreamParser). One thread, one epoll loop:
+ * MIDI input, a timerfd armed for the next timed fast-press release, one for the end of a
+ * chord gather, and a signalfd so
+ * Ctrl+C / SIGTERM release every held key before exiting.
+ *
+ * The key engine mirrors the firmware's (same pressed-key list, modifier modes and release
+ * strategies), reports go straight to uinput instead of through a USB transmit queue.
+ *
+ * Usage: midi2key [-d DIR] [-c CLIENT:PORT]... [-r RAWMIDI] [-v]
+ */
+
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MidiConfig.h"
+#include "MappingParser.h"
+#include "MidiStreamParser.h"
+#include "Transpose.h"
+#include "ChordMatcher.h"
+#include "KeyEngine.h"
+#include "UinputKeyboard.h"
+#include "ConfigDirectory.h"
+
+// Name of the virtual keyboard and of the ALSA sequencer client
+#define DAEMON_NAME "midi2key"
+
+// Sequencer sources connected with -c (and matched against DEVICE_VID/PID/NAME)
+#define SEQ_SOURCE_MAX MIDI_DEVICE_COUNT
+
+#define EPOLL_MAX_EVENTS 16
+#define POLL_DESCRIPTORS_MAX 8
+
+#define NO_PROFILE 0xFF
+
+// MIDI channel message types (status without channel)
+#define MIDI_NOTE_OFF 0x80
+#define MIDI_NOTE_ON  0x90
+#define MIDI_CONTROL_CHANGE 0xB0
+
+// Profiles loaded from the config directory
+Profile profiles[MAX_PROFILES];
+char profileNames[MAX_PROFILES][PROFILE_NAME_MAX_LEN + 1];
+DeviceMatch profileDeviceMatch[MAX_PROFILES];
+KeyMapping profileSourceTables[MAX_PROFILES][MAX_MIDI_NOTES];  // Tables as declared, rebuilt from on a key change
+uint8_t keyChangePending = 0;  // Bit per profile whose table waits for every note to be up
+uint8_t profileCount = 0;
+uint8_t currentProfileIndex = 0;
+Config config = defaultConfig;
+
+bool verbose = false;
+
+// Key engine state, shared with the firmware (see KeyEngine.h)
+KeyEngine keyEngine;
+uint8_t heldNotes[MAX_MIDI_NOTES / 8];  // Bitset of mapped notes currently down (all sources, after transpose)
+TransposeState transpose;               // Runtime transpose, as in the firmware's route stage
+ChordTable chordTable;                  // Chord patterns of every profile, as in the firmware
+ChordState chordState;
+KeySetPool keySets;                     // Key sets of every profile (60=A+S), as in the firmware
+
+// Boot keyboard report content (modifiers + 6 key codes)
+struct KeyReport {
+  uint8_t modifiers;
+  uint8_t keys[MAX_SIMULTANEOUS_KEYS];
+};
+
+KeyReport lastReport = {0, {0}};  // Last report written to uinput
+UinputKeyboard keyboard;
+
+// Event sources
+snd_seq_t* seq = nullptr;
+snd_rawmidi_t* rawmidi = nullptr;
+MidiStreamParser rawParser;
+int epollFd = -1;
+int releaseTimerFd = -1;
+int chordTimerFd = -1;
+int transposeTimerFd = -1;
+int signalFd = -1;
+
+// Forward declarations
+bool loadConfigDirectory(const char* directory);
+void loadFallbackProfile();
+uint8_t findDeviceProfile(uint16_t vendorId, uint16_t productId, const char* name);
+bool readCardUsbId(int card, uint16_t& vendorId, uint16_t& productId);
+void selectDeviceProfile(int card, const char* name);
+bool openSequencer(const char* const* sources, int sourceCount);
+bool openRawMidi(const char* device);
+bool addPollDescriptors(struct pollfd* fds, int count);
+void serviceSequencer();
+void serviceRawMidi();
+void processMidiMessage(uint8_t type, uint8_t note, uint8_t velocity);
+void playNote(uint8_t note, bool on);
+void switchProfile(uint8_t profileIndex);
+void changeKeySignature(int fifths);
+void rebuildPendingTables();
+void noteOn(KeyMapping mapping);
+void noteOff(KeyMapping mapping);
+void emitKeyboardState();
+void sendPreRolledReport(const KeyReport& report);
+void sendReport(const KeyReport& report);
+void handleReleaseTimers();
+void armReleaseTimer();
+void armChordTimer();
+void armTransposeTimer();
+uint32_t monotonicMs();
+
+// The chord matcher presses and releases through the key engine
+const ChordOutput chordOutput = {noteOn, noteOff};
+
+void printUsage() {
+  fprintf(stderr,
+    "Usage: " DAEMON_NAME " [-d DIR] [-c CLIENT:PORT]... [-r RAWMIDI] [-v]\n"
+    "  -d DIR           directory with CONFIG.TXT and mapping files (default: .)\n"
+    "  -c CLIENT:PORT   connect an ALSA sequencer source (repeatable, see aconnect -i)\n"
+    "  -r RAWMIDI       read a raw MIDI device instead (e.g. hw:1,0,0)\n"
+    "  -v               log MIDI messages and key reports\n");
+}
+
+int main(int argc, char** argv) {
+  const char* directory = ".";
+  const char* rawDevice = nullptr;
+  const char* sources[SEQ_SOURCE_MAX];
+  int sourceCount = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:c:r:vh")) != -1) {
+    switch (opt) {
+      case 'd':
+        directory = optarg;
+        break;
+      case 'c':
+        if (sourceCount == SEQ_SOURCE_MAX) {
+          fprintf(stderr, "At most %d sequencer sources\n", SEQ_SOURCE_MAX);
+          return 2;
+        }
+        sources[sourceCount++] = optarg;
+        break;
+      case 'r':
+        rawDevice = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        printUsage();
+        return (opt == 'h') ? 0 : 2;
+    }
+  }
+
+  if (!loadConfigDirectory(directory)) {
+    loadFallbackProfile();
+  }
+  resetTranspose(transpose, config);
+  resetChords(chordState, config);
+  setKeyEngineProfile(keyEngine, profiles[currentProfileIndex]);
+  printf("Loaded %d profile(s) from %s, active: %s\n", profileCount, directory, profileNames[currentProfileIndex]);
+
+  if (!keyboard.open(DAEMON_NAME)) {
+    fprintf(stderr, "Cannot create uinput keyboard: %s (is /dev/uinput writable?)\n", strerror(errno));
+    return 1;
+  }
+
+  // Signals are read from a signalfd in the loop, not delivered asynchronously
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  sigprocmask(SIG_BLOCK, &signals, nullptr);
+
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  releaseTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  chordTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  transposeTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epollFd < 0 || signalFd < 0 || releaseTimerFd < 0 || chordTimerFd < 0 || transposeTimerFd < 0) {
+    fprintf(stderr, "Cannot set up event loop: %s\n", strerror(errno));
+    return 1;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = signalFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &event);
+  event.data.fd = releaseTimerFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, releaseTimerFd, &event);
+  event.data.fd = chordTimerFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, chordTimerFd, &event);
+  event.data.fd = transposeTimerFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, transposeTimerFd, &event);
+
+  bool inputOpen = rawDevice ? openRawMidi(rawDevice) : openSequencer(sources, sourceCount);
+  if (!inputOpen) {
+    return 1;
+  }
+
+  bool running = true;
+  while (running) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int ready = epoll_wait(epollFd, events, EPOLL_MAX_EVENTS, -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      int fd = events[i].data.fd;
+      if (fd == signalFd) {
+        struct signalfd_siginfo info;
+        if (read(signalFd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+          running = false;
+        }
+      } else if (fd == releaseTimerFd) {
+        uint64_t expirations;
+        if (read(releaseTimerFd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations)) {
+          handleReleaseTimers();
+        }
+      } else if (fd == chordTimerFd) {
+        uint64_t expirations;
+        if (read(chordTimerFd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations)) {
+          expireChordGather(chordState, profiles[currentProfileIndex], monotonicMs(), chordOutput);
+        }
+      } else if (fd == transposeTimerFd) {
+        // The phrase gap has passed: search the next phrase's offset off the note path
+        uint64_t expirations;
+        if (read(transposeTimerFd, &expirations, sizeof(expirations)) == (ssize_t)sizeof(expirations)) {
+          serviceAutoTranspose(transpose, monotonicMs(), profiles[currentProfileIndex]);
+          armTransposeTimer();
+        }
+      } else if (rawmidi) {
+        serviceRawMidi();
+      } else {
+        serviceSequencer();
+      }
+    }
+  }
+
+  // Leave nothing held on the PC
+  keyboard.close();
+  if (seq) {
+    snd_seq_close(seq);
+  }
+  if (rawmidi) {
+    snd_rawmidi_close(rawmidi);
+  }
+  return 0;
+}
+
+// Load CONFIG.TXT and every mapping file from a directory (a copy of the SD card, see
+// ConfigDirectory.h)
+// Returns false if no mapping file could be loaded
+bool loadConfigDirectory(const char* directory) {
+  static ConfigDirectory files;
+  if (!scanConfigDirectory(directory, files)) {
+    return false;
+  }
+  loadConfigFile(directory, files, config);
+
+  profileCount = 0;
+  currentProfileIndex = 0;
+  clearChords(chordTable);
+  clearKeySets(keySets);
+  memset(profiles, 0, sizeof(profiles));
+  memset(profileNames, 0, sizeof(profileNames));
+  memset(profileDeviceMatch, 0, sizeof(profileDeviceMatch));
+
+  for (int fileIdx = 0; fileIdx < files.mappingCount && profileCount < MAX_PROFILES; fileIdx++) {
+    const char* fileName = files.mappingFiles[fileIdx];
+    int profileIdx = profileCount;
+    MappingFileCounts counts;
+    if (!loadMappingFile(directory, fileName, config, profiles[profileIdx], profileDeviceMatch[profileIdx],
+                         profileSourceTables[profileIdx], keySets, &chordTable, profileIdx, counts)) {
+      continue;
+    }
+    profileCount++;
+    profileNameFromFileName(fileName, profileNames[profileIdx], PROFILE_NAME_MAX_LEN);
+
+    if (verbose) {
+      printf("Profile %d: %s (%d mappings, %d chords) from %s\n", profileIdx + 1, profileNames[profileIdx], counts.mappings,
+             counts.chords, fileName);
+    }
+  }
+
+  return profileCount > 0;
+}
+
+// Single test profile used when nothing could be loaded: note 60 = H, note 58 = G
+void loadFallbackProfile() {
+  clearChords(chordTable);
+  clearKeySets(keySets);
+  memset(profiles, 0, sizeof(profiles));
+  memset(profileDeviceMatch, 0, sizeof(profileDeviceMatch));
+  strcpy(profileNames[0], "default");
+  initProfileFromConfig(profiles[0], config);
+  profiles[0].isValid = true;
+  profiles[0].noteToKey[60].keyCode = KEY_H;
+  profiles[0].noteToKey[58].keyCode = KEY_G;
+  memcpy(profileSourceTables[0], profiles[0].noteToKey, sizeof(profiles[0].noteToKey));
+  buildNoteTable(profiles[0], profileSourceTables[0], keySets);
+  profileCount = 1;
+  currentProfileIndex = 0;
+}
+
+// First profile whose DEVICE_VID / DEVICE_PID / DEVICE_NAME all match (same rules as the
+// firmware); vendorId/productId are 0 when the source is not a USB device
+uint8_t findDeviceProfile(uint16_t vendorId, uint16_t productId, const char* name) {
+  for (int i = 0; i < profileCount; i++) {
+    const DeviceMatch& match = profileDeviceMatch[i];
+    if (match.vendorId == 0 && match.productId == 0 && match.productName[0] == '\0') {
+      continue;
+    }
+    if (match.vendorId != 0 && match.vendorId != vendorId) {
+      continue;
+    }
+    if (match.productId != 0 && match.productId != productId) {
+      continue;
+    }
+    if (match.productName[0] != '\0' && (name == nullptr || !containsIgnoreCase(name, match.productName))) {
+      continue;
+    }
+    return i;
+  }
+  return NO_PROFILE;
+}
+
+// USB vendor/product of a sound card, from /proc/asound/cardN/usbid ("vvvv:pppp")
+bool readCardUsbId(int card, uint16_t& vendorId, uint16_t& productId) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/asound/card%d/usbid", card);
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return false;
+  }
+  unsigned int vendor = 0;
+  unsigned int product = 0;
+  bool ok = fscanf(file, "%x:%x", &vendor, &product) == 2;
+  fclose(file);
+  vendorId = vendor;
+  productId = product;
+  return ok;
+}
+
+// Switch to the profile a newly connected source declares, if any
+void selectDeviceProfile(int card, const char* name) {
+  uint16_t vendorId = 0;
+  uint16_t productId = 0;
+  if (card >= 0) {
+    readCardUsbId(card, vendorId, productId);
+  }
+  uint8_t profileIndex = findDeviceProfile(vendorId, productId, name);
+  printf("Input: %s (%04x:%04x)", name, vendorId, productId);
+  if (profileIndex != NO_PROFILE) {
+    printf(" -> profile %s", profileNames[profileIndex]);
+    switchProfile(profileIndex);
+  }
+  printf("\n");
+}
+
+// Open the sequencer client with one writable port, connecting the given sources to it
+bool openSequencer(const char* const* sources, int sourceCount) {
+  int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK);
+  if (err < 0) {
+    fprintf(stderr, "Cannot open ALSA sequencer: %s\n", snd_strerror(err));
+    return false;
+  }
+  snd_seq_set_client_name(seq, DAEMON_NAME);
+  int port = snd_seq_create_simple_port(seq, "MIDI in",
+                                        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+  if (port < 0) {
+    fprintf(stderr, "Cannot create sequencer port: %s\n", snd_strerror(port));
+    return false;
+  }
+  printf("Listening on sequencer port %d:%d\n", snd_seq_client_id(seq), port);
+
+  for (int i = 0; i < sourceCount; i++) {
+    snd_seq_addr_t address;
+    err = snd_seq_parse_address(seq, &address, sources[i]);
+    if (err >= 0) {
+      err = snd_seq_connect_from(seq, port, address.client, address.port);
+    }
+    if (err < 0) {
+      fprintf(stderr, "Cannot connect %s: %s\n", sources[i], snd_strerror(err));
+      return false;
+    }
+
+    snd_seq_client_info_t* info;
+    snd_seq_client_info_alloca(&info);
+    if (snd_seq_get_any_client_info(seq, address.client, info) >= 0) {
+      selectDeviceProfile(snd_seq_client_info_get_card(info), snd_seq_client_info_get_name(info));
+    }
+  }
+
+  struct pollfd fds[POLL_DESCRIPTORS_MAX];
+  int count = snd_seq_poll_descriptors(seq, fds, POLL_DESCRIPTORS_MAX, POLLIN);
+  return addPollDescriptors(fds, count);
+}
+
+// Open a raw MIDI input device (bytes are parsed here, running status and all)
+bool openRawMidi(const char* device) {
+  int err = snd_rawmidi_open(&rawmidi, nullptr, device, SND_RAWMIDI_NONBLOCK);
+  if (err < 0) {
+    fprintf(stderr, "Cannot open raw MIDI device %s: %s\n", device, snd_strerror(err));
+    rawmidi = nullptr;
+    return false;
+  }
+
+  snd_rawmidi_info_t* info;
+  snd_rawmidi_info_alloca(&info);
+  if (snd_rawmidi_info(rawmidi, info) >= 0) {
+    selectDeviceProfile(snd_rawmidi_info_get_card(info), snd_rawmidi_info_get_name(info));
+  }
+
+  struct pollfd fds[POLL_DESCRIPTORS_MAX];
+  int count = snd_rawmidi_poll_descriptors(rawmidi, fds, POLL_DESCRIPTORS_MAX);
+  return addPollDescriptors(fds, count);
+}
+
+bool addPollDescriptors(struct pollfd* fds, int count) {
+  for (int i = 0; i < count; i++) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fds[i].fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[i].fd, &event) < 0) {
+      fprintf(stderr, "Cannot watch MIDI input: %s\n", strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+// Drain every event the sequencer has queued
+void serviceSequencer() {
+  snd_seq_event_t* event;
+  int err;
+  while ((err = snd_seq_event_input(seq, &event)) >= 0) {
+    switch (event->type) {
+      case SND_SEQ_EVENT_NOTEON:
+        processMidiMessage(MIDI_NOTE_ON, event->data.note.note, event->data.note.velocity);
+        break;
+      case SND_SEQ_EVENT_NOTEOFF:
+        processMidiMessage(MIDI_NOTE_OFF, event->data.note.note, event->data.note.velocity);
+        break;
+      case SND_SEQ_EVENT_CONTROLLER:
+        processMidiMessage(MIDI_CONTROL_CHANGE, event->data.control.param, event->data.control.value);
+        break;
+      default:
+        break;
+    }
+  }
+  if (err == -ENOSPC) {
+    fprintf(stderr, "Sequencer input overrun, events lost\n");
+  }
+}
+
+// Drain the raw MIDI device through the stream parser
+void serviceRawMidi() {
+  uint8_t buffer[256];
+  ssize_t length;
+  while ((length = snd_rawmidi_read(rawmidi, buffer, sizeof(buffer))) > 0) {
+    for (ssize_t i = 0; i < length; i++) {
+      MidiStreamMessage message;
+      if (rawParser.parse(buffer[i], message) && message.status < 0xF0) {
+        processMidiMessage(message.status & 0xF0, message.data1, message.data2);
+      }
+    }
+  }
+  if (length < 0 && length != -EAGAIN) {
+    fprintf(stderr, "Raw MIDI read: %s\n", snd_strerror(length));
+  }
+}
+
+// Handle one channel message (any channel), same rules as the firmware
+void processMidiMessage(uint8_t type, uint8_t note, uint8_t velocity) {
+  if (verbose && (type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF)) {
+    printf("MIDI: %s note=%d velocity=%d\n", type == MIDI_NOTE_ON ? "NoteOn" : "NoteOff", note, velocity);
+  }
+
+  // Profile switch note cycles through the loaded profiles (255 disables it)
+  if (config.profileSwitchNote < 255 && type == MIDI_NOTE_ON && velocity > 0 && note == config.profileSwitchNote) {
+    if (profileCount > 1) {
+      switchProfile((currentProfileIndex + 1) % profileCount);
+      printf("Profile: %s\n", profileNames[currentProfileIndex]);
+    }
+    return;
+  }
+
+  // Key change notes move the current profile's key one fifth (note-offs are ignored)
+  if ((type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF) && (note == config.keyUpNote || note == config.keyDownNote)) {
+    if (type == MIDI_NOTE_ON && velocity > 0) {
+      changeKeySignature(note == config.keyUpNote ? 1 : -1);
+    }
+    return;
+  }
+
+  // For a control change, note is the controller and velocity its value
+  int8_t fromTranspose = transpose.offset;
+  if (type == MIDI_CONTROL_CHANGE) {
+    transposeController(transpose, note & 0x7F, velocity & 0x7F);
+  } else if (type == MIDI_NOTE_ON || type == MIDI_NOTE_OFF) {
+    bool on = type == MIDI_NOTE_ON && velocity > 0;
+    note &= 0x7F;
+    if (!transposeControlNote(transpose, note, on)) {
+      int transposed = transposeNote(transpose, note, on, monotonicMs());
+      if (transposed >= 0) {
+        playNote(transposed, on);
+      }
+    }
+  }
+  armTransposeTimer();
+  if (transpose.offset != fromTranspose) {
+    printf("Transpose: %d semitones\n", transpose.offset);
+  }
+}
+
+// Press or release the key of a (transposed) note through the current profile
+// Chord notes go through the chord matcher first, which may hold them back or take them
+void playNote(uint8_t note, bool on) {
+  const Profile& profile = profiles[currentProfileIndex];
+  KeyMapping mapping = profile.noteToKey[note];
+  if (!isMapped(mapping) && !chordBit(profile.chordNotes, note)) {
+    return;
+  }
+  if (on) {
+    // A note already down (retriggered without a note-off) holds its key once
+    if (!holdNote(heldNotes, note)) {
+      return;
+    }
+    uint32_t recognizedBefore = chordState.recognized;
+    if (!chordNoteOn(chordState, chordTable, currentProfileIndex, profile, note, monotonicMs(), chordOutput)
+        && isMapped(mapping)) {
+      noteOn(mapping);
+    }
+    if (verbose && chordState.recognized != recognizedBefore) {
+      printf("Chord: note %d completes a chord\n", note);
+    }
+    armChordTimer();
+  } else {
+    // A note that is not down releases nothing: a second note-off, or a note a profile
+    // switch let go of (its mapping changed) - its key was released then, and its
+    // note-off must not release what the new mapping holds
+    if (!releaseNote(heldNotes, note)) {
+      rebuildPendingTables();
+      return;
+    }
+    if (!chordNoteOff(chordState, profile, note, chordOutput) && isMapped(mapping)) {
+      noteOff(mapping);
+    }
+    armChordTimer();
+    rebuildPendingTables();
+  }
+}
+
+// Move the current profile's key signature around the circle of fifths (+1 = one sharp
+// more); its table is rebuilt once no note is down, so every note-off reaches the key its
+// note-on pressed
+void changeKeySignature(int fifths) {
+  Profile& profile = profiles[currentProfileIndex];
+  int signature = profile.keySignature + fifths;
+  if (signature < -KEY_SIGNATURE_MAX || signature > KEY_SIGNATURE_MAX) {
+    return;
+  }
+  profile.keySignature = signature;
+  if (profile.accidentalMode != ACCIDENTALS_KEEP) {
+    keyChangePending |= 1 << currentProfileIndex;
+    rebuildPendingTables();
+  }
+  printf("Key signature: %d (profile %s)\n", signature, profileNames[currentProfileIndex]);
+}
+
+void rebuildPendingTables() {
+  if (keyChangePending == 0) {
+    return;
+  }
+  for (int i = 0; i < MAX_MIDI_NOTES / 8; i++) {
+    if (heldNotes[i]) {
+      return;
+    }
+  }
+  for (int p = 0; p < profileCount; p++) {
+    if (keyChangePending & (1 << p)) {
+      buildNoteTable(profiles[p], profileSourceTables[p], keySets);
+    }
+  }
+  keyChangePending = 0;
+  transpose.autoReady = false;  // Searched on the old table
+  armTransposeTimer();
+}
+
+// Switch to a different profile, as in the firmware: held notes the new profile maps to
+// the same key (released the same way) keep their key, every other held key is released in
+// one report; pending timed releases keep running, rescaled if both profiles are timed
+// (unarmed hybrid timers go with their key)
+void switchProfile(uint8_t profileIndex) {
+  if (profileIndex >= profileCount || !profiles[profileIndex].isValid) {
+    return;
+  }
+  const Profile& oldProfile = profiles[currentProfileIndex];
+  const Profile& newProfile = profiles[profileIndex];
+  ReleaseStrategy oldRelease = releaseStrategyFor(oldProfile);
+  ReleaseStrategy newRelease = releaseStrategyFor(newProfile);
+  bool releaseUnchanged = releasesOnNoteOff(oldRelease) == releasesOnNoteOff(newRelease);
+
+  KeyKeep keep;
+  memset(&keep, 0, sizeof(keep));
+  // Notes held back or taken by a chord pressed no key of their own, they go with the chord state
+  uint32_t chordNotes[CHORD_WORDS];
+  chordOwnedNotes(chordState, chordNotes);
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    if (!(heldNotes[note >> 3] & (1 << (note & 7)))) {
+      continue;
+    }
+    KeyMapping before = oldProfile.noteToKey[note];
+    if (chordBit(chordNotes, note) || !noteKeepsKey(before, newProfile.noteToKey[note], releaseUnchanged)) {
+      heldNotes[note >> 3] &= ~(1 << (note & 7));
+      continue;
+    }
+    keepNoteKeys(keyEngine, keySets, before, keep);
+  }
+
+  bool rescale = oldRelease == RELEASE_TIMED && newRelease == RELEASE_TIMED;
+  applyKeptKeys(keyEngine, keep, rescale ? (int32_t)newProfile.pressDurationMs - (int32_t)oldProfile.pressDurationMs : 0);
+  currentProfileIndex = profileIndex;
+  setKeyEngineProfile(keyEngine, newProfile);
+  // Chord keys were released above with the other keys not held by a note
+  resetChords(chordState, config);
+  armChordTimer();
+  transpose.autoReady = false;  // Searched on the old profile's keys
+  armTransposeTimer();
+  emitKeyboardState();
+  armReleaseTimer();
+}
+
+// Press a mapped key (mapping has a keyCode or a modifier)
+void noteOn(KeyMapping mapping) {
+  ReleaseStrategy release = releaseStrategyFor(profiles[currentProfileIndex]);
+  keyNoteOn(keyEngine, keySets, mapping, release, monotonicMs(), emitKeyboardState);
+  armReleaseTimer();
+}
+
+// Release a mapped key (fast-press profiles ignore NoteOff for regular keys)
+void noteOff(KeyMapping mapping) {
+  ReleaseStrategy release = releaseStrategyFor(profiles[currentProfileIndex]);
+  keyNoteOff(keyEngine, keySets, mapping, release, monotonicMs(), emitKeyboardState);
+  armReleaseTimer();
+}
+
+// Turn the pressed keys into reports, following the profile's modifier mode
+void emitKeyboardState() {
+  uint8_t mode = profiles[currentProfileIndex].modifierMode;
+  buildKeyReports(keyEngine, mode, [mode](uint8_t modifiers, const uint8_t* keys) {
+    KeyReport report;
+    report.modifiers = modifiers;
+    memcpy(report.keys, keys, MAX_SIMULTANEOUS_KEYS);
+    if (mode == MODIFIERS_PREROLL) {
+      sendPreRolledReport(report);
+    } else {
+      sendReport(report);
+    }
+  });
+}
+
+// Send a report, first reporting a changed modifier byte with only the keys already down
+void sendPreRolledReport(const KeyReport& report) {
+  if (report.modifiers != lastReport.modifiers) {
+    KeyReport preRoll;
+    memset(&preRoll, 0, sizeof(preRoll));
+    preRoll.modifiers = report.modifiers;
+    int keyIdx = 0;
+    for (int i = 0; i < MAX_SIMULTANEOUS_KEYS && report.keys[i] > 0; i++) {
+      for (int j = 0; j < MAX_SIMULTANEOUS_KEYS; j++) {
+        if (lastReport.keys[j] == report.keys[i]) {
+          preRoll.keys[keyIdx++] = report.keys[i];
+          break;
+        }
+      }
+    }
+    sendReport(preRoll);
+  }
+  sendReport(report);
+}
+
+// Write a report to the virtual keyboard (skipped if nothing changed)
+void sendReport(const KeyReport& report) {
+  if (memcmp(&report, &lastReport, sizeof(KeyReport)) == 0) {
+    return;
+  }
+  if (!keyboard.sendReport(report.modifiers, report.keys)) {
+    fprintf(stderr, "uinput write failed: %s\n", strerror(errno));
+  }
+  lastReport = report;
+
+  if (verbose) {
+    printf("Report: mod=%02x keys=%02x %02x %02x %02x %02x %02x\n", report.modifiers,
+           report.keys[0], report.keys[1], report.keys[2], report.keys[3], report.keys[4], report.keys[5]);
+  }
+}
+
+// Release timed fast-press keys that are due (the timerfd fired)
+void handleReleaseTimers() {
+  if (expireReleaseTimers(keyEngine, monotonicMs())) {
+    emitKeyboardState();
+  }
+  armReleaseTimer();
+}
+
+// Arm the timerfd for the earliest armed release (disarm when there is none)
+// Relative, like the chord timer: the engine's millisecond clock is 32-bit and wraps
+void armReleaseTimer() {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  uint32_t delayMs;
+  if (nextReleaseDelay(keyEngine, monotonicMs(), delayMs)) {
+    // An all-zero it_value disarms, so a release that is due now is bumped by 1ns
+    spec.it_value.tv_sec = delayMs / 1000;
+    spec.it_value.tv_nsec = (delayMs % 1000) * 1000000L + (delayMs == 0);
+  }
+  timerfd_settime(releaseTimerFd, 0, &spec, nullptr);
+}
+
+// Arm the chord timerfd for the end of the gather window while notes are held back or a
+// chord waits for a bigger one (disarm otherwise) - otherwise CANCEL mode has nothing to do
+// when the window closes
+void armChordTimer() {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (chordState.gathering && (chordState.pendingCount > 0 || chordState.deferred)) {
+    // Relative: the matcher's millisecond clock is 32-bit and wraps
+    uint32_t elapsedMs = monotonicMs() - chordState.gatherStartMs;
+    uint32_t remainingMs = (elapsedMs < chordState.windowMs) ? chordState.windowMs - elapsedMs : 0;
+    spec.it_value.tv_sec = remainingMs / 1000;
+    spec.it_value.tv_nsec = (remainingMs % 1000) * 1000000L + (remainingMs == 0);
+  }
+  timerfd_settime(chordTimerFd, 0, &spec, nullptr);
+}
+
+// Arm the transpose timerfd for the end of the phrase gap while auto-transpose has yet to
+// search the next phrase's offset (disarm otherwise)
+void armTransposeTimer() {
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (transpose.autoEnabled && !transpose.autoReady && transpose.heldCount == 0 && transpose.windowCount > 0) {
+    uint32_t elapsedMs = monotonicMs() - transpose.lastReleaseMs;
+    uint32_t remainingMs = (elapsedMs < transpose.autoGapMs) ? transpose.autoGapMs - elapsedMs : 0;
+    spec.it_value.tv_sec = remainingMs / 1000;
+    spec.it_value.tv_nsec = (remainingMs % 1000) * 1000000L + (remainingMs == 0);
+  }
+  timerfd_settime(transposeTimerFd, 0, &spec, nullptr);
+}
+
+// CLOCK_MONOTONIC in milliseconds, wrapping like the firmware's millis()
+uint32_t monotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)((uint64_t)now.tv_sec * 1000ULL + now.tv_nsec / 1000000);
+}
@@ -7,7 +7,10 @@
  * Features:
  * - USB MIDI Host support (class-compliant devices)
  * - HID Keyboard output (appears as generic USB keyboard)
+ * - Optional USB MIDI passthrough of everything received to the PC
+ * - Optional DIN MIDI input on a hardware UART (31250 baud)
  * - SD card configuration (CONFIG.TXT and mapping files)
+ * - Profiles kept on program flash, so the device boots without an SD card
  * - Fast-press mode for games that don't recognize held keys
  * - Polyphonic chord support (up to 6 simultaneous keys)
  * - Modifier key support (Shift, Ctrl, Alt, Meta/Win)
@@ -22,93 +25,591 @@
 #include <Arduino.h>
 #include <USBHost_t36.h>
 #include <SD.h>
+#include <LittleFS.h>
 #include <SPI.h>
 #include "MidiConfig.h"
+#include "LoadArena.h"
+#include "MidiStreamParser.h"
+#include "MappingParser.h"
+#include "TaskScheduler.h"
+#include "EventPipeline.h"
+#include "ChordMatcher.h"
+#include "KeyEngine.h"
+#include <malloc.h>
+#include <type_traits>
 
-// USB MIDI Host - support up to 4 MIDI devices
+// USB MIDI Host - MIDI_DEVICE_COUNT devices behind up to USB_HUB_COUNT hubs (MidiConfig.h)
 USBHost myusb;
 // USB Hub support (needed when using a USB hub)
+#if USB_HUB_COUNT >= 1
 USBHub hub1(myusb);
+#endif
+#if USB_HUB_COUNT >= 2
 USBHub hub2(myusb);
-MIDIDevice midi1(myusb);
-MIDIDevice midi2(myusb);
-MIDIDevice midi3(myusb);
-MIDIDevice midi4(myusb);
-
-// Structure to store key mapping with modifier
-struct KeyMapping {
-  byte keyCode;      // HID key code (0 = unmapped)
-  byte modifierMask; // Modifier mask (SHIFT, CTRL, etc.)
-};
+#endif
+#if USB_HUB_COUNT >= 3
+USBHub hub3(myusb);
+#endif
+#if USB_HUB_COUNT >= 4
+USBHub hub4(myusb);
+#endif
+
+// Driver class for device n: big-buffer if its bit is set in MIDI_BIG_BUFFER_PORTS
+#define MIDI_PORT_TYPE(n) std::conditional<((MIDI_BIG_BUFFER_PORTS >> ((n) - 1)) & 1) != 0, MIDIDevice_BigBuffer, MIDIDevice>::type
 
-// Structure to store a profile (set of mappings)
-struct Profile {
-  String name;                              // Profile name (e.g., "default", "touchscreen")
-  KeyMapping noteToKey[MAX_MIDI_NOTES];     // 128 MIDI notes (0-127)
-  bool isValid;                              // True if profile has been loaded
-  bool fastPressMode;                        // Fast-press mode for this profile (overrides global config)
-  unsigned int pressDurationMs;              // Press duration for this profile (overrides global config)
+MIDI_PORT_TYPE(1) midi1(myusb);
+#if MIDI_DEVICE_COUNT >= 2
+MIDI_PORT_TYPE(2) midi2(myusb);
+#endif
+#if MIDI_DEVICE_COUNT >= 3
+MIDI_PORT_TYPE(3) midi3(myusb);
+#endif
+#if MIDI_DEVICE_COUNT >= 4
+MIDI_PORT_TYPE(4) midi4(myusb);
+#endif
+#if MIDI_DEVICE_COUNT >= 5
+MIDI_PORT_TYPE(5) midi5(myusb);
+#endif
+#if MIDI_DEVICE_COUNT >= 6
+MIDI_PORT_TYPE(6) midi6(myusb);
+#endif
+#if MIDI_DEVICE_COUNT >= 7
+MIDI_PORT_TYPE(7) midi7(myusb);
+#endif
+#if MIDI_DEVICE_COUNT >= 8
+MIDI_PORT_TYPE(8) midi8(myusb);
+#endif
+
+// Device table iterated by loop() - a controller may enumerate on any of these instances
+MIDIDeviceBase* const midiDevices[MIDI_DEVICE_COUNT] = {
+  &midi1,
+#if MIDI_DEVICE_COUNT >= 2
+  &midi2,
+#endif
+#if MIDI_DEVICE_COUNT >= 3
+  &midi3,
+#endif
+#if MIDI_DEVICE_COUNT >= 4
+  &midi4,
+#endif
+#if MIDI_DEVICE_COUNT >= 5
+  &midi5,
+#endif
+#if MIDI_DEVICE_COUNT >= 6
+  &midi6,
+#endif
+#if MIDI_DEVICE_COUNT >= 7
+  &midi7,
+#endif
+#if MIDI_DEVICE_COUNT >= 8
+  &midi8,
+#endif
 };
 
+// Profile, Config, KeyMapping and DeviceMatch are shared with the Linux daemon (MappingParser.h)
+
+// Memory placement (Teensy 4.1):
+// - Hot data (profiles, key state, HID queue) is ordinary globals, which the linker puts in
+//   RAM1 DTCM - single-cycle access, no cache involved
+// - Cold data (profile names, loader buffers) is DMAMEM in RAM2, which is NOT zero-initialized
+//   at boot - setup() clears it before use
+// - Per-note functions are FASTRUN (ITCM), load-time and debug code is FLASHMEM so it does
+//   not use up RAM1
+// printMemoryReport() lists the budget per subsystem, static_asserts below enforce it
+
 // Multiple profiles support
 Profile profiles[MAX_PROFILES];
 byte profileCount = 0;                      // Number of profiles loaded
 byte currentProfileIndex = 0;                // Index of currently active profile
 
-// Configuration settings
-struct Config {
-  bool fastPressMode;     // If true, send quick press/release regardless of MIDI duration
-  unsigned int pressDurationMs;  // Duration for fast press mode (milliseconds)
-  byte profileSwitchNote; // MIDI note to trigger profile switching (default: 12 = C0)
-};
+// Profile names (e.g., "default", "WWM36_TOUCHSCREEN_MAPPINGS") - only used for logging
+DMAMEM char profileNames[MAX_PROFILES][PROFILE_NAME_MAX_LEN + 1];
+
+// USB identity each profile's mapping file is meant for
+// Compared once when a MIDI device connects, never on the note path
+DMAMEM DeviceMatch profileDeviceMatch[MAX_PROFILES];
+
+#define NO_PROFILE 0xFF
 
-Config config = {
-  .fastPressMode = true,      // Default: fast press mode enabled
-  .pressDurationMs = 0,       // Default: 0ms = immediate press/release (like open source player)
-  .profileSwitchNote = PROFILE_SWITCH_NOTE  // Default: C1 = note 24 (configurable via CONFIG.TXT)
+// Note tables as the mapping files declared them, before accidentals were snapped and the
+// window folded - a key change rebuilds profiles[].noteToKey from these (serviceKeyChange)
+DMAMEM KeyMapping profileSourceTables[MAX_PROFILES][MAX_MIDI_NOTES];
+byte keyChangePending = 0;  // Bit per profile whose table waits to be rebuilt for a new key
+
+// Mapping file names found on the SD card, collected before the files are parsed
+DMAMEM char mappingFileNames[MAX_PROFILES][MAPPING_FILE_NAME_MAX_LEN + 1];
+
+// Scratch memory for loading config and mapping files (line buffers, uppercase copies)
+// Loaders open a LoadArenaScope, so the arena is empty again after every load
+DMAMEM uint8_t loadArenaBuffer[LOAD_ARENA_SIZE];
+LoadArena loadArena(loadArenaBuffer, sizeof(loadArenaBuffer));
+
+// Configuration settings (CONFIG.TXT), defaults in MappingParser.cpp
+Config config = defaultConfig;
+
+// Chord patterns of every profile ({60,64,67}=F lines), looked up by hash on chord note-ons
+// in the schedule stage, and the gather/active chord state of the note stream
+ChordTable chordTable;
+ChordState chordState;
+
+// Key sets of every profile (60=A+S lines), referenced from noteToKey and chord entries by
+// index - read on every key set note-on, so they stay in DTCM with the note tables
+KeySetPool keySets;
+
+// Profile store: config and profiles in parsed binary form on a LittleFS partition in
+// program flash. setup() boots from it and only parses the SD card when its files changed.
+// File layout: ProfileStoreHeader, then per profile the Profile record, its name, DeviceMatch
+// and source table, then chordCount ChordEntry records, then keySetCount KeySet records
+struct ProfileStoreHeader {
+  uint32_t magic;            // PROFILE_STORE_MAGIC
+  uint16_t version;          // PROFILE_STORE_VERSION
+  uint16_t profileSize;      // sizeof(Profile) when written - rejects stores from other layouts
+  uint32_t sourceSignature;  // sdSourceSignature() of the card the profiles were imported from
+  uint32_t checksum;         // FNV-1a over config and all profile records
+  Config config;
+  byte profileCount;
+  uint16_t chordCount;
+  byte keySetCount;
 };
 
-// Polyphony support: Track simultaneously pressed keys with modifiers
+LittleFS_Program profileFlash;
+bool profileStoreMounted = false;  // LittleFS partition available
+bool sdCardPresent = false;        // SD card initialized at boot
+
+// Polyphony support: keys the notes hold down, modifier-only keys and release timers (see KeyEngine.h)
 // USB HID keyboard supports up to 6 keys + modifiers in a single report
-struct PressedKey {
-  byte keyCode;
-  byte modifierMask;
+KeyEngine keyEngine;
+
+// Per-device state for the MIDI device table
+// heldNotes lets a device's keys be released the moment it is unplugged
+// Counters are reset when a device connects and printed by the "stats" serial command
+struct MidiPort {
+  bool connected;                      // Device was present at the last poll
+  byte heldNotes[MAX_MIDI_NOTES / 8];  // Bitset of mapped notes currently down on this device
+  uint16_t queueHighWater;             // Most messages waiting in the driver's receive queue
+  unsigned long messages;              // Messages read from the device
+  unsigned long overflows;             // Polls that found the receive queue full (input was being dropped)
+  byte matchedProfile;                 // Profile declared for this device (NO_PROFILE if none), found at connect
+  bool releasePending;                 // RELEASE_SOURCE still waits for room in the ingest queue
+  bool selectPending;                  // SELECT_PROFILE of matchedProfile still waits for room
+};
+
+// Access to a MIDI driver's receive queue, which USBHost_t36 fills from the USB interrupt
+// The queue members are protected; a member pointer named through a derived class may be
+// applied to any MIDIDeviceBase, so no driver needs to be subclassed
+// Ring convention: head = last packet written, tail = last packet read
+struct MidiQueueProbe : MIDIDeviceBase {
+  static uint16_t depth(const MIDIDeviceBase& midi) {
+    uint16_t head = midi.*(&MidiQueueProbe::rx_head);
+    uint16_t tail = midi.*(&MidiQueueProbe::rx_tail);
+    uint16_t size = midi.*(&MidiQueueProbe::rx_queue_size);
+    return (head >= tail) ? head - tail : size - tail + head;
+  }
+  
+  // One slot always stays empty to tell a full ring from an empty one
+  static uint16_t capacity(const MIDIDeviceBase& midi) {
+    return midi.*(&MidiQueueProbe::rx_queue_size) - 1;
+  }
+  
+  static uint16_t tail(const MIDIDeviceBase& midi) {
+    return midi.*(&MidiQueueProbe::rx_tail);
+  }
+  
+  static uint16_t next(const MIDIDeviceBase& midi, uint16_t index) {
+    return (index + 1 < midi.*(&MidiQueueProbe::rx_queue_size)) ? index + 1 : 0;
+  }
+  
+  // Raw 32-bit USB-MIDI event packet (cable/CIN byte + 3 MIDI bytes) as received
+  static uint32_t packet(const MIDIDeviceBase& midi, uint16_t index) {
+    return (midi.*(&MidiQueueProbe::rx_queue))[index];
+  }
+};
+
+#ifdef ENABLE_DIN_MIDI
+static_assert((DIN_MIDI_RX_QUEUE_SIZE & (DIN_MIDI_RX_QUEUE_SIZE - 1)) == 0, "DIN_MIDI_RX_QUEUE_SIZE must be a power of two");
+
+// DIN MIDI input: the LPUART6 (Serial1) interrupt stores every byte with its arrival time,
+// loop() parses them into messages for the same ingestMidiMessage() as the USB devices
+struct DinMidiByte {
+  uint32_t arrivalMicros;  // micros() in the UART interrupt
+  byte data;
+};
+
+DinMidiByte dinRxQueue[DIN_MIDI_RX_QUEUE_SIZE];
+volatile uint16_t dinRxHead = 0;  // Next slot the interrupt writes
+volatile uint16_t dinRxTail = 0;  // Next slot loop() reads
+volatile unsigned long dinRxOverflows = 0;  // Bytes lost because loop() fell behind
+
+MidiStreamParser dinParser;
+MidiPort dinMidiPort;  // Held notes and counters, like a USB port (never disconnects)
+
+// UART interrupt to dispatch: time from the last byte of a message arriving to its handling
+unsigned long dinLatencyTotalMicros = 0;
+unsigned long dinLatencyMaxMicros = 0;
+
+constexpr size_t ram1DinMidi = sizeof(dinRxQueue) + sizeof(dinParser) + sizeof(dinMidiPort);
+static_assert(ram1DinMidi <= RAM1_BUDGET_DIN_MIDI, "DIN MIDI input exceeds its RAM1 budget");
+#endif
+
+#ifdef ENABLE_MIDI_PASSTHROUGH
+#ifndef MIDI_INTERFACE
+#error "ENABLE_MIDI_PASSTHROUGH needs a USB type with MIDI and keyboard (e.g. USB_EVERYTHING)"
+#endif
+
+// MIDI passthrough stage: packets read from the host ports are copied here unchanged, as
+// raw USB-MIDI words straight from the driver's receive queue (nothing decoded or rebuilt),
+// and servicePassthrough() sends them to the PC after the HID stage has run, only while the
+// USB MIDI endpoint can take them without waiting
+uint32_t passthroughQueue[MIDI_PASSTHROUGH_QUEUE_SIZE];
+uint16_t passthroughHead = 0;   // Index of the oldest queued packet
+uint16_t passthroughCount = 0;  // Packets waiting for the PC
+
+struct PassthroughStats {
+  unsigned long queued;     // Packets accepted into the queue
+  unsigned long forwarded;  // Packets handed to the USB MIDI device
+  unsigned long dropped;    // Packets lost because the queue was full (PC not reading)
+  unsigned long busy;       // Slices that left packets queued, the endpoint still sending
+  uint16_t maxDepth;        // Queue depth high-water mark
+};
+
+PassthroughStats passthroughStats = {0, 0, 0, 0, 0};
+
+constexpr size_t ram1Passthrough = sizeof(passthroughQueue) + sizeof(passthroughStats);
+static_assert(ram1Passthrough <= RAM1_BUDGET_PASSTHROUGH, "MIDI passthrough queue exceeds its RAM1 budget");
+#endif
+
+MidiPort midiPorts[MIDI_DEVICE_COUNT];
+byte nextMidiPort = 0;  // Port drained first on the next loop pass (round-robin)
+
+// Event pipeline (see EventPipeline.h): source of an event = USB port index, DIN, or the
+// synthetic load generator
+#define MIDI_SOURCE_DIN MIDI_DEVICE_COUNT
+#define MIDI_SOURCE_LOAD (MIDI_DEVICE_COUNT + 1)
+
+enum PipelineStage : uint8_t {
+  STAGE_NORMALIZE,
+  STAGE_ROUTE,
+  STAGE_MAP,
+  STAGE_SCHEDULE,
+  STAGE_COUNT
+};
+
+const char* const stageNames[STAGE_COUNT] = {"normalize", "route", "map", "schedule"};
+
+EventQueue<MidiEvent, PIPELINE_QUEUE_SIZE> ingestQueue;      // ingest -> normalize
+EventQueue<NoteEvent, PIPELINE_QUEUE_SIZE> normalizedQueue;  // normalize -> route
+EventQueue<NoteEvent, PIPELINE_QUEUE_SIZE> routedQueue;      // route -> map
+EventQueue<KeyEvent, PIPELINE_QUEUE_SIZE> mappedQueue;       // map -> schedule
+RouteState routeState;  // Set up by resetPipeline()
+StageStats stageStats[STAGE_COUNT];
+
+constexpr size_t ram1Pipeline = sizeof(ingestQueue) + sizeof(normalizedQueue) + sizeof(routedQueue) + sizeof(mappedQueue)
+                                + sizeof(routeState) + sizeof(stageStats);
+static_assert(ram1Pipeline <= RAM1_BUDGET_PIPELINE, "event pipeline exceeds its RAM1 budget");
+
+#ifdef ENABLE_LOAD_GENERATOR
+#ifndef ENABLE_DEBUG
+#error "ENABLE_LOAD_GENERATOR reports over the serial console - build with ENABLE_DEBUG"
+#endif
+
+// Synthetic MIDI load ("load" serial command): a pattern is played at a fixed event rate as
+// one more MIDI source, straight into the ingest queue, through the real pipeline and engine
+enum LoadPattern : uint8_t {
+  LOAD_GLISSANDO,        // Mapped notes up and down, each released as the next is pressed
+  LOAD_CHORDS,           // LOAD_GENERATOR_CHORD_SIZE notes pressed and released as one burst
+  LOAD_TRILL,            // Two neighbouring notes alternating
+  LOAD_STORM,            // Random notes, velocity-0 note-offs, controllers and clock
+  LOAD_MODIFIER_CHORDS,  // Chords alternating plain and modified keys (SHIFT, CTRL, ...)
+  LOAD_PATTERN_COUNT
+};
+
+const char* const loadPatternNames[LOAD_PATTERN_COUNT] = {"gliss", "chords", "trill", "storm", "modchords"};
+
+enum LoadState : uint8_t {
+  LOAD_IDLE,
+  LOAD_RUNNING,
+  LOAD_DRAINING  // Pattern stopped, waiting for its last reports to go out
+};
+
+#define LOAD_GROUP_MAX (2 * LOAD_GENERATOR_CHORD_SIZE)
+
+struct LoadRun {
+  uint8_t state;           // LoadState
+  uint8_t pattern;         // LoadPattern
+  bool sweep;              // "load all": every pattern in turn
+  uint8_t chordSize;       // Notes per chord for this profile
+  uint32_t rate;           // Events per second
+  uint32_t cyclesPerEvent;
+  uint32_t nextDue;        // Cycle count the next group is due at (becomes its timestamp)
+  uint32_t startMillis;
+  uint32_t durationMs;
+  uint32_t drainStartMillis;
+  uint32_t step;           // Position in the pattern
+  uint32_t random;         // xorshift32 state (storm)
+  byte lastNote;           // Note to release on the next step (glissando, trill)
+  byte groupCount;         // Events in group (0 = build the next one)
+  MidiEvent group[LOAD_GROUP_MAX];  // Events sharing one due time (a chord is one group)
+  // Results
+  uint32_t generated;      // Events that came due
+  uint32_t injected;       // Events accepted by the ingest queue
+  uint32_t dropped;        // Events given up on because the backlog exceeded LOAD_GENERATOR_BACKLOG
+  uint32_t maxBacklog;     // Most events owed at once
+  uint32_t latencySamples;
+  uint32_t maxLatencyCycles;
+  // Counters when the run started
+  unsigned long hidSentStart;
+  unsigned long hidCollapsedStart;
+  unsigned long hidDroppedStart;
+  uint32_t refusedStart;
+};
+
+// A press waiting for the report that carries it: sampled when hidStats.sent reaches report
+struct LoadProbe {
+  uint32_t timestamp;  // Due time of the note-on
+  uint32_t report;
+};
+
+LoadRun loadRun;
+LoadProbe loadProbes[LOAD_GENERATOR_PROBES];
+byte loadProbeHead = 0;
+byte loadProbeCount = 0;
+MidiPort loadGeneratorPort;  // Held notes of the synthetic source
+
+// Mapped notes of the profile under test (the profile switch note is left out)
+byte loadNotes[MAX_MIDI_NOTES];
+byte loadPlainNotes[MAX_MIDI_NOTES];
+byte loadModifiedNotes[MAX_MIDI_NOTES];
+byte loadNoteCount = 0;
+byte loadPlainCount = 0;
+byte loadModifiedCount = 0;
+
+// Due time -> report handed to USB, LOAD_LATENCY_BUCKET_US per bucket, last one = overflow
+DMAMEM uint32_t loadLatencyHistogram[LOAD_LATENCY_BUCKETS + 1];
+
+constexpr size_t ram1LoadGenerator = sizeof(loadRun) + sizeof(loadProbes) + sizeof(loadGeneratorPort) + sizeof(loadNotes)
+                                     + sizeof(loadPlainNotes) + sizeof(loadModifiedNotes);
+constexpr size_t ram2LoadLatency = sizeof(loadLatencyHistogram);
+static_assert(ram1LoadGenerator <= RAM1_BUDGET_LOAD_GENERATOR, "load generator exceeds its RAM1 budget");
+static_assert(ram2LoadLatency <= RAM2_BUDGET_LOAD_LATENCY, "load latency histogram exceeds its RAM2 budget");
+#endif
+
+// HID transmit stage: updateKeyboardState() builds reports into a fixed ring buffer,
+// serviceHidTransmit() hands them to the USB keyboard endpoint without ever blocking loop()
+// Layout matches the 8-byte USB HID boot keyboard report, so a report is one contiguous buffer
+struct HidReport {
+  byte modifiers;                    // Modifier mask (MODIFIERKEY_*)
+  byte reserved;                     // Always 0 (boot protocol reserved byte)
+  byte keys[MAX_SIMULTANEOUS_KEYS];  // Key codes, 0 = empty slot
 };
 
-PressedKey pressedKeys[MAX_SIMULTANEOUS_KEYS];
-byte pressedKeyCount = 0;  // Number of keys currently pressed
+static_assert(sizeof(HidReport) == HID_REPORT_SIZE, "HidReport must match the boot keyboard report layout");
 
-// Track modifier-only keys separately (LSHIFT, RSHIFT, etc. as standalone keys)
-// This prevents modifier changes from causing other keys to replay
-byte activeModifierKeys = 0;  // Combined modifier mask from modifier-only keys
+HidReport hidQueue[HID_REPORT_QUEUE_SIZE];
+byte hidQueueHead = 0;    // Index of the oldest queued report
+byte hidQueueCount = 0;   // Number of reports waiting for the endpoint
+HidReport lastSentReport = {0, 0, {0}};  // Last report handed to the USB stack
 
-// For fast-press mode: track keys that need timed release
-struct FastPressTimer {
-  byte keyCode;
-  byte modifierMask;
-  unsigned long releaseTime;  // millis() timestamp when key should be released
+// Keyboard endpoint transfers the transmit stage submits reports through, bypassing the
+// core's keyboard buffer: one packed report per slot, each in its own cache line because
+// the USB controller reads it by DMA. A slot is free once the host has polled its report
+struct alignas(32) HidTxBuffer {
+  HidReport report;
 };
 
-FastPressTimer fastPressTimers[MAX_SIMULTANEOUS_KEYS];
-byte fastPressKeyCount = 0;
+DMAMEM HidTxBuffer hidTxBuffers[HID_TX_SLOTS];
+transfer_t hidTransfers[HID_TX_SLOTS] __attribute__((aligned(32)));
+byte hidTxHead = 0;  // Slot the next report goes out through
+
+// HID transmit counters (printed by the "stats" serial command in debug builds)
+struct HidTxStats {
+  unsigned long queued;         // Reports accepted into the queue
+  unsigned long sent;           // Reports handed to the USB stack
+  unsigned long collapsed;      // Reports merged into the newest queued one (queue full)
+  unsigned long dropped;        // Intermediate reports discarded (queue full)
+  unsigned long deferred;       // Service passes held back because the endpoint was busy
+  byte maxDepth;                // Queue depth high-water mark
+};
+
+HidTxStats hidStats = {0, 0, 0, 0, 0, 0};
+
+// Memory budgets per subsystem (see MidiConfig.h) - printMemoryReport() prints these same sums
+constexpr size_t ram1Profiles = sizeof(profiles);
+constexpr size_t ram1KeyState = sizeof(keyEngine);
+constexpr size_t ram1HidTx = sizeof(hidQueue) + sizeof(lastSentReport) + sizeof(hidTransfers) + sizeof(hidStats);
+constexpr size_t ram1MidiPorts = sizeof(midiPorts) + sizeof(midiDevices);
+constexpr size_t ram1Chords = sizeof(chordTable) + sizeof(chordState);
+constexpr size_t ram1KeySets = sizeof(keySets);
+constexpr size_t ram2Names = sizeof(profileNames) + sizeof(mappingFileNames) + sizeof(profileDeviceMatch);
+constexpr size_t ram2HidTxBuffers = sizeof(hidTxBuffers);
+constexpr size_t ram2LoadArena = sizeof(loadArenaBuffer);
+constexpr size_t ram2SourceTables = sizeof(profileSourceTables);
+static_assert(ram1Profiles <= RAM1_BUDGET_PROFILES, "profile tables exceed their RAM1 budget");
+static_assert(ram1KeyState <= RAM1_BUDGET_KEY_STATE, "key state exceeds its RAM1 budget");
+static_assert(ram1HidTx <= RAM1_BUDGET_HID_TX, "HID transmit queue exceeds its RAM1 budget");
+static_assert(ram1MidiPorts <= RAM1_BUDGET_MIDI_PORTS, "MIDI device table exceeds its RAM1 budget");
+static_assert(ram1Chords <= RAM1_BUDGET_CHORDS, "chord patterns exceed their RAM1 budget");
+static_assert(ram1KeySets <= RAM1_BUDGET_KEY_SETS, "key sets exceed their RAM1 budget");
+static_assert(ram2Names <= RAM2_BUDGET_NAMES, "profile and file names exceed their RAM2 budget");
+static_assert(ram2HidTxBuffers <= RAM2_BUDGET_HID_TX_BUFFERS, "HID transmit buffers exceed their RAM2 budget");
+static_assert(ram2LoadArena <= RAM2_BUDGET_LOAD_ARENA, "load arena exceeds its RAM2 budget");
+static_assert(ram2SourceTables <= RAM2_BUDGET_SOURCE_TABLES, "profile source tables exceed their RAM2 budget");
+
+// USB device configuration state from the Teensy core (0 = not configured by the host)
+extern "C" volatile uint8_t usb_configuration;
+
 
 // Forward declaration
-bool parseKeyMapping(String keyName, byte& keyCode, byte& modifierMask);
+bool readLine(File& file, char* buffer, size_t maxLength);
 void loadConfig();
-void loadMappings();
+bool loadMappings();
+void clearProfiles();
+void loadFallbackProfile();
+uint32_t fnv1a(uint32_t hash, const void* data, size_t length);
+uint32_t sdSourceSignature(int& sourceFileCount);
+bool loadProfileStore(uint32_t& sourceSignature);
+bool saveProfileStore(uint32_t sourceSignature);
 void switchProfile(byte profileIndex);
-void addPressedKey(byte keyCode, byte modifierMask);
-void removePressedKey(byte keyCode, byte modifierMask);
 void updateKeyboardState();
-void handleFastPress();
-void processMidiMessage(MIDIDevice& midi, int deviceNum);
+void selectEngineVariant();
+template <ReleaseStrategy R, ModifierMode M> void engineNoteOn(KeyMapping mapping);
+template <ReleaseStrategy R, ModifierMode M> void engineNoteOff(KeyMapping mapping);
+template <ModifierMode M> void emitKeyboardState();
+void queuePreRolledReport(const HidReport& report);
+void setProfileName(byte profileIndex, const char* name);
+void clearHidReport(HidReport& report);
+bool hidReportsEqual(const HidReport& a, const HidReport& b);
+void queueHidReport(const HidReport& report);
+bool hidTxSlotFree();
+void submitKeyboardReport(const HidReport& report);
+bool serviceHidTransmit();
+bool handleFastPress();
+bool ingestMidiMessage(byte source, byte type, byte data1, byte data2);
+bool ingestHasRoom();
+bool servicePipeline();
+bool runNormalizeStage();
+bool runRouteStage();
+bool runMapStage();
+bool runScheduleStage();
+MidiPort* portForSource(byte source);
+void releaseHeldNotes(MidiPort& port);
+void resetPipeline();
+void changeKeySignature(byte profileIndex, int fifths);
+void chordPress(KeyMapping mapping);
+void chordRelease(KeyMapping mapping);
+bool serviceChordWindow();
+bool serviceKeyChange();
+bool serviceTransposeSearch();
+bool pipelineIdle();
+#ifdef ENABLE_LOAD_GENERATOR
+bool serviceLoadGenerator();
+byte buildLoadGroup(MidiEvent* group);
+void setLoadEvent(MidiEvent& event, byte type, byte data1, byte data2);
+byte loadChordNote(uint32_t chord, byte index);
+bool startLoadRun(byte pattern, uint32_t rate, uint32_t seconds, bool sweep);
+void stopLoadRun();
+void trackLoadPress(uint32_t timestamp, byte queueDepthBefore);
+void loadReportSent();
+void handleLoadCommand(char* args);
+void printLoadReport();
+uint32_t loadLatencyPercentile(uint32_t partsPer10000);
+#endif
+uint32_t readCycleCounter();
+void idleUntilInterrupt();
+bool inputPending();
+#if IDLE_CLOCK_DROP_MS > 0
+void setIdleClock(bool lowered);
+#endif
+void registerTasks();
+bool serviceUsbHost();
+bool serviceMidiPorts();
+#ifdef ENABLE_DIN_MIDI
+void beginDinMidi();
+void dinMidiIsr();
+bool serviceDinMidi();
+#endif
+void midiPortConnected(byte portIndex);
+void midiPortDisconnected(byte portIndex);
+bool flushPortControl(byte portIndex);
+#ifdef ENABLE_MIDI_PASSTHROUGH
+void queuePassthroughPackets(const MIDIDeviceBase& midi, uint16_t fromTail);
+bool servicePassthrough();
+#endif
+byte findDeviceProfile(MIDIDeviceBase& midi);
+#ifdef ENABLE_DEBUG
+bool serviceSerialConsole();
+void printRuntimeStats();
+void printMemoryReport();
+void printBudgetLine(const char* name, size_t bytes, size_t budget);
+void printHeapReport();
+#endif
+#ifdef ENABLE_BENCHMARKS
+void runBenchmarks();
+void benchmarkReportSubmission();
+void benchmarkHidReportRate();
+void benchmarkEngineVariants();
+void benchmarkProfileStore();
+void benchmarkStreamParser();
+void benchmarkIdleWake();
+void idleBenchmarkIsr();
+void benchmarkRuntimeNoteOn(const Profile& profile, KeyMapping mapping);
+void benchmarkRuntimeNoteOff(const Profile& profile, KeyMapping mapping);
+void benchmarkRuntimeEmit(const Profile& profile);
+void resetEngineState();
+#endif
+
+// Engine variant: note handlers and report builder specialized at compile time for one
+// release strategy and modifier mode. switchProfile() picks one, notes call through it.
+struct EngineVariant {
+  void (*noteOn)(KeyMapping mapping);
+  void (*noteOff)(KeyMapping mapping);
+  void (*emitState)();
+};
+
+#define ENGINE_VARIANT(R, M) { engineNoteOn<R, M>, engineNoteOff<R, M>, emitKeyboardState<M> }
+#define ENGINE_VARIANTS_FOR(R) { \
+  ENGINE_VARIANT(R, MODIFIERS_SPLIT), \
+  ENGINE_VARIANT(R, MODIFIERS_MERGED), \
+  ENGINE_VARIANT(R, MODIFIERS_PREROLL) }
+
+const EngineVariant engineVariants[RELEASE_STRATEGY_COUNT][MODIFIER_MODE_COUNT] = {
+  ENGINE_VARIANTS_FOR(RELEASE_IMMEDIATE),
+  ENGINE_VARIANTS_FOR(RELEASE_TIMED),
+  ENGINE_VARIANTS_FOR(RELEASE_HELD),
+  ENGINE_VARIANTS_FOR(RELEASE_HYBRID)
+};
+
+// Variant for the current profile (default config: fast-press, 0ms, split modifiers)
+EngineVariant activeEngine = engineVariants[RELEASE_IMMEDIATE][MODIFIERS_SPLIT];
+
+// How the chord matcher presses and releases chord keys and held-back note keys
+const ChordOutput chordOutput = {chordPress, chordRelease};
+
+// loop() tasks (registered in registerTasks), timed with the DWT cycle counter
+SchedulerTask schedulerTasks[SCHEDULER_MAX_TASKS];
+TaskScheduler scheduler(schedulerTasks, SCHEDULER_MAX_TASKS, readCycleCounter, F_CPU / 1000000, HOUSEKEEPING_MAX_DEFER_US);
+
+constexpr size_t ram1Scheduler = sizeof(schedulerTasks) + sizeof(scheduler);
+static_assert(ram1Scheduler <= RAM1_BUDGET_SCHEDULER, "task scheduler exceeds its RAM1 budget");
+
+// Idle handling (see idleUntilInterrupt)
+struct IdleStats {
+  unsigned long sleeps;      // WFIs entered
+  unsigned long clockDrops;  // Times the clock was lowered to IDLE_CPU_FREQ
+};
+
+IdleStats idleStats = {0, 0};
+unsigned long lastBusyMillis = 0;  // Last pass where a task found work
+#if IDLE_CLOCK_DROP_MS > 0
+bool idleClockLowered = false;
+#endif
 
-void setup() {
+FLASHMEM void setup() {
   // Initialize Serial for debugging (only if ENABLE_DEBUG is defined)
   #ifdef ENABLE_DEBUG
   Serial.begin(115200);
   delay(1000);  // Give Serial time to initialize
   Serial.println("=== Teensy MIDI to HID Translator ===");
+  printMemoryReport();
   #endif
   
   // Initialize USB Host
@@ -118,41 +619,69 @@ void setup() {
   delay(500);
   
   // Initialize profiles
-  profileCount = 0;
-  currentProfileIndex = 0;
-  for (int i = 0; i < MAX_PROFILES; i++) {
-    profiles[i].name = "";
-    profiles[i].isValid = false;
-    profiles[i].fastPressMode = config.fastPressMode;  // Default to global config
-    profiles[i].pressDurationMs = config.pressDurationMs;  // Default to global config
-    for (int j = 0; j < MAX_MIDI_NOTES; j++) {
-      profiles[i].noteToKey[j].keyCode = 0;
-      profiles[i].noteToKey[j].modifierMask = 0;
-    }
+  // RAM2 (DMAMEM) is not cleared at boot
+  memset(profileNames, 0, sizeof(profileNames));
+  memset(mappingFileNames, 0, sizeof(mappingFileNames));
+  memset(profileDeviceMatch, 0, sizeof(profileDeviceMatch));
+  memset(profileSourceTables, 0, sizeof(profileSourceTables));
+  clearProfiles();
+  
+  // Boot from the profile store on program flash - no SD card needed
+  bool profilesLoaded = false;
+  uint32_t storedSignature = 0;
+  profileStoreMounted = profileFlash.begin(PROFILE_STORE_FLASH_SIZE);
+  if (profileStoreMounted) {
+    profilesLoaded = loadProfileStore(storedSignature);
+    #ifdef ENABLE_DEBUG
+    Serial.println(profilesLoaded ? "Profiles loaded from flash store" : "Flash profile store empty or invalid");
+    #endif
   }
   
-  // Initialize SD card
-  if (!SD.begin(BUILTIN_SDCARD)) {
-    // SD card failed - use hardcoded fallback mappings for testing
-    profiles[0].name = "default";
-    profiles[0].isValid = true;
-    profiles[0].fastPressMode = config.fastPressMode;
-    profiles[0].pressDurationMs = config.pressDurationMs;
-    profiles[0].noteToKey[60].keyCode = KEY_H;
-    profiles[0].noteToKey[60].modifierMask = 0;
-    profiles[0].noteToKey[58].keyCode = KEY_G;
-    profiles[0].noteToKey[58].modifierMask = 0;
-    profileCount = 1;
-    currentProfileIndex = 0;
-    delay(2000);  // Give USB Host more time to enumerate devices, especially with hubs
-    return;
+  // The SD card is only an import source: parse it when its files differ from the store
+  sdCardPresent = SD.begin(BUILTIN_SDCARD);
+  if (sdCardPresent) {
+    // A card without CONFIG.TXT or mapping files (blank, or meant for something else) is
+    // no import source at all: the store keeps its profiles
+    int sourceFileCount = 0;
+    uint32_t sdSignature = sdSourceSignature(sourceFileCount);
+    if (sourceFileCount > 0 && (!profilesLoaded || sdSignature != storedSignature)) {
+      // Load configuration from CONFIG.TXT (settings missing from the file keep their defaults)
+      config = defaultConfig;
+      loadConfig();
+      
+      // Load all mapping files from SD card (each file becomes one profile)
+      bool imported = loadMappings();
+      if (!imported && profilesLoaded) {
+        // No mapping file could be loaded: the stored profiles beat the fallback mappings
+        profilesLoaded = loadProfileStore(storedSignature);
+        #ifdef ENABLE_DEBUG
+        Serial.println("No mapping files imported from SD card - keeping the flash store");
+        #endif
+      } else {
+        profilesLoaded = true;
+      }
+      
+      if (imported && profileStoreMounted) {
+        bool saved = saveProfileStore(sdSignature);
+        #ifdef ENABLE_DEBUG
+        Serial.println(saved ? "Profiles imported from SD card into flash store" : "Failed to write flash profile store");
+        #else
+        (void)saved;
+        #endif
+      }
+    }
   }
   
-  // Load configuration from CONFIG.TXT
-  loadConfig();
+  if (!profilesLoaded) {
+    // No store and no SD card - use hardcoded fallback mappings for testing
+    loadFallbackProfile();
+  }
+  selectEngineVariant();
+  resetPipeline();
   
-  // Load all mapping files from SD card (each file becomes one profile)
-  loadMappings();
+  #ifdef ENABLE_DIN_MIDI
+  beginDinMidi();
+  #endif
   
   // Allow time for USB Host to enumerate devices (hubs may take longer)
   // Run USB Task multiple times to ensure hubs and devices are detected
@@ -162,274 +691,1032 @@ void setup() {
   }
   
   delay(500);  // Wait for USB keyboard to initialize
+  
+  registerTasks();
+  
+  #ifdef ENABLE_BENCHMARKS
+  runBenchmarks();
+  #endif
+  
+  #if defined(ENABLE_LOAD_GENERATOR) && LOAD_GENERATOR_AT_BOOT
+  startLoadRun(0, LOAD_GENERATOR_DEFAULT_RATE, LOAD_GENERATOR_DEFAULT_SECONDS, true);
+  #endif
 }
 
-void loop() {
-  // USB Task must be called frequently for proper device communication
-  // This is especially important with hubs that may buffer or delay messages
-  myusb.Task();
+FASTRUN void loop() {
+  #if IDLE_CLOCK_DROP_MS > 0
+  // Input arrived while the clock was lowered: full speed before it is handled
+  if (idleClockLowered && inputPending()) {
+    setIdleClock(false);
+  }
+  #endif
+  // Every pass runs the note path (USB host, MIDI ingest, event pipeline, release timers,
+  // report emitter); housekeeping tasks get one slice when it had nothing to do
+  // (see registerTasks)
+  if (scheduler.runPass()) {
+    lastBusyMillis = millis();
+  } else {
+    idleUntilInterrupt();
+  }
+}
+
+// After an idle pass: sleep until the next interrupt instead of spinning at 600 MHz
+// Interrupts are masked around the last check, so input that arrives after the tasks
+// looked cannot slip in before the WFI - its interrupt stays pending and the WFI returns
+// at once (a pending interrupt wakes WFI even while masked), then runs on __enable_irq()
+// The CCM stays in RUN mode, so WFI only stops the core clock: peripherals, USB and the
+// SysTick keep running and wake-up takes a few cycles
+FASTRUN void idleUntilInterrupt() {
+  #if IDLE_SLEEP
+  // Reports wait for a transmit slot, which frees up with the host's polls - those do not
+  // interrupt, so keep passing instead of sleeping up to a SysTick
+  if (hidQueueCount > 0) {
+    return;
+  }
+  #ifdef ENABLE_MIDI_PASSTHROUGH
+  if (passthroughCount > 0) {
+    return;
+  }
+  #endif
+  #ifdef ENABLE_LOAD_GENERATOR
+  if (loadRun.state != LOAD_IDLE) {
+    return;  // Paced by the cycle counter, not by interrupts
+  }
+  #endif
   
-  // Handle fast-press mode timing (use current profile's setting)
-  if (profiles[currentProfileIndex].isValid && profiles[currentProfileIndex].fastPressMode) {
-    handleFastPress();
+  #if IDLE_CLOCK_DROP_MS > 0
+  bool inactive = millis() - lastBusyMillis >= IDLE_CLOCK_DROP_MS;
+  if (inactive != idleClockLowered) {
+    setIdleClock(inactive);
   }
+  #endif
   
-  // Check for MIDI messages from all 4 possible MIDI devices
-  // This ensures we catch messages regardless of which device instance the controller uses
-  // With hubs, devices may enumerate on different instances, so check all
-  // Only check devices that are connected (using the bool operator)
-  if (midi1 && midi1.read()) {
-    processMidiMessage(midi1, 1);
+  __disable_irq();
+  if (!inputPending()) {
+    asm volatile("dsb\n\twfi" ::: "memory");
+    idleStats.sleeps++;
+  }
+  __enable_irq();
+  #else
+  // Small delay to prevent a tight loop (helps with hub communication)
+  delayMicroseconds(IDLE_PASS_DELAY_US);
+  #endif
+}
+
+// MIDI waiting in a driver or DIN receive queue, or in the pipeline
+FASTRUN bool inputPending() {
+  for (int i = 0; i < MIDI_DEVICE_COUNT; i++) {
+    if (MidiQueueProbe::depth(*midiDevices[i]) > 0) {
+      return true;
+    }
   }
-  if (midi2 && midi2.read()) {
-    processMidiMessage(midi2, 2);
+  #ifdef ENABLE_DIN_MIDI
+  if (dinRxHead != dinRxTail) {
+    return true;
   }
-  if (midi3 && midi3.read()) {
-    processMidiMessage(midi3, 3);
+  #endif
+  return !ingestQueue.empty();
+}
+
+#if IDLE_CLOCK_DROP_MS > 0
+// Lower or restore the CPU clock (set_arm_clock also adjusts voltage, bus dividers and micros())
+// Scheduler and pipeline times are counted in F_CPU cycles, so slices run at the idle clock
+// show up shorter than they took
+FASTRUN void setIdleClock(bool lowered) {
+  set_arm_clock(lowered ? IDLE_CPU_FREQ : F_CPU);
+  idleClockLowered = lowered;
+  if (lowered) {
+    idleStats.clockDrops++;
   }
-  if (midi4 && midi4.read()) {
-    processMidiMessage(midi4, 4);
+}
+#endif
+
+FASTRUN uint32_t readCycleCounter() {
+  return ARM_DWT_CYCCNT;
+}
+
+// The tasks loop() runs, in priority order within each class
+// Latency-critical tasks run on every pass; a new background job goes in as housekeeping
+// (or background) with a budget, so it can never sit between a MIDI message and its report
+FLASHMEM void registerTasks() {
+  scheduler.add("USB host", serviceUsbHost, TASK_PRIORITY_INPUT, TASK_BUDGET_USB_HOST_US);
+  scheduler.add("MIDI ingest", serviceMidiPorts, TASK_PRIORITY_INPUT, TASK_BUDGET_MIDI_INGEST_US);
+  #ifdef ENABLE_DIN_MIDI
+  scheduler.add("DIN ingest", serviceDinMidi, TASK_PRIORITY_INPUT, TASK_BUDGET_MIDI_INGEST_US);
+  #endif
+  #ifdef ENABLE_LOAD_GENERATOR
+  scheduler.add("Load generator", serviceLoadGenerator, TASK_PRIORITY_INPUT, TASK_BUDGET_LOAD_GENERATOR_US);
+  #endif
+  scheduler.add("Event pipeline", servicePipeline, TASK_PRIORITY_INPUT, TASK_BUDGET_PIPELINE_US);
+  scheduler.add("Release timers", handleFastPress, TASK_PRIORITY_TIMERS, TASK_BUDGET_RELEASE_TIMERS_US);
+  scheduler.add("Chord window", serviceChordWindow, TASK_PRIORITY_TIMERS, TASK_BUDGET_CHORD_WINDOW_US);
+  scheduler.add("Report emitter", serviceHidTransmit, TASK_PRIORITY_OUTPUT, TASK_BUDGET_HID_TX_US);
+  // Rebuilds a profile's note table after a key change, once no note is down
+  scheduler.add("Key change", serviceKeyChange, TASK_PRIORITY_HOUSEKEEPING, TASK_BUDGET_KEY_CHANGE_US);
+  // Searches auto-transpose's offset for the next phrase while every note is up
+  scheduler.add("Auto-transpose", serviceTransposeSearch, TASK_PRIORITY_HOUSEKEEPING, TASK_BUDGET_AUTO_TRANSPOSE_US);
+  #ifdef ENABLE_MIDI_PASSTHROUGH
+  // Forward MIDI to the PC only while no keyboard report is waiting on the note path
+  scheduler.add("MIDI passthrough", servicePassthrough, TASK_PRIORITY_HOUSEKEEPING, TASK_BUDGET_PASSTHROUGH_US);
+  #endif
+  #ifdef ENABLE_DEBUG
+  scheduler.add("Serial console", serviceSerialConsole, TASK_PRIORITY_BACKGROUND, TASK_BUDGET_SERIAL_CONSOLE_US);
+  #endif
+}
+
+// USB Task must be called frequently for proper device communication
+// This is especially important with hubs that may buffer or delay messages
+// The host stack does not say whether it did anything, so this never counts as busy
+FASTRUN bool serviceUsbHost() {
+  myusb.Task();
+  return false;
+}
+
+// Check for MIDI messages from every device in the table
+// Returns true if any message was read
+FASTRUN bool serviceMidiPorts() {
+  // With hubs, devices may enumerate on different instances, so check all
+  // Round-robin: up to MIDI_READ_BURST messages per device, starting one port later each
+  // pass, so a controller streaming data cannot starve the others
+  bool busy = false;
+  byte portIndex = nextMidiPort;
+  for (byte n = 0; n < MIDI_DEVICE_COUNT; n++) {
+    MIDIDeviceBase& midi = *midiDevices[portIndex];
+    MidiPort& port = midiPorts[portIndex];
+    bool present = midi;
+    // Control events the ingest queue refused go first: until they are in, the port's
+    // next connect/disconnect and its notes wait, so the pipeline sees them in order
+    bool controlQueued = flushPortControl(portIndex);
+    if (controlQueued && present != port.connected) {
+      if (present) {
+        midiPortConnected(portIndex);
+      } else {
+        midiPortDisconnected(portIndex);
+      }
+      controlQueued = flushPortControl(portIndex);
+    }
+    if (present && port.connected && controlQueued) {
+      // Sample the receive queue before draining: a full queue means the driver is
+      // discarding input that never reaches ingestMidiMessage()
+      uint16_t depth = MidiQueueProbe::depth(midi);
+      if (depth > port.queueHighWater) {
+        port.queueHighWater = depth;
+      }
+      if (depth >= MidiQueueProbe::capacity(midi)) {
+        port.overflows++;
+      }
+      for (byte burst = 0; burst < MIDI_READ_BURST && ingestHasRoom(); burst++) {
+        #ifdef ENABLE_MIDI_PASSTHROUGH
+        uint16_t tail = MidiQueueProbe::tail(midi);
+        #endif
+        bool gotMessage = midi.read();
+        #ifdef ENABLE_MIDI_PASSTHROUGH
+        // Copy the packets read() just consumed - they are still in the driver's queue. Also
+        // when it returns false: SysEx parts and messages it filters are consumed all the same
+        queuePassthroughPackets(midi, tail);
+        #endif
+        if (!gotMessage) {
+          break;
+        }
+        busy = true;
+        port.messages++;
+        ingestMidiMessage(portIndex, midi.getType(), midi.getData1(), midi.getData2());
+      }
+    }
+    portIndex = (portIndex + 1) % MIDI_DEVICE_COUNT;
   }
-  
-  // Small delay to prevent tight loop (helps with hub communication)
-  delayMicroseconds(100);
+  nextMidiPort = (nextMidiPort + 1) % MIDI_DEVICE_COUNT;
+  return busy;
 }
 
-// Process MIDI message from any MIDI device (handles all MIDI channels)
-void processMidiMessage(MIDIDevice& midi, int deviceNum) {
-  byte type = midi.getType();
-  byte note = midi.getData1();
-  byte velocity = midi.getData2();
-  
-  // Accept all MIDI channels (0-15) - no channel filtering
-  // The USBHost_t36 library handles channel messages automatically
-  
+// Ingest stage: queue a message from any MIDI input (handles all MIDI channels)
+// type is the status without channel (MIDIDeviceBase::NoteOn, ...) or a PIPELINE_CONTROL_*
+// value, source the input (USB port index or MIDI_SOURCE_DIN) - everything ends up here
+// Returns false if the ingest queue was full (callers check ingestHasRoom() first)
+FASTRUN bool ingestMidiMessage(byte source, byte type, byte data1, byte data2) {
   // Debug: Log all MIDI messages
   #ifdef ENABLE_DEBUG
-  if (type == midi.NoteOn || type == midi.NoteOff) {
+  if (type == MIDIDeviceBase::NoteOn || type == MIDIDeviceBase::NoteOff) {
     Serial.print("MIDI: ");
-    Serial.print(type == midi.NoteOn ? "NoteOn" : "NoteOff");
+    Serial.print(type == MIDIDeviceBase::NoteOn ? "NoteOn" : "NoteOff");
     Serial.print(" note=");
-    Serial.print(note);
+    Serial.print(data1);
     Serial.print(" velocity=");
-    Serial.println(velocity);
+    Serial.println(data2);
   }
   #endif
   
-  // Check for profile switch note (configurable, default: C1 = note 24)
-  // Note: 255 disables profile switching
-  if (config.profileSwitchNote < 255 && type == midi.NoteOn && velocity > 0 && note == config.profileSwitchNote) {
+  MidiEvent event;
+  event.timestamp = ARM_DWT_CYCCNT;
+  event.source = source;
+  event.type = type;
+  event.data1 = data1;
+  event.data2 = data2;
+  return ingestQueue.push(event);
+}
+
+// MIDI input stops while the ingest queue is nearly full (the rest waits in the driver or
+// DIN ring); the last PIPELINE_CONTROL_RESERVE slots are kept for control messages
+FASTRUN bool ingestHasRoom() {
+  return ingestQueue.depth() < ingestQueue.capacity() - PIPELINE_CONTROL_RESERVE;
+}
+
+// Run every stage until its input queue is empty, in pipeline order
+// Returns true if any event moved
+FASTRUN bool servicePipeline() {
+  bool busy = runNormalizeStage();
+  busy |= runRouteStage();
+  busy |= runMapStage();
+  busy |= runScheduleStage();
+  return busy;
+}
+
+// Normalize stage: note-on with velocity 0 becomes note-off, non-note messages end here
+FASTRUN bool runNormalizeStage() {
+  if (ingestQueue.empty()) {
+    return false;
+  }
+  StageStats& stats = stageStats[STAGE_NORMALIZE];
+  uint32_t start = ARM_DWT_CYCCNT;
+  MidiEvent in;
+  NoteEvent out;
+  while (!normalizedQueue.full() && ingestQueue.pop(in)) {
+    recordStageEvent(stats, ARM_DWT_CYCCNT - in.timestamp);
+    if (normalizeEvent(in, out)) {
+      normalizedQueue.push(out);
+      stats.forwarded++;
+    } else {
+      stats.filtered++;
+    }
+  }
+  stats.busyCycles += ARM_DWT_CYCCNT - start;
+  return true;
+}
+
+// Route stage: the profile switch note (configurable, default: C1 = note 24, 255 disables
+// it) selects the next profile, key change notes become key-change events, transpose
+// controls shift the notes that follow; every note is stamped with the profile it is
+// played on and transposed
+FASTRUN bool runRouteStage() {
+  if (normalizedQueue.empty()) {
+    return false;
+  }
+  StageStats& stats = stageStats[STAGE_ROUTE];
+  uint32_t start = ARM_DWT_CYCCNT;
+  NoteEvent event;
+  while (!routedQueue.full() && normalizedQueue.pop(event)) {
+    recordStageEvent(stats, ARM_DWT_CYCCNT - event.timestamp);
     #ifdef ENABLE_DEBUG
-    Serial.print("Profile switch note received (note ");
-    Serial.print(note);
-    Serial.print("), current profile count: ");
-    Serial.println(profileCount);
+    byte fromProfile = routeState.profileIndex;
+    bool switchNote = event.kind == NOTE_EVENT_ON && config.profileSwitchNote < 255 && event.note == config.profileSwitchNote;
+    int8_t fromTranspose = routeState.transpose.offset;
     #endif
-    
-    // Switch to next profile
-    if (profileCount > 1) {
-      byte nextProfile = (currentProfileIndex + 1) % profileCount;
+    if (!routeEvent(routeState, event, millis())) {
       #ifdef ENABLE_DEBUG
+      if (switchNote) {
+        Serial.println("ERROR: Only 1 profile loaded - cannot switch! Need multiple mapping files on SD card.");
+      }
+      if (routeState.transpose.offset != fromTranspose) {
+        Serial.print("Transpose: ");
+        Serial.print(routeState.transpose.offset);
+        Serial.println(" semitones");
+      }
+      #endif
+      stats.filtered++;
+      continue;
+    }
+    #ifdef ENABLE_DEBUG
+    if (switchNote) {
       Serial.print("Switching from profile ");
-      Serial.print(currentProfileIndex);
+      Serial.print(fromProfile);
       Serial.print(" (");
-      Serial.print(profiles[currentProfileIndex].name);
+      Serial.print(profileNames[fromProfile]);
       Serial.print(") to profile ");
-      Serial.print(nextProfile);
+      Serial.print(event.note);
       Serial.print(" (");
-      Serial.print(profiles[nextProfile].name);
+      Serial.print(profileNames[event.note]);
       Serial.println(")");
-      #endif
-      switchProfile(nextProfile);
-    } else {
-      #ifdef ENABLE_DEBUG
-      Serial.println("ERROR: Only 1 profile loaded - cannot switch! Need multiple mapping files on SD card.");
-      #endif
     }
-    return;  // Don't process profile switch note as a regular key
+    #endif
+    routedQueue.push(event);
+    stats.forwarded++;
   }
-  
-  if (type == midi.NoteOn && velocity > 0) {
-    // Note On
-    KeyMapping mapping = profiles[currentProfileIndex].noteToKey[note];
-    // Process if there's a key code OR a modifier (for modifier-only keys like LSHIFT/RSHIFT)
-    if (mapping.keyCode > 0 || mapping.modifierMask > 0) {
-      #ifdef ENABLE_DEBUG
+  stats.busyCycles += ARM_DWT_CYCCNT - start;
+  return true;
+}
+
+// Map stage: notes become key actions through their profile; unmapped notes end here
+FASTRUN bool runMapStage() {
+  if (routedQueue.empty()) {
+    return false;
+  }
+  StageStats& stats = stageStats[STAGE_MAP];
+  uint32_t start = ARM_DWT_CYCCNT;
+  NoteEvent in;
+  KeyEvent out;
+  while (!mappedQueue.full() && routedQueue.pop(in)) {
+    recordStageEvent(stats, ARM_DWT_CYCCNT - in.timestamp);
+    // Mapped if there's a key code OR a modifier (for modifier-only keys like LSHIFT/RSHIFT)
+    if (!mapEvent(profiles, in, out)) {
+      stats.filtered++;
+      continue;
+    }
+    #ifdef ENABLE_DEBUG
+    // Synthetic notes are not logged - printing would be most of what a load test measures
+    if (out.kind == KEY_EVENT_PRESS && out.source != MIDI_SOURCE_LOAD) {
       Serial.print("Key press: note ");
-      Serial.print(note);
-      Serial.print(" -> keyCode ");
-      Serial.print(mapping.keyCode);
+      Serial.print(out.note);
+      Serial.print(isKeySet(out.mapping) ? " -> key set " : " -> keyCode ");
+      Serial.print(isKeySet(out.mapping) ? out.mapping.modifierMask : out.mapping.keyCode);
       Serial.print(" (profile: ");
-      Serial.print(profiles[currentProfileIndex].name);
+      Serial.print(profileNames[in.profile]);
       Serial.println(")");
-      #endif
-      
-      // Check if this is a modifier-only key (keyCode=0, modifierMask>0)
-      if (mapping.keyCode == 0 && mapping.modifierMask > 0) {
-        // Modifier-only key (LSHIFT, RSHIFT, etc.) - handle separately to avoid replaying other keys
-        activeModifierKeys |= mapping.modifierMask;
-        updateKeyboardState();
-        return;  // Don't process as regular key
-      }
-      
-      // Regular key (with or without modifier)
-      // Use current profile's fast-press mode setting
-      bool profileFastPress = profiles[currentProfileIndex].fastPressMode;
-      unsigned int profileDuration = profiles[currentProfileIndex].pressDurationMs;
-      
-      if (profileFastPress) {
-        // Fast press mode: send quick press/release
-        if (profileDuration == 0) {
-          // Immediate press/release (like open source player)
-          addPressedKey(mapping.keyCode, mapping.modifierMask);
-          updateKeyboardState();
-          // Release immediately
-          removePressedKey(mapping.keyCode, mapping.modifierMask);
-          updateKeyboardState();
-        } else {
-          // Timed press/release (for longer durations)
-          addPressedKey(mapping.keyCode, mapping.modifierMask);
-          updateKeyboardState();
-          
-          // Schedule release after pressDurationMs
-          if (fastPressKeyCount < MAX_SIMULTANEOUS_KEYS) {
-            fastPressTimers[fastPressKeyCount].keyCode = mapping.keyCode;
-            fastPressTimers[fastPressKeyCount].modifierMask = mapping.modifierMask;
-            fastPressTimers[fastPressKeyCount].releaseTime = millis() + profileDuration;
-            fastPressKeyCount++;
-          }
-        }
-      } else {
-        // Normal mode: hold key until NoteOff
-        addPressedKey(mapping.keyCode, mapping.modifierMask);
-        updateKeyboardState();
-      }
-    }
-  }
-  else if (type == midi.NoteOff || (type == midi.NoteOn && velocity == 0)) {
-    // Note Off
-    KeyMapping mapping = profiles[currentProfileIndex].noteToKey[note];
-    // Process if there's a key code OR a modifier (for modifier-only keys like LSHIFT/RSHIFT)
-    if (mapping.keyCode > 0 || mapping.modifierMask > 0) {
-      // Check if this is a modifier-only key (keyCode=0, modifierMask>0)
-      if (mapping.keyCode == 0 && mapping.modifierMask > 0) {
-        // Modifier-only key release - handle separately to avoid replaying other keys
-        activeModifierKeys &= ~mapping.modifierMask;
-        updateKeyboardState();
-        return;  // Don't process as regular key
-      }
-      
-      // Regular key release
-      // Use current profile's fast-press mode setting
-      bool profileFastPress = profiles[currentProfileIndex].fastPressMode;
-      if (!profileFastPress) {
-        // Only handle NoteOff in normal mode (fast mode uses timers)
-        removePressedKey(mapping.keyCode, mapping.modifierMask);
-        updateKeyboardState();
-      }
     }
+    #endif
+    mappedQueue.push(out);
+    stats.forwarded++;
   }
+  stats.busyCycles += ARM_DWT_CYCCNT - start;
+  return true;
 }
 
-// Load configuration from CONFIG.TXT
-void loadConfig() {
-  File file = SD.open(CONFIG_FILE_NAME, FILE_READ);
-  if (!file) {
-    // Config file doesn't exist, use defaults
-    return;
+// Schedule stage: key actions drive the key engine, which queues reports for the emit
+// stage (serviceHidTransmit) and arms release timers
+FASTRUN bool runScheduleStage() {
+  if (mappedQueue.empty()) {
+    return false;
   }
-  
-  while (file.available()) {
-    String line = file.readStringUntil('\n');
-    line.trim();
-    
-    // Skip comments and empty lines
-    if (line.length() == 0 || line.startsWith("#")) {
-      continue;
-    }
-    
-    // Parse: SETTING=VALUE
-    int equalsPos = line.indexOf('=');
-    if (equalsPos > 0) {
-      String setting = line.substring(0, equalsPos);
-      String value = line.substring(equalsPos + 1);
-      setting.trim();
-      setting.toUpperCase();
-      value.trim();
-      value.toUpperCase();
-      
-      if (setting == "FAST_PRESS_MODE" || setting == "FASTPRESS") {
-        config.fastPressMode = (value == "1" || value == "TRUE" || value == "ON" || value == "YES");
-      }
-      else if (setting == "PRESS_DURATION" || setting == "DURATION") {
-        int duration = value.toInt();
-        // Valid range: 0ms (immediate) to 1000ms (1 second)
-        if (duration >= 0 && duration <= 1000) {
-          config.pressDurationMs = duration;
+  StageStats& stats = stageStats[STAGE_SCHEDULE];
+  uint32_t start = ARM_DWT_CYCCNT;
+  KeyEvent event;
+  while (mappedQueue.pop(event)) {
+    recordStageEvent(stats, ARM_DWT_CYCCNT - event.timestamp);
+    MidiPort* port = portForSource(event.source);
+    byte note = event.note;
+    switch (event.kind) {
+      case KEY_EVENT_PRESS: {
+        #ifdef ENABLE_LOAD_GENERATOR
+        unsigned long queuedBefore = hidStats.queued;
+        byte depthBefore = hidQueueCount;
+        #endif
+        #ifdef ENABLE_DEBUG
+        uint32_t recognizedBefore = chordState.recognized;
+        #endif
+        // A note already down on this input (retriggered without a note-off) holds its key once
+        if (port && !holdNote(port->heldNotes, note)) {
+          break;
         }
-      }
-      else if (setting == "PROFILE_SWITCH_NOTE" || setting == "PROFILE_SWITCH" || setting == "SWITCH_NOTE") {
-        int note = value.toInt();
-        // Valid range: 0-127 (MIDI note range), or 255 to disable
-        if ((note >= 0 && note < MAX_MIDI_NOTES) || note == 255) {
-          config.profileSwitchNote = note;
+        // Chord notes go through the chord matcher, which may hold them back or take them
+        // Fast-press/hold and modifier handling are baked into the active engine variant
+        if (!chordNoteOn(chordState, chordTable, currentProfileIndex, profiles[currentProfileIndex], note, millis(), chordOutput)
+            && isMapped(event.mapping)) {
+          activeEngine.noteOn(event.mapping);
         }
+        #ifdef ENABLE_DEBUG
+        if (chordState.recognized != recognizedBefore) {
+          Serial.print("Chord: note ");
+          Serial.print(note);
+          Serial.print(" completes a chord -> keyCode ");
+          Serial.println(chordState.active[chordState.activeCount - 1].mapping.keyCode);
+        }
+        #endif
+        #ifdef ENABLE_LOAD_GENERATOR
+        if (event.source == MIDI_SOURCE_LOAD && hidStats.queued != queuedBefore) {
+          trackLoadPress(event.timestamp, depthBefore);
+        }
+        #endif
+        break;
       }
+      case KEY_EVENT_RELEASE:
+        // A note that is not down releases nothing: a second note-off, or a note a profile
+        // switch let go of (its mapping changed) - its key was released then, and its
+        // note-off must not release what the new mapping holds
+        if (port && !releaseNote(port->heldNotes, note)) {
+          break;
+        }
+        if (!chordNoteOff(chordState, profiles[currentProfileIndex], note, chordOutput) && isMapped(event.mapping)) {
+          activeEngine.noteOff(event.mapping);
+        }
+        break;
+      case KEY_EVENT_SELECT_PROFILE:
+        if (note != currentProfileIndex) {
+          switchProfile(note);
+        }
+        break;
+      case KEY_EVENT_RELEASE_SOURCE:
+        if (port) {
+          releaseHeldNotes(*port);
+        }
+        break;
+      case KEY_EVENT_KEY_CHANGE:
+        // Events reach this stage in order, so the current profile is the one the control
+        // note was routed to
+        changeKeySignature(currentProfileIndex, note ? 1 : -1);
+        break;
     }
+    stats.forwarded++;
   }
-  file.close();
+  stats.busyCycles += ARM_DWT_CYCCNT - start;
+  return true;
 }
 
-// Switch to a different profile
-void switchProfile(byte profileIndex) {
-  if (profileIndex < profileCount && profiles[profileIndex].isValid) {
-    currentProfileIndex = profileIndex;
-    // Release all currently pressed keys when switching profiles
-    for (int i = pressedKeyCount - 1; i >= 0; i--) {
-      removePressedKey(pressedKeys[i].keyCode, pressedKeys[i].modifierMask);
-    }
-    // Clear modifier-only keys
-    activeModifierKeys = 0;
-    updateKeyboardState();
-    // Clear fast press timers
-    fastPressKeyCount = 0;
+// Chord keys are pressed and released through the active engine variant, like note keys
+FASTRUN void chordPress(KeyMapping mapping) {
+  activeEngine.noteOn(mapping);
+}
+
+FASTRUN void chordRelease(KeyMapping mapping) {
+  activeEngine.noteOff(mapping);
+}
+
+// Timer task: once a chord gather's window closes, fires the chord that waited for a bigger
+// one or plays the notes the gather held back
+FASTRUN bool serviceChordWindow() {
+  return expireChordGather(chordState, profiles[currentProfileIndex], millis(), chordOutput);
+}
+
+// State of the input an event came from (nullptr for unknown sources)
+FASTRUN MidiPort* portForSource(byte source) {
+  if (source < MIDI_DEVICE_COUNT) {
+    return &midiPorts[source];
+  }
+  #ifdef ENABLE_DIN_MIDI
+  if (source == MIDI_SOURCE_DIN) {
+    return &dinMidiPort;
   }
+  #endif
+  #ifdef ENABLE_LOAD_GENERATOR
+  if (source == MIDI_SOURCE_LOAD) {
+    return &loadGeneratorPort;
+  }
+  #endif
+  return nullptr;
 }
 
-// Load all mapping files from SD card root directory
-// Each .txt file containing "MAPPINGS" in its name becomes one profile
-// Profile name is derived from the filename (without .txt extension)
-// Pressing the profile switch note cycles through all loaded mapping files
-void loadMappings() {
-  // Initialize all profiles
-  profileCount = 0;
-  currentProfileIndex = 0;
-  for (int i = 0; i < MAX_PROFILES; i++) {
-    profiles[i].name = "";
-    profiles[i].isValid = false;
-    for (int j = 0; j < MAX_MIDI_NOTES; j++) {
-      profiles[i].noteToKey[j].keyCode = 0;
-      profiles[i].noteToKey[j].modifierMask = 0;
+// Release every key an input is holding (its notes map through the current profile)
+FASTRUN void releaseHeldNotes(MidiPort& port) {
+  const Profile& profile = profiles[currentProfileIndex];
+  // Notes held back or taken by a chord have no key of their own down (releaseChords below)
+  uint32_t chordNotes[CHORD_WORDS];
+  chordOwnedNotes(chordState, chordNotes);
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    if ((port.heldNotes[note >> 3] & (1 << (note & 7))) && !chordBit(chordNotes, note)) {
+      activeEngine.noteOff(profile.noteToKey[note]);
     }
   }
-  
-  // Open root directory and search for all mapping files
-  File root = SD.open("/");
-  if (!root) {
-    // SD card root not accessible - use fallback test mappings
-    profiles[0].name = "default";
-    profiles[0].isValid = true;
-    profiles[0].noteToKey[60].keyCode = KEY_H;
-    profiles[0].noteToKey[60].modifierMask = 0;
-    profiles[0].noteToKey[58].keyCode = KEY_G;
-    profiles[0].noteToKey[58].modifierMask = 0;
-    profileCount = 1;
-    currentProfileIndex = 0;
-    return;
+  memset(port.heldNotes, 0, sizeof(port.heldNotes));
+  // Chords are gathered over all inputs together, so any input's release ends them
+  releaseChords(chordState, chordOutput);
+}
+
+// Move a profile's key signature around the circle of fifths (+1 = one sharp more)
+// The note table is rebuilt by serviceKeyChange, not here on the note path
+FASTRUN void changeKeySignature(byte profileIndex, int fifths) {
+  Profile& profile = profiles[profileIndex];
+  int signature = profile.keySignature + fifths;
+  if (signature < -KEY_SIGNATURE_MAX || signature > KEY_SIGNATURE_MAX) {
+    return;
+  }
+  profile.keySignature = signature;
+  if (profile.accidentalMode != ACCIDENTALS_KEEP) {
+    keyChangePending |= 1 << profileIndex;
+  }
+  #ifdef ENABLE_DEBUG
+  Serial.print("Key signature: ");
+  Serial.print(signature);
+  Serial.print(" (profile ");
+  Serial.print(profileNames[profileIndex]);
+  Serial.println(")");
+  #endif
+}
+
+// Housekeeping: rebuild one profile's note table for its new key per slice
+// Waits until no note is down and nothing is in flight in the pipeline, so every note-off
+// maps to the key its note-on pressed
+FLASHMEM bool serviceKeyChange() {
+  if (keyChangePending == 0 || !pipelineIdle()) {
+    return false;
+  }
+  byte profileIndex = 0;
+  while (!(keyChangePending & (1 << profileIndex))) {
+    profileIndex++;
+  }
+  keyChangePending &= ~(1 << profileIndex);
+  buildNoteTable(profiles[profileIndex], profileSourceTables[profileIndex], keySets);
+  routeState.transpose.autoReady = false;  // Searched on the old table
+  return true;
+}
+
+// Housekeeping: auto-transpose's search between phrases, so the first note-on of a phrase
+// only picks up its result
+FLASHMEM bool serviceTransposeSearch() {
+  return serviceRouteTranspose(routeState, millis());
+}
+
+// No event queued between ingest and the key engine, and no note down on any input
+FLASHMEM bool pipelineIdle() {
+  if (!ingestQueue.empty() || !normalizedQueue.empty() || !routedQueue.empty() || !mappedQueue.empty()) {
+    return false;
+  }
+  for (int source = 0; source <= MIDI_SOURCE_LOAD; source++) {
+    const MidiPort* port = portForSource(source);
+    if (!port) {
+      continue;
+    }
+    for (int i = 0; i < MAX_MIDI_NOTES / 8; i++) {
+      if (port->heldNotes[i]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Empty the pipeline and point the route stage at the current profile
+// Called after profiles are loaded or the engine is reset outside the pipeline
+FLASHMEM void resetPipeline() {
+  ingestQueue.clear();
+  normalizedQueue.clear();
+  routedQueue.clear();
+  mappedQueue.clear();
+  initRouteState(routeState, profiles, currentProfileIndex, profileCount, config);
+  resetChords(chordState, config);
+}
+
+// A device enumerated on this port
+FLASHMEM void midiPortConnected(byte portIndex) {
+  MidiPort& port = midiPorts[portIndex];
+  port.connected = true;
+  memset(port.heldNotes, 0, sizeof(port.heldNotes));
+  port.queueHighWater = 0;
+  port.messages = 0;
+  port.overflows = 0;
+  
+  // Match the device against the profiles once and cache the result
+  MIDIDeviceBase& midi = *midiDevices[portIndex];
+  port.matchedProfile = findDeviceProfile(midi);
+  
+  #ifdef ENABLE_DEBUG
+  const uint8_t* product = midi.product();
+  Serial.print("MIDI device ");
+  Serial.print(portIndex + 1);
+  Serial.print(" connected: ");
+  Serial.print(midi.idVendor(), HEX);
+  Serial.print(":");
+  Serial.print(midi.idProduct(), HEX);
+  Serial.print(" ");
+  Serial.println(product ? (const char*)product : "");
+  if (port.matchedProfile != NO_PROFILE) {
+    Serial.print("  -> profile ");
+    Serial.println(profileNames[port.matchedProfile]);
+  }
+  #endif
+  
+  // Through the pipeline, so notes already queued still play on the old profile
+  // serviceMidiPorts() queues it, retrying while the ingest queue is full
+  port.releasePending = false;
+  port.selectPending = port.matchedProfile != NO_PROFILE;
+}
+
+// The device on this port was unplugged: release every key it was holding right away
+// instead of leaving them stuck until the next profile switch
+// The release goes through the pipeline behind the device's last queued notes
+FLASHMEM void midiPortDisconnected(byte portIndex) {
+  MidiPort& port = midiPorts[portIndex];
+  port.connected = false;
+  port.releasePending = true;
+  port.selectPending = false;
+  
+  #ifdef ENABLE_DEBUG
+  Serial.print("MIDI device ");
+  Serial.print(portIndex + 1);
+  Serial.println(" disconnected");
+  #endif
+  
+  // If the unplugged device picked the active profile, hand over to another connected
+  // device that declared one
+  if (port.matchedProfile != NO_PROFILE && port.matchedProfile == currentProfileIndex) {
+    for (int i = 0; i < MIDI_DEVICE_COUNT; i++) {
+      MidiPort& other = midiPorts[i];
+      if (other.connected && other.matchedProfile != NO_PROFILE && other.matchedProfile != currentProfileIndex) {
+        other.selectPending = true;
+        break;
+      }
+    }
+  }
+  port.matchedProfile = NO_PROFILE;
+}
+
+// Queue the control events of a port that did not fit into the ingest queue yet
+// Returns true once none is waiting any more
+FASTRUN bool flushPortControl(byte portIndex) {
+  MidiPort& port = midiPorts[portIndex];
+  if (port.releasePending) {
+    if (!ingestMidiMessage(portIndex, PIPELINE_CONTROL_RELEASE_SOURCE, 0, 0)) {
+      return false;
+    }
+    port.releasePending = false;
+  }
+  if (port.selectPending) {
+    if (!ingestMidiMessage(portIndex, PIPELINE_CONTROL_SELECT_PROFILE, port.matchedProfile, 0)) {
+      return false;
+    }
+    port.selectPending = false;
+  }
+  return true;
+}
+
+// First profile whose DEVICE_VID / DEVICE_PID / DEVICE_NAME all match the device
+// Profiles that declare none of them never match
+FLASHMEM byte findDeviceProfile(MIDIDeviceBase& midi) {
+  const char* product = (const char*)midi.product();
+  for (int i = 0; i < profileCount; i++) {
+    const DeviceMatch& match = profileDeviceMatch[i];
+    if (match.vendorId == 0 && match.productId == 0 && match.productName[0] == '\0') {
+      continue;
+    }
+    if (match.vendorId != 0 && match.vendorId != midi.idVendor()) {
+      continue;
+    }
+    if (match.productId != 0 && match.productId != midi.idProduct()) {
+      continue;
+    }
+    if (match.productName[0] != '\0' && (product == nullptr || !containsIgnoreCase(product, match.productName))) {
+      continue;
+    }
+    return i;
+  }
+  return NO_PROFILE;
+}
+
+// Set a profile's name, truncated to PROFILE_NAME_MAX_LEN
+FLASHMEM void setProfileName(byte profileIndex, const char* name) {
+  strncpy(profileNames[profileIndex], name, PROFILE_NAME_MAX_LEN);
+  profileNames[profileIndex][PROFILE_NAME_MAX_LEN] = '\0';
+}
+
+// Read one line (without the line ending) into buffer, which holds maxLength characters + '\0'
+// Characters past maxLength are discarded; returns false if the line was truncated
+FLASHMEM bool readLine(File& file, char* buffer, size_t maxLength) {
+  size_t length = 0;
+  bool truncated = false;
+  while (file.available()) {
+    int c = file.read();
+    if (c < 0 || c == '\n') {
+      break;
+    }
+    if (length < maxLength) {
+      buffer[length++] = (char)c;
+    } else {
+      truncated = true;
+    }
+  }
+  buffer[length] = '\0';
+  return !truncated;
+}
+
+// Load configuration from CONFIG.TXT
+FLASHMEM void loadConfig() {
+  File file = SD.open(CONFIG_FILE_NAME, FILE_READ);
+  if (!file) {
+    // Config file doesn't exist, use defaults
+    return;
+  }
+  
+  LoadArenaScope scratch(loadArena);
+  char* lineBuffer = loadArena.allocateString(LOAD_LINE_MAX_LEN);
+  if (!lineBuffer) {
+    file.close();
+    return;
+  }
+  
+  while (file.available()) {
+    readLine(file, lineBuffer, LOAD_LINE_MAX_LEN);
+    parseConfigLine(lineBuffer, config);
+  }
+  file.close();
+}
+
+// Reset every profile to an empty, invalid one using the global config defaults
+FLASHMEM void clearProfiles() {
+  profileCount = 0;
+  currentProfileIndex = 0;
+  for (int i = 0; i < MAX_PROFILES; i++) {
+    profileNames[i][0] = '\0';
+    memset(&profileDeviceMatch[i], 0, sizeof(DeviceMatch));
+    initProfileFromConfig(profiles[i], config);
+    memcpy(profileSourceTables[i], profiles[i].noteToKey, sizeof(profiles[i].noteToKey));
+  }
+  keyChangePending = 0;
+  clearChords(chordTable);
+  clearKeySets(keySets);
+}
+
+// Single test profile used when nothing could be loaded: note 60 = H, note 58 = G
+FLASHMEM void loadFallbackProfile() {
+  clearProfiles();
+  setProfileName(0, "default");
+  profiles[0].isValid = true;
+  profiles[0].noteToKey[60].keyCode = KEY_H;
+  profiles[0].noteToKey[58].keyCode = KEY_G;
+  memcpy(profileSourceTables[0], profiles[0].noteToKey, sizeof(profiles[0].noteToKey));
+  buildNoteTable(profiles[0], profileSourceTables[0], keySets);
+  profileCount = 1;
+  currentProfileIndex = 0;
+}
+
+// 32-bit FNV-1a, chained through hash (start with FNV_OFFSET_BASIS)
+const uint32_t FNV_OFFSET_BASIS = 2166136261UL;
+const uint32_t FNV_PRIME = 16777619UL;
+
+FLASHMEM uint32_t fnv1a(uint32_t hash, const void* data, size_t length) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+// Signature of everything the profile store is imported from: the firmware build (so a
+// new parser re-imports) plus name, size and modify time of CONFIG.TXT and every mapping file
+// Only the directory is read, so checking an unchanged card costs no file parsing
+FLASHMEM uint32_t sdSourceSignature(int& sourceFileCount) {
+  static const char firmwareBuild[] = __DATE__ " " __TIME__;
+  uint32_t signature = fnv1a(FNV_OFFSET_BASIS, firmwareBuild, sizeof(firmwareBuild));
+  
+  File root = SD.open("/");
+  if (!root) {
+    return signature;
+  }
+  
+  LoadArenaScope scratch(loadArena);
+  char* nameUpper = loadArena.allocateString(MAPPING_FILE_NAME_MAX_LEN);
+  if (!nameUpper) {
+    root.close();
+    return signature;
+  }
+  
+  while (true) {
+    File entry = root.openNextFile();
+    if (!entry) {
+      break;
+    }
+    
+    const char* fileName = entry.name();
+    if (!entry.isDirectory() && strncmp(fileName, "._", 2) != 0 && strlen(fileName) <= MAPPING_FILE_NAME_MAX_LEN) {
+      strcpy(nameUpper, fileName);
+      upperString(nameUpper);
+      if (strEquals(nameUpper, CONFIG_FILE_NAME) || isMappingFileName(nameUpper)) {
+        sourceFileCount++;
+        uint32_t size = entry.size();
+        DateTimeFields modified;
+        memset(&modified, 0, sizeof(modified));
+        entry.getModifyTime(modified);
+        signature = fnv1a(signature, nameUpper, strlen(nameUpper));
+        signature = fnv1a(signature, &size, sizeof(size));
+        signature = fnv1a(signature, &modified, sizeof(modified));
+      }
+    }
+    entry.close();
+  }
+  
+  root.close();
+  return signature;
+}
+
+// Load config and profiles from the flash store
+// Returns false (profiles cleared, config untouched) if the store is missing or invalid
+FLASHMEM bool loadProfileStore(uint32_t& sourceSignature) {
+  File file = profileFlash.open(PROFILE_STORE_FILE_NAME, FILE_READ);
+  if (!file) {
+    return false;
+  }
+  
+  ProfileStoreHeader header;
+  bool valid = file.read(&header, sizeof(header)) == sizeof(header) &&
+               header.magic == PROFILE_STORE_MAGIC &&
+               header.version == PROFILE_STORE_VERSION &&
+               header.profileSize == sizeof(Profile) &&
+               header.profileCount > 0 && header.profileCount <= MAX_PROFILES;
+  
+  uint32_t checksum = fnv1a(FNV_OFFSET_BASIS, &header.config, sizeof(header.config));
+  for (int i = 0; valid && i < header.profileCount; i++) {
+    valid = file.read(&profiles[i], sizeof(Profile)) == sizeof(Profile) &&
+            file.read(profileNames[i], sizeof(profileNames[i])) == sizeof(profileNames[i]) &&
+            file.read(&profileDeviceMatch[i], sizeof(DeviceMatch)) == sizeof(DeviceMatch) &&
+            file.read(profileSourceTables[i], sizeof(profileSourceTables[i])) == sizeof(profileSourceTables[i]);
+    checksum = fnv1a(checksum, &profiles[i], sizeof(Profile));
+    checksum = fnv1a(checksum, profileNames[i], sizeof(profileNames[i]));
+    checksum = fnv1a(checksum, &profileDeviceMatch[i], sizeof(DeviceMatch));
+    checksum = fnv1a(checksum, profileSourceTables[i], sizeof(profileSourceTables[i]));
+  }
+  valid = valid && header.chordCount <= CHORD_MAX && header.keySetCount <= KEY_SET_MAX;
+  clearChords(chordTable);
+  for (int i = 0; valid && i < header.chordCount; i++) {
+    ChordEntry entry;
+    valid = file.read(&entry, sizeof(entry)) == sizeof(entry) && entry.profile < header.profileCount;
+    checksum = fnv1a(checksum, &entry, sizeof(entry));
+    if (valid) {
+      ChordPattern pattern;
+      memcpy(pattern.notes, entry.notes, sizeof(pattern.notes));
+      pattern.mapping = entry.mapping;
+      addChord(chordTable, entry.profile, profiles[entry.profile], pattern);
+    }
+  }
+  clearKeySets(keySets);
+  if (valid) {
+    int setBytes = header.keySetCount * sizeof(KeySet);
+    valid = file.read(keySets.sets, setBytes) == setBytes;
+    checksum = fnv1a(checksum, keySets.sets, setBytes);
+    keySets.count = header.keySetCount;
+  }
+  file.close();
+  
+  if (!valid || checksum != header.checksum) {
+    // Partially read records must not be used
+    clearProfiles();
+    return false;
+  }
+  
+  config = header.config;
+  for (int i = 0; i < header.profileCount; i++) {
+    profileNames[i][PROFILE_NAME_MAX_LEN] = '\0';
+    profileDeviceMatch[i].productName[DEVICE_NAME_MAX_LEN] = '\0';
+    if (profiles[i].modifierMode >= MODIFIER_MODE_COUNT) {
+      profiles[i].modifierMode = MODIFIERS_SPLIT;
+    }
+    if (profiles[i].keySignature < -KEY_SIGNATURE_MAX || profiles[i].keySignature > KEY_SIGNATURE_MAX) {
+      profiles[i].keySignature = 0;
+    }
+  }
+  profileCount = header.profileCount;
+  currentProfileIndex = 0;
+  sourceSignature = header.sourceSignature;
+  return true;
+}
+
+// Write config and the loaded profiles to the flash store
+// The new store is written to a temp file and renamed over the old one, so losing power
+// mid-write leaves the previous store intact
+FLASHMEM bool saveProfileStore(uint32_t sourceSignature) {
+  ProfileStoreHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = PROFILE_STORE_MAGIC;
+  header.version = PROFILE_STORE_VERSION;
+  header.profileSize = sizeof(Profile);
+  header.sourceSignature = sourceSignature;
+  header.config = config;
+  header.profileCount = profileCount;
+  header.chordCount = chordTable.count;
+  header.keySetCount = keySets.count;
+  
+  uint32_t checksum = fnv1a(FNV_OFFSET_BASIS, &header.config, sizeof(header.config));
+  for (int i = 0; i < profileCount; i++) {
+    checksum = fnv1a(checksum, &profiles[i], sizeof(Profile));
+    checksum = fnv1a(checksum, profileNames[i], sizeof(profileNames[i]));
+    checksum = fnv1a(checksum, &profileDeviceMatch[i], sizeof(DeviceMatch));
+    checksum = fnv1a(checksum, profileSourceTables[i], sizeof(profileSourceTables[i]));
+  }
+  for (int i = 0; i < chordTable.count; i++) {
+    checksum = fnv1a(checksum, &chordTable.entries[i], sizeof(ChordEntry));
+  }
+  checksum = fnv1a(checksum, keySets.sets, keySets.count * sizeof(KeySet));
+  header.checksum = checksum;
+  
+  profileFlash.remove(PROFILE_STORE_TEMP_NAME);
+  File file = profileFlash.open(PROFILE_STORE_TEMP_NAME, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  
+  bool written = file.write(&header, sizeof(header)) == sizeof(header);
+  for (int i = 0; written && i < profileCount; i++) {
+    written = file.write(&profiles[i], sizeof(Profile)) == sizeof(Profile) &&
+              file.write(profileNames[i], sizeof(profileNames[i])) == sizeof(profileNames[i]) &&
+              file.write(&profileDeviceMatch[i], sizeof(DeviceMatch)) == sizeof(DeviceMatch) &&
+              file.write(profileSourceTables[i], sizeof(profileSourceTables[i])) == sizeof(profileSourceTables[i]);
+  }
+  for (int i = 0; written && i < chordTable.count; i++) {
+    written = file.write(&chordTable.entries[i], sizeof(ChordEntry)) == sizeof(ChordEntry);
+  }
+  if (written) {
+    size_t setBytes = keySets.count * sizeof(KeySet);
+    written = file.write(keySets.sets, setBytes) == setBytes;
+  }
+  file.close();
+  
+  if (!written) {
+    profileFlash.remove(PROFILE_STORE_TEMP_NAME);
+    return false;
+  }
+  return profileFlash.rename(PROFILE_STORE_TEMP_NAME, PROFILE_STORE_FILE_NAME);
+}
+
+// Switch to a different profile without cutting off notes that mean the same in both
+// A held note keeps its key if the new profile maps it to the same key and releases it the
+// same way (on NoteOff - held or hybrid - or by timer); every other held note's key is released. The result
+// goes out as one keyboard state through the new profile's engine variant
+// Pending timed releases keep running - rescaled to the new press duration if both
+// profiles are timed - so a fast-press key is neither cut short nor stuck
+void switchProfile(byte profileIndex) {
+  if (profileIndex >= profileCount || !profiles[profileIndex].isValid) {
+    return;
+  }
+  const Profile& oldProfile = profiles[currentProfileIndex];
+  const Profile& newProfile = profiles[profileIndex];
+  ReleaseStrategy oldRelease = releaseStrategyFor(oldProfile);
+  ReleaseStrategy newRelease = releaseStrategyFor(newProfile);
+  // A key held until NoteOff must stay that way (a fast-press variant ignores NoteOff)
+  bool releaseUnchanged = releasesOnNoteOff(oldRelease) == releasesOnNoteOff(newRelease);
+  
+  KeyKeep keep;
+  memset(&keep, 0, sizeof(keep));
+  // Notes held back or taken by a chord pressed no key of their own, they go with the chord state
+  uint32_t chordNotes[CHORD_WORDS];
+  chordOwnedNotes(chordState, chordNotes);
+  #ifdef ENABLE_DEBUG
+  int keptNotes = 0;
+  int releasedNotes = 0;
+  #endif
+  
+  // Held notes on every input: keep the unchanged ones, forget the rest
+  for (byte source = 0; source <= MIDI_SOURCE_LOAD; source++) {
+    MidiPort* port = portForSource(source);
+    if (!port) {
+      continue;
+    }
+    for (int byteIndex = 0; byteIndex < MAX_MIDI_NOTES / 8; byteIndex++) {
+      byte bits = port->heldNotes[byteIndex];
+      for (int bit = 0; bits != 0; bit++, bits >>= 1) {
+        if (!(bits & 1)) {
+          continue;
+        }
+        int note = byteIndex * 8 + bit;
+        KeyMapping before = oldProfile.noteToKey[note];
+        if (chordBit(chordNotes, note) || !noteKeepsKey(before, newProfile.noteToKey[note], releaseUnchanged)) {
+          port->heldNotes[byteIndex] &= ~(1 << bit);
+          #ifdef ENABLE_DEBUG
+          releasedNotes++;
+          #endif
+          continue;
+        }
+        #ifdef ENABLE_DEBUG
+        keptNotes++;
+        #endif
+        keepNoteKeys(keyEngine, keySets, before, keep);
+      }
+    }
+  }
+  
+  // Keys waiting for a timed release stay down until their timer - rescaled to the new
+  // press duration if both profiles are timed; every other key not kept is released
+  bool rescale = oldRelease == RELEASE_TIMED && newRelease == RELEASE_TIMED;
+  applyKeptKeys(keyEngine, keep, rescale ? (int32_t)newProfile.pressDurationMs - (int32_t)oldProfile.pressDurationMs : 0);
+  
+  currentProfileIndex = profileIndex;
+  // Chord keys were released above with the other keys not held by a note
+  resetChords(chordState, config);
+  // Pick the engine variant for the new profile once, not on every note
+  selectEngineVariant();
+  updateKeyboardState();
+  
+  #ifdef ENABLE_DEBUG
+  Serial.print("Profile switch: ");
+  Serial.print(keptNotes);
+  Serial.print(" held note(s) kept, ");
+  Serial.print(releasedNotes);
+  Serial.println(" released");
+  #endif
+}
+
+// Load all mapping files from SD card root directory
+// Each .txt file containing "MAPPINGS" in its name becomes one profile
+// Profile name is derived from the filename (without .txt extension)
+// Pressing the profile switch note cycles through all loaded mapping files
+// Returns false if no mapping file was loaded (the fallback or a default profile is in place)
+FLASHMEM bool loadMappings() {
+  // Initialize all profiles
+  clearProfiles();
+  
+  // Open root directory and search for all mapping files
+  File root = SD.open("/");
+  if (!root) {
+    // SD card root not accessible - use fallback test mappings
+    loadFallbackProfile();
+    return false;
+  }
+  
+  // All scratch strings below come from the load arena and are released when loading ends
+  LoadArenaScope scratch(loadArena);
+  char* fileNameUpper = loadArena.allocateString(MAPPING_FILE_NAME_MAX_LEN);
+  char* lineBuffer = loadArena.allocateString(LOAD_LINE_MAX_LEN);
+  if (!fileNameUpper || !lineBuffer) {
+    root.close();
+    loadFallbackProfile();
+    return false;
   }
   
   // First pass: collect all mapping file names
-  String mappingFiles[MAX_PROFILES];
   int fileCount = 0;
   
   #ifdef ENABLE_DEBUG
@@ -450,9 +1737,7 @@ void loadMappings() {
     }
     
     // Get filename (must capture before closing entry)
-    String fileName = String(entry.name());
-    String fileNameUpper = fileName;
-    fileNameUpper.toUpperCase();  // Convert to uppercase for case-insensitive comparison
+    const char* fileName = entry.name();
     
     #ifdef ENABLE_DEBUG
     Serial.print("Found file: ");
@@ -460,7 +1745,7 @@ void loadMappings() {
     #endif
     
     // Skip macOS metadata files (._ files)
-    if (fileName.startsWith("._")) {
+    if (strncmp(fileName, "._", 2) == 0) {
       #ifdef ENABLE_DEBUG
       Serial.println("  -> Skipping macOS metadata file");
       #endif
@@ -468,9 +1753,20 @@ void loadMappings() {
       continue;
     }
     
-    // Check if filename contains "MAPPINGS" and ends with ".TXT"
-    if (fileNameUpper.indexOf("MAPPINGS") >= 0 && fileNameUpper.endsWith(".TXT")) {
-      mappingFiles[fileCount] = fileName;
+    if (strlen(fileName) > MAPPING_FILE_NAME_MAX_LEN) {
+      #ifdef ENABLE_DEBUG
+      Serial.println("  -> Skipping, file name too long");
+      #endif
+      entry.close();
+      continue;
+    }
+    
+    // Uppercase copy for case-insensitive comparison
+    strcpy(fileNameUpper, fileName);
+    upperString(fileNameUpper);
+    
+    if (isMappingFileName(fileNameUpper)) {
+      strcpy(mappingFileNames[fileCount], fileName);
       fileCount++;
       #ifdef ENABLE_DEBUG
       Serial.print("  -> Added as mapping file #");
@@ -490,47 +1786,28 @@ void loadMappings() {
   
   if (fileCount == 0) {
     // No mapping files found - use fallback test mappings
-    profiles[0].name = "default";
-    profiles[0].isValid = true;
-    profiles[0].fastPressMode = config.fastPressMode;
-    profiles[0].pressDurationMs = config.pressDurationMs;
-    profiles[0].noteToKey[60].keyCode = KEY_H;
-    profiles[0].noteToKey[60].modifierMask = 0;
-    profiles[0].noteToKey[58].keyCode = KEY_G;
-    profiles[0].noteToKey[58].modifierMask = 0;
-    profileCount = 1;
-    currentProfileIndex = 0;
-    return;
+    loadFallbackProfile();
+    return false;
   }
   
   // Second pass: load each mapping file as a separate profile
   for (int fileIdx = 0; fileIdx < fileCount && profileCount < MAX_PROFILES; fileIdx++) {
-    File file = SD.open(mappingFiles[fileIdx].c_str(), FILE_READ);
+    File file = SD.open(mappingFileNames[fileIdx], FILE_READ);
     if (!file) {
       continue;  // Skip files that can't be opened
     }
     
-    // Extract profile name from filename (remove .txt extension)
-    String profileName = mappingFiles[fileIdx];
-    int dotPos = profileName.lastIndexOf('.');
-    if (dotPos > 0) {
-      profileName = profileName.substring(0, dotPos);
-    }
-    profileName.trim();
-    
-    // If profile name is empty, use a default
-    if (profileName.length() == 0) {
-      profileName = "mapping";
-    }
-    
     // Create new profile for this file
     int profileIdx = profileCount;
-    profiles[profileIdx].name = profileName;
-    profiles[profileIdx].isValid = true;
+    
+    // Profile name is the filename without the .txt extension (or "mapping" if that is empty)
+    profileNameFromFileName(mappingFileNames[fileIdx], profileNames[profileIdx], PROFILE_NAME_MAX_LEN);
+    
     // Initialize with global config defaults from CONFIG.TXT
-    // These can be overridden by FAST_PRESS_MODE= and PRESS_DURATION= lines in the mapping file
-    profiles[profileIdx].fastPressMode = config.fastPressMode;
-    profiles[profileIdx].pressDurationMs = config.pressDurationMs;
+    // These can be overridden by FAST_PRESS_MODE=, PRESS_DURATION=, MODIFIER_MODE=, HYBRID_RELEASE=,
+    // MIN_HOLD=, FOLD_OUT_OF_RANGE=, SNAP_ACCIDENTALS= and KEY_SIGNATURE= lines in the mapping file
+    initProfileFromConfig(profiles[profileIdx], config);
+    profiles[profileIdx].isValid = true;
     profileCount++;
     
     // If this is the first profile, make it the active one
@@ -542,113 +1819,79 @@ void loadMappings() {
     Serial.print("Loading profile ");
     Serial.print(profileCount);
     Serial.print(": ");
-    Serial.print(profileName);
+    Serial.print(profileNames[profileIdx]);
     Serial.print(" from ");
-    Serial.println(mappingFiles[fileIdx]);
+    Serial.println(mappingFileNames[fileIdx]);
     #endif
     
     // Load mappings from this file (ignore [profile_name] sections - each file is one profile)
     int mappingCount = 0;
+    int chordCount = 0;
+    ChordPattern chord;
     
     while (file.available()) {
-      String line = file.readStringUntil('\n');
-      line.trim();
-      
-      // Skip empty lines
-      if (line.length() == 0) {
-        continue;
-      }
-      
-      // Skip profile section headers (legacy support - they're ignored now)
-      if (line.startsWith("[") && line.endsWith("]")) {
-        continue;
-      }
-      
-      // Skip comments
-      if (line.startsWith("#")) {
-        continue;
-      }
-      
-      // Parse profile-specific settings: FAST_PRESS_MODE=value or PRESS_DURATION=value
-      // OR parse MIDI note mappings: MIDI_NOTE=KEY_NAME
-      int equalsPos = line.indexOf('=');
-      if (equalsPos > 0) {
-        String leftSide = line.substring(0, equalsPos);
-        String rightSide = line.substring(equalsPos + 1);
-        leftSide.trim();
-        rightSide.trim();
-        
-        // Check if it's a setting (not a MIDI note mapping)
-        // Settings have text keywords on the left side, MIDI notes are numbers 0-127
-        String leftUpper = leftSide;
-        leftUpper.toUpperCase();
-        
-        bool isSetting = false;
-        if (leftUpper == "FAST_PRESS_MODE" || leftUpper == "FASTPRESS") {
-          String value = rightSide;
-          value.toUpperCase();
-          profiles[profileIdx].fastPressMode = (value == "1" || value == "TRUE" || value == "ON" || value == "YES");
+      readLine(file, lineBuffer, LOAD_LINE_MAX_LEN);
+      MappingLineType lineType = parseMappingLine(lineBuffer, profiles[profileIdx], profileDeviceMatch[profileIdx], &chord, &keySets);
+      if (lineType == MAPPING_LINE_NOTE) {
+        mappingCount++;
+      } else if (lineType == MAPPING_LINE_CHORD) {
+        if (addChord(chordTable, profileIdx, profiles[profileIdx], chord)) {
+          chordCount++;
+        } else {
           #ifdef ENABLE_DEBUG
-          Serial.print("  Profile fast-press mode: ");
-          Serial.println(profiles[profileIdx].fastPressMode ? "enabled" : "disabled");
+          Serial.println("  WARNING: chord table full - chord ignored");
           #endif
-          isSetting = true;
-        }
-        else if (leftUpper == "PRESS_DURATION" || leftUpper == "DURATION") {
-          int duration = rightSide.toInt();
-          if (duration >= 0 && duration <= 1000) {
-            profiles[profileIdx].pressDurationMs = duration;
-            #ifdef ENABLE_DEBUG
-            Serial.print("  Profile press duration: ");
-            Serial.print(duration);
-            Serial.println("ms");
-            #endif
-          }
-          isSetting = true;
-        }
-        
-        if (isSetting) {
-          continue;  // Skip to next line, this was a setting
-        }
-        
-        // Not a setting, so it must be a MIDI note mapping: MIDI_NOTE=KEY_NAME
-        int note = leftSide.toInt();
-        String keyName = rightSide;
-        
-        // Remove inline comments (everything after #)
-        int commentPos = keyName.indexOf('#');
-        if (commentPos >= 0) {
-          keyName = keyName.substring(0, commentPos);
-        }
-        keyName.trim();
-        
-        // Validate MIDI note range (0-127)
-        if (note >= 0 && note < MAX_MIDI_NOTES) {
-          byte keyCode = 0;
-          byte modifierMask = 0;
-          if (parseKeyMapping(keyName, keyCode, modifierMask)) {
-            profiles[profileIdx].noteToKey[note].keyCode = keyCode;
-            profiles[profileIdx].noteToKey[note].modifierMask = modifierMask;
-            mappingCount++;
-          }
         }
       }
     }
     
     file.close();
     #ifdef ENABLE_DEBUG
+    if (keySets.count == KEY_SET_MAX) {
+      Serial.println("  WARNING: key set pool full - further key sets ignored");
+    }
+    #endif
+    memcpy(profileSourceTables[profileIdx], profiles[profileIdx].noteToKey, sizeof(profiles[profileIdx].noteToKey));
+    buildNoteTable(profiles[profileIdx], profileSourceTables[profileIdx], keySets);
+    #ifdef ENABLE_DEBUG
     Serial.print("  -> Loaded ");
     Serial.print(mappingCount);
-    Serial.println(" mappings");
+    Serial.print(" mappings, ");
+    Serial.print(chordCount);
+    Serial.print(" chords (fast-press ");
+    Serial.print(profiles[profileIdx].fastPressMode ? "on" : "off");
+    Serial.print(", duration ");
+    Serial.print(profiles[profileIdx].pressDurationMs);
+    Serial.print("ms, hybrid release ");
+    Serial.print(profiles[profileIdx].hybridRelease ? "on" : "off");
+    Serial.print(", min hold ");
+    Serial.print(profiles[profileIdx].minHoldMs);
+    Serial.print("ms, modifier mode ");
+    Serial.print(profiles[profileIdx].modifierMode);
+    Serial.print(", fold ");
+    Serial.print(profiles[profileIdx].foldMode);
+    Serial.print(", accidentals ");
+    Serial.print(profiles[profileIdx].accidentalMode);
+    Serial.print(" in key ");
+    Serial.print(profiles[profileIdx].keySignature);
+    if (profileDeviceMatch[profileIdx].vendorId || profileDeviceMatch[profileIdx].productId || profileDeviceMatch[profileIdx].productName[0]) {
+      Serial.print(", device ");
+      Serial.print(profileDeviceMatch[profileIdx].vendorId, HEX);
+      Serial.print(":");
+      Serial.print(profileDeviceMatch[profileIdx].productId, HEX);
+      Serial.print(" ");
+      Serial.print(profileDeviceMatch[profileIdx].productName);
+    }
+    Serial.println(")");
     #endif
   }
   
   // Ensure we have at least one profile
+  bool loaded = profileCount > 0;
   if (profileCount == 0) {
-    profiles[0].name = "default";
+    setProfileName(0, "default");
+    initProfileFromConfig(profiles[0], config);
     profiles[0].isValid = true;
-    profiles[0].fastPressMode = config.fastPressMode;
-    profiles[0].pressDurationMs = config.pressDurationMs;
     profileCount = 1;
     currentProfileIndex = 0;
     #ifdef ENABLE_DEBUG
@@ -663,355 +1906,1462 @@ void loadMappings() {
   Serial.print("Active profile: ");
   Serial.print(currentProfileIndex);
   Serial.print(" (");
-  Serial.print(profiles[currentProfileIndex].name);
+  Serial.print(profileNames[currentProfileIndex]);
   Serial.println(")");
   Serial.print("Profile switch note: ");
   Serial.println(config.profileSwitchNote);
+  Serial.print("Transpose: ");
+  Serial.print(config.transpose);
+  Serial.print(" (notes up/down ");
+  Serial.print(config.transposeUpNote);
+  Serial.print("/");
+  Serial.print(config.transposeDownNote);
+  Serial.print(", octave up/down ");
+  Serial.print(config.octaveUpNote);
+  Serial.print("/");
+  Serial.print(config.octaveDownNote);
+  Serial.print(", CC ");
+  Serial.print(config.transposeController);
+  Serial.print(", auto ");
+  Serial.print(config.autoTranspose ? "on" : "off");
+  Serial.println(")");
+  Serial.print("Chords: ");
+  Serial.print(chordTable.count);
+  Serial.print(" (mode ");
+  Serial.print(config.chordMode == CHORD_CANCEL ? "cancel" : "suppress");
+  Serial.print(", window ");
+  Serial.print(config.chordWindowMs);
+  Serial.println("ms)");
+  Serial.print("Key sets: ");
+  Serial.print(keySets.count);
+  Serial.print(" of ");
+  Serial.println(KEY_SET_MAX);
+  Serial.print("Key change notes up/down: ");
+  Serial.print(config.keyUpNote);
+  Serial.print("/");
+  Serial.println(config.keyDownNote);
   Serial.println();
+  printHeapReport();
   #endif
+  return loaded;
 }
 
-// Parse key name with optional modifiers (e.g., "SHIFT+F", "F+SHIFT", "CTRL+SPACE")
-// Returns true if parsing succeeded
-bool parseKeyMapping(String keyName, byte& keyCode, byte& modifierMask) {
-  keyName.trim();
-  keyName.toUpperCase();
-  modifierMask = 0;
-  
-  // Check for modifier combinations (SHIFT+F, CTRL+SPACE, etc.)
-  int plusPos = keyName.indexOf('+');
-  String baseKey = keyName;
-  String modifierStr = "";
-  
-  if (plusPos > 0) {
-    // Try "MODIFIER+KEY" format
-    modifierStr = keyName.substring(0, plusPos);
-    modifierStr.trim();
-    baseKey = keyName.substring(plusPos + 1);
-    baseKey.trim();
-  } else {
-    // Try "KEY+MODIFIER" format
-    plusPos = keyName.lastIndexOf('+');
-    if (plusPos > 0) {
-      baseKey = keyName.substring(0, plusPos);
-      baseKey.trim();
-      modifierStr = keyName.substring(plusPos + 1);
-      modifierStr.trim();
-    }
-  }
-  
-  // Parse modifiers
-  if (modifierStr.length() > 0) {
-    if (modifierStr == "SHIFT" || modifierStr == "LEFTSHIFT") {
-      modifierMask |= MODIFIERKEY_LEFTSHIFT;
-    } else if (modifierStr == "RSHIFT" || modifierStr == "RIGHTSHIFT") {
-      modifierMask |= MODIFIERKEY_RIGHTSHIFT;
-    } else if (modifierStr == "CTRL" || modifierStr == "CONTROL" || modifierStr == "LEFTCTRL") {
-      modifierMask |= MODIFIERKEY_LEFTCTRL;
-    } else if (modifierStr == "RCTRL" || modifierStr == "RIGHTCTRL") {
-      modifierMask |= MODIFIERKEY_RIGHTCTRL;
-    } else if (modifierStr == "ALT" || modifierStr == "LEFTALT") {
-      modifierMask |= MODIFIERKEY_LEFTALT;
-    } else if (modifierStr == "RALT" || modifierStr == "RIGHTALT") {
-      modifierMask |= MODIFIERKEY_RIGHTALT;
-    } else if (modifierStr == "META" || modifierStr == "WIN" || modifierStr == "CMD" || modifierStr == "LEFTMETA") {
-      modifierMask |= MODIFIERKEY_LEFTMETA;
-    } else if (modifierStr == "RMETA" || modifierStr == "RIGHTMETA") {
-      modifierMask |= MODIFIERKEY_RIGHTMETA;
-    }
-  }
-  
-  // Parse base key
-  baseKey.trim();
-  
-  // Single letter A-Z
-  if (baseKey.length() == 1 && baseKey[0] >= 'A' && baseKey[0] <= 'Z') {
-    keyCode = KEY_A + (baseKey[0] - 'A');
-    return true;
+
+// Handle fast-press mode timing - release keys after duration
+// Timers only exist while a timed or hybrid profile has keys down; returns true if a key was released
+FASTRUN bool handleFastPress() {
+  if (keyEngine.timerCount == 0 || !expireReleaseTimers(keyEngine, millis())) {
+    return false;
   }
-  
-  // Number keys 0-9
-  if (baseKey.length() == 1 && baseKey[0] >= '0' && baseKey[0] <= '9') {
-    if (baseKey[0] == '0') {
-      keyCode = KEY_0;
+  updateKeyboardState();
+  return true;
+}
+
+// Update the keyboard state with all currently pressed keys (through the active engine variant)
+FASTRUN void updateKeyboardState() {
+  activeEngine.emitState();
+}
+
+// Choose the engine variant matching the current profile's release strategy and modifier mode
+// Called once at profile load/switch so the per-note path carries no mode checks
+void selectEngineVariant() {
+  const Profile& profile = profiles[currentProfileIndex];
+  byte release = releaseStrategyFor(profile);
+  byte modifiers = (profile.modifierMode < MODIFIER_MODE_COUNT) ? profile.modifierMode : (byte)MODIFIERS_SPLIT;
+  activeEngine = engineVariants[release][modifiers];
+  setKeyEngineProfile(keyEngine, profile);
+}
+
+// Press a mapped key (mapping has a keyCode or a modifier)
+// Modifier-only keys (LSHIFT, RSHIFT, etc.) are held until NoteOff in every mode
+template <ReleaseStrategy R, ModifierMode M>
+FASTRUN void engineNoteOn(KeyMapping mapping) {
+  keyNoteOn(keyEngine, keySets, mapping, R, millis(), emitKeyboardState<M>);
+}
+
+// Release a mapped key (fast-press variants ignore NoteOff for regular keys, timers release them)
+// Keys another note still holds stay down (reference counted in the key engine)
+template <ReleaseStrategy R, ModifierMode M>
+FASTRUN void engineNoteOff(KeyMapping mapping) {
+  keyNoteOff(keyEngine, keySets, mapping, R, millis(), emitKeyboardState<M>);
+}
+
+// Turn the pressed keys into HID reports
+// Preserves order of key presses; modifier-only keys (LSHIFT, RSHIFT, etc.) are combined
+// with every report without replaying other keys
+// Reports are queued for the HID transmit stage (see serviceHidTransmit), never sent directly
+template <ModifierMode M>
+FASTRUN void emitKeyboardState() {
+  buildKeyReports(keyEngine, M, [](uint8_t modifiers, const uint8_t* keys) {
+    HidReport report;
+    report.modifiers = modifiers;
+    report.reserved = 0;
+    memcpy(report.keys, keys, MAX_SIMULTANEOUS_KEYS);
+    if (M == MODIFIERS_PREROLL) {
+      queuePreRolledReport(report);
     } else {
-      keyCode = KEY_1 + (baseKey[0] - '1');
+      queueHidReport(report);
     }
-    return true;
-  }
+  });
+}
+
+// Queue a report, first reporting a changed modifier byte on its own
+// The pre-roll report keeps only the keys already down, so the host sees the new
+// modifier before any key that depends on it
+FASTRUN void queuePreRolledReport(const HidReport& report) {
+  const HidReport& previous = (hidQueueCount > 0)
+    ? hidQueue[(hidQueueHead + hidQueueCount - 1) % HID_REPORT_QUEUE_SIZE]
+    : lastSentReport;
   
-  // Named keys
-  if (baseKey == "SPACE" || baseKey == "SPC") {
-    keyCode = KEY_SPACE;
-    return true;
-  }
-  if (baseKey == "ENTER" || baseKey == "RETURN") {
-    keyCode = KEY_ENTER;
-    return true;
+  if (report.modifiers != previous.modifiers) {
+    HidReport preRoll;
+    clearHidReport(preRoll);
+    preRoll.modifiers = report.modifiers;
+    int keyIdx = 0;
+    for (int i = 0; i < MAX_SIMULTANEOUS_KEYS && report.keys[i] > 0; i++) {
+      for (int j = 0; j < MAX_SIMULTANEOUS_KEYS; j++) {
+        if (previous.keys[j] == report.keys[i]) {
+          preRoll.keys[keyIdx++] = report.keys[i];
+          break;
+        }
+      }
+    }
+    queueHidReport(preRoll);
   }
-  if (baseKey == "TAB") {
-    keyCode = KEY_TAB;
-    return true;
-  }
-  if (baseKey == "ESC" || baseKey == "ESCAPE") {
-    keyCode = KEY_ESC;
-    return true;
-  }
-  if (baseKey == "BACKSPACE" || baseKey == "BS") {
-    keyCode = KEY_BACKSPACE;
-    return true;
+  
+  queueHidReport(report);
+}
+
+// Reset a report to "nothing pressed"
+FASTRUN void clearHidReport(HidReport& report) {
+  memset(&report, 0, sizeof(HidReport));
+}
+
+FASTRUN bool hidReportsEqual(const HidReport& a, const HidReport& b) {
+  return memcmp(&a, &b, sizeof(HidReport)) == 0;
+}
+
+// Has the host polled out the report the next transmit slot carried?
+FASTRUN bool hidTxSlotFree() {
+  return !(usb_transfer_status(&hidTransfers[hidTxHead]) & 0x80);  // 0x80 = still active
+}
+
+// Hand a packed report to the keyboard endpoint through the next transmit slot: one 8-byte
+// copy and one transfer, no core globals in between and no wait (callers check
+// hidTxSlotFree() first) - the same calls the core's usb_keyboard_send() makes
+FASTRUN void submitKeyboardReport(const HidReport& report) {
+  HidTxBuffer& buffer = hidTxBuffers[hidTxHead];
+  transfer_t& transfer = hidTransfers[hidTxHead];
+  buffer.report = report;
+  usb_prepare_transfer(&transfer, &buffer.report, sizeof(HidReport), 0);
+  arm_dcache_flush_delete(&buffer, sizeof(buffer));
+  usb_transmit(KEYBOARD_ENDPOINT, &transfer);
+  hidTxHead = (hidTxHead + 1) % HID_TX_SLOTS;
+}
+
+// Append a report to the HID transmit queue
+// Reports identical to the previous state are skipped (nothing would change on the PC)
+// When the queue is full the host has fallen behind, and HID_QUEUE_POLICY decides what is lost
+FASTRUN void queueHidReport(const HidReport& report) {
+  const HidReport& previous = (hidQueueCount > 0)
+    ? hidQueue[(hidQueueHead + hidQueueCount - 1) % HID_REPORT_QUEUE_SIZE]
+    : lastSentReport;
+  if (hidReportsEqual(report, previous)) {
+    return;
   }
   
-  // Modifier keys as standalone keys (must be sent as modifiers, not key codes)
-  // USB HID keyboard protocol: modifiers are sent via modifier byte, not as key codes
-  if (baseKey == "LSHIFT" || baseKey == "LEFTSHIFT") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_LEFTSHIFT;
-    return true;
+  hidStats.queued++;
+  
+  if (hidQueueCount == HID_REPORT_QUEUE_SIZE) {
+    #if HID_QUEUE_POLICY == HID_QUEUE_DROP_INTERMEDIATE
+    // Drop every intermediate state still waiting, keep only the latest one
+    hidStats.dropped += hidQueueCount;
+    hidQueueHead = 0;
+    hidQueueCount = 0;
+    #else
+    // Collapse: overwrite the newest queued report so the final state is still delivered
+    hidQueue[(hidQueueHead + hidQueueCount - 1) % HID_REPORT_QUEUE_SIZE] = report;
+    hidStats.collapsed++;
+    return;
+    #endif
   }
-  if (baseKey == "RSHIFT" || baseKey == "RIGHTSHIFT") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_RIGHTSHIFT;
-    return true;
+  
+  hidQueue[(hidQueueHead + hidQueueCount) % HID_REPORT_QUEUE_SIZE] = report;
+  hidQueueCount++;
+  if (hidQueueCount > hidStats.maxDepth) {
+    hidStats.maxDepth = hidQueueCount;
   }
-  if (baseKey == "LCTRL" || baseKey == "LEFTCTRL") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_LEFTCTRL;
-    return true;
+}
+
+// HID transmit stage - called every loop() pass, never waits on the USB endpoint
+// The stage owns HID_TX_SLOTS transfers on the keyboard endpoint and a report is only
+// submitted through a slot whose previous report the host has polled out, otherwise it
+// stays queued - so pacing follows the transfers' real completion, at whatever rate the
+// host polls (bInterval, hubs in between)
+FASTRUN bool serviceHidTransmit() {
+  // Host not configured - keep (and collapse) reports until it comes back; transfers still
+  // marked active went away with the configuration
+  if (!usb_configuration) {
+    memset(hidTransfers, 0, sizeof(hidTransfers));
+    if (hidQueueCount > 0) {
+      hidStats.deferred++;
+    }
+    return false;
   }
-  if (baseKey == "RCTRL" || baseKey == "RIGHTCTRL") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_RIGHTCTRL;
-    return true;
+  if (hidQueueCount == 0) {
+    return false;
   }
-  if (baseKey == "LALT" || baseKey == "LEFTALT") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_LEFTALT;
-    return true;
+  
+  bool sent = false;
+  while (hidQueueCount > 0) {
+    if (!hidTxSlotFree()) {
+      // Endpoint busy - try again on the next pass instead of blocking loop()
+      hidStats.deferred++;
+      return sent;
+    }
+    
+    const HidReport& report = hidQueue[hidQueueHead];
+    submitKeyboardReport(report);
+    lastSentReport = report;
+    hidQueueHead = (hidQueueHead + 1) % HID_REPORT_QUEUE_SIZE;
+    hidQueueCount--;
+    hidStats.sent++;
+    sent = true;
+    #ifdef ENABLE_LOAD_GENERATOR
+    if (loadProbeCount > 0) {
+      loadReportSent();
+    }
+    #endif
   }
-  if (baseKey == "RALT" || baseKey == "RIGHTALT") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_RIGHTALT;
-    return true;
+  return sent;
+}
+
+#ifdef ENABLE_DIN_MIDI
+// Start Serial1 at MIDI speed and take over its receive interrupt
+// HardwareSerial sets up the pins, baud rate and NVIC; only the ISR is replaced, so each
+// byte is timestamped the moment it arrives instead of when loop() gets to it
+FLASHMEM void beginDinMidi() {
+  Serial1.begin(DIN_MIDI_BAUD);
+  // Interrupt on every received byte rather than at the FIFO watermark / idle line
+  LPUART6_WATER &= ~LPUART_WATER_RXWATER(3);
+  attachInterruptVector(IRQ_LPUART6, dinMidiIsr);
+}
+
+FASTRUN void dinMidiIsr() {
+  uint32_t now = micros();
+  // Drain the receive FIFO (RXCOUNT is WATER bits 24-26)
+  while ((LPUART6_WATER >> 24) & 0x07) {
+    byte data = LPUART6_DATA;
+    uint16_t head = dinRxHead;
+    uint16_t next = (head + 1) & (DIN_MIDI_RX_QUEUE_SIZE - 1);
+    if (next == dinRxTail) {
+      dinRxOverflows++;
+      continue;
+    }
+    dinRxQueue[head].arrivalMicros = now;
+    dinRxQueue[head].data = data;
+    dinRxHead = next;
   }
-  if (baseKey == "LMETA" || baseKey == "LEFTMETA" || baseKey == "LWIN" || baseKey == "LCMD") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_LEFTMETA;
-    return true;
+  // Clear idle line and overrun flags (write 1 to clear)
+  LPUART6_STAT |= LPUART_STAT_IDLE | LPUART_STAT_OR;
+}
+
+// Parse queued DIN bytes and hand complete messages to ingestMidiMessage()
+// At 31250 baud at most ~3 bytes arrive per millisecond, so the queue is always drained
+FASTRUN bool serviceDinMidi() {
+  uint16_t head = dinRxHead;
+  uint16_t tail = dinRxTail;
+  if (head == tail) {
+    return false;
   }
-  if (baseKey == "RMETA" || baseKey == "RIGHTMETA" || baseKey == "RWIN" || baseKey == "RCMD") {
-    keyCode = 0;  // No regular key, just the modifier
-    modifierMask = MODIFIERKEY_RIGHTMETA;
-    return true;
+  
+  uint16_t depth = (head - tail) & (DIN_MIDI_RX_QUEUE_SIZE - 1);
+  if (depth > dinMidiPort.queueHighWater) {
+    dinMidiPort.queueHighWater = depth;
   }
+  dinMidiPort.overflows = dinRxOverflows;
   
-  // Punctuation and special characters
-  if (baseKey == "COMMA" || baseKey == ",") {
-    keyCode = KEY_COMMA;
-    return true;
+  MidiStreamMessage message;
+  while (tail != head && ingestHasRoom()) {
+    const DinMidiByte& rx = dinRxQueue[tail];
+    bool complete = dinParser.parse(rx.data, message);
+    uint32_t arrivalMicros = rx.arrivalMicros;
+    tail = (tail + 1) & (DIN_MIDI_RX_QUEUE_SIZE - 1);
+    if (!complete) {
+      continue;
+    }
+    
+    unsigned long latency = micros() - arrivalMicros;
+    dinLatencyTotalMicros += latency;
+    if (latency > dinLatencyMaxMicros) {
+      dinLatencyMaxMicros = latency;
+    }
+    
+    // Channel messages carry the channel in the low nibble, system messages do not
+    byte type = (message.status < 0xF0) ? (message.status & 0xF0) : message.status;
+    dinMidiPort.messages++;
+    ingestMidiMessage(MIDI_SOURCE_DIN, type, message.data1, message.data2);
   }
-  if (baseKey == "DOT" || baseKey == "PERIOD" || baseKey == ".") {
-    keyCode = KEY_DOT;
-    return true;
+  dinRxTail = tail;
+  return true;
+}
+#endif
+
+#ifdef ENABLE_MIDI_PASSTHROUGH
+// Queue the packets a read() consumed from the driver's receive queue: everything after
+// fromTail up to the current tail
+FASTRUN void queuePassthroughPackets(const MIDIDeviceBase& midi, uint16_t fromTail) {
+  uint16_t toTail = MidiQueueProbe::tail(midi);
+  for (uint16_t index = fromTail; index != toTail; ) {
+    index = MidiQueueProbe::next(midi, index);
+    if (passthroughCount >= MIDI_PASSTHROUGH_QUEUE_SIZE) {
+      passthroughStats.dropped++;
+      continue;
+    }
+    passthroughQueue[(passthroughHead + passthroughCount) % MIDI_PASSTHROUGH_QUEUE_SIZE] = MidiQueueProbe::packet(midi, index);
+    passthroughCount++;
+    passthroughStats.queued++;
+    if (passthroughCount > passthroughStats.maxDepth) {
+      passthroughStats.maxDepth = passthroughCount;
+    }
   }
-  if (baseKey == "SLASH" || baseKey == "/" || baseKey == "?") {
-    // Note: "?" is typically SHIFT+/, but we'll map it to / for standalone use
-    // If you need actual ?, use SHIFT+SLASH or SHIFT+/
-    keyCode = KEY_SLASH;
-    return true;
+}
+
+// Can the USB MIDI endpoint take a burst without waiting? usb_midi_write_packed() blocks
+// (up to its timeout) once every transmit buffer is in flight, so packets only go out while
+// nothing is primed on the endpoint: then every buffer is free and a burst cannot block
+FASTRUN bool passthroughEndpointIdle() {
+  uint32_t bit = 1UL << (MIDI_TX_ENDPOINT + 16);  // Transmit endpoints are the upper 16 bits
+  return !((USB1_ENDPTPRIME | USB1_ENDPTSTATUS) & bit);
+}
+
+// MIDI passthrough stage - sends up to MIDI_PASSTHROUGH_BURST packets per slice
+// Runs as a housekeeping task, so forwarding never delays a keyboard report; while the PC
+// has not taken the previous burst, packets stay queued (and only a full queue drops them)
+FASTRUN bool servicePassthrough() {
+  if (passthroughCount == 0 || !usb_configuration) {
+    return false;
   }
-  if (baseKey == "MINUS" || baseKey == "-" || baseKey == "DASH") {
-    keyCode = KEY_MINUS;
-    return true;
+  if (!passthroughEndpointIdle()) {
+    passthroughStats.busy++;
+    return false;
   }
-  if (baseKey == "EQUAL" || baseKey == "EQUALS" || baseKey == "=") {
-    keyCode = KEY_EQUAL;
-    return true;
+  
+  for (int n = 0; n < MIDI_PASSTHROUGH_BURST && passthroughCount > 0; n++) {
+    usb_midi_write_packed(passthroughQueue[passthroughHead]);
+    passthroughHead = (passthroughHead + 1) % MIDI_PASSTHROUGH_QUEUE_SIZE;
+    passthroughCount--;
+    passthroughStats.forwarded++;
   }
-  if (baseKey == "LEFTBRACE" || baseKey == "LBRACE" || baseKey == "[") {
-    keyCode = KEY_LEFTBRACE;
-    return true;
+  usb_midi_flush_output();
+  return true;
+}
+#endif
+
+#ifdef ENABLE_LOAD_GENERATOR
+// Load generator task: inject every group that has come due, as one more MIDI source
+// A run that cannot keep up (ingest queue full) falls behind like a USB device whose
+// receive queue fills; once it owes more than LOAD_GENERATOR_BACKLOG events, due groups are
+// dropped and counted, as the device would have lost them
+FASTRUN bool serviceLoadGenerator() {
+  if (loadRun.state == LOAD_IDLE) {
+    return false;
   }
-  if (baseKey == "RIGHTBRACE" || baseKey == "RBRACE" || baseKey == "]") {
-    keyCode = KEY_RIGHTBRACE;
+  
+  if (loadRun.state == LOAD_DRAINING) {
+    bool drained = ingestQueue.empty() && normalizedQueue.empty() && routedQueue.empty() && mappedQueue.empty()
+                   && hidQueueCount == 0 && keyEngine.timerCount == 0;
+    if (!drained && millis() - loadRun.drainStartMillis < LOAD_GENERATOR_DRAIN_TIMEOUT_MS) {
+      return false;
+    }
+    printLoadReport();
+    loadRun.state = LOAD_IDLE;
+    if (loadRun.sweep && loadRun.pattern + 1 < LOAD_PATTERN_COUNT) {
+      startLoadRun(loadRun.pattern + 1, loadRun.rate, loadRun.durationMs / 1000, true);
+    }
     return true;
   }
-  if (baseKey == "BACKSLASH" || baseKey == "BSLASH" || baseKey == "\\") {
-    keyCode = KEY_BACKSLASH;
+  
+  if (millis() - loadRun.startMillis >= loadRun.durationMs) {
+    stopLoadRun();
     return true;
   }
   
-  return false; // Invalid
+  uint32_t now = ARM_DWT_CYCCNT;
+  byte events = 0;
+  while ((int32_t)(now - loadRun.nextDue) >= 0 && events < LOAD_GENERATOR_SLICE_EVENTS) {
+    if (loadRun.groupCount == 0) {
+      loadRun.groupCount = buildLoadGroup(loadRun.group);
+      loadRun.generated += loadRun.groupCount;
+    }
+    byte count = loadRun.groupCount;
+    
+    uint32_t backlog = (now - loadRun.nextDue) / loadRun.cyclesPerEvent + count;
+    if (backlog > loadRun.maxBacklog) {
+      loadRun.maxBacklog = backlog;
+    }
+    
+    if (ingestQueue.depth() + count <= ingestQueue.capacity() - PIPELINE_CONTROL_RESERVE) {
+      for (byte i = 0; i < count; i++) {
+        loadRun.group[i].timestamp = loadRun.nextDue;
+        ingestQueue.push(loadRun.group[i]);
+      }
+      loadRun.injected += count;
+    } else if (backlog <= LOAD_GENERATOR_BACKLOG) {
+      break;  // Still fits in what a device would buffer - try again next pass
+    } else {
+      loadRun.dropped += count;
+    }
+    loadRun.nextDue += count * loadRun.cyclesPerEvent;
+    loadRun.groupCount = 0;
+    events += count;
+  }
+  return events > 0;
 }
 
-// Handle fast-press mode timing - release keys after duration
-void handleFastPress() {
-  unsigned long now = millis();
-  for (int i = fastPressKeyCount - 1; i >= 0; i--) {
-    if (now >= fastPressTimers[i].releaseTime) {
-      // Time to release this specific key
-      removePressedKey(fastPressTimers[i].keyCode, fastPressTimers[i].modifierMask);
-      updateKeyboardState();
-      
-      // Remove timer
-      for (int j = i; j < fastPressKeyCount - 1; j++) {
-        fastPressTimers[j] = fastPressTimers[j + 1];
+FASTRUN void setLoadEvent(MidiEvent& event, byte type, byte data1, byte data2) {
+  event.source = MIDI_SOURCE_LOAD;
+  event.type = type;
+  event.data1 = data1;
+  event.data2 = data2;
+}
+
+// Note index of a chord: plain chords walk up the mapped notes by a third of a chord per
+// chord; modifier chords alternate plain and modified keys
+FASTRUN byte loadChordNote(uint32_t chord, byte index) {
+  if (loadRun.pattern == LOAD_MODIFIER_CHORDS && loadPlainCount > 0 && loadModifiedCount > 0) {
+    uint32_t position = chord + index / 2;
+    return (index & 1) ? loadModifiedNotes[position % loadModifiedCount] : loadPlainNotes[position % loadPlainCount];
+  }
+  uint32_t base = chord * (loadRun.chordSize / 3 + 1);
+  return loadNotes[(base + index) % loadNoteCount];
+}
+
+// Next group of events of the running pattern - returns how many were written
+FASTRUN byte buildLoadGroup(MidiEvent* group) {
+  uint32_t step = loadRun.step++;
+  byte count = 0;
+  
+  switch (loadRun.pattern) {
+    case LOAD_GLISSANDO: {
+      // Legato: press the next note, then release the previous one
+      uint32_t span = (loadNoteCount > 1) ? 2 * (loadNoteCount - 1) : 1;
+      uint32_t position = step % span;
+      byte note = loadNotes[(position < loadNoteCount) ? position : span - position];
+      setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_ON, note, 100);
+      if (step > 0) {
+        setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_OFF, loadRun.lastNote, 64);
+      }
+      loadRun.lastNote = note;
+      break;
+    }
+    
+    case LOAD_CHORDS:
+    case LOAD_MODIFIER_CHORDS: {
+      // Even steps press a chord, odd steps release the same chord
+      bool press = (step & 1) == 0;
+      for (byte i = 0; i < loadRun.chordSize; i++) {
+        byte note = loadChordNote(step >> 1, i);
+        setLoadEvent(group[count++], press ? PIPELINE_MIDI_NOTE_ON : PIPELINE_MIDI_NOTE_OFF, note, press ? 100 : 64);
+      }
+      break;
+    }
+    
+    case LOAD_TRILL: {
+      byte lower = loadNotes[loadNoteCount / 2];
+      byte upper = loadNotes[(loadNoteCount / 2 + 1) % loadNoteCount];
+      byte note = (step & 1) ? upper : lower;
+      setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_ON, note, 100);
+      if (step > 0) {
+        setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_OFF, loadRun.lastNote, 64);
+      }
+      loadRun.lastNote = note;
+      break;
+    }
+    
+    default: {
+      // Storm: xorshift32, so every run plays the same sequence
+      uint32_t r = loadRun.random;
+      r ^= r << 13;
+      r ^= r >> 17;
+      r ^= r << 5;
+      loadRun.random = r;
+      byte note = loadNotes[(r >> 8) % loadNoteCount];
+      byte velocity = 1 + (r >> 16) % 127;
+      byte kind = r % 100;
+      if (kind < 45) {
+        setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_ON, note, velocity);
+      } else if (kind < 70) {
+        setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_OFF, note, velocity);
+      } else if (kind < 85) {
+        setLoadEvent(group[count++], PIPELINE_MIDI_NOTE_ON, note, 0);
+      } else if (kind < 95) {
+        setLoadEvent(group[count++], 0xB0, 1, velocity);  // Modulation wheel
+      } else {
+        setLoadEvent(group[count++], 0xF8, 0, 0);  // Clock
       }
-      fastPressKeyCount--;
+      break;
     }
   }
+  return count;
 }
 
-// Add a key to the pressed keys list (polyphony support)
-// Prevents duplicate entries (same keyCode + modifierMask combo)
-void addPressedKey(byte keyCode, byte modifierMask) {
-  // Check if key+modifier combo is already pressed
-  for (int i = 0; i < pressedKeyCount; i++) {
-    if (pressedKeys[i].keyCode == keyCode && pressedKeys[i].modifierMask == modifierMask) {
-      return;  // Already pressed, skip duplicate
+// Start a run on the current profile's mapped notes
+FLASHMEM bool startLoadRun(byte pattern, uint32_t rate, uint32_t seconds, bool sweep) {
+  if (loadRun.state != LOAD_IDLE) {
+    Serial.println("Load: a run is already in progress (\"load stop\" ends it)");
+    return false;
+  }
+  if (rate < LOAD_GENERATOR_MIN_RATE || rate > LOAD_GENERATOR_MAX_RATE || seconds == 0 || seconds > LOAD_GENERATOR_MAX_SECONDS) {
+    Serial.print("Load: rate must be ");
+    Serial.print(LOAD_GENERATOR_MIN_RATE);
+    Serial.print("-");
+    Serial.print(LOAD_GENERATOR_MAX_RATE);
+    Serial.print(" events/s and duration 1-");
+    Serial.print(LOAD_GENERATOR_MAX_SECONDS);
+    Serial.println("s");
+    return false;
+  }
+  
+  const Profile& profile = profiles[currentProfileIndex];
+  loadNoteCount = 0;
+  loadPlainCount = 0;
+  loadModifiedCount = 0;
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    KeyMapping mapping = profile.noteToKey[note];
+    if (note == config.profileSwitchNote || (mapping.keyCode == 0 && mapping.modifierMask == 0)) {
+      continue;
     }
+    loadNotes[loadNoteCount++] = note;
+    if (isKeySet(mapping)) {
+      continue;
+    }
+    if (mapping.keyCode > 0 && mapping.modifierMask == 0) {
+      loadPlainNotes[loadPlainCount++] = note;
+    } else if (mapping.keyCode > 0) {
+      loadModifiedNotes[loadModifiedCount++] = note;
+    }
+  }
+  if (loadNoteCount == 0) {
+    Serial.println("Load: the current profile has no mapped notes");
+    return false;
   }
   
-  // Add if we have room (USB HID keyboard supports max 6 keys)
-  if (pressedKeyCount < MAX_SIMULTANEOUS_KEYS) {
-    pressedKeys[pressedKeyCount].keyCode = keyCode;
-    pressedKeys[pressedKeyCount].modifierMask = modifierMask;
-    pressedKeyCount++;
+  memset(&loadRun, 0, sizeof(loadRun));
+  loadRun.pattern = pattern;
+  loadRun.sweep = sweep;
+  loadRun.rate = rate;
+  loadRun.cyclesPerEvent = F_CPU_ACTUAL / rate;
+  loadRun.durationMs = seconds * 1000;
+  loadRun.random = 0x2545F491;
+  if (pattern == LOAD_MODIFIER_CHORDS) {
+    loadRun.chordSize = LOAD_GENERATOR_MODIFIER_CHORD_SIZE;
+    if (loadPlainCount == 0 || loadModifiedCount == 0) {
+      Serial.println("Load: profile has no mix of plain and modified keys - modchords plays plain chords");
+    }
+  } else {
+    loadRun.chordSize = LOAD_GENERATOR_CHORD_SIZE;
   }
+  if (loadRun.chordSize > loadNoteCount) {
+    loadRun.chordSize = loadNoteCount;
+  }
+  loadRun.hidSentStart = hidStats.sent;
+  loadRun.hidCollapsedStart = hidStats.collapsed;
+  loadRun.hidDroppedStart = hidStats.dropped;
+  loadRun.refusedStart = ingestQueue.refused() + normalizedQueue.refused() + routedQueue.refused() + mappedQueue.refused();
+  loadProbeHead = 0;
+  loadProbeCount = 0;
+  memset(loadLatencyHistogram, 0, sizeof(loadLatencyHistogram));
+  memset(loadGeneratorPort.heldNotes, 0, sizeof(loadGeneratorPort.heldNotes));
+  
+  Serial.print("Load: ");
+  Serial.print(loadPatternNames[pattern]);
+  Serial.print(" at ");
+  Serial.print(rate);
+  Serial.print(" events/s for ");
+  Serial.print(seconds);
+  Serial.print("s on profile ");
+  Serial.print(profileNames[currentProfileIndex]);
+  Serial.print(" (");
+  Serial.print(loadNoteCount);
+  Serial.println(" mapped notes)");
+  
+  loadRun.startMillis = millis();
+  loadRun.nextDue = ARM_DWT_CYCCNT;
+  loadRun.state = LOAD_RUNNING;
+  return true;
 }
 
-// Remove a key from the pressed keys list
-void removePressedKey(byte keyCode, byte modifierMask) {
-  for (int i = 0; i < pressedKeyCount; i++) {
-    if (pressedKeys[i].keyCode == keyCode && pressedKeys[i].modifierMask == modifierMask) {
-      // Shift remaining keys down
-      for (int j = i; j < pressedKeyCount - 1; j++) {
-        pressedKeys[j] = pressedKeys[j + 1];
-      }
-      pressedKeyCount--;
-      return;
+// End the pattern: release what it holds behind its last notes, then wait for the reports
+FLASHMEM void stopLoadRun() {
+  if (loadRun.state != LOAD_RUNNING) {
+    return;
+  }
+  loadRun.durationMs = millis() - loadRun.startMillis;
+  ingestMidiMessage(MIDI_SOURCE_LOAD, PIPELINE_CONTROL_RELEASE_SOURCE, 0, 0);
+  loadRun.drainStartMillis = millis();
+  loadRun.state = LOAD_DRAINING;
+}
+
+// A synthetic press changed the keyboard state: time it until its report is handed to USB
+// The report is the one queued behind the queue's contents before the press (the newest
+// slot if the queue was full and the report was collapsed into it)
+FASTRUN void trackLoadPress(uint32_t timestamp, byte queueDepthBefore) {
+  if (loadProbeCount == LOAD_GENERATOR_PROBES) {
+    return;  // Enough presses in flight - this one is not sampled
+  }
+  byte position = (queueDepthBefore < HID_REPORT_QUEUE_SIZE) ? queueDepthBefore + 1 : HID_REPORT_QUEUE_SIZE;
+  LoadProbe& probe = loadProbes[(loadProbeHead + loadProbeCount) % LOAD_GENERATOR_PROBES];
+  probe.timestamp = timestamp;
+  probe.report = hidStats.sent + position;
+  loadProbeCount++;
+}
+
+// Called for every report handed to USB while presses are being timed
+FASTRUN void loadReportSent() {
+  uint32_t now = ARM_DWT_CYCCNT;
+  while (loadProbeCount > 0 && (int32_t)(hidStats.sent - loadProbes[loadProbeHead].report) >= 0) {
+    uint32_t latency = now - loadProbes[loadProbeHead].timestamp;
+    uint32_t bucket = latency / (F_CPU_ACTUAL / 1000000) / LOAD_LATENCY_BUCKET_US;
+    loadLatencyHistogram[(bucket < LOAD_LATENCY_BUCKETS) ? bucket : LOAD_LATENCY_BUCKETS]++;
+    loadRun.latencySamples++;
+    if (latency > loadRun.maxLatencyCycles) {
+      loadRun.maxLatencyCycles = latency;
     }
+    loadProbeHead = (loadProbeHead + 1) % LOAD_GENERATOR_PROBES;
+    loadProbeCount--;
   }
 }
 
-// Update the keyboard state with all currently pressed keys
-// Preserves order of key presses, batches consecutive keys with same modifier for speed
-// Optimized for fast execution: single send for all-same-modifier chords, batched sends for mixed modifiers
-// Combines modifier-only keys (LSHIFT, RSHIFT, etc.) with regular keys without replaying
-void updateKeyboardState() {
-  // Combine modifier-only keys with regular key modifiers
-  // activeModifierKeys contains modifiers from standalone modifier keys (LSHIFT, RSHIFT, etc.)
+// "load PATTERN [RATE] [SECONDS]", "load all [RATE] [SECONDS]" or "load stop"
+FLASHMEM void handleLoadCommand(char* args) {
+  char* patternName = strtok(args, " ");
+  char* rateArg = strtok(nullptr, " ");
+  char* secondsArg = strtok(nullptr, " ");
+  uint32_t rate = rateArg ? strtoul(rateArg, nullptr, 10) : LOAD_GENERATOR_DEFAULT_RATE;
+  uint32_t seconds = secondsArg ? strtoul(secondsArg, nullptr, 10) : LOAD_GENERATOR_DEFAULT_SECONDS;
   
-  if (pressedKeyCount == 0 && activeModifierKeys == 0) {
-    // No keys pressed and no modifier-only keys - clear everything
-    Keyboard.set_key1(0);
-    Keyboard.set_key2(0);
-    Keyboard.set_key3(0);
-    Keyboard.set_key4(0);
-    Keyboard.set_key5(0);
-    Keyboard.set_key6(0);
-    Keyboard.set_modifier(0);
-    Keyboard.send_now();
+  if (patternName && strcmp(patternName, "stop") == 0) {
+    loadRun.sweep = false;
+    stopLoadRun();
+    return;
+  }
+  if (patternName && strcmp(patternName, "all") == 0) {
+    startLoadRun(0, rate, seconds, true);
     return;
   }
+  for (byte pattern = 0; patternName && pattern < LOAD_PATTERN_COUNT; pattern++) {
+    if (strcmp(patternName, loadPatternNames[pattern]) == 0) {
+      startLoadRun(pattern, rate, seconds, false);
+      return;
+    }
+  }
+  Serial.print("Usage: load PATTERN [RATE] [SECONDS] | load all [RATE] [SECONDS] | load stop - patterns:");
+  for (byte pattern = 0; pattern < LOAD_PATTERN_COUNT; pattern++) {
+    Serial.print(" ");
+    Serial.print(loadPatternNames[pattern]);
+  }
+  Serial.println();
+}
+
+// Latency below which the given share of samples fall (bucket upper bound, in us)
+FLASHMEM uint32_t loadLatencyPercentile(uint32_t partsPer10000) {
+  uint32_t target = ((uint64_t)loadRun.latencySamples * partsPer10000 + 9999) / 10000;
+  uint32_t total = 0;
+  for (int bucket = 0; bucket <= LOAD_LATENCY_BUCKETS; bucket++) {
+    total += loadLatencyHistogram[bucket];
+    if (total >= target) {
+      return (bucket + 1) * LOAD_LATENCY_BUCKET_US;
+    }
+  }
+  return (LOAD_LATENCY_BUCKETS + 1) * LOAD_LATENCY_BUCKET_US;
+}
+
+FLASHMEM void printLoadReport() {
+  float seconds = loadRun.durationMs / 1000.0f;
+  unsigned long reports = hidStats.sent - loadRun.hidSentStart;
+  uint32_t refused = ingestQueue.refused() + normalizedQueue.refused() + routedQueue.refused() + mappedQueue.refused()
+                     - loadRun.refusedStart;
   
-  if (pressedKeyCount == 0) {
-    // Only modifier-only keys active (no regular keys)
-    Keyboard.set_key1(0);
-    Keyboard.set_key2(0);
-    Keyboard.set_key3(0);
-    Keyboard.set_key4(0);
-    Keyboard.set_key5(0);
-    Keyboard.set_key6(0);
-    Keyboard.set_modifier(activeModifierKeys);
-    Keyboard.send_now();
+  Serial.print("=== Load: ");
+  Serial.print(loadPatternNames[loadRun.pattern]);
+  Serial.print(" at ");
+  Serial.print(loadRun.rate);
+  Serial.print(" events/s, ");
+  Serial.print(seconds);
+  Serial.println("s ===");
+  Serial.print("Events: due ");
+  Serial.print(loadRun.generated);
+  Serial.print(", injected ");
+  Serial.print(loadRun.injected);
+  Serial.print(", dropped ");
+  Serial.print(loadRun.dropped);
+  Serial.print(" (backlog over ");
+  Serial.print(LOAD_GENERATOR_BACKLOG);
+  Serial.print("), max backlog ");
+  Serial.print(loadRun.maxBacklog);
+  Serial.print(", pipeline refused ");
+  Serial.println(refused);
+  Serial.print("Sustained throughput: ");
+  Serial.print(seconds > 0 ? loadRun.injected / seconds : 0.0f);
+  Serial.print(" events/s (");
+  Serial.print(loadRun.generated ? 100.0f * loadRun.injected / loadRun.generated : 0.0f);
+  Serial.println("% of due)");
+  Serial.print("HID reports: sent ");
+  Serial.print(reports);
+  Serial.print(" (");
+  Serial.print(seconds > 0 ? reports / seconds : 0.0f);
+  Serial.print("/s), collapsed ");
+  Serial.print(hidStats.collapsed - loadRun.hidCollapsedStart);
+  Serial.print(", dropped ");
+  Serial.println(hidStats.dropped - loadRun.hidDroppedStart);
+  Serial.print("Latency, note due -> report handed to USB (");
+  Serial.print(loadRun.latencySamples);
+  Serial.print(" presses): ");
+  if (loadRun.latencySamples == 0) {
+    Serial.println("no samples");
     return;
   }
+  Serial.print("p50 ");
+  Serial.print(loadLatencyPercentile(5000));
+  Serial.print("us, p90 ");
+  Serial.print(loadLatencyPercentile(9000));
+  Serial.print("us, p99 ");
+  Serial.print(loadLatencyPercentile(9900));
+  Serial.print("us, p99.9 ");
+  Serial.print(loadLatencyPercentile(9990));
+  Serial.print("us, max ");
+  Serial.print(loadRun.maxLatencyCycles / (F_CPU_ACTUAL / 1000000));
+  Serial.println("us");
+}
+#endif
+
+#ifdef ENABLE_DEBUG
+// Serial console - line-based commands typed into the serial monitor
+// Commands: "stats" prints runtime statistics, "mem" prints the memory report,
+// "heap" prints heap usage, "bench" re-runs the benchmarks (ENABLE_BENCHMARKS builds),
+// "load PATTERN [RATE] [SECONDS]" runs the load generator (ENABLE_LOAD_GENERATOR builds)
+bool serviceSerialConsole() {
+  bool busy = false;
+  static char commandLine[SERIAL_COMMAND_MAX_LEN + 1];
+  static byte commandLength = 0;
   
-  // Check if all keys have the same modifier state
-  bool allSameModifier = true;
-  byte firstModifier = pressedKeys[0].modifierMask;
-  for (int i = 1; i < pressedKeyCount; i++) {
-    if (pressedKeys[i].modifierMask != firstModifier) {
-      allSameModifier = false;
-      break;
+  while (Serial.available()) {
+    busy = true;
+    char c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      if (commandLength == 0) {
+        continue;
+      }
+      commandLine[commandLength] = '\0';
+      commandLength = 0;
+      
+      if (strcmp(commandLine, "stats") == 0) {
+        printRuntimeStats();
+      }
+      else if (strcmp(commandLine, "mem") == 0) {
+        printMemoryReport();
+      }
+      else if (strcmp(commandLine, "heap") == 0) {
+        printHeapReport();
+      }
+      #ifdef ENABLE_BENCHMARKS
+      else if (strcmp(commandLine, "bench") == 0) {
+        runBenchmarks();
+      }
+      #endif
+      #ifdef ENABLE_LOAD_GENERATOR
+      else if (strncmp(commandLine, "load", 4) == 0 && (commandLine[4] == ' ' || commandLine[4] == '\0')) {
+        handleLoadCommand(commandLine + 4);
+      }
+      #endif
+      else {
+        Serial.print("Unknown command: ");
+        Serial.println(commandLine);
+      }
+    } else if (commandLength < SERIAL_COMMAND_MAX_LEN) {
+      commandLine[commandLength++] = c;
+    }
+  }
+  return busy;
+}
+
+// Print runtime statistics over Serial
+FLASHMEM void printRuntimeStats() {
+  Serial.println("=== Runtime Stats ===");
+  Serial.print("HID reports queued: ");
+  Serial.print(hidStats.queued);
+  Serial.print(" sent: ");
+  Serial.print(hidStats.sent);
+  Serial.print(" collapsed: ");
+  Serial.print(hidStats.collapsed);
+  Serial.print(" dropped: ");
+  Serial.println(hidStats.dropped);
+  Serial.print("HID queue depth: ");
+  Serial.print(hidQueueCount);
+  Serial.print(" (max ");
+  Serial.print(hidStats.maxDepth);
+  Serial.print(" of ");
+  Serial.print(HID_REPORT_QUEUE_SIZE);
+  Serial.print("), deferred passes: ");
+  Serial.println(hidStats.deferred);
+  for (int i = 0; i < MIDI_DEVICE_COUNT; i++) {
+    const MidiPort& port = midiPorts[i];
+    if (!port.connected && port.messages == 0) {
+      continue;  // Nothing ever connected on this port
+    }
+    Serial.print("MIDI device ");
+    Serial.print(i + 1);
+    Serial.print(port.connected ? "" : " (disconnected)");
+    Serial.print(": messages ");
+    Serial.print(port.messages);
+    Serial.print(", queue max ");
+    Serial.print(port.queueHighWater);
+    Serial.print(" of ");
+    Serial.print(MidiQueueProbe::capacity(*midiDevices[i]));
+    Serial.print(", overflows ");
+    Serial.println(port.overflows);
+  }
+  #ifdef ENABLE_DIN_MIDI
+  Serial.print("DIN MIDI: messages ");
+  Serial.print(dinMidiPort.messages);
+  Serial.print(", queue max ");
+  Serial.print(dinMidiPort.queueHighWater);
+  Serial.print(" of ");
+  Serial.print(DIN_MIDI_RX_QUEUE_SIZE - 1);
+  Serial.print(", overflows ");
+  Serial.print(dinRxOverflows);
+  Serial.print(", stray bytes ");
+  Serial.println(dinParser.strayBytes());
+  Serial.print("DIN MIDI latency (UART interrupt to dispatch): ");
+  Serial.print(dinMidiPort.messages ? dinLatencyTotalMicros / dinMidiPort.messages : 0);
+  Serial.print("us avg, ");
+  Serial.print(dinLatencyMaxMicros);
+  Serial.println("us max");
+  #endif
+  #ifdef ENABLE_MIDI_PASSTHROUGH
+  Serial.print("MIDI passthrough queued: ");
+  Serial.print(passthroughStats.queued);
+  Serial.print(" forwarded: ");
+  Serial.print(passthroughStats.forwarded);
+  Serial.print(" dropped: ");
+  Serial.print(passthroughStats.dropped);
+  Serial.print(" endpoint busy: ");
+  Serial.print(passthroughStats.busy);
+  Serial.print(" depth: ");
+  Serial.print(passthroughCount);
+  Serial.print(" (max ");
+  Serial.print(passthroughStats.maxDepth);
+  Serial.print(" of ");
+  Serial.print(MIDI_PASSTHROUGH_QUEUE_SIZE);
+  Serial.println(")");
+  #endif
+  Serial.print("Idle: ");
+  #if IDLE_SLEEP
+  Serial.print("sleeps ");
+  Serial.print(idleStats.sleeps);
+  Serial.print(", clock drops ");
+  Serial.print(idleStats.clockDrops);
+  Serial.print(", clock now ");
+  Serial.print(F_CPU_ACTUAL / 1000000);
+  Serial.println(" MHz");
+  #else
+  Serial.println("spinning (IDLE_SLEEP=0)");
+  #endif
+  uint32_t cyclesPerMicro = scheduler.cyclesPerMicro();
+  // Each stage with its input queue; latency is the age of events when the stage took them
+  const uint16_t queueDepth[STAGE_COUNT] = {ingestQueue.depth(), normalizedQueue.depth(), routedQueue.depth(), mappedQueue.depth()};
+  const uint16_t queueMaxDepth[STAGE_COUNT] = {ingestQueue.maxDepth(), normalizedQueue.maxDepth(), routedQueue.maxDepth(), mappedQueue.maxDepth()};
+  const uint32_t queueRefused[STAGE_COUNT] = {ingestQueue.refused(), normalizedQueue.refused(), routedQueue.refused(), mappedQueue.refused()};
+  Serial.println("Event pipeline:");
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const StageStats& stats = stageStats[i];
+    Serial.print("  ");
+    Serial.print(stageNames[i]);
+    Serial.print(": events ");
+    Serial.print(stats.processed);
+    Serial.print(" (forwarded ");
+    Serial.print(stats.forwarded);
+    Serial.print(", filtered ");
+    Serial.print(stats.filtered);
+    Serial.print("), latency avg ");
+    Serial.print(stats.processed ? (float)stats.latencyCycles / stats.processed / cyclesPerMicro : 0.0f);
+    Serial.print("us max ");
+    Serial.print((float)stats.maxLatencyCycles / cyclesPerMicro);
+    Serial.print("us, busy ");
+    Serial.print(stats.processed ? (uint32_t)(stats.busyCycles / stats.processed) : 0);
+    Serial.print(" cycles/event, queue ");
+    Serial.print(queueDepth[i]);
+    Serial.print(" (max ");
+    Serial.print(queueMaxDepth[i]);
+    Serial.print(" of ");
+    Serial.print(PIPELINE_QUEUE_SIZE);
+    Serial.print("), refused ");
+    Serial.println(queueRefused[i]);
+  }
+  Serial.print("Scheduler passes: ");
+  Serial.print(scheduler.passes());
+  Serial.print(", longest pass ");
+  Serial.print(scheduler.maxPassCycles() / cyclesPerMicro);
+  Serial.print("us, housekeeping deferred ");
+  Serial.println(scheduler.deferrals());
+  for (int i = 0; i < scheduler.count(); i++) {
+    const SchedulerTask& task = scheduler.task(i);
+    Serial.print("  ");
+    Serial.print(task.name);
+    Serial.print(": runs ");
+    Serial.print(task.stats.runs);
+    Serial.print(" (busy ");
+    Serial.print(task.stats.busyRuns);
+    Serial.print("), avg ");
+    Serial.print(task.stats.runs ? (uint32_t)(task.stats.totalCycles / task.stats.runs) : 0);
+    Serial.print(" cycles, max ");
+    Serial.print(task.stats.maxCycles / cyclesPerMicro);
+    Serial.print("us of ");
+    Serial.print(task.budgetCycles / cyclesPerMicro);
+    Serial.print("us budget, overruns ");
+    Serial.println(task.stats.overruns);
+  }
+}
+#endif
+
+#ifdef ENABLE_DEBUG
+// Linker symbols from the Teensy 4.1 memory map (imxrt1062_t41.ld)
+extern unsigned long _stext;          // Start of code in ITCM (RAM1)
+extern unsigned long _etext;          // End of code in ITCM
+extern unsigned long _sdata;          // Start of initialized data in DTCM (RAM1)
+extern unsigned long _ebss;           // End of zero-initialized data in DTCM
+extern unsigned long _heap_start;     // End of DMAMEM data in RAM2, start of the heap
+extern unsigned long _flashimagelen;  // Size of the program image in flash
+
+// One subsystem of the memory report: its size and budget, as the static_asserts check them
+FLASHMEM void printBudgetLine(const char* name, size_t bytes, size_t budget) {
+  Serial.print("  ");
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(bytes);
+  Serial.print(" / ");
+  Serial.println(budget);
+}
+
+// Print where memory goes: per-subsystem sizes (compile-time) and region totals (linker)
+FLASHMEM void printMemoryReport() {
+  Serial.println("=== Memory Report ===");
+  Serial.println("RAM1 (DTCM) - hot data:");
+  printBudgetLine("profile tables", ram1Profiles, RAM1_BUDGET_PROFILES);
+  printBudgetLine("key state", ram1KeyState, RAM1_BUDGET_KEY_STATE);
+  printBudgetLine("HID transmit", ram1HidTx, RAM1_BUDGET_HID_TX);
+  printBudgetLine("MIDI device table", ram1MidiPorts, RAM1_BUDGET_MIDI_PORTS);
+  #ifdef ENABLE_DIN_MIDI
+  printBudgetLine("DIN MIDI input", ram1DinMidi, RAM1_BUDGET_DIN_MIDI);
+  #endif
+  #ifdef ENABLE_MIDI_PASSTHROUGH
+  printBudgetLine("MIDI passthrough", ram1Passthrough, RAM1_BUDGET_PASSTHROUGH);
+  #endif
+  printBudgetLine("task scheduler", ram1Scheduler, RAM1_BUDGET_SCHEDULER);
+  printBudgetLine("chord patterns", ram1Chords, RAM1_BUDGET_CHORDS);
+  printBudgetLine("key sets", ram1KeySets, RAM1_BUDGET_KEY_SETS);
+  printBudgetLine("event pipeline", ram1Pipeline, RAM1_BUDGET_PIPELINE);
+  #ifdef ENABLE_LOAD_GENERATOR
+  printBudgetLine("load generator", ram1LoadGenerator, RAM1_BUDGET_LOAD_GENERATOR);
+  #endif
+  Serial.println("RAM2 (DMAMEM) - cold data:");
+  printBudgetLine("profile/file names", ram2Names, RAM2_BUDGET_NAMES);
+  printBudgetLine("HID transmit buffers", ram2HidTxBuffers, RAM2_BUDGET_HID_TX_BUFFERS);
+  printBudgetLine("load arena", ram2LoadArena, RAM2_BUDGET_LOAD_ARENA);
+  printBudgetLine("profile source tables", ram2SourceTables, RAM2_BUDGET_SOURCE_TABLES);
+  #ifdef ENABLE_LOAD_GENERATOR
+  printBudgetLine("load latency histogram", ram2LoadLatency, RAM2_BUDGET_LOAD_LATENCY);
+  #endif
+  Serial.println("Totals:");
+  Serial.print("  RAM1 code (ITCM): ");
+  Serial.println((unsigned long)&_etext - (unsigned long)&_stext);
+  Serial.print("  RAM1 data (DTCM): ");
+  Serial.println((unsigned long)&_ebss - (unsigned long)&_sdata);
+  Serial.print("  RAM2 DMAMEM:      ");
+  Serial.println((unsigned long)&_heap_start - RAM2_START_ADDRESS);
+  Serial.print("  Flash image:      ");
+  Serial.println((unsigned long)&_flashimagelen);
+  
+  Serial.print("  Load arena:       ");
+  Serial.print(loadArena.highWater());
+  Serial.print(" / ");
+  Serial.print(loadArena.capacity());
+  Serial.print(" high-water, ");
+  Serial.print(loadArena.failures());
+  Serial.println(" failed allocations");
+  
+  // Hot tables must have landed in DTCM
+  unsigned long profilesAddress = (unsigned long)profiles;
+  if (profilesAddress < DTCM_START_ADDRESS || profilesAddress >= DTCM_START_ADDRESS + RAM1_SIZE) {
+    Serial.println("WARNING: profile tables are not in DTCM");
+  }
+}
+
+// Heap usage - nothing in the firmware should allocate after boot, so these numbers
+// staying flat over days of uptime is the check that no String/new crept back in
+// The heap sits in RAM2 between the DMAMEM data and the top of RAM2
+FLASHMEM void printHeapReport() {
+  extern char* __brkval;               // Current top of the heap (grows with malloc)
+  extern unsigned long _heap_end;      // Upper limit of the heap
+  struct mallinfo info = mallinfo();
+  Serial.println("=== Heap Report ===");
+  Serial.print("  high-water:   ");
+  Serial.print((unsigned long)(__brkval - (char*)&_heap_start));
+  Serial.println(" bytes taken from the system");
+  Serial.print("  in use:       ");
+  Serial.println(info.uordblks);
+  Serial.print("  free blocks:  ");
+  Serial.print(info.ordblks);
+  Serial.print(" (");
+  Serial.print(info.fordblks);
+  Serial.println(" bytes)");
+  Serial.print("  never used:   ");
+  Serial.println((unsigned long)((char*)&_heap_end - __brkval));
+}
+#endif
+
+#ifdef ENABLE_BENCHMARKS
+// On-device benchmarks (build with the teensy41_bench environment)
+// Run once at the end of setup(), results are printed over Serial
+// Benchmarks never send reports to the PC unless they say so
+FLASHMEM void runBenchmarks() {
+  Serial.println("=== Benchmarks ===");
+  Serial.print("CPU clock: ");
+  Serial.print(F_CPU_ACTUAL / 1000000);
+  Serial.println(" MHz");
+  benchmarkReportSubmission();
+  benchmarkHidReportRate();
+  benchmarkEngineVariants();
+  benchmarkProfileStore();
+  benchmarkStreamParser();
+  benchmarkIdleWake();
+  Serial.println("=== Benchmarks Complete ===");
+  Serial.println();
+}
+
+// Compare loading a full 6-key report for the endpoint: per-slot setters into the core's
+// buffer through the keyIdx ladder (previous path) vs the packed copy submitKeyboardReport()
+// makes into a transfer buffer - the transfer that follows is not measured
+FLASHMEM void benchmarkReportSubmission() {
+  HidReport report;
+  clearHidReport(report);
+  report.modifiers = MODIFIERKEY_LEFTSHIFT;
+  for (int i = 0; i < MAX_SIMULTANEOUS_KEYS; i++) {
+    report.keys[i] = KEY_A + i;
+  }
+  
+  uint32_t start = ARM_DWT_CYCCNT;
+  for (int n = 0; n < BENCHMARK_ITERATIONS; n++) {
+    for (int keyIdx = 0; keyIdx < MAX_SIMULTANEOUS_KEYS; keyIdx++) {
+      if (keyIdx == 0) Keyboard.set_key1(report.keys[keyIdx]);
+      else if (keyIdx == 1) Keyboard.set_key2(report.keys[keyIdx]);
+      else if (keyIdx == 2) Keyboard.set_key3(report.keys[keyIdx]);
+      else if (keyIdx == 3) Keyboard.set_key4(report.keys[keyIdx]);
+      else if (keyIdx == 4) Keyboard.set_key5(report.keys[keyIdx]);
+      else if (keyIdx == 5) Keyboard.set_key6(report.keys[keyIdx]);
     }
+    Keyboard.set_modifier(report.modifiers);
+    asm volatile("" ::: "memory");  // Keep the compiler from merging iterations
+  }
+  uint32_t setterCycles = ARM_DWT_CYCCNT - start;
+  
+  static HidTxBuffer scratch;
+  start = ARM_DWT_CYCCNT;
+  for (int n = 0; n < BENCHMARK_ITERATIONS; n++) {
+    scratch.report = report;
+    asm volatile("" ::: "memory");
   }
+  uint32_t rawCycles = ARM_DWT_CYCCNT - start;
   
-  // Combine regular key modifiers with modifier-only keys
-  byte combinedModifier = firstModifier | activeModifierKeys;
+  // Leave the core's buffer empty: the report rate benchmark sends it
+  Keyboard.set_modifier(0);
+  Keyboard.set_key1(0);
+  Keyboard.set_key2(0);
+  Keyboard.set_key3(0);
+  Keyboard.set_key4(0);
+  Keyboard.set_key5(0);
+  Keyboard.set_key6(0);
   
-  if (allSameModifier) {
-    // All keys have same modifier - send them all at once (fastest)
-    Keyboard.set_key1(0);
-    Keyboard.set_key2(0);
-    Keyboard.set_key3(0);
-    Keyboard.set_key4(0);
-    Keyboard.set_key5(0);
-    Keyboard.set_key6(0);
-    Keyboard.set_modifier(combinedModifier);
+  Serial.print("Report load, per-slot setters: ");
+  Serial.print((float)setterCycles / BENCHMARK_ITERATIONS);
+  Serial.println(" cycles/report");
+  Serial.print("Report load, packed copy:      ");
+  Serial.print((float)rawCycles / BENCHMARK_ITERATIONS);
+  Serial.println(" cycles/report");
+}
+
+// Measure the report rate the host actually delivers on the keyboard endpoint
+// Empty reports are sent back-to-back through the core's blocking usb_keyboard_send(), from
+// its own report buffer (which the firmware leaves empty): once the core's transfer buffers
+// are full, each send completes only when the host has polled one out, so the time between
+// completions is the real polling interval. Empty reports keep the PC from seeing any key
+// activity.
+FLASHMEM void benchmarkHidReportRate() {
+  Serial.print("HID report rate (configured poll interval ");
+  Serial.print(HID_POLL_INTERVAL_US);
+  Serial.println("us):");
+  
+  unsigned long waitStart = millis();
+  while (!usb_configuration) {
+    if (millis() - waitStart > 5000) {
+      Serial.println("  skipped - USB host has not configured the device");
+      return;
+    }
+    delay(10);
+  }
+  
+  HidReport report;
+  clearHidReport(report);
+  
+  // Fill the endpoint's transfer buffers so the measured sends are paced by the host
+  for (int i = 0; i < HID_TX_SLOTS; i++) {
+    usb_keyboard_send();
+  }
+  
+  uint32_t minCycles = 0xFFFFFFFF;
+  uint32_t maxCycles = 0;
+  uint32_t slowReports = 0;  // Reports that took more than twice the configured interval
+  uint32_t slowThreshold = (F_CPU_ACTUAL / 1000000) * HID_POLL_INTERVAL_US * 2;
+  uint32_t start = ARM_DWT_CYCCNT;
+  uint32_t previous = start;
+  for (int n = 0; n < HID_BENCHMARK_REPORTS; n++) {
+    usb_keyboard_send();
+    uint32_t now = ARM_DWT_CYCCNT;
+    uint32_t cycles = now - previous;
+    previous = now;
+    if (cycles < minCycles) minCycles = cycles;
+    if (cycles > maxCycles) maxCycles = cycles;
+    if (cycles > slowThreshold) slowReports++;
+  }
+  uint32_t totalCycles = previous - start;
+  
+  // The PC's last report is empty now
+  lastSentReport = report;
+  
+  float cyclesPerMicro = F_CPU_ACTUAL / 1000000.0f;
+  float totalMicros = totalCycles / cyclesPerMicro;
+  Serial.print("  sustained rate: ");
+  Serial.print(HID_BENCHMARK_REPORTS * 1000000.0f / totalMicros);
+  Serial.println(" reports/s");
+  Serial.print("  per-report: avg ");
+  Serial.print(totalMicros / HID_BENCHMARK_REPORTS);
+  Serial.print("us, min ");
+  Serial.print(minCycles / cyclesPerMicro);
+  Serial.print("us, max ");
+  Serial.print(maxCycles / cyclesPerMicro);
+  Serial.println("us");
+  Serial.print("  reports slower than 2x interval: ");
+  Serial.print(slowReports);
+  Serial.print(" of ");
+  Serial.println(HID_BENCHMARK_REPORTS);
+}
+
+// Per-note cost of the compile-time engine variants vs runtime mode checks on every note
+// Each iteration plays a two-note chord (one plain key, one SHIFT key) on and off, from an
+// empty engine and transmit queue - so the queue never fills and every iteration takes the
+// same path; that reset is timed on its own and taken off both results
+FLASHMEM void benchmarkEngineVariants() {
+  static const char* releaseNames[RELEASE_STRATEGY_COUNT] = {"immediate", "timed", "held", "hybrid"};
+  KeyMapping plainKey = {KEY_A, 0};
+  KeyMapping shiftedKey = {KEY_B, MODIFIERKEY_LEFTSHIFT};
+  
+  // The runtime reference reads the profile through a pointer the compiler cannot see
+  // through, so its mode checks stay branches instead of being folded per strategy
+  static Profile profile;
+  const Profile* volatile runtimeProfile = &profile;
+  
+  uint32_t start = ARM_DWT_CYCCNT;
+  for (int n = 0; n < BENCHMARK_ITERATIONS; n++) {
+    resetEngineState();
+    asm volatile("" ::: "memory");
+  }
+  uint32_t resetCycles = ARM_DWT_CYCCNT - start;
+  
+  for (int release = 0; release < RELEASE_STRATEGY_COUNT; release++) {
+    profile.fastPressMode = (release != RELEASE_HELD);
+    profile.pressDurationMs = (release == RELEASE_TIMED || release == RELEASE_HYBRID) ? 50 : 0;
+    profile.modifierMode = MODIFIERS_SPLIT;
+    profile.hybridRelease = (release == RELEASE_HYBRID);
+    profile.minHoldMs = 0;
+    const EngineVariant& variant = engineVariants[release][MODIFIERS_SPLIT];
+    setKeyEngineProfile(keyEngine, profile);
     
-    // Set all keys in order (only keys with keyCode > 0)
-    int keyIdx = 0;
-    for (int i = 0; i < pressedKeyCount && keyIdx < MAX_SIMULTANEOUS_KEYS; i++) {
-      if (pressedKeys[i].keyCode > 0) {
-        if (keyIdx == 0) Keyboard.set_key1(pressedKeys[i].keyCode);
-        else if (keyIdx == 1) Keyboard.set_key2(pressedKeys[i].keyCode);
-        else if (keyIdx == 2) Keyboard.set_key3(pressedKeys[i].keyCode);
-        else if (keyIdx == 3) Keyboard.set_key4(pressedKeys[i].keyCode);
-        else if (keyIdx == 4) Keyboard.set_key5(pressedKeys[i].keyCode);
-        else if (keyIdx == 5) Keyboard.set_key6(pressedKeys[i].keyCode);
-        keyIdx++;
-      }
+    start = ARM_DWT_CYCCNT;
+    for (int n = 0; n < BENCHMARK_ITERATIONS; n++) {
+      resetEngineState();
+      benchmarkRuntimeNoteOn(*runtimeProfile, plainKey);
+      benchmarkRuntimeNoteOn(*runtimeProfile, shiftedKey);
+      benchmarkRuntimeNoteOff(*runtimeProfile, plainKey);
+      benchmarkRuntimeNoteOff(*runtimeProfile, shiftedKey);
+    }
+    uint32_t runtimeCycles = ARM_DWT_CYCCNT - start - resetCycles;
+    
+    start = ARM_DWT_CYCCNT;
+    for (int n = 0; n < BENCHMARK_ITERATIONS; n++) {
+      resetEngineState();
+      variant.noteOn(plainKey);
+      variant.noteOn(shiftedKey);
+      variant.noteOff(plainKey);
+      variant.noteOff(shiftedKey);
     }
+    uint32_t variantCycles = ARM_DWT_CYCCNT - start - resetCycles;
+    resetEngineState();
     
-    Keyboard.send_now();
+    Serial.print("Engine (");
+    Serial.print(releaseNames[release]);
+    Serial.print(", split): runtime checks ");
+    Serial.print((float)runtimeCycles / (BENCHMARK_ITERATIONS * 2));
+    Serial.print(" cycles/note, specialized ");
+    Serial.print((float)variantCycles / (BENCHMARK_ITERATIONS * 2));
+    Serial.println(" cycles/note");
+  }
+  
+  // Put the real profile's variant back
+  selectEngineVariant();
+}
+
+// Boot-time profile loading: binary records from the flash store vs parsing the SD card
+// Leaves the flash store's profiles loaded, as after a normal boot
+FLASHMEM void benchmarkProfileStore() {
+  if (!profileStoreMounted) {
+    Serial.println("Profile store: skipped - flash partition not mounted");
+    return;
+  }
+  
+  byte savedProfileIndex = currentProfileIndex;
+  uint32_t signature = 0;
+  
+  uint32_t start = micros();
+  bool loaded = loadProfileStore(signature);
+  uint32_t flashMicros = micros() - start;
+  
+  Serial.print("Profile store, flash load: ");
+  if (loaded) {
+    Serial.print(flashMicros);
+    Serial.print("us (");
+    Serial.print(profileCount);
+    Serial.print(" profiles, ");
+    Serial.print((uint32_t)profileFlash.usedSize());
+    Serial.print(" of ");
+    Serial.print((uint32_t)profileFlash.totalSize());
+    Serial.println(" bytes used)");
   } else {
-    // Mixed modifiers - batch consecutive keys with same modifier, preserve order
-    // Process keys in order, grouping consecutive keys with same modifier
+    Serial.println("no valid store");
+  }
+  
+  if (sdCardPresent) {
+    start = micros();
+    int sourceFileCount = 0;
+    sdSourceSignature(sourceFileCount);
+    uint32_t signatureMicros = micros() - start;
     
-    int startIdx = 0;
-    byte currentModifier = pressedKeys[0].modifierMask;
+    start = micros();
+    config = defaultConfig;
+    loadConfig();
+    loadMappings();
+    uint32_t parseMicros = micros() - start;
     
-    for (int i = 0; i <= pressedKeyCount; i++) {
-      // Check if we've reached end or modifier changed
-      bool modifierChanged = (i == pressedKeyCount) || 
-                            (pressedKeys[i].modifierMask != currentModifier);
-      
-      if (modifierChanged && i > startIdx) {
-        // Send batch of consecutive keys with same modifier
-        Keyboard.set_key1(0);
-        Keyboard.set_key2(0);
-        Keyboard.set_key3(0);
-        Keyboard.set_key4(0);
-        Keyboard.set_key5(0);
-        Keyboard.set_key6(0);
-        // Combine regular key modifier with modifier-only keys
-        Keyboard.set_modifier(currentModifier | activeModifierKeys);
-        
-        // Set keys in this batch (in order, max 6 keys per USB HID report, only keyCode > 0)
-        int keyIdx = 0;
-        for (int j = startIdx; j < i && keyIdx < MAX_SIMULTANEOUS_KEYS; j++) {
-          if (pressedKeys[j].keyCode > 0) {
-            if (keyIdx == 0) Keyboard.set_key1(pressedKeys[j].keyCode);
-            else if (keyIdx == 1) Keyboard.set_key2(pressedKeys[j].keyCode);
-            else if (keyIdx == 2) Keyboard.set_key3(pressedKeys[j].keyCode);
-            else if (keyIdx == 3) Keyboard.set_key4(pressedKeys[j].keyCode);
-            else if (keyIdx == 4) Keyboard.set_key5(pressedKeys[j].keyCode);
-            else if (keyIdx == 5) Keyboard.set_key6(pressedKeys[j].keyCode);
-            keyIdx++;
+    Serial.print("Profile store, SD change check: ");
+    Serial.print(signatureMicros);
+    Serial.println("us");
+    Serial.print("Profile store, SD parse:        ");
+    Serial.print(parseMicros);
+    Serial.println("us");
+    
+    if (loaded) {
+      loadProfileStore(signature);
+    }
+  }
+  
+  if (savedProfileIndex < profileCount) {
+    currentProfileIndex = savedProfileIndex;
+  }
+  selectEngineVariant();
+  resetPipeline();
+}
+
+// DIN MIDI parser throughput on a typical stream: running-status notes with MIDI clock
+// bytes interleaved, a program change and a short SysEx
+// Line rate at 31250 baud is 3125 bytes/s, so the margin is how many times faster it parses
+FLASHMEM void benchmarkStreamParser() {
+  static const byte pattern[] = {
+    0x90, 60, 100, 64, 100, 0xF8, 67, 100,  // Chord, running status, clock inside it
+    60, 0, 64, 0, 67, 0,                     // Releases as NoteOn velocity 0
+    0xC0, 5,                                 // Program change
+    0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7,      // SysEx (skipped)
+    0xF8, 0x80, 62, 64                       // Clock, NoteOff
+  };
+  
+  MidiStreamParser parser;
+  MidiStreamMessage message;
+  unsigned long messages = 0;
+  uint32_t start = ARM_DWT_CYCCNT;
+  for (int n = 0; n < PARSER_BENCHMARK_BYTES; n++) {
+    if (parser.parse(pattern[n % sizeof(pattern)], message)) {
+      messages++;
+    }
+  }
+  uint32_t cycles = ARM_DWT_CYCCNT - start;
+  
+  float cyclesPerByte = (float)cycles / PARSER_BENCHMARK_BYTES;
+  float bytesPerSecond = F_CPU_ACTUAL / cyclesPerByte;
+  Serial.print("MIDI stream parser: ");
+  Serial.print(cyclesPerByte);
+  Serial.print(" cycles/byte, ");
+  Serial.print(bytesPerSecond / 1000000.0f);
+  Serial.print(" MB/s (");
+  Serial.print(bytesPerSecond / (DIN_MIDI_BAUD / 10));
+  Serial.print("x DIN line rate), ");
+  Serial.print(messages);
+  Serial.println(" messages");
+}
+
+// Reference: the note path with every mode decided at runtime, as before engine variants
+FASTRUN void benchmarkRuntimeNoteOn(const Profile& profile, KeyMapping mapping) {
+  if (mapping.keyCode == 0 && mapping.modifierMask > 0) {
+    keyEngine.activeModifierKeys |= mapping.modifierMask;
+    benchmarkRuntimeEmit(profile);
+    return;
+  }
+  if (profile.hybridRelease) {
+    addPressedKey(keyEngine, mapping.keyCode, mapping.modifierMask);
+    if (profile.pressDurationMs > 0 || profile.minHoldMs > 0) {
+      unsigned int maxHoldMs = (profile.pressDurationMs > profile.minHoldMs) ? profile.pressDurationMs : profile.minHoldMs;
+      scheduleRelease(keyEngine, mapping, millis(), millis() + maxHoldMs, profile.pressDurationMs > 0, true);
+    }
+    benchmarkRuntimeEmit(profile);
+  } else if (profile.fastPressMode) {
+    if (profile.pressDurationMs == 0) {
+      addPressedKey(keyEngine, mapping.keyCode, mapping.modifierMask);
+      benchmarkRuntimeEmit(profile);
+      removePressedKey(keyEngine, mapping.keyCode, mapping.modifierMask);
+      benchmarkRuntimeEmit(profile);
+    } else {
+      addPressedKey(keyEngine, mapping.keyCode, mapping.modifierMask);
+      benchmarkRuntimeEmit(profile);
+      scheduleRelease(keyEngine, mapping, millis(), millis() + profile.pressDurationMs, true, false);
+    }
+  } else {
+    addPressedKey(keyEngine, mapping.keyCode, mapping.modifierMask);
+    benchmarkRuntimeEmit(profile);
+  }
+}
+
+FASTRUN void benchmarkRuntimeNoteOff(const Profile& profile, KeyMapping mapping) {
+  if (mapping.keyCode == 0 && mapping.modifierMask > 0) {
+    keyEngine.activeModifierKeys &= ~mapping.modifierMask;
+    benchmarkRuntimeEmit(profile);
+    return;
+  }
+  if (profile.hybridRelease) {
+    if (releaseKey(keyEngine, mapping, RELEASE_HYBRID, millis())) {
+      benchmarkRuntimeEmit(profile);
+    }
+  } else if (!profile.fastPressMode) {
+    removePressedKey(keyEngine, mapping.keyCode, mapping.modifierMask);
+    benchmarkRuntimeEmit(profile);
+  }
+}
+
+// emitKeyboardState() with the modifier mode checked at runtime, for every report
+FASTRUN void benchmarkRuntimeEmit(const Profile& profile) {
+  uint8_t modifierMode = profile.modifierMode;
+  buildKeyReports(keyEngine, modifierMode, [modifierMode](uint8_t modifiers, const uint8_t* keys) {
+    HidReport report;
+    report.modifiers = modifiers;
+    report.reserved = 0;
+    memcpy(report.keys, keys, MAX_SIMULTANEOUS_KEYS);
+    if (modifierMode == MODIFIERS_PREROLL) {
+      queuePreRolledReport(report);
+    } else {
+      queueHidReport(report);
+    }
+  });
+}
+
+// Idle wake benchmark: GPT1 timer interrupt at a varying phase, standing in for the USB
+// host interrupt that delivers a MIDI packet
+volatile bool idleBenchmarkFired = false;
+volatile uint32_t idleBenchmarkIsrTicks = 0;
+
+FASTRUN void idleBenchmarkIsr() {
+  GPT1_SR = GPT_SR_OF1;
+  idleBenchmarkIsrTicks = GPT1_CNT;
+  idleBenchmarkFired = true;
+  asm volatile("dsb");
+}
+
+// Time from an interrupt to the loop running again, per idle mode: the previous delay loop,
+// WFI, and WFI at IDLE_CPU_FREQ including raising the clock back to F_CPU
+// Timed on GPT1 at 24 MHz, which keeps counting while the core sleeps or changes clock
+FLASHMEM void benchmarkIdleWake() {
+  static const char* modeNames[3] = {"delay loop", "WFI", "WFI at idle clock"};
+  
+  // 24 MHz: the core sets PERCLK to the crystal oscillator
+  CCM_CCGR1 |= CCM_CCGR1_GPT1_BUS(CCM_CCGR_ON) | CCM_CCGR1_GPT1_SERIAL(CCM_CCGR_ON);
+  GPT1_CR = 0;
+  GPT1_PR = 0;
+  GPT1_SR = 0x3F;
+  GPT1_IR = GPT_IR_OF1IE;
+  GPT1_CR = GPT_CR_EN | GPT_CR_CLKSRC(1) | GPT_CR_FRR;
+  attachInterruptVector(IRQ_GPT1, idleBenchmarkIsr);
+  NVIC_ENABLE_IRQ(IRQ_GPT1);
+  
+  for (int mode = 0; mode < 3; mode++) {
+    uint32_t totalTicks = 0;
+    uint32_t maxTicks = 0;
+    uint32_t entryTicks = 0;
+    for (int n = 0; n < IDLE_BENCHMARK_SAMPLES; n++) {
+      if (mode == 2) {
+        set_arm_clock(IDLE_CPU_FREQ);
+      }
+      idleBenchmarkFired = false;
+      uint32_t due = GPT1_CNT + 2400 + (n * 7919) % 24000;  // 0.1-1.1ms ahead
+      GPT1_OCR1 = due;
+      while (!idleBenchmarkFired) {
+        if (mode == 0) {
+          delayMicroseconds(IDLE_PASS_DELAY_US);
+        } else {
+          __disable_irq();
+          if (!idleBenchmarkFired) {
+            asm volatile("dsb\n\twfi" ::: "memory");
           }
+          __enable_irq();
         }
-        
-        Keyboard.send_now();
-        
-        // Start next batch
-        if (i < pressedKeyCount) {
-          startIdx = i;
-          currentModifier = pressedKeys[i].modifierMask;
-        }
+      }
+      if (mode == 2) {
+        set_arm_clock(F_CPU);
+      }
+      uint32_t ticks = GPT1_CNT - due;
+      totalTicks += ticks;
+      entryTicks += idleBenchmarkIsrTicks - due;
+      if (ticks > maxTicks) {
+        maxTicks = ticks;
       }
     }
+    
+    Serial.print("Idle wake (");
+    Serial.print(modeNames[mode]);
+    Serial.print("): interrupt -> loop ");
+    Serial.print(totalTicks / 24.0f / IDLE_BENCHMARK_SAMPLES);
+    Serial.print("us avg, ");
+    Serial.print(maxTicks / 24.0f);
+    Serial.print("us max (interrupt entry ");
+    Serial.print(entryTicks / 24.0f / IDLE_BENCHMARK_SAMPLES);
+    Serial.println("us avg)");
   }
+  
+  NVIC_DISABLE_IRQ(IRQ_GPT1);
+  GPT1_IR = 0;
+  GPT1_CR = 0;
 }
 
+// Forget all key state and queued reports without sending anything
+FLASHMEM void resetEngineState() {
+  clearKeyEngine(keyEngine);
+  hidQueueHead = 0;
+  hidQueueCount = 0;
+  clearHidReport(lastSentReport);
+}
+#endif
@@ -0,0 +1,134 @@
+/*
+ * evdev key capture - see EvdevCapture.h
+ */
+
+#include "EvdevCapture.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+
+// Older headers only have the timeval member
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define TEST_BIT(bits, bit) ((bits[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+static bool containsIgnoreCase(const char* str, const char* needle) {
+  size_t needleLength = strlen(needle);
+  for (; *str; str++) {
+    if (strncasecmp(str, needle, needleLength) == 0) {
+      return true;
+    }
+  }
+  return needleLength == 0;
+}
+
+// Has letter keys - skips the mouse, consumer-control and system-control nodes a
+// composite USB device (like the Teensy) also creates
+static bool isKeyboard(int fd) {
+  unsigned long keyBits[KEY_MAX / BITS_PER_LONG + 1];
+  memset(keyBits, 0, sizeof(keyBits));
+  if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keyBits)), keyBits) < 0) {
+    return false;
+  }
+  return TEST_BIT(keyBits, KEY_A) && TEST_BIT(keyBits, KEY_Z);
+}
+
+static bool isModifierCode(uint16_t code) {
+  switch (code) {
+    case KEY_LEFTCTRL: case KEY_LEFTSHIFT: case KEY_LEFTALT: case KEY_LEFTMETA:
+    case KEY_RIGHTCTRL: case KEY_RIGHTSHIFT: case KEY_RIGHTALT: case KEY_RIGHTMETA:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint64_t monotonicNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+EvdevCapture::EvdevCapture() : fd_(-1) {
+  name_[0] = '\0';
+  path_[0] = '\0';
+}
+
+EvdevCapture::~EvdevCapture() {
+  close();
+}
+
+bool EvdevCapture::open(const char* nameFilter) {
+  // eventN nodes in number order, so the choice is stable between runs
+  for (int index = 0; index < 256 && fd_ < 0; index++) {
+    snprintf(path_, sizeof(path_), "/dev/input/event%d", index);
+    int fd = ::open(path_, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    if (ioctl(fd, EVIOCGNAME(sizeof(name_)), name_) >= 0 && containsIgnoreCase(name_, nameFilter) && isKeyboard(fd)) {
+      int clock = CLOCK_MONOTONIC;
+      if (ioctl(fd, EVIOCSCLOCKID, &clock) == 0 && ioctl(fd, EVIOCGRAB, 1) == 0) {
+        fd_ = fd;
+        break;
+      }
+    }
+    ::close(fd);
+  }
+
+  if (fd_ < 0) {
+    name_[0] = '\0';
+    path_[0] = '\0';
+    return false;
+  }
+  return true;
+}
+
+void EvdevCapture::close() {
+  if (fd_ < 0) {
+    return;
+  }
+  ioctl(fd_, EVIOCGRAB, 0);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+bool EvdevCapture::read(uint64_t deadlineNs, CapturedKey& key) {
+  while (fd_ >= 0) {
+    struct input_event event;
+    ssize_t length = ::read(fd_, &event, sizeof(event));
+    if (length == (ssize_t)sizeof(event)) {
+      // Value 2 is autorepeat, which says nothing about latency
+      if (event.type != EV_KEY || event.value == 2) {
+        continue;
+      }
+      key.timestampNs = (uint64_t)event.input_event_sec * 1000000000ULL + (uint64_t)event.input_event_usec * 1000ULL;
+      key.code = event.code;
+      key.pressed = event.value == 1;
+      key.modifier = isModifierCode(event.code);
+      return true;
+    }
+
+    uint64_t now = monotonicNs();
+    if (now >= deadlineNs) {
+      return false;
+    }
+    struct pollfd pfd = {fd_, POLLIN, 0};
+    int timeoutMs = (int)((deadlineNs - now + 999999) / 1000000);
+    if (poll(&pfd, 1, timeoutMs) <= 0 && monotonicNs() >= deadlineNs) {
+      return false;
+    }
+  }
+  return false;
+}
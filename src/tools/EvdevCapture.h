@@ -0,0 +1,45 @@
+/*
+ * evdev key capture for the latency rig
+ *
+ * Finds a keyboard under /dev/input by name, grabs it (so test keys do not type into the
+ * desktop) and returns its key events with kernel timestamps on CLOCK_MONOTONIC - the
+ * moment the OS saw the key, comparable with clock_gettime(CLOCK_MONOTONIC) on the sender.
+ *
+ * Kept apart from MidiConfig.h for the same reason as UinputKeyboard: KEY_* name clashes.
+ */
+
+#ifndef EVDEV_CAPTURE_H
+#define EVDEV_CAPTURE_H
+
+#include <stdint.h>
+
+struct CapturedKey {
+  uint64_t timestampNs;  // Kernel event time, CLOCK_MONOTONIC
+  uint16_t code;         // evdev key code
+  bool pressed;          // false = released (autorepeat events are not reported)
+  bool modifier;         // Ctrl, Shift, Alt or Meta
+};
+
+class EvdevCapture {
+public:
+  EvdevCapture();
+  ~EvdevCapture();
+
+  // Open the first keyboard whose name contains nameFilter (case-insensitive)
+  // Returns false if there is none or it cannot be grabbed
+  bool open(const char* nameFilter);
+  void close();
+
+  const char* deviceName() const { return name_; }
+  const char* devicePath() const { return path_; }
+
+  // Wait until deadlineNs (CLOCK_MONOTONIC) for the next key event - false on timeout
+  bool read(uint64_t deadlineNs, CapturedKey& key);
+
+private:
+  int fd_;
+  char name_[128];
+  char path_[32];
+};
+
+#endif // EVDEV_CAPTURE_H
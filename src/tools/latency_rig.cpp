@@ -0,0 +1,570 @@
+/*
+ * latency_rig - end-to-end "MIDI in to key seen by the OS" measurement
+ *
+ * Sends note-ons and chords from mapped notes of a profile and times them against the key
+ * events the kernel reports on the target keyboard's evdev node. The send time is taken
+ * with CLOCK_MONOTONIC right before the MIDI write; evdev is switched to the same clock, so
+ * a latency is the kernel's event timestamp minus the send time.
+ *
+ * Targets:
+ *   midi2key daemon  - send to its sequencer port (-o midi2key), capture "midi2key"
+ *   Teensy           - send out of a MIDI interface wired to the Teensy (DIN input, or a
+ *                      USB MIDI device on its host port), capture "Teensyduino"
+ *   stand-in (-s)    - no MIDI: key reports go straight into a uinput keyboard, which
+ *                      measures the capture path itself (the floor of every other number)
+ *
+ * Chords are sent as one burst; "first" is the first key press seen, "last" the moment every
+ * key of the chord is down. Trials are spaced by the gap plus up to 1ms of random jitter so
+ * they do not lock to the USB polling phase.
+ *
+ * Usage: latency_rig [-d DIR] [-p PROFILE] (-o CLIENT:PORT | -r RAWMIDI | -s) [-k NAME]
+ *                    [-c SIZES] [-n TRIALS] [-g GAP_MS] [-t TIMEOUT_MS] [-w CSV]
+ */
+
+#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "MidiConfig.h"
+#include "MappingParser.h"
+#include "ChordMatcher.h"
+#include "EvdevCapture.h"
+#include "../linux/UinputKeyboard.h"
+#include "../linux/ConfigDirectory.h"
+
+#define RIG_NAME "latency-rig"
+#define STAND_IN_NAME "latency-rig stand-in"
+
+#define MAX_CHORD_SIZES 8
+#define NOTE_VELOCITY 100
+
+// evdev key codes tracked for held state (KEY_MAX is 0x2FF)
+#define EVDEV_KEY_CODES 0x300
+
+// Where note-ons go
+enum RigTarget {
+  TARGET_SEQUENCER,  // ALSA sequencer port (daemon or a MIDI interface's output port)
+  TARGET_RAWMIDI,    // Raw MIDI device, bypassing the sequencer
+  TARGET_STAND_IN    // Reports written to our own uinput keyboard
+};
+
+struct Options {
+  const char* directory = ".";
+  const char* profileName = nullptr;
+  const char* destination = nullptr;
+  const char* rawDevice = nullptr;
+  const char* keyboardName = "midi2key";
+  const char* csvPath = nullptr;
+  RigTarget target = TARGET_SEQUENCER;
+  int chordSizes[MAX_CHORD_SIZES] = {1, 2, 4};
+  int chordSizeCount = 3;
+  int trials = 200;
+  int gapMs = 30;
+  int timeoutMs = 250;
+};
+
+// A mapped note the rig can play: plain key, no modifier, one note per key
+struct TestNote {
+  uint8_t note;
+  uint8_t keyCode;  // HID usage
+};
+
+// One trial's result, latencies in microseconds (-1 = timed out)
+struct Sample {
+  int chordSize;
+  uint8_t firstNote;
+  long firstUs;
+  long lastUs;
+};
+
+Options options;
+Profile profile;
+KeyMapping sourceTable[MAX_MIDI_NOTES];  // Tested profile's table as declared
+KeySetPool keySets;  // Key sets of the tested profile (60=A+S)
+ChordTable chordTable;  // Chord patterns of the tested profile, only to keep their notes out of the test
+char profileName[PROFILE_NAME_MAX_LEN + 1];
+DeviceMatch deviceMatch;
+Config config = defaultConfig;
+TestNote testNotes[MAX_MIDI_NOTES];
+int testNoteCount = 0;
+
+snd_seq_t* seq = nullptr;
+int seqPort = -1;
+snd_rawmidi_t* rawmidi = nullptr;
+UinputKeyboard standIn;
+EvdevCapture capture;
+
+// Keys the target currently holds, from every event read so far
+bool keyDown[EVDEV_KEY_CODES];
+int heldKeyCount = 0;
+
+// Forward declarations
+bool parseOptions(int argc, char** argv);
+bool loadTestProfile();
+bool isControlNote(int note);
+void collectTestNotes();
+bool openTarget();
+uint64_t sendChord(const TestNote* notes, int count, bool on);
+bool runTrial(const TestNote* notes, int count, Sample& sample);
+bool readKey(uint64_t deadlineNs, CapturedKey& key);
+void waitForRelease(uint64_t deadlineNs);
+void printDistribution(const char* label, std::vector<long>& values);
+void printReport(std::vector<Sample>& samples);
+bool writeCsv(const std::vector<Sample>& samples);
+uint64_t monotonicNs();
+void sleepUntil(uint64_t timeNs);
+
+void printUsage() {
+  fprintf(stderr,
+    "Usage: " RIG_NAME " [-d DIR] [-p PROFILE] (-o CLIENT:PORT | -r RAWMIDI | -s) [-k NAME]\n"
+    "                   [-c SIZES] [-n TRIALS] [-g GAP_MS] [-t TIMEOUT_MS] [-w CSV]\n"
+    "  -d DIR          CONFIG.TXT and mapping files the target was loaded with (default: .)\n"
+    "  -p PROFILE      profile to play (default: first)\n"
+    "  -o CLIENT:PORT  send to an ALSA sequencer port (e.g. midi2key, or a MIDI interface)\n"
+    "  -r RAWMIDI      send to a raw MIDI device (e.g. hw:1,0,0)\n"
+    "  -s              stand-in: no MIDI, measure the uinput -> evdev capture path alone\n"
+    "  -k NAME         capture the keyboard whose name contains NAME (default: midi2key)\n"
+    "  -c SIZES        chord sizes, comma separated (default: 1,2,4)\n"
+    "  -n TRIALS       trials per chord size (default: 200)\n"
+    "  -g GAP_MS       pause between trials (default: 30, plus up to 1ms random)\n"
+    "  -t TIMEOUT_MS   give up on a trial after this long (default: 250)\n"
+    "  -w CSV          write every sample to a CSV file\n");
+}
+
+int main(int argc, char** argv) {
+  if (!parseOptions(argc, argv)) {
+    printUsage();
+    return 2;
+  }
+  if (!loadTestProfile()) {
+    return 1;
+  }
+
+  collectTestNotes();
+  int largestChord = *std::max_element(options.chordSizes, options.chordSizes + options.chordSizeCount);
+  if (testNoteCount < largestChord) {
+    fprintf(stderr, "Profile %s has %d plain key mappings, chords of %d need more\n", profileName, testNoteCount, largestChord);
+    return 1;
+  }
+
+  if (!openTarget()) {
+    return 1;
+  }
+
+  // Keep the rig itself out of the numbers as far as possible
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+  struct sched_param param;
+  param.sched_priority = 50;
+  bool realtime = sched_setscheduler(0, SCHED_FIFO, &param) == 0;
+
+  printf("Profile %s, %d test notes, capturing %s (%s)%s\n", profileName, testNoteCount,
+         capture.deviceName(), capture.devicePath(), realtime ? ", SCHED_FIFO" : "");
+
+  srand((unsigned int)monotonicNs());
+  std::vector<Sample> samples;
+  samples.reserve(options.trials * options.chordSizeCount);
+
+  for (int sizeIdx = 0; sizeIdx < options.chordSizeCount; sizeIdx++) {
+    int chordSize = options.chordSizes[sizeIdx];
+    for (int trial = 0; trial < options.trials; trial++) {
+      // Walk through the notes so single-note trials cover every mapped note
+      TestNote chord[MAX_SIMULTANEOUS_KEYS];
+      for (int i = 0; i < chordSize; i++) {
+        chord[i] = testNotes[(trial * chordSize + i) % testNoteCount];
+      }
+
+      Sample sample;
+      if (!runTrial(chord, chordSize, sample)) {
+        return 1;
+      }
+      samples.push_back(sample);
+
+      sleepUntil(monotonicNs() + (uint64_t)options.gapMs * 1000000ULL + (uint64_t)(rand() % 1000) * 1000ULL);
+    }
+  }
+
+  printReport(samples);
+  if (options.csvPath && !writeCsv(samples)) {
+    fprintf(stderr, "Cannot write %s: %s\n", options.csvPath, strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+bool parseOptions(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "d:p:o:r:sk:c:n:g:t:w:h")) != -1) {
+    switch (opt) {
+      case 'd': options.directory = optarg; break;
+      case 'p': options.profileName = optarg; break;
+      case 'o': options.destination = optarg; options.target = TARGET_SEQUENCER; break;
+      case 'r': options.rawDevice = optarg; options.target = TARGET_RAWMIDI; break;
+      case 's': options.target = TARGET_STAND_IN; break;
+      case 'k': options.keyboardName = optarg; break;
+      case 'n': options.trials = atoi(optarg); break;
+      case 'g': options.gapMs = atoi(optarg); break;
+      case 't': options.timeoutMs = atoi(optarg); break;
+      case 'w': options.csvPath = optarg; break;
+      case 'c': {
+        options.chordSizeCount = 0;
+        for (char* size = strtok(optarg, ","); size && options.chordSizeCount < MAX_CHORD_SIZES; size = strtok(nullptr, ",")) {
+          int value = atoi(size);
+          if (value < 1 || value > MAX_SIMULTANEOUS_KEYS) {
+            fprintf(stderr, "Chord sizes must be 1-%d\n", MAX_SIMULTANEOUS_KEYS);
+            return false;
+          }
+          options.chordSizes[options.chordSizeCount++] = value;
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  if (options.target == TARGET_SEQUENCER && !options.destination) {
+    fprintf(stderr, "Choose a target with -o, -r or -s\n");
+    return false;
+  }
+  return options.trials > 0 && options.chordSizeCount > 0;
+}
+
+// Load CONFIG.TXT and the requested mapping file with the daemon's loader
+bool loadTestProfile() {
+  static ConfigDirectory files;
+  if (!scanConfigDirectory(options.directory, files)) {
+    return false;
+  }
+  loadConfigFile(options.directory, files, config);
+
+  // Only the profiles the target loaded (the first MAX_PROFILES by name) can be played
+  for (int i = 0; i < files.mappingCount && i < MAX_PROFILES; i++) {
+    profileNameFromFileName(files.mappingFiles[i], profileName, PROFILE_NAME_MAX_LEN);
+    if (options.profileName && strcasecmp(profileName, options.profileName) != 0) {
+      continue;
+    }
+    MappingFileCounts counts;
+    clearKeySets(keySets);
+    clearChords(chordTable);
+    if (!loadMappingFile(options.directory, files.mappingFiles[i], config, profile, deviceMatch, sourceTable, keySets,
+                         &chordTable, 0, counts)) {
+      fprintf(stderr, "Cannot open %s/%s: %s\n", options.directory, files.mappingFiles[i], strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  fprintf(stderr, "No mapping file%s%s found in %s\n", options.profileName ? " for profile " : "",
+          options.profileName ? options.profileName : "", options.directory);
+  return false;
+}
+
+// Notes the target takes for itself: profile switch, transpose and key change controls
+bool isControlNote(int note) {
+  return note == config.profileSwitchNote || note == config.transposeUpNote || note == config.transposeDownNote
+         || note == config.octaveUpNote || note == config.octaveDownNote || note == config.keyUpNote
+         || note == config.keyDownNote;
+}
+
+// Notes mapped to a key without modifiers, the first note for each key - never a control
+// note, and never a chord note (a chord gather would hold it back or fire another key)
+void collectTestNotes() {
+  bool keyUsed[256] = {false};
+  for (int note = 0; note < MAX_MIDI_NOTES; note++) {
+    const KeyMapping& mapping = profile.noteToKey[note];
+    if (mapping.keyCode == 0 || isKeySet(mapping) || mapping.modifierMask != 0 || keyUsed[mapping.keyCode]) {
+      continue;
+    }
+    if (isControlNote(note) || chordBit(profile.chordNotes, note)) {
+      continue;
+    }
+    keyUsed[mapping.keyCode] = true;
+    testNotes[testNoteCount].note = note;
+    testNotes[testNoteCount].keyCode = mapping.keyCode;
+    testNoteCount++;
+  }
+}
+
+bool openTarget() {
+  int err;
+  switch (options.target) {
+    case TARGET_SEQUENCER: {
+      err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+      if (err < 0) {
+        fprintf(stderr, "Cannot open ALSA sequencer: %s\n", snd_strerror(err));
+        return false;
+      }
+      snd_seq_set_client_name(seq, RIG_NAME);
+      seqPort = snd_seq_create_simple_port(seq, "MIDI out", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                           SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+      snd_seq_addr_t address;
+      err = (seqPort < 0) ? seqPort : snd_seq_parse_address(seq, &address, options.destination);
+      if (err >= 0) {
+        err = snd_seq_connect_to(seq, seqPort, address.client, address.port);
+      }
+      if (err < 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", options.destination, snd_strerror(err));
+        return false;
+      }
+      break;
+    }
+    case TARGET_RAWMIDI:
+      err = snd_rawmidi_open(nullptr, &rawmidi, options.rawDevice, 0);
+      if (err < 0) {
+        fprintf(stderr, "Cannot open raw MIDI device %s: %s\n", options.rawDevice, snd_strerror(err));
+        return false;
+      }
+      break;
+    case TARGET_STAND_IN:
+      if (!standIn.open(STAND_IN_NAME)) {
+        fprintf(stderr, "Cannot create uinput keyboard: %s\n", strerror(errno));
+        return false;
+      }
+      options.keyboardName = STAND_IN_NAME;
+      break;
+  }
+
+  // A new uinput device takes a moment to show up under /dev/input
+  uint64_t deadline = monotonicNs() + 2000000000ULL;
+  while (!capture.open(options.keyboardName)) {
+    if (monotonicNs() >= deadline) {
+      fprintf(stderr, "No keyboard named \"%s\" found (needs read access to /dev/input/event*)\n", options.keyboardName);
+      return false;
+    }
+    sleepUntil(monotonicNs() + 50000000ULL);
+  }
+  return true;
+}
+
+// Send note-ons (or note-offs) for a whole chord in one burst - returns the send time
+uint64_t sendChord(const TestNote* notes, int count, bool on) {
+  uint64_t sentNs = 0;
+  switch (options.target) {
+    case TARGET_SEQUENCER: {
+      for (int i = 0; i < count; i++) {
+        snd_seq_event_t event;
+        snd_seq_ev_clear(&event);
+        snd_seq_ev_set_source(&event, seqPort);
+        snd_seq_ev_set_subs(&event);
+        snd_seq_ev_set_direct(&event);
+        if (on) {
+          snd_seq_ev_set_noteon(&event, 0, notes[i].note, NOTE_VELOCITY);
+        } else {
+          snd_seq_ev_set_noteoff(&event, 0, notes[i].note, 0);
+        }
+        snd_seq_event_output_buffer(seq, &event);
+      }
+      sentNs = monotonicNs();
+      snd_seq_drain_output(seq);
+      break;
+    }
+    case TARGET_RAWMIDI: {
+      // Running status: one status byte for the whole chord
+      uint8_t bytes[1 + 2 * MAX_SIMULTANEOUS_KEYS];
+      int length = 0;
+      bytes[length++] = on ? 0x90 : 0x80;
+      for (int i = 0; i < count; i++) {
+        bytes[length++] = notes[i].note;
+        bytes[length++] = on ? NOTE_VELOCITY : 0;
+      }
+      sentNs = monotonicNs();
+      snd_rawmidi_write(rawmidi, bytes, length);
+      snd_rawmidi_drain(rawmidi);
+      break;
+    }
+    case TARGET_STAND_IN: {
+      uint8_t keys[UINPUT_REPORT_KEYS] = {0};
+      for (int i = 0; on && i < count; i++) {
+        keys[i] = notes[i].keyCode;
+      }
+      sentNs = monotonicNs();
+      standIn.sendReport(0, keys);
+      break;
+    }
+  }
+  return sentNs;
+}
+
+// Play one chord and time its key presses, then release it and wait until the keys are up
+bool runTrial(const TestNote* notes, int count, Sample& sample) {
+  // Anything still queued belongs to the previous trial
+  CapturedKey key;
+  while (readKey(0, key)) {
+  }
+  if (heldKeyCount > 0) {
+    fprintf(stderr, "Target still holds %d key(s) - is something else typing on it?\n", heldKeyCount);
+    return false;
+  }
+
+  sample.chordSize = count;
+  sample.firstNote = notes[0].note;
+  sample.firstUs = -1;
+  sample.lastUs = -1;
+
+  uint64_t sentNs = sendChord(notes, count, true);
+  uint64_t deadline = sentNs + (uint64_t)options.timeoutMs * 1000000ULL;
+
+  // Distinct keys seen going down (fast-press profiles release them again right away)
+  uint16_t downCodes[MAX_SIMULTANEOUS_KEYS];
+  int downCount = 0;
+  while (downCount < count && readKey(deadline, key)) {
+    if (!key.pressed || key.modifier) {
+      continue;
+    }
+    bool seen = false;
+    for (int i = 0; i < downCount; i++) {
+      seen = seen || downCodes[i] == key.code;
+    }
+    if (seen) {
+      continue;
+    }
+    downCodes[downCount++] = key.code;
+    long latencyUs = (key.timestampNs >= sentNs) ? (long)((key.timestampNs - sentNs) / 1000) : 0;
+    if (downCount == 1) {
+      sample.firstUs = latencyUs;
+    }
+    if (downCount == count) {
+      sample.lastUs = latencyUs;
+    }
+  }
+
+  sendChord(notes, count, false);
+  waitForRelease(monotonicNs() + (uint64_t)options.timeoutMs * 1000000ULL);
+  if (heldKeyCount > 0) {
+    fprintf(stderr, "Keys not released within %dms (timed fast-press longer than -t?)\n", options.timeoutMs);
+    return false;
+  }
+  return true;
+}
+
+// Next key event, keeping track of which keys the target holds
+bool readKey(uint64_t deadlineNs, CapturedKey& key) {
+  if (!capture.read(deadlineNs, key)) {
+    return false;
+  }
+  if (key.code < EVDEV_KEY_CODES && keyDown[key.code] != key.pressed) {
+    keyDown[key.code] = key.pressed;
+    heldKeyCount += key.pressed ? 1 : -1;
+  }
+  return true;
+}
+
+// Read events until the target holds no keys, or the deadline passes
+void waitForRelease(uint64_t deadlineNs) {
+  CapturedKey key;
+  while (heldKeyCount > 0 && readKey(deadlineNs, key)) {
+  }
+}
+
+long percentile(const std::vector<long>& sorted, double p) {
+  size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+  return sorted[index];
+}
+
+void printDistribution(const char* label, std::vector<long>& values) {
+  if (values.empty()) {
+    printf("  %-10s no samples\n", label);
+    return;
+  }
+  std::sort(values.begin(), values.end());
+  double sum = 0;
+  for (long value : values) {
+    sum += value;
+  }
+  printf("  %-10s min %6ld  p50 %6ld  p90 %6ld  p99 %6ld  p99.9 %6ld  max %6ld  mean %8.1f us\n", label,
+         values.front(), percentile(values, 50), percentile(values, 90), percentile(values, 99),
+         percentile(values, 99.9), values.back(), sum / values.size());
+}
+
+void printReport(std::vector<Sample>& samples) {
+  std::vector<long> headline;
+
+  for (int sizeIdx = 0; sizeIdx < options.chordSizeCount; sizeIdx++) {
+    int chordSize = options.chordSizes[sizeIdx];
+    std::vector<long> first;
+    std::vector<long> last;
+    int timeouts = 0;
+    for (const Sample& sample : samples) {
+      if (sample.chordSize != chordSize) {
+        continue;
+      }
+      if (sample.lastUs < 0) {
+        timeouts++;
+      }
+      if (sample.firstUs >= 0) {
+        first.push_back(sample.firstUs);
+      }
+      if (sample.lastUs >= 0) {
+        last.push_back(sample.lastUs);
+      }
+    }
+    printf("\nChord size %d: %d trials, %d incomplete\n", chordSize, options.trials, timeouts);
+    printDistribution("first key", first);
+    if (chordSize > 1) {
+      printDistribution("all keys", last);
+    }
+    if (chordSize == 1) {
+      headline = first;
+    }
+  }
+
+  // Per note, from the single-note trials
+  bool header = false;
+  for (int i = 0; i < testNoteCount; i++) {
+    std::vector<long> values;
+    for (const Sample& sample : samples) {
+      if (sample.chordSize == 1 && sample.firstNote == testNotes[i].note && sample.firstUs >= 0) {
+        values.push_back(sample.firstUs);
+      }
+    }
+    if (values.empty()) {
+      continue;
+    }
+    if (!header) {
+      printf("\nPer note (single notes):\n  note  key    n     p50     p99     max (us)\n");
+      header = true;
+    }
+    std::sort(values.begin(), values.end());
+    printf("  %4d  0x%02X %4zu  %6ld  %6ld  %6ld\n", testNotes[i].note, testNotes[i].keyCode, values.size(),
+           percentile(values, 50), percentile(values, 99), values.back());
+  }
+
+  if (!headline.empty()) {
+    printf("\nMIDI in -> key seen by OS: p50 %.3f ms, p99 %.3f ms (%zu single notes)\n",
+           percentile(headline, 50) / 1000.0, percentile(headline, 99) / 1000.0, headline.size());
+  }
+}
+
+bool writeCsv(const std::vector<Sample>& samples) {
+  FILE* file = fopen(options.csvPath, "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "trial,chord_size,first_note,first_us,all_us\n");
+  for (size_t i = 0; i < samples.size(); i++) {
+    fprintf(file, "%zu,%d,%d,%ld,%ld\n", i, samples[i].chordSize, samples[i].firstNote, samples[i].firstUs, samples[i].lastUs);
+  }
+  return fclose(file) == 0;
+}
+
+uint64_t monotonicNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void sleepUntil(uint64_t timeNs) {
+  struct timespec when;
+  when.tv_sec = timeNs / 1000000000ULL;
+  when.tv_nsec = timeNs % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, nullptr) == EINTR) {
+  }
+}
@@ -0,0 +1,283 @@
+/*
+ * pipeline_bench - host benchmark of the event pipeline stages (see EventPipeline.h)
+ *
+ * Times each pure stage on its own (normalize, route, map), the queue hand-off between
+ * stages, and the three stages chained through queues the way the firmware runs them.
+ * The input is a fixed MIDI stream with the usual mix: note-ons, note-offs, note-ons with
+ * velocity 0, the profile switch note, and controller and clock messages that are filtered
+ * (controllers by route, which checks them against the transpose controller).
+ *
+ * Numbers are for the PC the bench runs on; compare them between builds to see which stage
+ * a change made slower. The firmware's "stats" command reports the same stages on device.
+ *
+ * Usage: pipeline_bench [-n EVENTS] [-p PROFILES] [-a]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "MidiConfig.h"
+#include "EventPipeline.h"
+
+#define DEFAULT_EVENTS 10000000
+#define STREAM_LENGTH 4096  // Events in the generated stream (replayed until EVENTS are done)
+#define SWITCH_NOTE 24      // Profile switch note, as in the default CONFIG.TXT
+
+static Profile profiles[MAX_PROFILES];
+static MidiEvent stream[STREAM_LENGTH];
+static Config benchConfig;  // Default config with SWITCH_NOTE
+
+// Keeps results alive so the compiler cannot drop the work being timed
+static volatile uint32_t sink;
+
+static uint64_t monotonicNs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Profiles map the white keys of C2..C7 to letters, with SHIFT on every fourth one
+// Black keys stay unmapped, so the map stage filters a realistic share of notes
+static void buildProfiles(int profileCount) {
+  static const bool whiteKey[12] = {true, false, true, false, true, true, false, true, false, true, false, true};
+  for (int p = 0; p < profileCount; p++) {
+    Profile& profile = profiles[p];
+    memset(&profile, 0, sizeof(profile));
+    profile.isValid = true;
+    int mapped = 0;
+    for (int note = 36; note <= 96; note++) {
+      if (!whiteKey[note % 12]) {
+        continue;
+      }
+      profile.noteToKey[note].keyCode = KEY_A + (mapped + p) % 26;
+      profile.noteToKey[note].modifierMask = (mapped % 4 == 3) ? MODIFIERKEY_LEFTSHIFT : 0;
+      mapped++;
+    }
+  }
+}
+
+// Pseudo-random but repeatable stream (same seed every run)
+static void buildStream() {
+  srand(12345);
+  for (int i = 0; i < STREAM_LENGTH; i++) {
+    MidiEvent& event = stream[i];
+    event.timestamp = i;
+    event.source = i % 2;
+    event.data1 = 36 + rand() % 61;
+    event.data2 = 1 + rand() % 127;
+    int kind = rand() % 100;
+    if (kind < 40) {
+      event.type = PIPELINE_MIDI_NOTE_ON;
+    } else if (kind < 60) {
+      event.type = PIPELINE_MIDI_NOTE_OFF;
+    } else if (kind < 80) {
+      event.type = PIPELINE_MIDI_NOTE_ON;
+      event.data2 = 0;
+    } else if (kind < 81) {
+      event.type = PIPELINE_MIDI_NOTE_ON;
+      event.data1 = SWITCH_NOTE;
+    } else if (kind < 90) {
+      event.type = 0xB0;  // Control change
+    } else {
+      event.type = 0xF8;  // Clock
+    }
+  }
+}
+
+static void printResult(const char* name, unsigned long events, unsigned long passed, uint64_t elapsedNs) {
+  printf("%-22s %8.2f ns/event  %8.1f Mevents/s  (%lu of %lu passed on)\n", name, (double)elapsedNs / events,
+         events * 1000.0 / elapsedNs, passed, events);
+}
+
+static void benchNormalize(unsigned long events) {
+  unsigned long passed = 0;
+  NoteEvent out;
+  uint64_t start = monotonicNs();
+  for (unsigned long n = 0; n < events; n++) {
+    if (normalizeEvent(stream[n % STREAM_LENGTH], out)) {
+      passed++;
+      sink += out.note;
+    }
+  }
+  printResult("normalize", events, passed, monotonicNs() - start);
+}
+
+static void benchRoute(unsigned long events, int profileCount) {
+  // Route works on normalized events, so normalize the stream once up front
+  static NoteEvent normalized[STREAM_LENGTH];
+  int normalizedCount = 0;
+  for (int i = 0; i < STREAM_LENGTH; i++) {
+    if (normalizeEvent(stream[i], normalized[normalizedCount])) {
+      normalizedCount++;
+    }
+  }
+
+  RouteState state;
+  initRouteState(state, profiles, 0, profileCount, benchConfig);
+  unsigned long passed = 0;
+  uint64_t start = monotonicNs();
+  for (unsigned long n = 0; n < events; n++) {
+    NoteEvent event = normalized[n % normalizedCount];
+    if (routeEvent(state, event, event.timestamp)) {
+      passed++;
+      sink += event.profile;
+    }
+  }
+  printResult("route", events, passed, monotonicNs() - start);
+}
+
+static void benchMap(unsigned long events, int profileCount) {
+  static NoteEvent routed[STREAM_LENGTH];
+  RouteState state;
+  initRouteState(state, profiles, 0, profileCount, benchConfig);
+  int routedCount = 0;
+  for (int i = 0; i < STREAM_LENGTH; i++) {
+    if (normalizeEvent(stream[i], routed[routedCount]) && routeEvent(state, routed[routedCount], i)) {
+      routedCount++;
+    }
+  }
+
+  unsigned long passed = 0;
+  KeyEvent out;
+  uint64_t start = monotonicNs();
+  for (unsigned long n = 0; n < events; n++) {
+    if (mapEvent(profiles, routed[n % routedCount], out)) {
+      passed++;
+      sink += out.mapping.keyCode;
+    }
+  }
+  printResult("map", events, passed, monotonicNs() - start);
+}
+
+// One push and one pop per event, the cost every stage boundary adds
+static void benchQueue(unsigned long events) {
+  static EventQueue<KeyEvent, PIPELINE_QUEUE_SIZE> queue;
+  KeyEvent event;
+  memset(&event, 0, sizeof(event));
+  unsigned long passed = 0;
+  uint64_t start = monotonicNs();
+  for (unsigned long n = 0; n < events; n++) {
+    event.note = n & 0x7F;
+    queue.push(event);
+    if (queue.pop(event)) {
+      passed++;
+      sink += event.note;
+    }
+  }
+  printResult("queue push+pop", events, passed, monotonicNs() - start);
+}
+
+// Auto-transpose's search between phrases, over a full window of stream notes
+// (the per-note histogram update is part of "route" when run with -a)
+static void benchAutoTranspose(unsigned long events) {
+  static TransposeState state;
+  resetTranspose(state, benchConfig);
+  for (int i = 0; i < AUTO_TRANSPOSE_WINDOW; i++) {
+    state.window[i] = stream[i].data1;
+    state.histogram[stream[i].data1]++;
+  }
+  state.windowCount = AUTO_TRANSPOSE_WINDOW;
+
+  unsigned long searches = events / 1000 + 1;
+  uint64_t start = monotonicNs();
+  for (unsigned long n = 0; n < searches; n++) {
+    state.offset = n % 2;  // A different starting point each time
+    sink += bestAutoTransposeOffset(state, profiles[0]);
+  }
+  printResult("auto-transpose search", searches, searches, monotonicNs() - start);
+}
+
+// Ingest queue to mapped queue, drained in batches like the firmware's pipeline task
+static void benchChain(unsigned long events, int profileCount) {
+  static EventQueue<MidiEvent, PIPELINE_QUEUE_SIZE> ingestQueue;
+  static EventQueue<NoteEvent, PIPELINE_QUEUE_SIZE> normalizedQueue;
+  static EventQueue<NoteEvent, PIPELINE_QUEUE_SIZE> routedQueue;
+  static EventQueue<KeyEvent, PIPELINE_QUEUE_SIZE> mappedQueue;
+  RouteState state;
+  initRouteState(state, profiles, 0, profileCount, benchConfig);
+  unsigned long passed = 0;
+
+  uint64_t start = monotonicNs();
+  unsigned long n = 0;
+  while (n < events) {
+    while (n < events && ingestQueue.push(stream[n % STREAM_LENGTH])) {
+      n++;
+    }
+    MidiEvent midi;
+    NoteEvent note;
+    KeyEvent key;
+    while (ingestQueue.pop(midi)) {
+      if (normalizeEvent(midi, note)) {
+        normalizedQueue.push(note);
+      }
+    }
+    while (normalizedQueue.pop(note)) {
+      if (routeEvent(state, note, note.timestamp)) {
+        routedQueue.push(note);
+      }
+    }
+    while (routedQueue.pop(note)) {
+      if (mapEvent(profiles, note, key)) {
+        mappedQueue.push(key);
+      }
+    }
+    while (mappedQueue.pop(key)) {
+      passed++;
+      sink += key.mapping.keyCode;
+    }
+  }
+  printResult("chain (via queues)", events, passed, monotonicNs() - start);
+}
+
+static void usage(const char* program) {
+  fprintf(stderr, "Usage: %s [-n EVENTS] [-p PROFILES] [-a]\n", program);
+  fprintf(stderr, "  -n EVENTS    events per benchmark (default %d)\n", DEFAULT_EVENTS);
+  fprintf(stderr, "  -p PROFILES  profiles the switch note cycles through (default 2, max %d)\n", MAX_PROFILES);
+  fprintf(stderr, "  -a           route with auto-transpose on\n");
+}
+
+int main(int argc, char** argv) {
+  unsigned long events = DEFAULT_EVENTS;
+  int profileCount = 2;
+  bool autoTranspose = false;
+  int option;
+  while ((option = getopt(argc, argv, "n:p:ah")) != -1) {
+    switch (option) {
+      case 'n':
+        events = strtoul(optarg, nullptr, 10);
+        break;
+      case 'p':
+        profileCount = atoi(optarg);
+        break;
+      case 'a':
+        autoTranspose = true;
+        break;
+      default:
+        usage(argv[0]);
+        return option == 'h' ? 0 : 1;
+    }
+  }
+  if (events == 0 || profileCount < 1 || profileCount > MAX_PROFILES) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  benchConfig = defaultConfig;
+  benchConfig.profileSwitchNote = SWITCH_NOTE;
+  benchConfig.autoTranspose = autoTranspose;
+  buildProfiles(profileCount);
+  buildStream();
+
+  printf("Event pipeline stages, %lu events each, %d profile(s), queues of %d\n", events, profileCount,
+         PIPELINE_QUEUE_SIZE);
+  benchNormalize(events);
+  benchRoute(events, profileCount);
+  benchMap(events, profileCount);
+  benchQueue(events);
+  benchChain(events, profileCount);
+  benchAutoTranspose(events);
+  return 0;
+}
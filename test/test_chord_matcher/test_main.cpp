@@ -0,0 +1,192 @@
+/*
+ * Chord matcher note sequences (pio test -e native_test)
+ *
+ * Each fixture loads a few chord patterns, plays chord notes at given times through the
+ * matcher and checks which keys it pressed and released.
+ */
+
+#include <unity.h>
+#include <string.h>
+
+#include "ChordMatcher.h"
+
+static ChordTable table;
+static ChordState state;
+static Profile profile;
+static Config config;
+static int presses;
+static int releases;
+static KeyMapping lastPress;
+
+static void press(KeyMapping mapping) {
+  presses++;
+  lastPress = mapping;
+}
+
+static void release(KeyMapping mapping) {
+  (void)mapping;
+  releases++;
+}
+
+static const ChordOutput out = {press, release};
+
+void setUp() {
+  clearChords(table);
+  memset(&profile, 0, sizeof(profile));
+  memset(&config, 0, sizeof(config));
+  config.chordMode = CHORD_SUPPRESS;
+  config.chordWindowMs = 30;
+  memset(&state, 0, sizeof(state));
+  resetChords(state, config);
+  presses = 0;
+  releases = 0;
+  lastPress = {0, 0};
+}
+
+void tearDown() {}
+
+static void addPattern(const uint8_t* notes, int count, uint8_t keyCode) {
+  ChordPattern pattern;
+  memset(&pattern, 0, sizeof(pattern));
+  for (int i = 0; i < count; i++) {
+    pattern.notes[notes[i] >> 5] |= 1UL << (notes[i] & 31);
+    profile.noteToKey[notes[i]] = {(uint8_t)(KEY_A + notes[i] % 20), 0};
+  }
+  pattern.mapping = {keyCode, 0};
+  TEST_ASSERT_TRUE(addChord(table, 0, profile, pattern));
+}
+
+static bool noteOn(uint8_t note, uint32_t nowMs) {
+  return chordNoteOn(state, table, 0, profile, note, nowMs, out);
+}
+
+static void loadSubsetChords() {
+  const uint8_t major[] = {60, 64, 67};
+  const uint8_t third[] = {60, 64};
+  addPattern(third, 2, KEY_X);
+  addPattern(major, 3, KEY_Z);
+}
+
+static void test_flags_subset_pattern() {
+  loadSubsetChords();
+  TEST_ASSERT_TRUE(table.entries[0].hasSuperset);
+  TEST_ASSERT_FALSE(table.entries[1].hasSuperset);
+}
+
+static void test_bigger_chord_wins() {
+  loadSubsetChords();
+  TEST_ASSERT_TRUE(noteOn(60, 0));
+  TEST_ASSERT_TRUE(noteOn(64, 5));
+  TEST_ASSERT_EQUAL(0, presses);
+  TEST_ASSERT_TRUE(noteOn(67, 10));
+  TEST_ASSERT_EQUAL(1, presses);
+  TEST_ASSERT_EQUAL_HEX8(KEY_Z, lastPress.keyCode);
+  TEST_ASSERT_EQUAL(1, state.recognized);
+}
+
+static void test_subset_fires_when_window_closes() {
+  loadSubsetChords();
+  noteOn(60, 0);
+  noteOn(64, 5);
+  TEST_ASSERT_FALSE(expireChordGather(state, profile, 29, out));
+  TEST_ASSERT_TRUE(expireChordGather(state, profile, 30, out));
+  TEST_ASSERT_EQUAL(1, presses);
+  TEST_ASSERT_EQUAL_HEX8(KEY_X, lastPress.keyCode);
+  TEST_ASSERT_FALSE(state.gathering);
+}
+
+static void test_subset_fires_on_note_off() {
+  // Let go before the window closed: the smaller chord, released right away
+  loadSubsetChords();
+  noteOn(60, 0);
+  noteOn(64, 5);
+  TEST_ASSERT_TRUE(chordNoteOff(state, profile, 64, out));
+  TEST_ASSERT_EQUAL(1, presses);
+  TEST_ASSERT_EQUAL_HEX8(KEY_X, lastPress.keyCode);
+  TEST_ASSERT_EQUAL(1, releases);
+  // The other note's note-off is swallowed
+  TEST_ASSERT_TRUE(chordNoteOff(state, profile, 60, out));
+  TEST_ASSERT_EQUAL(0, state.activeCount);
+}
+
+static void test_subset_fires_when_bigger_ruled_out() {
+  // 62 is in no bigger chord: {60,64} fires, 62 starts a gather of its own
+  loadSubsetChords();
+  const uint8_t other[] = {62, 65};
+  addPattern(other, 2, KEY_Y);
+  noteOn(60, 0);
+  noteOn(64, 5);
+  TEST_ASSERT_TRUE(noteOn(62, 10));
+  TEST_ASSERT_EQUAL(1, presses);
+  TEST_ASSERT_EQUAL_HEX8(KEY_X, lastPress.keyCode);
+  TEST_ASSERT_TRUE(state.gathering);
+  TEST_ASSERT_EQUAL(10, state.gatherStartMs);
+  TEST_ASSERT_TRUE(noteOn(65, 15));
+  TEST_ASSERT_EQUAL_HEX8(KEY_Y, lastPress.keyCode);
+  TEST_ASSERT_EQUAL(2, state.recognized);
+}
+
+static void test_cancel_releases_note_keys_of_deferred_chord() {
+  config.chordMode = CHORD_CANCEL;
+  resetChords(state, config);
+  loadSubsetChords();
+  TEST_ASSERT_FALSE(noteOn(60, 0));
+  TEST_ASSERT_FALSE(noteOn(64, 5));
+  TEST_ASSERT_TRUE(expireChordGather(state, profile, 40, out));
+  TEST_ASSERT_EQUAL(2, releases);
+  TEST_ASSERT_EQUAL_HEX8(KEY_X, lastPress.keyCode);
+}
+
+static void fillTable(int leave) {
+  // Two-note patterns on notes 0..40, away from the chords under test
+  for (uint8_t a = 0; a < 40 && table.count < CHORD_MAX - leave; a++) {
+    for (uint8_t b = a + 1; b <= 40 && table.count < CHORD_MAX - leave; b++) {
+      const uint8_t notes[] = {a, b};
+      addPattern(notes, 2, KEY_Q);
+    }
+  }
+}
+
+static void test_defers_over_full_table() {
+  fillTable(3);
+  const uint8_t third[] = {60, 64};
+  const uint8_t seventh[] = {60, 64, 67, 71};
+  const uint8_t other[] = {62, 65};
+  addPattern(third, 2, KEY_X);
+  addPattern(seventh, 4, KEY_Z);
+  addPattern(other, 2, KEY_Y);
+  TEST_ASSERT_EQUAL(CHORD_MAX, table.count);
+  TEST_ASSERT_TRUE(chordCanGrow(table, 0, table.entries[CHORD_MAX - 3].notes));
+
+  // {60,64,67} is no pattern but still inside {60,64,67,71}: keep waiting
+  noteOn(60, 0);
+  noteOn(64, 2);
+  TEST_ASSERT_TRUE(noteOn(67, 4));
+  TEST_ASSERT_TRUE(state.deferred);
+  TEST_ASSERT_EQUAL(0, presses);
+  TEST_ASSERT_TRUE(noteOn(71, 6));
+  TEST_ASSERT_EQUAL(1, presses);
+  TEST_ASSERT_EQUAL_HEX8(KEY_Z, lastPress.keyCode);
+  for (uint8_t note : seventh) {
+    chordNoteOff(state, profile, note, out);
+  }
+
+  // 62 is in no bigger chord: {60,64} fires at once
+  noteOn(60, 100);
+  noteOn(64, 102);
+  TEST_ASSERT_TRUE(noteOn(62, 104));
+  TEST_ASSERT_EQUAL(2, presses);
+  TEST_ASSERT_EQUAL_HEX8(KEY_X, lastPress.keyCode);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_flags_subset_pattern);
+  RUN_TEST(test_bigger_chord_wins);
+  RUN_TEST(test_subset_fires_when_window_closes);
+  RUN_TEST(test_subset_fires_on_note_off);
+  RUN_TEST(test_subset_fires_when_bigger_ruled_out);
+  RUN_TEST(test_cancel_releases_note_keys_of_deferred_chord);
+  RUN_TEST(test_defers_over_full_table);
+  return UNITY_END();
+}
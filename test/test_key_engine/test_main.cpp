@@ -0,0 +1,226 @@
+/*
+ * Key engine note sequences (pio test -e native_test)
+ *
+ * Each fixture plays note-ons, note-offs and timer expiries at given times through the
+ * shared key engine and checks which keys are down and how many reports went out.
+ */
+
+#include <unity.h>
+#include <string.h>
+
+#include "KeyEngine.h"
+
+static KeyEngine engine;
+static KeySetPool keySets;
+static Profile profile;
+static int emitted;
+
+static const KeyMapping keyA = {KEY_A, 0};
+
+static void emit() {
+  emitted++;
+}
+
+void setUp() {
+  memset(&engine, 0, sizeof(engine));
+  memset(&profile, 0, sizeof(profile));
+  clearKeySets(keySets);
+  emitted = 0;
+}
+
+void tearDown() {}
+
+static void useProfile(unsigned int pressDurationMs, unsigned int minHoldMs) {
+  profile.pressDurationMs = pressDurationMs;
+  profile.minHoldMs = minHoldMs;
+  setKeyEngineProfile(engine, profile);
+}
+
+static bool isDown(KeyMapping key) {
+  return findPressedKey(engine, key.keyCode, key.modifierMask) >= 0;
+}
+
+static void test_hybrid_release_after_min_hold() {
+  useProfile(0, 50);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 0, emit);
+  TEST_ASSERT_TRUE(isDown(keyA));
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 80, emit);
+  TEST_ASSERT_FALSE(isDown(keyA));
+  TEST_ASSERT_EQUAL(0, engine.timerCount);
+  TEST_ASSERT_EQUAL(2, emitted);
+}
+
+static void test_hybrid_short_press_held_for_min_hold() {
+  useProfile(0, 50);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 0, emit);
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 10, emit);
+  TEST_ASSERT_TRUE(isDown(keyA));
+  TEST_ASSERT_FALSE(expireReleaseTimers(engine, 49));
+  TEST_ASSERT_TRUE(expireReleaseTimers(engine, 50));
+  TEST_ASSERT_FALSE(isDown(keyA));
+  TEST_ASSERT_EQUAL(0, engine.timerCount);
+}
+
+static void test_hybrid_repress_during_min_hold() {
+  // Released before the minimum hold, pressed again while the key waits for it: the new
+  // note takes the key over, so its own note-off releases it
+  useProfile(0, 50);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 0, emit);
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 10, emit);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 20, emit);
+  TEST_ASSERT_EQUAL(1, engine.pressedKeys[0].refs);
+  TEST_ASSERT_FALSE(expireReleaseTimers(engine, 60));
+  TEST_ASSERT_TRUE(isDown(keyA));
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 100, emit);
+  TEST_ASSERT_FALSE(isDown(keyA));
+  TEST_ASSERT_EQUAL(0, engine.timerCount);
+}
+
+static void test_hybrid_repress_released_early_again() {
+  useProfile(0, 50);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 0, emit);
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 10, emit);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 20, emit);
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 30, emit);
+  TEST_ASSERT_TRUE(isDown(keyA));
+  TEST_ASSERT_FALSE(expireReleaseTimers(engine, 69));
+  TEST_ASSERT_TRUE(expireReleaseTimers(engine, 70));
+  TEST_ASSERT_FALSE(isDown(keyA));
+}
+
+static void test_hybrid_max_hold_cuts_long_press() {
+  useProfile(200, 50);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 0, emit);
+  TEST_ASSERT_FALSE(expireReleaseTimers(engine, 199));
+  TEST_ASSERT_TRUE(expireReleaseTimers(engine, 200));
+  TEST_ASSERT_FALSE(isDown(keyA));
+  // The note-off after the timer finds nothing to release
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 300, emit);
+  TEST_ASSERT_EQUAL(0, engine.pressedKeyCount);
+}
+
+static void test_hybrid_max_hold_stale_note_off() {
+  // Two notes on one key (folded or snapped): the first note's hold is cut short, the second
+  // presses the key again, then the first note's late note-off must not release it
+  useProfile(50, 0);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 0, emit);
+  TEST_ASSERT_TRUE(expireReleaseTimers(engine, 50));
+  TEST_ASSERT_FALSE(isDown(keyA));
+  keyNoteOn(engine, keySets, keyA, RELEASE_HYBRID, 60, emit);
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 70, emit);
+  TEST_ASSERT_TRUE(isDown(keyA));
+  keyNoteOff(engine, keySets, keyA, RELEASE_HYBRID, 80, emit);
+  TEST_ASSERT_FALSE(isDown(keyA));
+  TEST_ASSERT_EQUAL(0, engine.expiredKeyCount);
+}
+
+static void test_timed_release_and_delay() {
+  useProfile(30, 0);
+  keyNoteOn(engine, keySets, keyA, RELEASE_TIMED, 1000, emit);
+  keyNoteOff(engine, keySets, keyA, RELEASE_TIMED, 1005, emit);
+  TEST_ASSERT_TRUE(isDown(keyA));
+  uint32_t delayMs = 0;
+  TEST_ASSERT_TRUE(nextReleaseDelay(engine, 1010, delayMs));
+  TEST_ASSERT_EQUAL(20, delayMs);
+  TEST_ASSERT_TRUE(expireReleaseTimers(engine, 1030));
+  TEST_ASSERT_FALSE(nextReleaseDelay(engine, 1030, delayMs));
+}
+
+static void test_timer_across_clock_wrap() {
+  useProfile(30, 0);
+  keyNoteOn(engine, keySets, keyA, RELEASE_TIMED, 0xFFFFFFF0UL, emit);
+  TEST_ASSERT_FALSE(expireReleaseTimers(engine, 0xFFFFFFFFUL));
+  TEST_ASSERT_TRUE(expireReleaseTimers(engine, 14));
+}
+
+static void test_immediate_press_and_release() {
+  useProfile(0, 0);
+  keyNoteOn(engine, keySets, keyA, RELEASE_IMMEDIATE, 0, emit);
+  TEST_ASSERT_EQUAL(0, engine.pressedKeyCount);
+  TEST_ASSERT_EQUAL(2, emitted);
+}
+
+static void test_key_set_shares_key_with_note() {
+  // 60=A+S and 62=S: S stays down until both notes are up
+  KeySet set;
+  TEST_ASSERT_TRUE(parseKeySet("A+S", set));
+  KeyMapping chord = {0, 0};
+  TEST_ASSERT_TRUE(addKeySet(keySets, set, chord));
+  KeyMapping keyS = {KEY_S, 0};
+  useProfile(0, 0);
+  keyNoteOn(engine, keySets, chord, RELEASE_HELD, 0, emit);
+  keyNoteOn(engine, keySets, keyS, RELEASE_HELD, 10, emit);
+  TEST_ASSERT_EQUAL(2, engine.pressedKeyCount);
+  keyNoteOff(engine, keySets, chord, RELEASE_HELD, 20, emit);
+  TEST_ASSERT_FALSE(isDown(keyA));
+  TEST_ASSERT_TRUE(isDown(keyS));
+  keyNoteOff(engine, keySets, keyS, RELEASE_HELD, 30, emit);
+  TEST_ASSERT_EQUAL(0, engine.pressedKeyCount);
+}
+
+// The schedule stage's gate: a note reaches the engine only when its held bit changes
+static void playNote(uint8_t* heldNotes, uint8_t note, bool on, KeyMapping mapping, uint32_t nowMs) {
+  if (on && holdNote(heldNotes, note)) {
+    keyNoteOn(engine, keySets, mapping, RELEASE_HELD, nowMs, emit);
+  } else if (!on && releaseNote(heldNotes, note)) {
+    keyNoteOff(engine, keySets, mapping, RELEASE_HELD, nowMs, emit);
+  }
+}
+
+static void test_retrigger_holds_key_once() {
+  // Note-on, note-on again without a note-off, one note-off: the key is up again
+  uint8_t heldNotes[MAX_MIDI_NOTES / 8] = {0};
+  useProfile(0, 0);
+  playNote(heldNotes, 60, true, keyA, 0);
+  playNote(heldNotes, 60, true, keyA, 10);
+  TEST_ASSERT_EQUAL(1, engine.pressedKeys[0].refs);
+  playNote(heldNotes, 60, false, keyA, 20);
+  TEST_ASSERT_FALSE(isDown(keyA));
+  // A stray second note-off does not touch a key another note holds
+  playNote(heldNotes, 62, true, keyA, 30);
+  playNote(heldNotes, 60, false, keyA, 40);
+  TEST_ASSERT_TRUE(isDown(keyA));
+  playNote(heldNotes, 62, false, keyA, 50);
+  TEST_ASSERT_FALSE(isDown(keyA));
+}
+
+static void test_split_reports_per_modifier_run() {
+  KeyMapping shiftedB = {KEY_B, MODIFIERKEY_LEFTSHIFT};
+  useProfile(0, 0);
+  keyNoteOn(engine, keySets, keyA, RELEASE_HELD, 0, emit);
+  keyNoteOn(engine, keySets, shiftedB, RELEASE_HELD, 0, emit);
+  int reports = 0;
+  uint8_t lastModifiers = 0;
+  buildKeyReports(engine, MODIFIERS_SPLIT, [&](uint8_t modifiers, const uint8_t* keys) {
+    reports++;
+    lastModifiers = modifiers;
+    (void)keys;
+  });
+  TEST_ASSERT_EQUAL(2, reports);
+  TEST_ASSERT_EQUAL_HEX8(MODIFIERKEY_LEFTSHIFT, lastModifiers);
+  reports = 0;
+  buildKeyReports(engine, MODIFIERS_MERGED, [&](uint8_t modifiers, const uint8_t* keys) {
+    reports++;
+    TEST_ASSERT_EQUAL_HEX8(MODIFIERKEY_LEFTSHIFT, modifiers);
+    TEST_ASSERT_EQUAL_HEX8(KEY_A, keys[0]);
+    TEST_ASSERT_EQUAL_HEX8(KEY_B, keys[1]);
+  });
+  TEST_ASSERT_EQUAL(1, reports);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_hybrid_release_after_min_hold);
+  RUN_TEST(test_hybrid_short_press_held_for_min_hold);
+  RUN_TEST(test_hybrid_repress_during_min_hold);
+  RUN_TEST(test_hybrid_repress_released_early_again);
+  RUN_TEST(test_hybrid_max_hold_cuts_long_press);
+  RUN_TEST(test_hybrid_max_hold_stale_note_off);
+  RUN_TEST(test_timed_release_and_delay);
+  RUN_TEST(test_timer_across_clock_wrap);
+  RUN_TEST(test_immediate_press_and_release);
+  RUN_TEST(test_key_set_shares_key_with_note);
+  RUN_TEST(test_retrigger_holds_key_once);
+  RUN_TEST(test_split_reports_per_modifier_run);
+  return UNITY_END();
+}
@@ -0,0 +1,143 @@
+/*
+ * MidiStreamParser byte-stream fixtures (pio test -e native_test)
+ *
+ * Each fixture is the raw byte sequence a DIN input would deliver; the messages parse()
+ * completes are compared with the ones a receiver has to see.
+ */
+
+#include <unity.h>
+#include <string.h>
+
+#include "MidiStreamParser.h"
+#include "EventPipeline.h"
+
+#define MAX_PARSED 16
+
+static MidiStreamParser parser;
+static MidiStreamMessage parsed[MAX_PARSED];
+static int parsedCount;
+
+void setUp() {
+  parser = MidiStreamParser();
+  parsedCount = 0;
+}
+
+void tearDown() {}
+
+static void feed(const uint8_t* bytes, int length) {
+  for (int i = 0; i < length; i++) {
+    MidiStreamMessage message;
+    if (parser.parse(bytes[i], message) && parsedCount < MAX_PARSED) {
+      parsed[parsedCount++] = message;
+    }
+  }
+}
+
+static void assertMessage(int index, uint8_t status, uint8_t data1, uint8_t data2) {
+  TEST_ASSERT_TRUE(index < parsedCount);
+  TEST_ASSERT_EQUAL_HEX8(status, parsed[index].status);
+  TEST_ASSERT_EQUAL_UINT8(data1, parsed[index].data1);
+  TEST_ASSERT_EQUAL_UINT8(data2, parsed[index].data2);
+}
+
+static void test_complete_messages() {
+  const uint8_t bytes[] = {0x90, 60, 100, 0x80, 60, 64, 0xC1, 5};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(3, parsedCount);
+  assertMessage(0, 0x90, 60, 100);
+  assertMessage(1, 0x80, 60, 64);
+  assertMessage(2, 0xC1, 5, 0);
+}
+
+static void test_running_status() {
+  // One status byte, then three note-ons; a program change keeps its own running status
+  const uint8_t bytes[] = {0x92, 60, 100, 64, 90, 67, 80, 0xC0, 1, 2};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(5, parsedCount);
+  assertMessage(0, 0x92, 60, 100);
+  assertMessage(1, 0x92, 64, 90);
+  assertMessage(2, 0x92, 67, 80);
+  assertMessage(3, 0xC0, 1, 0);
+  assertMessage(4, 0xC0, 2, 0);
+}
+
+static void test_realtime_inside_message() {
+  // Clock and active sensing between status and data and between the data bytes, also
+  // inside a running status message
+  const uint8_t bytes[] = {0x90, 0xF8, 60, 0xFE, 100, 62, 0xF8, 90};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(5, parsedCount);
+  assertMessage(0, 0xF8, 0, 0);
+  assertMessage(1, 0xFE, 0, 0);
+  assertMessage(2, 0x90, 60, 100);
+  assertMessage(3, 0xF8, 0, 0);
+  assertMessage(4, 0x90, 62, 90);
+}
+
+static void test_system_common_cancels_running_status() {
+  // Song select in between: the data bytes after it have no status to belong to
+  const uint8_t bytes[] = {0x90, 60, 100, 0xF3, 4, 62, 90};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(2, parsedCount);
+  assertMessage(0, 0x90, 60, 100);
+  assertMessage(1, 0xF3, 4, 0);
+  TEST_ASSERT_EQUAL(2, parser.strayBytes());
+}
+
+static void test_sysex_skipped() {
+  const uint8_t bytes[] = {0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7, 0x90, 60, 100};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(1, parsedCount);
+  assertMessage(0, 0x90, 60, 100);
+  TEST_ASSERT_EQUAL(0, parser.strayBytes());
+}
+
+static void test_sysex_aborted_by_status() {
+  // No 0xF7: the next status byte ends the SysEx, a clock inside it still gets through
+  const uint8_t bytes[] = {0xF0, 0x43, 0x10, 0xF8, 0x4C, 0x90, 60, 100, 64, 90};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(3, parsedCount);
+  assertMessage(0, 0xF8, 0, 0);
+  assertMessage(1, 0x90, 60, 100);
+  assertMessage(2, 0x90, 64, 90);
+  TEST_ASSERT_EQUAL(0, parser.strayBytes());
+}
+
+static void test_stray_data_before_status() {
+  // Joined mid-message: data bytes without a status are counted and dropped
+  const uint8_t bytes[] = {100, 64, 0x80, 60, 0};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(1, parsedCount);
+  assertMessage(0, 0x80, 60, 0);
+  TEST_ASSERT_EQUAL(2, parser.strayBytes());
+}
+
+static void test_note_on_velocity_zero_is_note_off() {
+  // Running status note-on with velocity 0 releases the note (normalize stage)
+  const uint8_t bytes[] = {0x91, 60, 100, 60, 0};
+  feed(bytes, sizeof(bytes));
+  TEST_ASSERT_EQUAL(2, parsedCount);
+  assertMessage(1, 0x91, 60, 0);
+
+  NoteEvent note;
+  MidiEvent on = {0, 0, (uint8_t)(parsed[0].status & 0xF0), parsed[0].data1, parsed[0].data2};
+  TEST_ASSERT_TRUE(normalizeEvent(on, note));
+  TEST_ASSERT_EQUAL(NOTE_EVENT_ON, note.kind);
+  MidiEvent off = {0, 0, (uint8_t)(parsed[1].status & 0xF0), parsed[1].data1, parsed[1].data2};
+  TEST_ASSERT_TRUE(normalizeEvent(off, note));
+  TEST_ASSERT_EQUAL(NOTE_EVENT_OFF, note.kind);
+  TEST_ASSERT_EQUAL(60, note.note);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_complete_messages);
+  RUN_TEST(test_running_status);
+  RUN_TEST(test_realtime_inside_message);
+  RUN_TEST(test_system_common_cancels_running_status);
+  RUN_TEST(test_sysex_skipped);
+  RUN_TEST(test_sysex_aborted_by_status);
+  RUN_TEST(test_stray_data_before_status);
+  RUN_TEST(test_note_on_velocity_zero_is_note_off);
+  return UNITY_END();
+}